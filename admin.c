@@ -0,0 +1,172 @@
+/* admin.c
+ * Local administration interface for the mail servers.
+ *
+ * If the configuration sets an admin address for the server (e.g.,
+ * "mysmtpd_admin_listen unix:/run/mysmtpd.sock" or
+ * "mypopd_admin_listen 127.0.0.1:9110"), a separate process listens
+ * on that address and answers requests one at a time. HTTP requests
+ * for /metrics receive the server metrics in Prometheus text format,
+ * so the address can be scraped directly. Plain-text requests consist
+ * of a single command line:
+ *
+ *   METRICS    the server metrics, in Prometheus text format
+ *   SESSIONS   the sessions in progress, one per line (see
+ *              sessiontab_write for the fields)
+ *   KILL <id>  terminates the session with the given ID
+ *
+ * The mailctl tool sends these commands and formats the replies.
+ */
+
+#include "admin.h"
+#include "config.h"
+#include "metrics.h"
+#include "sessiontab.h"
+#include "netbuffer.h"
+#include "server.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#define MAX_REQUEST_LINE 1024
+#define REQUEST_TIMEOUT 2 // seconds
+#define LISTEN_ATTEMPTS 30 // one per second
+
+static int admin_fd = -1;
+
+/** Internal function that sends a whole buffer to a client. Unlike
+ *  send_all, data sent here is not counted in the server metrics.
+ */
+static void send_response(int fd, const char *buf, size_t size) {
+  while (size > 0) {
+    ssize_t rv = send(fd, buf, size, MSG_NOSIGNAL);
+    if (rv <= 0) return;
+    buf += rv;
+    size -= rv;
+  }
+}
+
+/** Internal function that answers an HTTP request. The rest of the
+ *  request (headers) is read and ignored.
+ */
+static void handle_http(int fd, net_buffer_t nb, const char *request) {
+
+  char line[MAX_REQUEST_LINE + 1];
+  while (nb_read_line(nb, line) > 0 && strcmp(line, "\r\n") && strcmp(line, "\n"));
+
+  char *body = NULL, header[256];
+  size_t size = 0;
+  FILE *out = open_memstream(&body, &size);
+  int found = !strncmp(request, "GET /metrics ", 13) || !strncmp(request, "GET / ", 6);
+
+  if (found)
+    metrics_write(out);
+  else
+    fprintf(out, "Not found\n");
+  fclose(out);
+
+  int len = snprintf(header, sizeof(header),
+                     "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                     "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+                     found ? "200 OK" : "404 Not Found", size);
+  send_response(fd, header, len);
+  send_response(fd, body, size);
+  free(body);
+}
+
+/** Internal function that answers a plain-text command.
+ */
+static void handle_command(int fd, char *command) {
+
+  char *body = NULL;
+  size_t size = 0;
+  FILE *out = open_memstream(&body, &size);
+
+  command[strcspn(command, "\r\n")] = 0;
+  char *name = strtok(command, " ");
+
+  if (name && !strcasecmp(name, "METRICS")) {
+    metrics_write(out);
+  } else if (name && !strcasecmp(name, "SESSIONS")) {
+    sessiontab_write(out);
+  } else if (name && !strcasecmp(name, "KILL")) {
+    char *id = strtok(NULL, " "), *end = NULL;
+    unsigned long session_id = id ? strtoul(id, &end, 10) : 0;
+    if (!id || *end)
+      fprintf(out, "ERR usage: KILL <session id>\n");
+    else if (sessiontab_kill(session_id) < 0)
+      fprintf(out, "ERR no such session\n");
+    else
+      fprintf(out, "OK\n");
+  } else
+    fprintf(out, "ERR unknown command\n");
+
+  fclose(out);
+  send_response(fd, body, size);
+  free(body);
+}
+
+/** Internal function run by the admin process: listens on the admin
+ *  address, accepts requests and answers them one at a time.
+ */
+static void admin_worker(void *arg) {
+
+  const char *address = arg;
+  char line[MAX_REQUEST_LINE + 1];
+  struct timeval timeout = { REQUEST_TIMEOUT, 0 };
+
+  // While a server is upgraded, the admin process of the previous
+  // server keeps the address until that server starts draining
+  for (int attempt = 1; (admin_fd = server_listen(address)) < 0; attempt++) {
+    if (attempt == LISTEN_ATTEMPTS) {
+      log_error("admin: cannot listen on %s", address);
+      return;
+    }
+    sleep(1);
+  }
+
+  while (1) {
+    int fd = accept(admin_fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno != EINTR) log_error("admin: accept: %s", strerror(errno));
+      continue;
+    }
+
+    // A client that does not send its request in time is dropped, so
+    // it cannot block other requests
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    net_buffer_t nb = nb_create(fd, MAX_REQUEST_LINE);
+    if (nb_read_line(nb, line) > 0) {
+      if (!strncmp(line, "GET ", 4))
+        handle_http(fd, nb, line);
+      else
+        handle_command(fd, line);
+    }
+    nb_destroy(nb);
+    close(fd);
+  }
+}
+
+/** Starts the admin process for a server, if the configuration sets
+ *  an admin address for it (in the <server_name>_admin_listen
+ *  setting). Must be called after the server metrics and the session
+ *  table are initialized and before run_server.
+ *
+ *  Parameters: server_name: Name of the server (e.g., "mysmtpd").
+ */
+void admin_start(const char *server_name) {
+
+  char key[128];
+  snprintf(key, sizeof(key), "%s_admin_listen", server_name);
+  const char *address = config_get_string(key, NULL);
+  if (!address) return;
+
+  // Only the admin process uses the socket
+  start_worker(admin_worker, (void *) address);
+}
@@ -0,0 +1,10 @@
+/* admin.h
+ * Local administration interface for the mail servers.
+ */
+
+#ifndef _ADMIN_H_
+#define _ADMIN_H_
+
+void admin_start(const char *server_name);
+
+#endif
@@ -0,0 +1,159 @@
+/* arena.c
+ * Region-based memory allocation for client sessions.
+ *
+ * An arena hands out memory from large blocks by advancing a pointer,
+ * and frees everything at once: objects allocated in an arena are
+ * never freed individually. Resetting an arena, or releasing it back
+ * to a previous mark, takes constant time. Blocks are kept after a
+ * reset and reused by later allocations, so an arena that is reset
+ * between sessions (or transactions) stops calling malloc once it has
+ * grown to fit the largest one.
+ */
+
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGNMENT 16
+
+struct arena_block {
+  struct arena_block *next;
+  size_t size;
+  _Alignas(ARENA_ALIGNMENT) char data[];
+};
+
+struct arena {
+  struct arena_block *first;
+  struct arena_block *current;
+  size_t used;        // bytes used in the current block
+  size_t block_size;
+};
+
+/** Internal function that allocates a new block for an arena, with at
+ *  least the given size.
+ */
+static struct arena_block *new_block(size_t size) {
+  struct arena_block *block = malloc(sizeof(struct arena_block) + size);
+  if (block) {
+    block->next = NULL;
+    block->size = size;
+  }
+  return block;
+}
+
+/** Creates a new, empty, arena. The first block is allocated right
+ *  away, so allocations that fit in it don't call malloc.
+ *
+ *  Parameters: block_size: Size of each block of memory taken from
+ *                          the system. Larger allocations get a block
+ *                          of their own.
+ *
+ *  Returns: A new arena, or NULL if memory is not available.
+ */
+arena_t arena_create(size_t block_size) {
+
+  arena_t arena = malloc(sizeof(struct arena));
+  if (!arena) return NULL;
+  arena->first = arena->current = new_block(block_size);
+  if (!arena->first) {
+    free(arena);
+    return NULL;
+  }
+  arena->used = 0;
+  arena->block_size = block_size;
+  return arena;
+}
+
+/** Frees an arena and all memory allocated in it.
+ *
+ *  Parameters: arena: Arena to be freed.
+ */
+void arena_destroy(arena_t arena) {
+  if (!arena) return;
+  struct arena_block *block = arena->first;
+  while (block) {
+    struct arena_block *next = block->next;
+    free(block);
+    block = next;
+  }
+  free(arena);
+}
+
+/** Allocates memory from an arena. The memory is suitably aligned for
+ *  any type, and is not initialized.
+ *
+ *  Parameters: arena: Arena the memory is taken from.
+ *              size: Number of bytes to allocate.
+ *
+ *  Returns: Pointer to the allocated memory, valid until the arena is
+ *           reset, released to a mark taken before this call, or
+ *           destroyed; NULL if memory is not available.
+ */
+void *arena_alloc(arena_t arena, size_t size) {
+
+  size_t offset = (arena->used + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1);
+  if (offset + size > arena->current->size) {
+    // Reuses the next block, kept from before a reset, if it fits;
+    // otherwise a new block is inserted after the current one
+    struct arena_block *block = arena->current->next;
+    if (!block || block->size < size) {
+      block = new_block(size > arena->block_size ? size : arena->block_size);
+      if (!block) return NULL;
+      block->next = arena->current->next;
+      arena->current->next = block;
+    }
+    arena->current = block;
+    offset = 0;
+  }
+
+  arena->used = offset + size;
+  return arena->current->data + offset;
+}
+
+/** Copies a string to memory allocated from an arena.
+ *
+ *  Parameters: arena: Arena the memory is taken from.
+ *              str: String to be copied.
+ *
+ *  Returns: The copy of the string, or NULL if memory is not
+ *           available.
+ */
+char *arena_strdup(arena_t arena, const char *str) {
+  size_t size = strlen(str) + 1;
+  char *copy = arena_alloc(arena, size);
+  if (copy)
+    memcpy(copy, str, size);
+  return copy;
+}
+
+/** Returns the current position of an arena, so that everything
+ *  allocated from now on can later be released with arena_release.
+ *
+ *  Parameters: arena: Arena to be assessed.
+ */
+arena_mark_t arena_mark(arena_t arena) {
+  arena_mark_t mark = { arena->current, arena->used };
+  return mark;
+}
+
+/** Releases all memory allocated in an arena after a mark was taken.
+ *  Memory allocated before the mark is not affected.
+ *
+ *  Parameters: arena: Arena to be released.
+ *              mark: Position returned by arena_mark.
+ */
+void arena_release(arena_t arena, arena_mark_t mark) {
+  arena->current = mark.block;
+  arena->used = mark.used;
+}
+
+/** Releases all memory allocated in an arena. The arena keeps its
+ *  blocks for later allocations.
+ *
+ *  Parameters: arena: Arena to be reset.
+ */
+void arena_reset(arena_t arena) {
+  arena->current = arena->first;
+  arena->used = 0;
+}
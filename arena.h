@@ -0,0 +1,26 @@
+/* arena.h
+ * Region-based memory allocation for client sessions.
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+typedef struct arena *arena_t;
+
+// Position in an arena, used to release everything allocated after it
+typedef struct {
+  struct arena_block *block;
+  size_t used;
+} arena_mark_t;
+
+arena_t arena_create(size_t block_size);
+void arena_destroy(arena_t arena);
+void *arena_alloc(arena_t arena, size_t size);
+char *arena_strdup(arena_t arena, const char *str);
+arena_mark_t arena_mark(arena_t arena);
+void arena_release(arena_t arena, arena_mark_t mark);
+void arena_reset(arena_t arena);
+
+#endif
@@ -0,0 +1,120 @@
+/* histogram.c
+ * Latency histogram with logarithmic buckets, in the style of HDR
+ * histograms, used by the benchmark tools.
+ *
+ * Small values (below 2^HISTOGRAM_SUB_BITS) get one bucket each;
+ * larger values are grouped in buckets whose width doubles every
+ * power of two, so every value is recorded with the same relative
+ * precision. Recording is lock-free and may be done by several
+ * threads at once.
+ */
+
+#include "histogram.h"
+
+#include <string.h>
+
+#define SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HALF_SUB_BUCKETS (SUB_BUCKETS / 2)
+
+/** Internal function that returns the bucket index for a value.
+ */
+static unsigned int bucket_index(uint64_t value) {
+  if (value < SUB_BUCKETS)
+    return value;
+  int shift = 63 - __builtin_clzll(value) - (HISTOGRAM_SUB_BITS - 1);
+  unsigned int index = (shift + 1) * HALF_SUB_BUCKETS + (value >> shift) - HALF_SUB_BUCKETS;
+  return index < HISTOGRAM_BUCKETS ? index : HISTOGRAM_BUCKETS - 1;
+}
+
+/** Internal function that returns the highest value recorded in a
+ *  bucket.
+ */
+static uint64_t bucket_value(unsigned int index) {
+  if (index < SUB_BUCKETS)
+    return index;
+  int shift = index / HALF_SUB_BUCKETS - 1;
+  uint64_t sub = index % HALF_SUB_BUCKETS + HALF_SUB_BUCKETS;
+  return ((sub + 1) << shift) - 1;
+}
+
+/** Initializes an empty histogram.
+ *
+ *  Parameters: h: Histogram to be initialized.
+ */
+void histogram_init(struct histogram *h) {
+  memset(h, 0, sizeof(*h));
+  h->min = UINT64_MAX;
+}
+
+/** Records a single value in a histogram. Safe to be called by
+ *  several threads at the same time.
+ *
+ *  Parameters: h: Histogram to be updated.
+ *              value: Value to be recorded (e.g., a latency in ns).
+ */
+void histogram_record(struct histogram *h, uint64_t value) {
+
+  __atomic_fetch_add(&h->buckets[bucket_index(value)], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+
+  uint64_t current = __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+  while (value < current &&
+         !__atomic_compare_exchange_n(&h->min, &current, value, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  current = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+  while (value > current &&
+         !__atomic_compare_exchange_n(&h->max, &current, value, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/** Adds all values recorded in one histogram to another.
+ *
+ *  Parameters: dst: Histogram to be updated.
+ *              src: Histogram whose values are added to dst.
+ */
+void histogram_merge(struct histogram *dst, const struct histogram *src) {
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    dst->buckets[i] += src->buckets[i];
+  dst->count += src->count;
+  dst->sum += src->sum;
+  if (src->min < dst->min) dst->min = src->min;
+  if (src->max > dst->max) dst->max = src->max;
+}
+
+/** Returns the value at a given percentile of all recorded values.
+ *
+ *  Parameters: h: Histogram to be assessed.
+ *              percentile: Percentile, between 0 and 100.
+ *
+ *  Returns: The highest value in the bucket containing the
+ *           percentile (capped by the maximum recorded value), or 0
+ *           if the histogram is empty.
+ */
+uint64_t histogram_percentile(const struct histogram *h, double percentile) {
+
+  if (!h->count) return 0;
+
+  uint64_t target = (uint64_t) (h->count * percentile / 100.0 + 0.5);
+  if (target < 1) target = 1;
+
+  uint64_t seen = 0;
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= target) {
+      uint64_t value = bucket_value(i);
+      return value < h->max ? value : h->max;
+    }
+  }
+  return h->max;
+}
+
+/** Returns the average of all recorded values.
+ *
+ *  Parameters: h: Histogram to be assessed.
+ *
+ *  Returns: Mean value, or 0 if the histogram is empty.
+ */
+double histogram_mean(const struct histogram *h) {
+  return h->count ? (double) h->sum / h->count : 0;
+}
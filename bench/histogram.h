@@ -0,0 +1,29 @@
+/* histogram.h
+ * Latency histogram with logarithmic buckets, in the style of HDR
+ * histograms, used by the benchmark tools.
+ */
+
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <stdint.h>
+
+// Values are kept with 7 significant bits (under 1% error) up to 2^48
+#define HISTOGRAM_SUB_BITS 7
+#define HISTOGRAM_BUCKETS ((48 - HISTOGRAM_SUB_BITS + 2) << (HISTOGRAM_SUB_BITS - 1))
+
+struct histogram {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+  uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+void histogram_init(struct histogram *h);
+void histogram_record(struct histogram *h, uint64_t value);
+void histogram_merge(struct histogram *dst, const struct histogram *src);
+uint64_t histogram_percentile(const struct histogram *h, double percentile);
+double histogram_mean(const struct histogram *h);
+
+#endif
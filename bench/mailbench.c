@@ -0,0 +1,576 @@
+/* mailbench.c
+ * Load generator for the SMTP and POP3 servers. Drives a mix of SMTP
+ * deliveries and POP3 sessions from many concurrent clients and
+ * reports throughput and per-command latency percentiles as JSON.
+ *
+ * Usage: mailbench [options]
+ *   -S            start mysmtpd and mypopd on free local ports, in a
+ *                 scratch directory with its own mail.store
+ *   -B dir        directory containing the server binaries (with -S;
+ *                 default: .)
+ *   -C file       configuration file copied to the scratch directory
+ *   -k            keep the scratch directory after the run
+ *   -h host       server host (default: 127.0.0.1)
+ *   -s port       SMTP port (without -S)
+ *   -p port       POP3 port (without -S)
+ *   -c clients    number of concurrent clients (default: 16)
+ *   -d seconds    duration of the run (default: 10)
+ *   -m percent    percentage of sessions that are SMTP (default: 50)
+ *   -u users      number of mailboxes used (default: 100)
+ *   -r rcpts      recipients per SMTP message (default: 1)
+ *   -n messages   messages per SMTP session (default: 1)
+ *   -z bytes      message body size (default: 4096)
+ *   -R count      messages retrieved and deleted per POP3 session
+ *                 (default: 5)
+ *   -l label      label stored in the output, to compare builds and
+ *                 server modes
+ *   -o file       write the JSON report to a file instead of stdout
+ *
+ * Without -S, the servers must already be running and the users
+ * bench0..bench<users-1> (with passwords equal to the user names)
+ * must exist in their users.txt.
+ */
+
+#define _GNU_SOURCE
+#include "histogram.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <ftw.h>
+#include <limits.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define MAX_LINE_LENGTH 1024
+#define READ_BUFFER_SIZE 65536
+#define SERVER_START_TIMEOUT 5   // seconds
+
+enum command {
+  SMTP_CONNECT, SMTP_HELO, SMTP_MAIL, SMTP_RCPT, SMTP_DATA, SMTP_BODY, SMTP_QUIT,
+  POP_CONNECT, POP_USER, POP_PASS, POP_STAT, POP_LIST, POP_RETR, POP_DELE, POP_QUIT,
+  NUM_COMMANDS
+};
+
+static const char *command_names[NUM_COMMANDS] = {
+  "smtp_connect", "smtp_helo", "smtp_mail", "smtp_rcpt", "smtp_data", "smtp_body", "smtp_quit",
+  "pop3_connect", "pop3_user", "pop3_pass", "pop3_stat", "pop3_list", "pop3_retr", "pop3_dele",
+  "pop3_quit"
+};
+
+struct options {
+  int spawn;
+  const char *bin_dir;
+  const char *config_file;
+  int keep;
+  const char *host;
+  char smtp_port[16];
+  char pop_port[16];
+  int clients;
+  int duration;
+  int smtp_percent;
+  int users;
+  int recipients;
+  int messages;
+  int message_size;
+  int retrieve;
+  const char *label;
+  const char *output;
+};
+
+struct stats {
+  uint64_t smtp_sessions;
+  uint64_t pop_sessions;
+  uint64_t messages_sent;
+  uint64_t messages_retrieved;
+  uint64_t bytes_sent;
+  uint64_t bytes_received;
+  uint64_t errors;
+};
+
+struct connection {
+  int fd;
+  size_t start;
+  size_t end;
+  char buf[READ_BUFFER_SIZE];
+};
+
+static struct options opts = {
+  .bin_dir = ".", .host = "127.0.0.1", .clients = 16, .duration = 10,
+  .smtp_percent = 50, .users = 100, .recipients = 1, .messages = 1,
+  .message_size = 4096, .retrieve = 5
+};
+static struct stats stats;
+static struct histogram histograms[NUM_COMMANDS];
+static char *message_body;
+static size_t message_body_size;
+static uint64_t deadline;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void count(uint64_t *counter, uint64_t value) {
+  __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+static int connect_to(const char *host, const char *port) {
+
+  struct addrinfo hints, *servinfo, *p;
+  int fd = -1;
+
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &servinfo) != 0)
+    return -1;
+
+  for (p = servinfo; p; p = p->ai_next) {
+    fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    if (fd < 0) continue;
+    if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) break;
+    close(fd);
+    fd = -1;
+  }
+
+  freeaddrinfo(servinfo);
+  if (fd >= 0) {
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+  }
+  return fd;
+}
+
+/** Reads a single line (up to LF) from the connection into out,
+ *  returning its length, or -1 on error or end of connection.
+ */
+static int read_line(struct connection *c, char *out, size_t size) {
+
+  while (1) {
+    char *eol = memchr(c->buf + c->start, '\n', c->end - c->start);
+    if (eol) {
+      size_t len = eol - (c->buf + c->start) + 1;
+      size_t copy = len < size - 1 ? len : size - 1;
+      memcpy(out, c->buf + c->start, copy);
+      out[copy] = 0;
+      c->start += len;
+      count(&stats.bytes_received, len);
+      return len;
+    }
+    if (c->start > 0) {
+      memmove(c->buf, c->buf + c->start, c->end - c->start);
+      c->end -= c->start;
+      c->start = 0;
+    }
+    if (c->end == sizeof(c->buf))
+      return -1;
+    ssize_t rv = recv(c->fd, c->buf + c->end, sizeof(c->buf) - c->end, 0);
+    if (rv <= 0)
+      return -1;
+    c->end += rv;
+  }
+}
+
+static int send_data(struct connection *c, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t rv = send(c->fd, data, size, MSG_NOSIGNAL);
+    if (rv <= 0) return -1;
+    count(&stats.bytes_sent, rv);
+    data += rv;
+    size -= rv;
+  }
+  return 0;
+}
+
+/** Sends a command (if not NULL) and waits for a single-line reply,
+ *  recording the latency for the command. Returns 0 if the reply
+ *  starts with the expected prefix, or -1 otherwise.
+ */
+static int command(struct connection *c, enum command cmd, const char *expect,
+                   char *reply, const char *fmt, ...) {
+
+  char line[MAX_LINE_LENGTH];
+  uint64_t start = now_ns();
+
+  if (fmt) {
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    if (send_data(c, line, len) < 0) return -1;
+  }
+
+  if (read_line(c, reply, MAX_LINE_LENGTH) < 0) return -1;
+  histogram_record(&histograms[cmd], now_ns() - start);
+  return strncmp(reply, expect, strlen(expect)) ? -1 : 0;
+}
+
+/** Reads the remaining lines of a multi-line POP3 reply, up to the
+ *  terminating ".". Returns the number of lines read, or -1 on error.
+ */
+static int read_multiline(struct connection *c) {
+  char line[MAX_LINE_LENGTH];
+  int lines = 0;
+  while (read_line(c, line, sizeof(line)) >= 0) {
+    if (!strcmp(line, ".\r\n")) return lines;
+    lines++;
+  }
+  return -1;
+}
+
+static struct connection *open_connection(const char *port, enum command cmd,
+                                          const char *greeting) {
+
+  char reply[MAX_LINE_LENGTH];
+  uint64_t start = now_ns();
+  struct connection *c = malloc(sizeof(struct connection));
+  c->start = c->end = 0;
+  c->fd = connect_to(opts.host, port);
+  if (c->fd < 0 || read_line(c, reply, sizeof(reply)) < 0 ||
+      strncmp(reply, greeting, strlen(greeting))) {
+    if (c->fd >= 0) close(c->fd);
+    free(c);
+    return NULL;
+  }
+  histogram_record(&histograms[cmd], now_ns() - start);
+  return c;
+}
+
+static void close_connection(struct connection *c) {
+  close(c->fd);
+  free(c);
+}
+
+static int smtp_session(unsigned int *seed) {
+
+  char reply[MAX_LINE_LENGTH];
+  struct connection *c = open_connection(opts.smtp_port, SMTP_CONNECT, "220");
+  if (!c) return -1;
+
+  int rv = command(c, SMTP_HELO, "250", reply, "HELO mailbench\r\n");
+  for (int m = 0; !rv && m < opts.messages; m++) {
+    rv = command(c, SMTP_MAIL, "250", reply, "MAIL FROM:<mailbench>\r\n");
+    for (int r = 0; !rv && r < opts.recipients; r++)
+      rv = command(c, SMTP_RCPT, "250", reply, "RCPT TO:<bench%d>\r\n",
+                   rand_r(seed) % opts.users);
+    if (!rv)
+      rv = command(c, SMTP_DATA, "354", reply, "DATA\r\n");
+    if (!rv) {
+      uint64_t start = now_ns();
+      rv = send_data(c, message_body, message_body_size);
+      if (!rv && (read_line(c, reply, sizeof(reply)) < 0 || strncmp(reply, "250", 3)))
+        rv = -1;
+      histogram_record(&histograms[SMTP_BODY], now_ns() - start);
+    }
+    if (!rv)
+      count(&stats.messages_sent, 1);
+  }
+  if (!rv)
+    rv = command(c, SMTP_QUIT, "221", reply, "QUIT\r\n");
+
+  close_connection(c);
+  count(&stats.smtp_sessions, 1);
+  return rv;
+}
+
+static int pop_session(unsigned int *seed) {
+
+  char reply[MAX_LINE_LENGTH];
+  struct connection *c = open_connection(opts.pop_port, POP_CONNECT, "+OK");
+  if (!c) return -1;
+
+  int user = rand_r(seed) % opts.users;
+  int messages = 0;
+  int rv = command(c, POP_USER, "+OK", reply, "USER bench%d\r\n", user);
+  if (!rv)
+    rv = command(c, POP_PASS, "+OK", reply, "PASS bench%d\r\n", user);
+  if (!rv)
+    rv = command(c, POP_STAT, "+OK", reply, "STAT\r\n");
+  if (!rv && sscanf(reply, "+OK %d", &messages) != 1)
+    rv = -1;
+
+  if (!rv) {
+    uint64_t start = now_ns();
+    if (send_data(c, "LIST\r\n", 6) < 0 || read_line(c, reply, sizeof(reply)) < 0 ||
+        strncmp(reply, "+OK", 3) || read_multiline(c) < 0)
+      rv = -1;
+    else
+      histogram_record(&histograms[POP_LIST], now_ns() - start);
+  }
+
+  for (int i = 1; !rv && i <= messages && i <= opts.retrieve; i++) {
+    uint64_t start = now_ns();
+    char line[32];
+    int len = snprintf(line, sizeof(line), "RETR %d\r\n", i);
+    if (send_data(c, line, len) < 0 || read_line(c, reply, sizeof(reply)) < 0) {
+      rv = -1;
+      break;
+    }
+    // Messages may have been deleted by a concurrent session
+    if (!strncmp(reply, "+OK", 3)) {
+      if (read_multiline(c) < 0) {
+        rv = -1;
+        break;
+      }
+      histogram_record(&histograms[POP_RETR], now_ns() - start);
+      count(&stats.messages_retrieved, 1);
+      rv = command(c, POP_DELE, "+OK", reply, "DELE %d\r\n", i);
+    }
+  }
+
+  if (!rv)
+    rv = command(c, POP_QUIT, "+OK", reply, "QUIT\r\n");
+
+  close_connection(c);
+  count(&stats.pop_sessions, 1);
+  return rv;
+}
+
+static void *client_thread(void *arg) {
+
+  unsigned int seed = (unsigned int) (uintptr_t) arg * 2654435761u ^ (unsigned int) now_ns();
+  while (now_ns() < deadline) {
+    int rv = (int) (rand_r(&seed) % 100) < opts.smtp_percent ?
+      smtp_session(&seed) : pop_session(&seed);
+    if (rv < 0)
+      count(&stats.errors, 1);
+  }
+  return NULL;
+}
+
+/** Builds the message sent in every SMTP delivery: a few headers and
+ *  a body of printable lines, followed by the terminating ".".
+ */
+static void build_message(void) {
+
+  size_t size = opts.message_size;
+  message_body = malloc(size + 256);
+  int len = sprintf(message_body, "From: <mailbench>\r\nSubject: mailbench\r\n\r\n");
+  while (len < size) {
+    int line = size - len < 78 ? size - len : 78;
+    if (line < 2) line = 2;
+    memset(message_body + len, 'x', line - 2);
+    memcpy(message_body + len + line - 2, "\r\n", 2);
+    len += line;
+  }
+  memcpy(message_body + len, ".\r\n", 3);
+  message_body_size = len + 3;
+}
+
+/** Finds a free TCP port on the loopback interface by binding to port
+ *  zero. The port is released before the server uses it, so another
+ *  process could take it in the meantime, but this is unlikely.
+ */
+static void find_free_port(char *port, size_t size) {
+
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+      getsockname(fd, (struct sockaddr *) &addr, &len) < 0) {
+    perror("mailbench: port");
+    exit(1);
+  }
+  snprintf(port, size, "%d", ntohs(addr.sin_port));
+  close(fd);
+}
+
+static pid_t start_server(const char *dir, const char *binary, const char *port) {
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", opts.bin_dir, binary);
+  char *resolved = realpath(path, NULL);
+  if (!resolved) {
+    perror(path);
+    exit(1);
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    // Servers run in their own process group, so that all their
+    // session processes can be stopped together
+    setpgid(0, 0);
+    if (chdir(dir) < 0) exit(1);
+    freopen("/dev/null", "w", stdout);
+    execl(resolved, binary, port, (char *) NULL);
+    perror(resolved);
+    exit(1);
+  }
+  free(resolved);
+
+  uint64_t limit = now_ns() + SERVER_START_TIMEOUT * 1000000000ull;
+  while (now_ns() < limit) {
+    int fd = connect_to(opts.host, port);
+    if (fd >= 0) {
+      close(fd);
+      return pid;
+    }
+    usleep(10000);
+  }
+  fprintf(stderr, "mailbench: %s did not start\n", binary);
+  kill(-pid, SIGTERM);
+  exit(1);
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int flag, struct FTW *ftw) {
+  return remove(path);
+}
+
+static void setup_scratch_directory(char *dir) {
+
+  if (!mkdtemp(dir)) {
+    perror("mailbench: mkdtemp");
+    exit(1);
+  }
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/users.txt", dir);
+  FILE *file = fopen(path, "w");
+  for (int i = 0; i < opts.users; i++)
+    fprintf(file, "bench%d bench%d\n", i, i);
+  fclose(file);
+
+  if (opts.config_file) {
+    snprintf(path, sizeof(path), "cp '%s' '%s/mail.conf'", opts.config_file, dir);
+    if (system(path) != 0) {
+      fprintf(stderr, "mailbench: cannot copy %s\n", opts.config_file);
+      exit(1);
+    }
+  }
+}
+
+static void print_report(FILE *out, double elapsed) {
+
+  fprintf(out, "{\n");
+  fprintf(out, "  \"label\": \"%s\",\n", opts.label ? opts.label : "");
+  fprintf(out, "  \"config\": {\"clients\": %d, \"duration_s\": %d, \"smtp_percent\": %d, "
+          "\"users\": %d, \"recipients\": %d, \"messages_per_session\": %d, "
+          "\"message_size\": %d, \"retrieve_per_session\": %d},\n",
+          opts.clients, opts.duration, opts.smtp_percent, opts.users, opts.recipients,
+          opts.messages, opts.message_size, opts.retrieve);
+  fprintf(out, "  \"elapsed_s\": %.3f,\n", elapsed);
+  fprintf(out, "  \"smtp_sessions\": %lu,\n", stats.smtp_sessions);
+  fprintf(out, "  \"pop3_sessions\": %lu,\n", stats.pop_sessions);
+  fprintf(out, "  \"errors\": %lu,\n", stats.errors);
+  fprintf(out, "  \"messages_sent\": %lu,\n", stats.messages_sent);
+  fprintf(out, "  \"messages_sent_per_s\": %.1f,\n", stats.messages_sent / elapsed);
+  fprintf(out, "  \"messages_retrieved\": %lu,\n", stats.messages_retrieved);
+  fprintf(out, "  \"messages_retrieved_per_s\": %.1f,\n", stats.messages_retrieved / elapsed);
+  fprintf(out, "  \"bytes_sent\": %lu,\n", stats.bytes_sent);
+  fprintf(out, "  \"bytes_received\": %lu,\n", stats.bytes_received);
+  fprintf(out, "  \"bytes_per_s\": %.1f,\n", (stats.bytes_sent + stats.bytes_received) / elapsed);
+  fprintf(out, "  \"latency_us\": {");
+
+  const char *sep = "\n";
+  for (int i = 0; i < NUM_COMMANDS; i++) {
+    struct histogram *h = &histograms[i];
+    if (!h->count) continue;
+    fprintf(out, "%s    \"%s\": {\"count\": %lu, \"mean\": %.1f, \"min\": %.1f, "
+            "\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}",
+            sep, command_names[i], h->count, histogram_mean(h) / 1000, h->min / 1000.0,
+            histogram_percentile(h, 50) / 1000.0, histogram_percentile(h, 90) / 1000.0,
+            histogram_percentile(h, 99) / 1000.0, histogram_percentile(h, 99.9) / 1000.0,
+            h->max / 1000.0);
+    sep = ",\n";
+  }
+  fprintf(out, "\n  }\n}\n");
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-S [-B dir] [-C conf] [-k]] [-h host] [-s smtp_port] "
+          "[-p pop_port] [-c clients] [-d seconds] [-m smtp_percent] [-u users] [-r rcpts] "
+          "[-n messages] [-z bytes] [-R count] [-l label] [-o file]\n", name);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+
+  int opt;
+  strcpy(opts.smtp_port, "25");
+  strcpy(opts.pop_port, "110");
+
+  while ((opt = getopt(argc, argv, "SB:C:kh:s:p:c:d:m:u:r:n:z:R:l:o:")) != -1) {
+    switch (opt) {
+    case 'S': opts.spawn = 1; break;
+    case 'B': opts.bin_dir = optarg; break;
+    case 'C': opts.config_file = optarg; break;
+    case 'k': opts.keep = 1; break;
+    case 'h': opts.host = optarg; break;
+    case 's': snprintf(opts.smtp_port, sizeof(opts.smtp_port), "%s", optarg); break;
+    case 'p': snprintf(opts.pop_port, sizeof(opts.pop_port), "%s", optarg); break;
+    case 'c': opts.clients = atoi(optarg); break;
+    case 'd': opts.duration = atoi(optarg); break;
+    case 'm': opts.smtp_percent = atoi(optarg); break;
+    case 'u': opts.users = atoi(optarg); break;
+    case 'r': opts.recipients = atoi(optarg); break;
+    case 'n': opts.messages = atoi(optarg); break;
+    case 'z': opts.message_size = atoi(optarg); break;
+    case 'R': opts.retrieve = atoi(optarg); break;
+    case 'l': opts.label = optarg; break;
+    case 'o': opts.output = optarg; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind != argc || opts.clients < 1 || opts.duration < 1 || opts.users < 1)
+    usage(argv[0]);
+
+  char scratch[] = "/tmp/mailbench-XXXXXX";
+  pid_t smtp_pid = 0, pop_pid = 0;
+  if (opts.spawn) {
+    setup_scratch_directory(scratch);
+    find_free_port(opts.smtp_port, sizeof(opts.smtp_port));
+    find_free_port(opts.pop_port, sizeof(opts.pop_port));
+    smtp_pid = start_server(scratch, "mysmtpd", opts.smtp_port);
+    pop_pid = start_server(scratch, "mypopd", opts.pop_port);
+  }
+
+  for (int i = 0; i < NUM_COMMANDS; i++)
+    histogram_init(&histograms[i]);
+  build_message();
+
+  pthread_t *threads = calloc(opts.clients, sizeof(pthread_t));
+  uint64_t start = now_ns();
+  deadline = start + opts.duration * 1000000000ull;
+  for (int i = 0; i < opts.clients; i++)
+    pthread_create(&threads[i], NULL, client_thread, (void *) (uintptr_t) i);
+  for (int i = 0; i < opts.clients; i++)
+    pthread_join(threads[i], NULL);
+  double elapsed = (now_ns() - start) / 1e9;
+
+  if (opts.spawn) {
+    kill(-smtp_pid, SIGTERM);
+    kill(-pop_pid, SIGTERM);
+    waitpid(smtp_pid, NULL, 0);
+    waitpid(pop_pid, NULL, 0);
+    if (opts.keep)
+      fprintf(stderr, "mailbench: scratch directory kept in %s\n", scratch);
+    else
+      nftw(scratch, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  }
+
+  FILE *out = stdout;
+  if (opts.output && !(out = fopen(opts.output, "w"))) {
+    perror(opts.output);
+    return 1;
+  }
+  print_report(out, elapsed);
+  if (out != stdout) fclose(out);
+  return 0;
+}
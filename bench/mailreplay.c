@@ -0,0 +1,933 @@
+/* mailreplay.c
+ * Replays sessions recorded by the servers' session capture (see
+ * capture.c) against a local mysmtpd and mypopd, with the timing and
+ * concurrency of the capture, and reports how the replay compares to
+ * the capture as JSON.
+ *
+ * Usage: mailreplay [options] capture_file
+ *   -S            start mysmtpd and mypopd on free local ports, in a
+ *                 scratch directory with its own mail.store
+ *   -B dir        directory containing the server binaries (with -S;
+ *                 default: .)
+ *   -C file       configuration file copied to the scratch directory
+ *   -k            keep the scratch directory after the run
+ *   -h host       server host (default: 127.0.0.1)
+ *   -s port       SMTP port (without -S)
+ *   -p port       POP3 port (without -S)
+ *   -x speed      replay speed; e.g., 10 replays an hour of traffic in
+ *                 six minutes (default: 1)
+ *   -c clients    maximum number of concurrent sessions (default: the
+ *                 peak concurrency of the capture)
+ *   -u users      number of mailboxes the captured mailboxes are
+ *                 mapped to (default: one for each captured mailbox)
+ *   -P            before replaying, fill each mailbox with as many
+ *                 messages (and bytes) as the first STAT reply
+ *                 captured for it
+ *   -l label      label stored in the output, to compare builds and
+ *                 server modes
+ *   -o file       write the JSON report to a file instead of stdout
+ *
+ * Each session starts at its captured start time (divided by the
+ * speed), and each command is sent at its captured time in the
+ * session, or as soon as the reply to the previous command arrives if
+ * the replay is running late. Commands the client pipelined are sent
+ * without waiting for the previous replies. Messages are replaced with
+ * generated text of the same size and number of lines. STARTTLS and
+ * STLS are skipped, so sessions are always replayed in clear.
+ *
+ * Captured mailboxes are mapped to the users bench0..bench<users-1>
+ * (with passwords equal to the user names), which must exist in the
+ * servers' users.txt unless -S is used. Commands that failed in the
+ * capture are replayed with an unknown mailbox or a wrong password,
+ * so they fail again.
+ *
+ * The report gives the captured and replayed throughput, the number of
+ * replies whose status differs from the capture, how late sessions
+ * started, and for each command the latency measured by the server in
+ * the capture next to the latency measured by the client in the
+ * replay (which includes the network round trip). Replaying the same
+ * capture against two builds compares them under the captured load.
+ */
+
+#define _GNU_SOURCE
+#include "histogram.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <ftw.h>
+#include <limits.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define MAX_LINE_LENGTH 1024
+#define READ_BUFFER_SIZE 65536
+#define SERVER_START_TIMEOUT 5   // seconds
+#define MAX_COMMAND_KINDS 64
+#define SESSION_TABLE_SIZE 4096  // open sessions while reading (power of two)
+#define TOKEN_TABLE_SIZE 65536   // captured mailboxes (power of two)
+
+enum protocol { SMTP, POP3, NUM_PROTOCOLS };
+
+static const char *protocol_names[NUM_PROTOCOLS] = { "smtp", "pop3" };
+
+struct options {
+  int spawn;
+  const char *bin_dir;
+  const char *config_file;
+  int keep;
+  const char *host;
+  char ports[NUM_PROTOCOLS][16];
+  double speed;
+  int clients;
+  int users;
+  int prefill;
+  const char *label;
+  const char *output;
+};
+
+struct replay_command {
+  uint64_t offset;        // us since the start of the session
+  uint64_t duration;      // us, as measured by the server
+  int pipelined;
+  size_t body_bytes;
+  unsigned int body_lines;
+  char reply[32];         // captured reply status (and numbers)
+  char *line;             // command and sanitized arguments
+  int kind;               // index in command_kinds
+};
+
+struct session {
+  enum protocol protocol;
+  int pid;
+  uint64_t start;         // us (Unix time)
+  uint64_t end;           // us since the start of the session
+  int user;               // last mailbox seen while reading
+  int num_commands;
+  int max_commands;
+  struct replay_command *commands;
+};
+
+struct command_kind {
+  enum protocol protocol;
+  char name[16];
+  struct histogram captured;
+  struct histogram replayed;
+  uint64_t mismatches;
+};
+
+struct stats {
+  uint64_t sessions;
+  uint64_t commands;
+  uint64_t skipped;
+  uint64_t mismatches;
+  uint64_t bytes_sent;
+  uint64_t bytes_received;
+  uint64_t errors;
+};
+
+struct connection {
+  int fd;
+  size_t start;
+  size_t end;
+  char buf[READ_BUFFER_SIZE];
+};
+
+static struct options opts = {
+  .bin_dir = ".", .host = "127.0.0.1", .speed = 1
+};
+static struct stats stats;
+
+static struct session *sessions;
+static int num_sessions;
+static uint64_t captured_commands, captured_bytes;
+static uint64_t capture_start, capture_end;   // us (Unix time)
+
+static struct command_kind command_kinds[MAX_COMMAND_KINDS];
+static int num_command_kinds;
+
+// Captured mailboxes, in order of appearance; the index of a token is
+// the test mailbox it is mapped to (modulo the number of users)
+static char *tokens[TOKEN_TABLE_SIZE];
+static int token_index[TOKEN_TABLE_SIZE];
+static int num_tokens;
+static char *token_stat[TOKEN_TABLE_SIZE]; // first STAT reply, by index
+
+static struct histogram start_lag;
+static int next_session;
+static uint64_t replay_start;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void count(uint64_t *counter, uint64_t value) {
+  __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+static void wait_until(uint64_t time) {
+  uint64_t now = now_ns();
+  if (time <= now) return;
+  struct timespec ts = { (time - now) / 1000000000, (time - now) % 1000000000 };
+  while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
+
+/** Returns p, or exits with an error message if it is NULL (memory
+ *  not available).
+ */
+static void *check_alloc(void *p) {
+  if (!p) {
+    perror("mailreplay");
+    exit(1);
+  }
+  return p;
+}
+
+/** Returns the index of a captured mailbox token, adding it if new.
+ */
+static int token_lookup(const char *token, int add) {
+
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (const char *p = token; *p; p++)
+    hash = (hash ^ (unsigned char) *p) * 0x100000001b3ull;
+
+  for (unsigned int i = hash & (TOKEN_TABLE_SIZE - 1), n = 0; n < TOKEN_TABLE_SIZE;
+       i = (i + 1) & (TOKEN_TABLE_SIZE - 1), n++) {
+    if (!tokens[i]) {
+      if (!add) return -1;
+      tokens[i] = check_alloc(strdup(token));
+      token_index[i] = num_tokens++;
+      return token_index[i];
+    }
+    if (!strcmp(tokens[i], token))
+      return token_index[i];
+  }
+  return -1;
+}
+
+/** Returns the index of the histograms kept for a command.
+ */
+static int command_kind(enum protocol protocol, const char *name) {
+
+  for (int i = 0; i < num_command_kinds; i++)
+    if (command_kinds[i].protocol == protocol && !strcasecmp(command_kinds[i].name, name))
+      return i;
+  if (num_command_kinds == MAX_COMMAND_KINDS)
+    return MAX_COMMAND_KINDS - 1;
+
+  struct command_kind *kind = &command_kinds[num_command_kinds];
+  kind->protocol = protocol;
+  snprintf(kind->name, sizeof(kind->name), "%s", name);
+  for (char *p = kind->name; *p; p++)
+    *p = *p >= 'A' && *p <= 'Z' ? *p + 32 : *p;
+  histogram_init(&kind->captured);
+  histogram_init(&kind->replayed);
+  return num_command_kinds++;
+}
+
+/** Returns the first word of a command line (the command).
+ */
+static void command_name(const char *line, char *name, size_t size) {
+  size_t len = strcspn(line, " ");
+  if (len >= size) len = size - 1;
+  memcpy(name, line, len);
+  name[len] = 0;
+}
+
+/** Returns the token in the arguments of USER, MAIL or RCPT.
+ */
+static const char *command_token(const char *line, char *token, size_t size) {
+  const char *p = strchr(line, ' ');
+  if (!p) return NULL;
+  p++;
+  const char *lt = strchr(p, '<');
+  if (lt) p = lt + 1;
+  size_t len = strcspn(p, " >");
+  if (len == 0 || len >= size) return NULL;
+  memcpy(token, p, len);
+  token[len] = 0;
+  return token;
+}
+
+static int reply_ok(const char *reply) {
+  return reply[0] == '2' || reply[0] == '3' || reply[0] == '+';
+}
+
+/** Reads the capture file, grouping the records of each session.
+ */
+static void read_capture(const char *file_name) {
+
+  FILE *file = fopen(file_name, "r");
+  if (!file) {
+    perror(file_name);
+    exit(1);
+  }
+
+  // Sessions being read, by process ID; a new session replaces an
+  // earlier one of the same process
+  static int open_sessions[SESSION_TABLE_SIZE];
+  memset(open_sessions, -1, sizeof(open_sessions));
+  int max_sessions = 0;
+
+  char line[MAX_LINE_LENGTH];
+  while (fgets(line, sizeof(line), file)) {
+    line[strcspn(line, "\r\n")] = 0;
+    char type;
+    int pid, pos = 0;
+    if (sscanf(line, "%c %d %n", &type, &pid, &pos) != 2 || !pos)
+      continue;
+    int *slot = &open_sessions[pid & (SESSION_TABLE_SIZE - 1)];
+
+    if (type == 'S') {
+      unsigned long long start;
+      char protocol[16];
+      // Only SMTP and POP3 sessions are replayed (e.g., not LMTP)
+      if (sscanf(line + pos, "%llu %15s", &start, protocol) != 2 ||
+          (strcasecmp(protocol, "smtp") && strcasecmp(protocol, "pop3"))) {
+        *slot = -1;
+        continue;
+      }
+      if (num_sessions == max_sessions) {
+        max_sessions = max_sessions ? max_sessions * 2 : 1024;
+        sessions = check_alloc(realloc(sessions, max_sessions * sizeof(struct session)));
+      }
+      struct session *s = &sessions[num_sessions];
+      memset(s, 0, sizeof(*s));
+      s->protocol = strcasecmp(protocol, "smtp") ? POP3 : SMTP;
+      s->pid = pid;
+      s->start = start;
+      s->user = -1;
+      *slot = num_sessions++;
+      continue;
+    }
+
+    if (*slot < 0 || sessions[*slot].pid != pid) continue;
+    struct session *s = &sessions[*slot];
+
+    if (type == 'E') {
+      unsigned long long end, in, out;
+      if (sscanf(line + pos, "%llu %llu %llu", &end, &in, &out) == 3) {
+        s->end = end;
+        captured_bytes += in + out;
+      }
+      *slot = -1;
+    } else if (type == 'C') {
+      struct replay_command c;
+      unsigned long long offset, duration;
+      size_t in, out;
+      int command = 0;
+      if (sscanf(line + pos, "%llu %llu %d %zu %zu %zu %u %31s %n", &offset, &duration,
+                 &c.pipelined, &in, &out, &c.body_bytes, &c.body_lines, c.reply, &command) != 8 ||
+          !command)
+        continue;
+      c.offset = offset;
+      c.duration = duration;
+      c.line = check_alloc(strdup(line + pos + command));
+
+      char name[16], token[64];
+      command_name(c.line, name, sizeof(name));
+      c.kind = command_kind(s->protocol, name);
+      histogram_record(&command_kinds[c.kind].captured, c.duration * 1000);
+
+      // Captured mailboxes are numbered in order of appearance, and the
+      // first STAT of each is kept for -P
+      if (!strcasecmp(name, "USER") || !strcasecmp(name, "RCPT") || !strcasecmp(name, "VRFY")) {
+        if (command_token(c.line, token, sizeof(token)))
+          s->user = token_lookup(token, 1);
+      } else if (!strcasecmp(name, "STAT") && s->protocol == POP3 && s->user >= 0 &&
+                 !token_stat[s->user] && reply_ok(c.reply)) {
+        token_stat[s->user] = check_alloc(strdup(c.reply));
+      }
+
+      if (s->num_commands == s->max_commands) {
+        s->max_commands = s->max_commands ? s->max_commands * 2 : 16;
+        s->commands = check_alloc(realloc(s->commands, s->max_commands * sizeof(struct replay_command)));
+      }
+      s->commands[s->num_commands++] = c;
+      if (s->end < c.offset + c.duration)
+        s->end = c.offset + c.duration;
+      captured_commands++;
+    }
+  }
+  fclose(file);
+
+  if (!num_sessions) {
+    fprintf(stderr, "mailreplay: no sessions in %s\n", file_name);
+    exit(1);
+  }
+}
+
+static int compare_sessions(const void *a, const void *b) {
+  const struct session *sa = a, *sb = b;
+  return sa->start < sb->start ? -1 : sa->start > sb->start;
+}
+
+static int compare_times(const void *a, const void *b) {
+  int64_t ta = *(const int64_t *) a, tb = *(const int64_t *) b;
+  return ta < tb ? -1 : ta > tb;
+}
+
+/** Sorts the sessions by start time, and returns the highest number
+ *  of sessions that were open at the same time in the capture.
+ */
+static int peak_concurrency(void) {
+
+  qsort(sessions, num_sessions, sizeof(struct session), compare_sessions);
+  capture_start = sessions[0].start;
+  capture_end = capture_start;
+
+  // Ends are even and starts odd, so a session ending when another
+  // starts does not count as overlapping it
+  int64_t *events = check_alloc(malloc(2 * num_sessions * sizeof(int64_t)));
+  for (int i = 0; i < num_sessions; i++) {
+    uint64_t end = sessions[i].start + sessions[i].end;
+    events[2 * i] = (int64_t) sessions[i].start * 2 + 1;
+    events[2 * i + 1] = (int64_t) end * 2;
+    if (end > capture_end) capture_end = end;
+  }
+  qsort(events, 2 * num_sessions, sizeof(int64_t), compare_times);
+
+  int open = 0, peak = 0;
+  for (int i = 0; i < 2 * num_sessions; i++) {
+    open += events[i] & 1 ? 1 : -1;
+    if (open > peak) peak = open;
+  }
+  free(events);
+  return peak;
+}
+
+static int connect_to(const char *host, const char *port) {
+
+  struct addrinfo hints, *servinfo, *p;
+  int fd = -1;
+
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &servinfo) != 0)
+    return -1;
+
+  for (p = servinfo; p; p = p->ai_next) {
+    fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    if (fd < 0) continue;
+    if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) break;
+    close(fd);
+    fd = -1;
+  }
+
+  freeaddrinfo(servinfo);
+  if (fd >= 0) {
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+  }
+  return fd;
+}
+
+/** Reads a single line (up to LF) from the connection into out,
+ *  returning its length, or -1 on error or end of connection.
+ */
+static int read_line(struct connection *c, char *out, size_t size) {
+
+  while (1) {
+    char *eol = memchr(c->buf + c->start, '\n', c->end - c->start);
+    if (eol) {
+      size_t len = eol - (c->buf + c->start) + 1;
+      size_t copy = len < size - 1 ? len : size - 1;
+      memcpy(out, c->buf + c->start, copy);
+      out[copy] = 0;
+      c->start += len;
+      count(&stats.bytes_received, len);
+      return len;
+    }
+    if (c->start > 0) {
+      memmove(c->buf, c->buf + c->start, c->end - c->start);
+      c->end -= c->start;
+      c->start = 0;
+    }
+    if (c->end == sizeof(c->buf))
+      return -1;
+    ssize_t rv = recv(c->fd, c->buf + c->end, sizeof(c->buf) - c->end, 0);
+    if (rv <= 0)
+      return -1;
+    c->end += rv;
+  }
+}
+
+static int send_data(struct connection *c, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t rv = send(c->fd, data, size, MSG_NOSIGNAL);
+    if (rv <= 0) return -1;
+    count(&stats.bytes_sent, rv);
+    data += rv;
+    size -= rv;
+  }
+  return 0;
+}
+
+/** Reads a whole reply: SMTP replies continue while the code is
+ *  followed by a dash; POP3 replies to some commands continue up to a
+ *  line with a single ".". The first line is returned in reply.
+ */
+static int read_reply(struct connection *c, enum protocol protocol, int multiline, char *reply) {
+
+  char line[MAX_LINE_LENGTH];
+  if (read_line(c, reply, MAX_LINE_LENGTH) < 0) return -1;
+  if (protocol == SMTP) {
+    strcpy(line, reply);
+    while (strlen(line) > 3 && line[3] == '-')
+      if (read_line(c, line, sizeof(line)) < 0) return -1;
+  } else if (multiline && !strncmp(reply, "+OK", 3)) {
+    do {
+      if (read_line(c, line, sizeof(line)) < 0) return -1;
+    } while (strcmp(line, ".\r\n"));
+  }
+  return 0;
+}
+
+/** Returns non-zero if the status of a reply (its first word) matches
+ *  the status captured for the command.
+ */
+static int same_status(const char *reply, const char *captured) {
+  size_t len = strcspn(captured, ",");
+  return !strncmp(reply, captured, len) &&
+    (reply[len] == ' ' || reply[len] == '-' || reply[len] == '\r' || reply[len] == '\n' || !reply[len]);
+}
+
+/** Sends a generated message of the given size and number of lines,
+ *  followed by the terminating ".".
+ */
+static int send_body(struct connection *c, size_t bytes, unsigned int lines) {
+
+  if (lines > bytes / 2) lines = bytes / 2;
+  char *body = check_alloc(malloc(bytes + 3));
+  size_t len = 0;
+  for (unsigned int i = 0; i < lines; i++) {
+    size_t line = i + 1 < lines ? bytes / lines : bytes - len;
+    memset(body + len, 'x', line - 2);
+    memcpy(body + len + line - 2, "\r\n", 2);
+    len += line;
+  }
+  memcpy(body + len, ".\r\n", 3);
+  int rv = send_data(c, body, len + 3);
+  free(body);
+  return rv;
+}
+
+/** Writes the command line to be sent for a captured command, mapping
+ *  tokens to test mailboxes. Returns 0 if the command is to be skipped.
+ */
+static int replay_line(struct session *s, struct replay_command *cmd, int *user,
+                       char *out, size_t size) {
+
+  char name[16], token[64] = "x", mailbox[80];
+  command_name(cmd->line, name, sizeof(name));
+  int ok = reply_ok(cmd->reply);
+  int mapped = -1;
+  if (command_token(cmd->line, token, sizeof(token)) && (mapped = token_lookup(token, 0)) >= 0)
+    mapped %= opts.users;
+  if (mapped >= 0 && ok)
+    snprintf(mailbox, sizeof(mailbox), "bench%d", mapped);
+  else
+    snprintf(mailbox, sizeof(mailbox), "nobody-%s", token);
+
+  if (!strcasecmp(name, "STARTTLS") || !strcasecmp(name, "STLS"))
+    return 0;
+  if (!strcasecmp(name, "?"))
+    snprintf(out, size, "XCAPTURED\r\n");
+  else if (!strcasecmp(name, "HELO") || !strcasecmp(name, "EHLO"))
+    snprintf(out, size, "%s mailreplay\r\n", name);
+  else if (!strcasecmp(name, "MAIL") && strstr(cmd->line, "<>"))
+    snprintf(out, size, "MAIL FROM:<>\r\n");
+  else if (!strcasecmp(name, "MAIL"))
+    snprintf(out, size, "MAIL FROM:<%s@mailreplay>\r\n", token);
+  else if (!strcasecmp(name, "RCPT"))
+    snprintf(out, size, "RCPT TO:<%s>\r\n", mailbox);
+  else if (!strcasecmp(name, "USER") || !strcasecmp(name, "VRFY")) {
+    snprintf(out, size, "%s %s\r\n", name, mailbox);
+    if (!strcasecmp(name, "USER"))
+      *user = mapped >= 0 && ok ? mapped : -1;
+  } else if (!strcasecmp(name, "PASS")) {
+    if (*user >= 0 && ok)
+      snprintf(out, size, "PASS bench%d\r\n", *user);
+    else
+      snprintf(out, size, "PASS mailreplay-wrong-password\r\n");
+  } else
+    snprintf(out, size, "%s\r\n", cmd->line);
+  return 1;
+}
+
+/** Returns non-zero if the POP3 reply to a command has several lines.
+ */
+static int pop_multiline(const char *line) {
+  char name[16];
+  command_name(line, name, sizeof(name));
+  int has_args = strchr(line, ' ') != NULL;
+  return !strcasecmp(name, "RETR") || !strcasecmp(name, "TOP") || !strcasecmp(name, "CAPA") ||
+    ((!strcasecmp(name, "LIST") || !strcasecmp(name, "UIDL")) && !has_args);
+}
+
+/** Replays one session, starting at the given time.
+ */
+static int replay_session(struct session *s, uint64_t start) {
+
+  char reply[MAX_LINE_LENGTH], line[MAX_LINE_LENGTH];
+  struct connection *c = check_alloc(malloc(sizeof(struct connection)));
+  c->start = c->end = 0;
+  c->fd = connect_to(opts.host, opts.ports[s->protocol]);
+  if (c->fd < 0 || read_reply(c, s->protocol, 0, reply) < 0) {
+    if (c->fd >= 0) close(c->fd);
+    free(c);
+    return -1;
+  }
+
+  int user = -1, rv = 0;
+  for (int i = 0; !rv && i < s->num_commands; ) {
+
+    // Commands pipelined after this one are sent before reading any
+    // replies; DATA always ends a group, as its message waits for 354
+    int last = i;
+    while (last + 1 < s->num_commands && s->commands[last + 1].pipelined &&
+           strncasecmp(s->commands[last].line, "DATA", 4))
+      last++;
+
+    wait_until(start + (uint64_t) (s->commands[i].offset * 1000 / opts.speed));
+    uint64_t sent = now_ns();
+    int skip[last - i + 1];
+    for (int j = i; !rv && j <= last; j++) {
+      skip[j - i] = !replay_line(s, &s->commands[j], &user, line, sizeof(line));
+      if (skip[j - i])
+        count(&stats.skipped, 1);
+      else
+        rv = send_data(c, line, strlen(line));
+    }
+
+    for (int j = i; !rv && j <= last; j++) {
+      struct replay_command *cmd = &s->commands[j];
+      if (skip[j - i]) continue;
+      int multiline = s->protocol == POP3 && pop_multiline(cmd->line);
+      if (read_reply(c, s->protocol, multiline, reply) < 0) {
+        rv = -1;
+        break;
+      }
+      if (s->protocol == SMTP && !strncasecmp(cmd->line, "DATA", 4) && !strncmp(reply, "354", 3) &&
+          (send_body(c, cmd->body_bytes, cmd->body_lines) < 0 ||
+           read_reply(c, s->protocol, 0, reply) < 0)) {
+        rv = -1;
+        break;
+      }
+      histogram_record(&command_kinds[cmd->kind].replayed, now_ns() - sent);
+      count(&stats.commands, 1);
+      if (!same_status(reply, cmd->reply)) {
+        count(&stats.mismatches, 1);
+        count(&command_kinds[cmd->kind].mismatches, 1);
+      }
+    }
+    i = last + 1;
+  }
+
+  // Sessions that were not closed by the client stay open as long as
+  // in the capture
+  if (!rv)
+    wait_until(start + (uint64_t) (s->end * 1000 / opts.speed));
+  close(c->fd);
+  free(c);
+  return rv;
+}
+
+static void *client_thread(void *arg) {
+
+  int i;
+  while ((i = __atomic_fetch_add(&next_session, 1, __ATOMIC_RELAXED)) < num_sessions) {
+    struct session *s = &sessions[i];
+    uint64_t start = replay_start + (uint64_t) ((s->start - capture_start) * 1000 / opts.speed);
+    wait_until(start);
+    uint64_t now = now_ns();
+    histogram_record(&start_lag, now > start ? now - start : 0);
+    if (replay_session(s, now > start ? now : start) < 0)
+      count(&stats.errors, 1);
+    count(&stats.sessions, 1);
+  }
+  return NULL;
+}
+
+/** Fills the mailboxes as seen by their first captured STAT, so that
+ *  POP3 sessions find mailboxes of the captured sizes.
+ */
+static void prefill_mailboxes(void) {
+
+  char reply[MAX_LINE_LENGTH], line[MAX_LINE_LENGTH];
+  struct connection *c = check_alloc(malloc(sizeof(struct connection)));
+  c->start = c->end = 0;
+  c->fd = connect_to(opts.host, opts.ports[SMTP]);
+  if (c->fd < 0 || read_reply(c, SMTP, 0, reply) < 0 ||
+      send_data(c, "HELO mailreplay\r\n", 17) < 0 || read_reply(c, SMTP, 0, reply) < 0) {
+    fprintf(stderr, "mailreplay: cannot connect to the SMTP server\n");
+    exit(1);
+  }
+
+  int filled = 0;
+  for (int i = 0; i < num_tokens && i < opts.users; i++) {
+    unsigned long messages = 0, bytes = 0;
+    if (!token_stat[i] || sscanf(token_stat[i], "%*[^,],%lu,%lu", &messages, &bytes) < 1)
+      continue;
+    size_t size = messages ? bytes / messages : 0;
+    for (unsigned long m = 0; m < messages; m++) {
+      int len = snprintf(line, sizeof(line), "MAIL FROM:<mailreplay>\r\nRCPT TO:<bench%d>\r\nDATA\r\n", i);
+      if (send_data(c, line, len) < 0 || read_reply(c, SMTP, 0, reply) < 0 ||
+          read_reply(c, SMTP, 0, reply) < 0 || read_reply(c, SMTP, 0, reply) < 0 ||
+          strncmp(reply, "354", 3) || send_body(c, size, size / 78 + 1) < 0 ||
+          read_reply(c, SMTP, 0, reply) < 0) {
+        fprintf(stderr, "mailreplay: cannot fill mailbox bench%d\n", i);
+        exit(1);
+      }
+    }
+    filled++;
+  }
+  send_data(c, "QUIT\r\n", 6);
+  read_reply(c, SMTP, 0, reply);
+  close(c->fd);
+  free(c);
+  stats.bytes_sent = stats.bytes_received = 0;
+  fprintf(stderr, "mailreplay: filled %d mailbox(es)\n", filled);
+}
+
+/** Finds a free TCP port on the loopback interface by binding to port
+ *  zero. The port is released before the server uses it, so another
+ *  process could take it in the meantime, but this is unlikely.
+ */
+static void find_free_port(char *port, size_t size) {
+
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+      getsockname(fd, (struct sockaddr *) &addr, &len) < 0) {
+    perror("mailreplay: port");
+    exit(1);
+  }
+  snprintf(port, size, "%d", ntohs(addr.sin_port));
+  close(fd);
+}
+
+static pid_t start_server(const char *dir, const char *binary, const char *port) {
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", opts.bin_dir, binary);
+  char *resolved = realpath(path, NULL);
+  if (!resolved) {
+    perror(path);
+    exit(1);
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    // Servers run in their own process group, so that all their
+    // session processes can be stopped together
+    setpgid(0, 0);
+    if (chdir(dir) < 0) exit(1);
+    freopen("/dev/null", "w", stdout);
+    execl(resolved, binary, port, (char *) NULL);
+    perror(resolved);
+    exit(1);
+  }
+  free(resolved);
+
+  uint64_t limit = now_ns() + SERVER_START_TIMEOUT * 1000000000ull;
+  while (now_ns() < limit) {
+    int fd = connect_to(opts.host, port);
+    if (fd >= 0) {
+      close(fd);
+      return pid;
+    }
+    usleep(10000);
+  }
+  fprintf(stderr, "mailreplay: %s did not start\n", binary);
+  kill(-pid, SIGTERM);
+  exit(1);
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int flag, struct FTW *ftw) {
+  return remove(path);
+}
+
+static void setup_scratch_directory(char *dir) {
+
+  if (!mkdtemp(dir)) {
+    perror("mailreplay: mkdtemp");
+    exit(1);
+  }
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/users.txt", dir);
+  FILE *file = fopen(path, "w");
+  for (int i = 0; i < opts.users; i++)
+    fprintf(file, "bench%d bench%d\n", i, i);
+  fclose(file);
+
+  if (opts.config_file) {
+    snprintf(path, sizeof(path), "cp '%s' '%s/mail.conf'", opts.config_file, dir);
+    if (system(path) != 0) {
+      fprintf(stderr, "mailreplay: cannot copy %s\n", opts.config_file);
+      exit(1);
+    }
+  }
+}
+
+static double delta_percent(double replayed, double captured) {
+  return captured > 0 ? (replayed / captured - 1) * 100 : 0;
+}
+
+static void print_latency(FILE *out, const char *name, const struct histogram *h) {
+  fprintf(out, "\"%s\": {\"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}",
+          name, h->count ? histogram_mean(h) / 1000 : 0, histogram_percentile(h, 50) / 1000.0,
+          histogram_percentile(h, 90) / 1000.0, histogram_percentile(h, 99) / 1000.0,
+          h->count ? h->max / 1000.0 : 0);
+}
+
+static void print_report(FILE *out, int clients, double elapsed) {
+
+  // Captured rates are scaled by the replay speed: a replay that keeps
+  // up with the capture matches them
+  double captured_elapsed = (capture_end - capture_start) / 1e6 / opts.speed;
+  if (captured_elapsed <= 0) captured_elapsed = 1e-6;
+  double captured_rate = captured_commands / captured_elapsed;
+  double replayed_rate = stats.commands / elapsed;
+  double captured_bytes_rate = captured_bytes / captured_elapsed;
+  double replayed_bytes_rate = (stats.bytes_sent + stats.bytes_received) / elapsed;
+
+  fprintf(out, "{\n");
+  fprintf(out, "  \"label\": \"%s\",\n", opts.label ? opts.label : "");
+  fprintf(out, "  \"config\": {\"speed\": %g, \"clients\": %d, \"users\": %d, \"prefill\": %d},\n",
+          opts.speed, clients, opts.users, opts.prefill);
+  fprintf(out, "  \"captured\": {\"sessions\": %d, \"commands\": %lu, \"mailboxes\": %d, "
+          "\"elapsed_s\": %.3f, \"commands_per_s\": %.1f, \"bytes_per_s\": %.1f},\n",
+          num_sessions, captured_commands, num_tokens, captured_elapsed, captured_rate,
+          captured_bytes_rate);
+  fprintf(out, "  \"replayed\": {\"sessions\": %lu, \"commands\": %lu, \"skipped\": %lu, "
+          "\"errors\": %lu, \"status_mismatches\": %lu, \"elapsed_s\": %.3f, "
+          "\"commands_per_s\": %.1f, \"bytes_per_s\": %.1f},\n",
+          stats.sessions, stats.commands, stats.skipped, stats.errors, stats.mismatches, elapsed,
+          replayed_rate, replayed_bytes_rate);
+  fprintf(out, "  \"delta_pct\": {\"commands_per_s\": %.1f, \"bytes_per_s\": %.1f, \"elapsed\": %.1f},\n",
+          delta_percent(replayed_rate, captured_rate),
+          delta_percent(replayed_bytes_rate, captured_bytes_rate),
+          delta_percent(elapsed, captured_elapsed));
+  fprintf(out, "  ");
+  print_latency(out, "session_start_lag_us", &start_lag);
+  fprintf(out, ",\n  \"latency_us\": {");
+
+  const char *sep = "\n";
+  for (int i = 0; i < num_command_kinds; i++) {
+    struct command_kind *kind = &command_kinds[i];
+    fprintf(out, "%s    \"%s_%s\": {\"count\": %lu, \"status_mismatches\": %lu, ", sep,
+            protocol_names[kind->protocol], kind->name, kind->captured.count, kind->mismatches);
+    print_latency(out, "captured", &kind->captured);
+    fprintf(out, ", ");
+    print_latency(out, "replayed", &kind->replayed);
+    fprintf(out, ", \"delta_pct\": {\"p50\": %.1f, \"p99\": %.1f}}",
+            delta_percent(histogram_percentile(&kind->replayed, 50),
+                          histogram_percentile(&kind->captured, 50)),
+            delta_percent(histogram_percentile(&kind->replayed, 99),
+                          histogram_percentile(&kind->captured, 99)));
+    sep = ",\n";
+  }
+  fprintf(out, "\n  }\n}\n");
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-S [-B dir] [-C conf] [-k]] [-h host] [-s smtp_port] "
+          "[-p pop_port] [-x speed] [-c clients] [-u users] [-P] [-l label] [-o file] "
+          "capture_file\n", name);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+
+  int opt;
+  strcpy(opts.ports[SMTP], "25");
+  strcpy(opts.ports[POP3], "110");
+
+  while ((opt = getopt(argc, argv, "SB:C:kh:s:p:x:c:u:Pl:o:")) != -1) {
+    switch (opt) {
+    case 'S': opts.spawn = 1; break;
+    case 'B': opts.bin_dir = optarg; break;
+    case 'C': opts.config_file = optarg; break;
+    case 'k': opts.keep = 1; break;
+    case 'h': opts.host = optarg; break;
+    case 's': snprintf(opts.ports[SMTP], sizeof(opts.ports[SMTP]), "%s", optarg); break;
+    case 'p': snprintf(opts.ports[POP3], sizeof(opts.ports[POP3]), "%s", optarg); break;
+    case 'x': opts.speed = atof(optarg); break;
+    case 'c': opts.clients = atoi(optarg); break;
+    case 'u': opts.users = atoi(optarg); break;
+    case 'P': opts.prefill = 1; break;
+    case 'l': opts.label = optarg; break;
+    case 'o': opts.output = optarg; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1 || opts.speed <= 0 || opts.clients < 0 || opts.users < 0)
+    usage(argv[0]);
+
+  read_capture(argv[optind]);
+  int peak = peak_concurrency();
+  int clients = opts.clients ? opts.clients : peak;
+  if (!opts.users)
+    opts.users = num_tokens ? num_tokens : 1;
+
+  char scratch[] = "/tmp/mailreplay-XXXXXX";
+  pid_t smtp_pid = 0, pop_pid = 0;
+  if (opts.spawn) {
+    setup_scratch_directory(scratch);
+    find_free_port(opts.ports[SMTP], sizeof(opts.ports[SMTP]));
+    find_free_port(opts.ports[POP3], sizeof(opts.ports[POP3]));
+    smtp_pid = start_server(scratch, "mysmtpd", opts.ports[SMTP]);
+    pop_pid = start_server(scratch, "mypopd", opts.ports[POP3]);
+  }
+  if (opts.prefill)
+    prefill_mailboxes();
+
+  histogram_init(&start_lag);
+  pthread_t *threads = calloc(clients, sizeof(pthread_t));
+  replay_start = now_ns();
+  for (int i = 0; i < clients; i++)
+    pthread_create(&threads[i], NULL, client_thread, NULL);
+  for (int i = 0; i < clients; i++)
+    pthread_join(threads[i], NULL);
+  double elapsed = (now_ns() - replay_start) / 1e9;
+
+  if (opts.spawn) {
+    kill(-smtp_pid, SIGTERM);
+    kill(-pop_pid, SIGTERM);
+    waitpid(smtp_pid, NULL, 0);
+    waitpid(pop_pid, NULL, 0);
+    if (opts.keep)
+      fprintf(stderr, "mailreplay: scratch directory kept in %s\n", scratch);
+    else
+      nftw(scratch, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  }
+
+  FILE *out = stdout;
+  if (opts.output && !(out = fopen(opts.output, "w"))) {
+    perror(opts.output);
+    return 1;
+  }
+  print_report(out, clients, elapsed);
+  if (out != stdout) fclose(out);
+  return 0;
+}
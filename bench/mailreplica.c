@@ -0,0 +1,628 @@
+/* mailreplica.c
+ * Replication check for mailfollow. Starts mysmtpd and mypopd on a
+ * primary store with a journal, and mailfollow keeping a replica of
+ * it served by a read-only mypopd, then delivers and deletes messages
+ * through the primary while mailfollow is killed (SIGKILL) and
+ * restarted, at times from an older saved position so that changes
+ * already replayed are replayed again. Once mailfollow has caught up,
+ * every mailbox is read through both POP3 servers (STAT, LIST and
+ * every message) and compared. The run fails (exit status 1) if any
+ * session fails, if the replica does not catch up, if it accepts a
+ * DELE, or if any mailbox differs.
+ *
+ * Usage: mailreplica [options]
+ *   -B dir        directory containing the server binaries and
+ *                 mailfollow (default: .)
+ *   -k            keep the scratch directory after the run
+ *   -u users      number of mailboxes used (default: 8)
+ *   -r rounds     rounds of deliveries and deletions; mailfollow is
+ *                 killed and restarted once per round (default: 6)
+ *   -m messages   messages delivered per round (default: 40)
+ *   -s seed       seed for the random choices (default: 1)
+ *   -v            list every step
+ *
+ * The primary and the replica run in their own subdirectories of a
+ * scratch directory, each with its own users.txt and mail.conf (with
+ * mail_journal set on the primary, and pop3_read_only on the replica).
+ * Expunges on the primary are deferred, as by default. The errors of
+ * each program are logged in its directory (e.g., mailfollow.log), and
+ * the scratch directory is kept if the run fails.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <ftw.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define MAX_LINE_LENGTH 1024
+#define READ_BUFFER_SIZE 4096
+#define SERVER_START_TIMEOUT 5   // seconds
+#define CATCH_UP_TIMEOUT 20      // seconds
+#define FOLLOW_INTERVAL "20"     // ms between mailfollow checks
+#define CATCH_UP_POLL 100000     // us between checks of the replica
+
+struct connection {
+  int fd;
+  size_t start, end;
+  char buf[READ_BUFFER_SIZE];
+};
+
+// Contents of a mailbox as seen through POP3
+struct mailbox {
+  unsigned int messages;
+  size_t bytes;
+  char *data;   // LIST reply and every message, as received
+  size_t size, capacity;
+};
+
+struct options {
+  const char *bin_dir;
+  int keep;
+  int users;
+  int rounds;
+  int messages;
+  unsigned int seed;
+  int verbose;
+};
+
+static struct options opts = { ".", 0, 8, 6, 40, 1, 0 };
+
+static char primary_dir[PATH_MAX / 2], replica_dir[PATH_MAX / 2], journal_dir[PATH_MAX];
+static char smtp_port[16], pop_port[16], replica_port[16];
+static pid_t follower_pid = 0;
+static unsigned long delivered = 0, deleted = 0, restarts = 0, rewinds = 0;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void step(const char *format, ...) {
+  if (!opts.verbose) return;
+  va_list args;
+  va_start(args, format);
+  fprintf(stderr, "mailreplica: ");
+  vfprintf(stderr, format, args);
+  fprintf(stderr, "\n");
+  va_end(args);
+}
+
+static int connect_to(const char *port) {
+
+  struct addrinfo hints, *servinfo, *p;
+  int fd = -1;
+
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo("127.0.0.1", port, &hints, &servinfo) != 0)
+    return -1;
+
+  for (p = servinfo; p; p = p->ai_next) {
+    fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    if (fd < 0) continue;
+    if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) break;
+    close(fd);
+    fd = -1;
+  }
+
+  freeaddrinfo(servinfo);
+  return fd;
+}
+
+/** Reads a single line (up to LF) from the connection into out,
+ *  returning its length, or -1 on error or end of connection.
+ */
+static int read_line(struct connection *c, char *out, size_t size) {
+
+  while (1) {
+    char *eol = memchr(c->buf + c->start, '\n', c->end - c->start);
+    if (eol) {
+      size_t len = eol - (c->buf + c->start) + 1;
+      size_t copy = len < size - 1 ? len : size - 1;
+      memcpy(out, c->buf + c->start, copy);
+      out[copy] = 0;
+      c->start += len;
+      return len;
+    }
+    if (c->start > 0) {
+      memmove(c->buf, c->buf + c->start, c->end - c->start);
+      c->end -= c->start;
+      c->start = 0;
+    }
+    if (c->end == sizeof(c->buf))
+      return -1;
+    ssize_t rv = recv(c->fd, c->buf + c->end, sizeof(c->buf) - c->end, 0);
+    if (rv <= 0)
+      return -1;
+    c->end += rv;
+  }
+}
+
+static int send_data(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t rv = send(fd, data, size, MSG_NOSIGNAL);
+    if (rv <= 0) return -1;
+    data += rv;
+    size -= rv;
+  }
+  return 0;
+}
+
+/** Sends a command and waits for a single-line reply. Returns 0 if
+ *  the reply starts with the expected prefix, or -1 otherwise.
+ */
+static int command(struct connection *c, const char *expect, char *reply, const char *fmt, ...) {
+
+  char line[MAX_LINE_LENGTH];
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(line, sizeof(line), fmt, args);
+  va_end(args);
+  if (send_data(c->fd, line, len) < 0) return -1;
+
+  if (read_line(c, reply, MAX_LINE_LENGTH) < 0) return -1;
+  return strncmp(reply, expect, strlen(expect)) ? -1 : 0;
+}
+
+static struct connection *open_connection(const char *port, const char *greeting) {
+
+  char reply[MAX_LINE_LENGTH];
+  struct connection *c = malloc(sizeof(struct connection));
+  c->start = c->end = 0;
+  c->fd = connect_to(port);
+  if (c->fd < 0 || read_line(c, reply, sizeof(reply)) < 0 ||
+      strncmp(reply, greeting, strlen(greeting))) {
+    if (c->fd >= 0) close(c->fd);
+    free(c);
+    return NULL;
+  }
+  return c;
+}
+
+static void close_connection(struct connection *c) {
+  close(c->fd);
+  free(c);
+}
+
+static struct connection *pop_login(const char *port, int user) {
+
+  char reply[MAX_LINE_LENGTH];
+  struct connection *c = open_connection(port, "+OK");
+  if (!c) return NULL;
+  if (command(c, "+OK", reply, "USER replica%d\r\n", user) < 0 ||
+      command(c, "+OK", reply, "PASS replica%d\r\n", user) < 0) {
+    close_connection(c);
+    return NULL;
+  }
+  return c;
+}
+
+/** Delivers a message to a user through the primary. The recipient is
+ *  at times spelled in upper case, which must not make a difference.
+ */
+static int deliver(int user, int round, int number, unsigned int *seed) {
+
+  char reply[MAX_LINE_LENGTH], body[MAX_LINE_LENGTH * 4];
+  struct connection *c = open_connection(smtp_port, "220");
+  if (!c) return -1;
+
+  int len = snprintf(body, sizeof(body), "Subject: round %d message %d\r\n\r\n", round, number);
+  for (int lines = 1 + rand_r(seed) % 20; lines > 0; lines--)
+    len += snprintf(body + len, sizeof(body) - len, "%s%d.%d for replica%d\r\n",
+                    lines % 7 ? "" : ".", round, number, user);
+  len += snprintf(body + len, sizeof(body) - len, ".\r\n");
+
+  int rv = command(c, "250", reply, "HELO replica\r\n") < 0 ||
+    command(c, "250", reply, "MAIL FROM:<check@replica>\r\n") < 0 ||
+    command(c, "250", reply, "RCPT TO:<%s%d>\r\n", number % 5 ? "replica" : "REPLICA", user) < 0 ||
+    command(c, "354", reply, "DATA\r\n") < 0 ||
+    send_data(c->fd, body, len) < 0 || read_line(c, reply, sizeof(reply)) < 0 ||
+    strncmp(reply, "250", 3) ||
+    command(c, "221", reply, "QUIT\r\n") < 0 ? -1 : 0;
+  close_connection(c);
+  if (rv == 0)
+    delivered++;
+  return rv;
+}
+
+/** Deletes about a third of the messages of a user through the
+ *  primary.
+ */
+static int delete_some(int user, unsigned int *seed) {
+
+  char reply[MAX_LINE_LENGTH];
+  unsigned int messages;
+  struct connection *c = pop_login(pop_port, user);
+  if (!c) return -1;
+
+  int rv = command(c, "+OK", reply, "STAT\r\n");
+  if (rv == 0 && sscanf(reply, "+OK %u", &messages) != 1)
+    rv = -1;
+  unsigned long count = 0;
+  for (unsigned int i = 1; rv == 0 && i <= messages; i++) {
+    if (rand_r(seed) % 3 == 0) {
+      rv = command(c, "+OK", reply, "DELE %u\r\n", i);
+      count++;
+    }
+  }
+  if (rv == 0)
+    rv = command(c, "+OK", reply, "QUIT\r\n");
+  close_connection(c);
+  if (rv == 0)
+    deleted += count;
+  return rv;
+}
+
+static void append_data(struct mailbox *mailbox, const char *data, size_t size) {
+  if (mailbox->size + size > mailbox->capacity) {
+    mailbox->capacity = (mailbox->size + size) * 2;
+    mailbox->data = realloc(mailbox->data, mailbox->capacity);
+  }
+  memcpy(mailbox->data + mailbox->size, data, size);
+  mailbox->size += size;
+}
+
+/** Reads the lines of a multi-line reply, up to the final ".",
+ *  appending them to the mailbox contents.
+ */
+static int read_multiline(struct connection *c, struct mailbox *mailbox) {
+
+  char line[MAX_LINE_LENGTH];
+  int len;
+  while ((len = read_line(c, line, sizeof(line))) > 0) {
+    if (!strcmp(line, ".\r\n"))
+      return 0;
+    append_data(mailbox, line, strlen(line));
+  }
+  return -1;
+}
+
+/** Reads the figures of a mailbox, and with contents set, its listing
+ *  and every message, through a POP3 server.
+ */
+static int read_mailbox(const char *port, int user, int contents, struct mailbox *mailbox) {
+
+  char reply[MAX_LINE_LENGTH];
+  mailbox->size = 0;
+  struct connection *c = pop_login(port, user);
+  if (!c) return -1;
+
+  int rv = command(c, "+OK", reply, "STAT\r\n");
+  if (rv == 0 && sscanf(reply, "+OK %u %zu", &mailbox->messages, &mailbox->bytes) != 2)
+    rv = -1;
+  if (rv == 0 && contents) {
+    rv = command(c, "+OK", reply, "LIST\r\n") < 0 ? -1 : read_multiline(c, mailbox);
+    for (unsigned int i = 1; rv == 0 && i <= mailbox->messages; i++)
+      rv = command(c, "+OK", reply, "RETR %u\r\n", i) < 0 ? -1 : read_multiline(c, mailbox);
+  }
+  if (rv == 0)
+    rv = command(c, "+OK", reply, "QUIT\r\n");
+  close_connection(c);
+  return rv;
+}
+
+/** Finds a free TCP port on the loopback interface by binding to port
+ *  zero. The port is released before the server uses it, so another
+ *  process could take it in the meantime, but this is unlikely.
+ */
+static void find_free_port(char *port, size_t size) {
+
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+      getsockname(fd, (struct sockaddr *) &addr, &len) < 0) {
+    perror("mailreplica: port");
+    exit(1);
+  }
+  snprintf(port, size, "%d", ntohs(addr.sin_port));
+  close(fd);
+}
+
+/** Starts a program in a directory, in its own process group, with
+ *  its output discarded and its errors logged to <binary>.log there.
+ */
+static pid_t start_program(const char *dir, const char *binary, char *const args[]) {
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", opts.bin_dir, binary);
+  char *resolved = realpath(path, NULL);
+  if (!resolved) {
+    perror(path);
+    exit(1);
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    setpgid(0, 0);
+    if (chdir(dir) < 0) exit(1);
+    snprintf(path, sizeof(path), "%s.log", binary);
+    freopen("/dev/null", "w", stdout);
+    freopen(path, "a", stderr);
+    execv(resolved, args);
+    perror(resolved);
+    exit(1);
+  }
+  free(resolved);
+  return pid;
+}
+
+static pid_t start_server(const char *dir, const char *binary, const char *port) {
+
+  char *args[] = { (char *) binary, (char *) port, NULL };
+  pid_t pid = start_program(dir, binary, args);
+  uint64_t limit = now_ns() + SERVER_START_TIMEOUT * 1000000000ull;
+  while (now_ns() < limit) {
+    int fd = connect_to(port);
+    if (fd >= 0) {
+      close(fd);
+      return pid;
+    }
+    usleep(10000);
+  }
+  fprintf(stderr, "mailreplica: %s did not start\n", binary);
+  kill(-pid, SIGTERM);
+  exit(1);
+}
+
+static void start_follower(void) {
+  char *args[] = { "mailfollow", "-i", FOLLOW_INTERVAL, journal_dir, NULL };
+  follower_pid = start_program(replica_dir, "mailfollow", args);
+  step("mailfollow started (pid %d)", (int) follower_pid);
+}
+
+/** Kills mailfollow without warning, as a crash would. */
+static void kill_follower(void) {
+  kill(follower_pid, SIGKILL);
+  waitpid(follower_pid, NULL, 0);
+  step("mailfollow killed (pid %d)", (int) follower_pid);
+  follower_pid = 0;
+}
+
+static int copy_file(const char *from, const char *to) {
+
+  char buf[READ_BUFFER_SIZE];
+  FILE *in = fopen(from, "r"), *out = in ? fopen(to, "w") : NULL;
+  size_t size;
+  while (out && (size = fread(buf, 1, sizeof(buf), in)) > 0)
+    fwrite(buf, 1, size, out);
+  int rv = in && out && !ferror(in) && fclose(out) == 0 ? 0 : -1;
+  if (in) fclose(in);
+  return rv;
+}
+
+static void write_file(const char *dir, const char *name, const char *contents) {
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  FILE *file = fopen(path, "w");
+  if (!file || fputs(contents, file) < 0 || fclose(file) != 0) {
+    perror(path);
+    exit(1);
+  }
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int flag, struct FTW *ftw) {
+  return remove(path);
+}
+
+static void setup_scratch_directory(char *dir) {
+
+  if (!mkdtemp(dir)) {
+    perror("mailreplica: mkdtemp");
+    exit(1);
+  }
+  snprintf(primary_dir, sizeof(primary_dir), "%s/primary", dir);
+  snprintf(replica_dir, sizeof(replica_dir), "%s/replica", dir);
+  snprintf(journal_dir, sizeof(journal_dir), "%s/mail.journal", primary_dir);
+  if (mkdir(primary_dir, 0777) < 0 || mkdir(replica_dir, 0777) < 0) {
+    perror("mailreplica: mkdir");
+    exit(1);
+  }
+
+  size_t size = opts.users * 32 + 1;
+  char *users = malloc(size);
+  users[0] = 0;
+  for (int i = 0, len = 0; i < opts.users; i++)
+    len += snprintf(users + len, size - len, "replica%d replica%d\n", i, i);
+  write_file(primary_dir, "users.txt", users);
+  write_file(replica_dir, "users.txt", users);
+  free(users);
+
+  char config[PATH_MAX + 64];
+  snprintf(config, sizeof(config), "mail_journal %s\n", journal_dir);
+  write_file(primary_dir, "mail.conf", config);
+  write_file(replica_dir, "mail.conf", "pop3_read_only 1\n");
+}
+
+/** Waits until every mailbox has the same figures in the replica as
+ *  in the primary.
+ *
+ *  Returns: 0 if the replica caught up, or -1 otherwise.
+ */
+static int wait_for_replica(void) {
+
+  struct mailbox primary = { 0 }, replica = { 0 };
+  uint64_t limit = now_ns() + CATCH_UP_TIMEOUT * 1000000000ull;
+  while (now_ns() < limit) {
+    int user = 0;
+    for (; user < opts.users; user++) {
+      if (read_mailbox(pop_port, user, 0, &primary) < 0 ||
+          read_mailbox(replica_port, user, 0, &replica) < 0 ||
+          primary.messages != replica.messages || primary.bytes != replica.bytes)
+        break;
+    }
+    if (user == opts.users)
+      return 0;
+    usleep(CATCH_UP_POLL);
+  }
+  return -1;
+}
+
+/** Compares every mailbox in both stores, through POP3.
+ *
+ *  Returns: the number of mailboxes that differ (or cannot be read).
+ */
+static int compare_stores(unsigned long *messages) {
+
+  struct mailbox primary = { 0 }, replica = { 0 };
+  int differ = 0;
+  *messages = 0;
+  for (int user = 0; user < opts.users; user++) {
+    if (read_mailbox(pop_port, user, 1, &primary) < 0 ||
+        read_mailbox(replica_port, user, 1, &replica) < 0) {
+      fprintf(stderr, "mailreplica: replica%d: cannot read mailbox\n", user);
+      differ++;
+    } else if (primary.messages != replica.messages || primary.bytes != replica.bytes ||
+               primary.size != replica.size || memcmp(primary.data, replica.data, primary.size)) {
+      fprintf(stderr, "mailreplica: replica%d: primary has %u messages (%zu bytes), "
+              "replica has %u messages (%zu bytes)%s\n", user, primary.messages, primary.bytes,
+              replica.messages, replica.bytes,
+              primary.messages == replica.messages ? ", with different contents" : "");
+      differ++;
+    }
+    *messages += primary.messages;
+  }
+  free(primary.data);
+  free(replica.data);
+  return differ;
+}
+
+/** Checks that the replica refuses to delete messages. */
+static int check_read_only(void) {
+
+  char reply[MAX_LINE_LENGTH];
+  struct connection *c = pop_login(replica_port, 0);
+  if (!c) return -1;
+  int rv = command(c, "-ERR", reply, "DELE 1\r\n") < 0 ||
+    command(c, "+OK", reply, "QUIT\r\n") < 0 ? -1 : 0;
+  close_connection(c);
+  return rv;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-B dir] [-k] [-u users] [-r rounds] [-m messages] [-s seed] [-v]\n",
+          name);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+
+  int opt;
+  while ((opt = getopt(argc, argv, "B:ku:r:m:s:v")) != -1) {
+    switch (opt) {
+    case 'B': opts.bin_dir = optarg; break;
+    case 'k': opts.keep = 1; break;
+    case 'u': opts.users = atoi(optarg); break;
+    case 'r': opts.rounds = atoi(optarg); break;
+    case 'm': opts.messages = atoi(optarg); break;
+    case 's': opts.seed = strtoul(optarg, NULL, 10); break;
+    case 'v': opts.verbose = 1; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind != argc || opts.users < 1 || opts.rounds < 1 || opts.messages < 1)
+    usage(argv[0]);
+
+  char scratch[] = "/tmp/mailreplica-XXXXXX";
+  setup_scratch_directory(scratch);
+  find_free_port(smtp_port, sizeof(smtp_port));
+  find_free_port(pop_port, sizeof(pop_port));
+  find_free_port(replica_port, sizeof(replica_port));
+  pid_t smtp_pid = start_server(primary_dir, "mysmtpd", smtp_port);
+  pid_t pop_pid = start_server(primary_dir, "mypopd", pop_port);
+  pid_t replica_pid = start_server(replica_dir, "mypopd", replica_port);
+  start_follower();
+
+  char position_file[PATH_MAX], old_position_file[PATH_MAX];
+  snprintf(position_file, sizeof(position_file), "%s/mailfollow.pos", replica_dir);
+  snprintf(old_position_file, sizeof(old_position_file), "%s/mailfollow.pos.old", replica_dir);
+
+  unsigned int seed = opts.seed;
+  unsigned long errors = 0;
+  for (int round = 0; round < opts.rounds; round++) {
+    // Keep the position reached so far, to rewind to it later
+    int have_old_position = copy_file(position_file, old_position_file) == 0;
+
+    // mailfollow is killed part way through the deliveries, and is
+    // restarted either before or after the deletions
+    int kill_at = rand_r(&seed) % opts.messages;
+    for (int i = 0; i < opts.messages; i++) {
+      if (i == kill_at)
+        kill_follower();
+      errors += deliver(rand_r(&seed) % opts.users, round, i, &seed) < 0;
+    }
+    if (round % 2 == 0) {
+      start_follower();
+      restarts++;
+    }
+    for (int user = 0; user < opts.users; user++)
+      errors += delete_some(user, &seed) < 0;
+    if (round % 2 == 1) {
+      // As if mailfollow crashed before saving its position: the
+      // changes since the start of the previous round are replayed
+      if (have_old_position && rename(old_position_file, position_file) == 0) {
+        step("mailfollow rewound to an older position");
+        rewinds++;
+      }
+      start_follower();
+      restarts++;
+    }
+    step("round %d: %lu delivered, %lu deleted so far", round, delivered, deleted);
+  }
+
+  int failed = 0;
+  unsigned long messages = 0;
+  if (errors) {
+    fprintf(stderr, "mailreplica: %lu session(s) on the primary failed\n", errors);
+    failed = 1;
+  }
+  if (wait_for_replica() < 0) {
+    fprintf(stderr, "mailreplica: replica did not catch up in %d s\n", CATCH_UP_TIMEOUT);
+    failed = 1;
+  }
+  int differ = compare_stores(&messages);
+  if (differ)
+    failed = 1;
+  if (check_read_only() < 0) {
+    fprintf(stderr, "mailreplica: replica did not refuse DELE\n");
+    failed = 1;
+  }
+
+  kill_follower();
+  kill(-smtp_pid, SIGTERM);
+  kill(-pop_pid, SIGTERM);
+  kill(-replica_pid, SIGTERM);
+  waitpid(smtp_pid, NULL, 0);
+  waitpid(pop_pid, NULL, 0);
+  waitpid(replica_pid, NULL, 0);
+  if (opts.keep || failed)
+    fprintf(stderr, "mailreplica: scratch directory kept in %s\n", scratch);
+  else
+    nftw(scratch, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+  printf("%lu message(s) delivered, %lu deleted, mailfollow restarted %lu time(s) (%lu rewound)\n",
+         delivered, deleted, restarts, rewinds);
+  printf("%d of %d mailbox(es) %s (%lu message(s) in the primary)\n", opts.users - differ,
+         opts.users, failed ? "match" : "match, replica is identical", messages);
+  return failed ? 1 : 0;
+}
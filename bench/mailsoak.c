@@ -0,0 +1,872 @@
+/* mailsoak.c
+ * Soak test for the SMTP and POP3 servers under many mostly idle
+ * connections. Opens a large number of idle connections, some of
+ * which slowly trickle commands one byte at a time, keeps them open
+ * while a few active clients run complete sessions, and reports the
+ * memory and file descriptors the servers use for each connection
+ * and the latency of the active sessions as JSON. The run fails (exit
+ * status 1) if any connection is refused or dropped, or if any of the
+ * budgets given is exceeded.
+ *
+ * Usage: mailsoak [options]
+ *   -S            start mysmtpd and mypopd on free local ports, in a
+ *                 scratch directory with its own mail.store
+ *   -B dir        directory containing the server binaries (with -S;
+ *                 default: .)
+ *   -C file       configuration file copied to the scratch directory
+ *   -k            keep the scratch directory after the run
+ *   -h host       server host (default: 127.0.0.1)
+ *   -s port       SMTP port (without -S)
+ *   -p port       POP3 port (without -S)
+ *   -g pid        process group of a server to measure (without -S;
+ *                 may be repeated)
+ *   -i count      idle connections (default: 10000)
+ *   -m percent    percentage of idle connections that are SMTP
+ *                 (default: 50)
+ *   -t percent    percentage of idle connections that trickle a NOOP
+ *                 one byte at a time (default: 10)
+ *   -T ms         interval between trickled bytes (default: 1000)
+ *   -c clients    active clients running complete sessions (default: 4)
+ *   -d seconds    duration of the soak once all idle connections are
+ *                 open (default: 30)
+ *   -u users      number of mailboxes used (default: 100)
+ *   -M MB         budget for the total memory of the servers
+ *   -K KB         budget for the server memory per idle connection
+ *   -F fds        budget for the server file descriptors per idle
+ *                 connection
+ *   -L ms         budget for the p99 latency of active commands
+ *   -l label      label stored in the output, to compare builds and
+ *                 server modes
+ *   -o file       write the JSON report to a file instead of stdout
+ *
+ * Server memory is the proportional set size (PSS) of every process
+ * in the servers' process groups, so pages shared by the session
+ * processes are only counted once; it is measured before the idle
+ * connections are opened, once they are all open and at the end of
+ * the soak. The cost of a connection is the growth from the first
+ * measurement to the highest of the other two, divided by the number
+ * of idle connections. Without -S or -g, only latency is measured.
+ *
+ * Without -S, the servers must already be running and the users
+ * bench0..bench<users-1> (with passwords equal to the user names)
+ * must exist in their users.txt.
+ */
+
+#define _GNU_SOURCE
+#include "histogram.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <ftw.h>
+#include <dirent.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#define MAX_LINE_LENGTH 1024
+#define READ_BUFFER_SIZE 4096
+#define SERVER_START_TIMEOUT 5   // seconds
+#define GREETING_TIMEOUT 5       // seconds
+#define MAX_GROUPS 8
+#define POLL_INTERVAL 100        // ms
+#define SETTLE_TIME 1            // seconds before measuring
+#define MESSAGE_SIZE 1024
+
+static const char trickle_command[] = "NOOP\r\n";
+
+enum command {
+  SMTP_CONNECT, SMTP_HELO, SMTP_MAIL, SMTP_RCPT, SMTP_DATA, SMTP_BODY, SMTP_QUIT,
+  POP_CONNECT, POP_USER, POP_PASS, POP_STAT, POP_RETR, POP_DELE, POP_QUIT,
+  NUM_COMMANDS
+};
+
+static const char *command_names[NUM_COMMANDS] = {
+  "smtp_connect", "smtp_helo", "smtp_mail", "smtp_rcpt", "smtp_data", "smtp_body", "smtp_quit",
+  "pop3_connect", "pop3_user", "pop3_pass", "pop3_stat", "pop3_retr", "pop3_dele", "pop3_quit"
+};
+
+struct options {
+  int spawn;
+  const char *bin_dir;
+  const char *config_file;
+  int keep;
+  const char *host;
+  char smtp_port[16];
+  char pop_port[16];
+  pid_t groups[MAX_GROUPS];
+  int num_groups;
+  int idle;
+  int smtp_percent;
+  int trickle_percent;
+  int trickle_interval;
+  int clients;
+  int duration;
+  int users;
+  double memory_budget;      // MB
+  double connection_budget;  // KB
+  double fd_budget;
+  double latency_budget;     // ms
+  const char *label;
+  const char *output;
+};
+
+struct stats {
+  uint64_t idle_open;
+  uint64_t idle_errors;
+  uint64_t idle_dropped;
+  uint64_t trickled_commands;
+  uint64_t trickle_errors;
+  uint64_t smtp_sessions;
+  uint64_t pop_sessions;
+  uint64_t errors;
+};
+
+// Resources used by the server processes at some point of the run
+struct usage {
+  int processes;
+  uint64_t rss_kb;
+  uint64_t pss_kb;
+  uint64_t fds;
+};
+
+// Connection of an active client
+struct connection {
+  int fd;
+  size_t start;
+  size_t end;
+  char buf[READ_BUFFER_SIZE];
+};
+
+// Idle connection; trickling connections send a command one byte at
+// a time and read its reply
+struct idle_connection {
+  int smtp;
+  int trickle;
+  int sent;            // bytes of the trickled command sent
+  uint64_t next_byte;  // when the next byte is due
+  int len;             // bytes of the reply received so far
+  char reply[64];
+};
+
+static struct options opts = {
+  .bin_dir = ".", .host = "127.0.0.1", .idle = 10000, .smtp_percent = 50,
+  .trickle_percent = 10, .trickle_interval = 1000, .clients = 4, .duration = 30, .users = 100
+};
+static struct stats stats;
+static struct histogram histograms[NUM_COMMANDS];
+static struct histogram idle_connect;
+static char *message_body;
+static size_t message_body_size;
+static volatile int active_done = 0;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void count(uint64_t *counter, uint64_t value) {
+  __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+static int connect_to(const char *host, const char *port) {
+
+  struct addrinfo hints, *servinfo, *p;
+  int fd = -1;
+
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &servinfo) != 0)
+    return -1;
+
+  for (p = servinfo; p; p = p->ai_next) {
+    fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    if (fd < 0) continue;
+    if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) break;
+    close(fd);
+    fd = -1;
+  }
+
+  freeaddrinfo(servinfo);
+  if (fd >= 0) {
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+  }
+  return fd;
+}
+
+/** Reads a single line (up to LF) from the connection into out,
+ *  returning its length, or -1 on error or end of connection.
+ */
+static int read_line(struct connection *c, char *out, size_t size) {
+
+  while (1) {
+    char *eol = memchr(c->buf + c->start, '\n', c->end - c->start);
+    if (eol) {
+      size_t len = eol - (c->buf + c->start) + 1;
+      size_t copy = len < size - 1 ? len : size - 1;
+      memcpy(out, c->buf + c->start, copy);
+      out[copy] = 0;
+      c->start += len;
+      return len;
+    }
+    if (c->start > 0) {
+      memmove(c->buf, c->buf + c->start, c->end - c->start);
+      c->end -= c->start;
+      c->start = 0;
+    }
+    if (c->end == sizeof(c->buf))
+      return -1;
+    ssize_t rv = recv(c->fd, c->buf + c->end, sizeof(c->buf) - c->end, 0);
+    if (rv <= 0)
+      return -1;
+    c->end += rv;
+  }
+}
+
+static int send_data(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t rv = send(fd, data, size, MSG_NOSIGNAL);
+    if (rv <= 0) return -1;
+    data += rv;
+    size -= rv;
+  }
+  return 0;
+}
+
+/** Sends a command and waits for a single-line reply, recording the
+ *  latency for the command. Returns 0 if the reply starts with the
+ *  expected prefix, or -1 otherwise.
+ */
+static int command(struct connection *c, enum command cmd, const char *expect,
+                   char *reply, const char *fmt, ...) {
+
+  char line[MAX_LINE_LENGTH];
+  uint64_t start = now_ns();
+
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(line, sizeof(line), fmt, args);
+  va_end(args);
+  if (send_data(c->fd, line, len) < 0) return -1;
+
+  if (read_line(c, reply, MAX_LINE_LENGTH) < 0) return -1;
+  histogram_record(&histograms[cmd], now_ns() - start);
+  return strncmp(reply, expect, strlen(expect)) ? -1 : 0;
+}
+
+static struct connection *open_connection(const char *port, enum command cmd,
+                                          const char *greeting) {
+
+  char reply[MAX_LINE_LENGTH];
+  uint64_t start = now_ns();
+  struct connection *c = malloc(sizeof(struct connection));
+  c->start = c->end = 0;
+  c->fd = connect_to(opts.host, port);
+  if (c->fd < 0 || read_line(c, reply, sizeof(reply)) < 0 ||
+      strncmp(reply, greeting, strlen(greeting))) {
+    if (c->fd >= 0) close(c->fd);
+    free(c);
+    return NULL;
+  }
+  histogram_record(&histograms[cmd], now_ns() - start);
+  return c;
+}
+
+static void close_connection(struct connection *c) {
+  close(c->fd);
+  free(c);
+}
+
+static int smtp_session(int user) {
+
+  char reply[MAX_LINE_LENGTH];
+  struct connection *c = open_connection(opts.smtp_port, SMTP_CONNECT, "220");
+  if (!c) return -1;
+
+  int rv = command(c, SMTP_HELO, "250", reply, "HELO mailsoak\r\n");
+  if (!rv)
+    rv = command(c, SMTP_MAIL, "250", reply, "MAIL FROM:<mailsoak>\r\n");
+  if (!rv)
+    rv = command(c, SMTP_RCPT, "250", reply, "RCPT TO:<bench%d>\r\n", user);
+  if (!rv)
+    rv = command(c, SMTP_DATA, "354", reply, "DATA\r\n");
+  if (!rv) {
+    uint64_t start = now_ns();
+    rv = send_data(c->fd, message_body, message_body_size);
+    if (!rv && (read_line(c, reply, sizeof(reply)) < 0 || strncmp(reply, "250", 3)))
+      rv = -1;
+    histogram_record(&histograms[SMTP_BODY], now_ns() - start);
+  }
+  if (!rv)
+    rv = command(c, SMTP_QUIT, "221", reply, "QUIT\r\n");
+
+  close_connection(c);
+  count(&stats.smtp_sessions, 1);
+  return rv;
+}
+
+static int pop_session(int user) {
+
+  char reply[MAX_LINE_LENGTH];
+  struct connection *c = open_connection(opts.pop_port, POP_CONNECT, "+OK");
+  if (!c) return -1;
+
+  int messages = 0;
+  int rv = command(c, POP_USER, "+OK", reply, "USER bench%d\r\n", user);
+  if (!rv)
+    rv = command(c, POP_PASS, "+OK", reply, "PASS bench%d\r\n", user);
+  if (!rv)
+    rv = command(c, POP_STAT, "+OK", reply, "STAT\r\n");
+  if (!rv && sscanf(reply, "+OK %d", &messages) != 1)
+    rv = -1;
+
+  if (!rv && messages > 0) {
+    uint64_t start = now_ns();
+    if (send_data(c->fd, "RETR 1\r\n", 8) < 0 || read_line(c, reply, sizeof(reply)) < 0)
+      rv = -1;
+    // The message may have been deleted by a concurrent session
+    if (!rv && !strncmp(reply, "+OK", 3)) {
+      while ((rv = read_line(c, reply, sizeof(reply)) < 0 ? -1 : 0) == 0 && strcmp(reply, ".\r\n"));
+      if (!rv) {
+        histogram_record(&histograms[POP_RETR], now_ns() - start);
+        rv = command(c, POP_DELE, "+OK", reply, "DELE 1\r\n");
+      }
+    }
+  }
+  if (!rv)
+    rv = command(c, POP_QUIT, "+OK", reply, "QUIT\r\n");
+
+  close_connection(c);
+  count(&stats.pop_sessions, 1);
+  return rv;
+}
+
+/** Runs sessions of an active client until the soak ends. Each client
+ *  uses its own mailboxes, so POP3 sessions never find a mailbox
+ *  locked by another client.
+ */
+static void *client_thread(void *arg) {
+
+  int client = (uintptr_t) arg;
+  int mailboxes = opts.users / opts.clients > 0 ? opts.users / opts.clients : 1;
+  unsigned int seed = (unsigned int) client * 2654435761u ^ (unsigned int) now_ns();
+  while (!active_done) {
+    int user = (client + opts.clients * (rand_r(&seed) % mailboxes)) % opts.users;
+    int rv = rand_r(&seed) % 2 ? smtp_session(user) : pop_session(user);
+    if (rv < 0)
+      count(&stats.errors, 1);
+  }
+  return NULL;
+}
+
+static void build_message(void) {
+
+  message_body = malloc(MESSAGE_SIZE + 256);
+  int len = sprintf(message_body, "From: <mailsoak>\r\nSubject: mailsoak\r\n\r\n");
+  while (len < MESSAGE_SIZE) {
+    memset(message_body + len, 'x', 76);
+    memcpy(message_body + len + 76, "\r\n", 2);
+    len += 78;
+  }
+  memcpy(message_body + len, ".\r\n", 3);
+  message_body_size = len + 3;
+}
+
+/** Opens an idle connection and waits for the server greeting. The
+ *  connection is left in non-blocking mode.
+ *
+ *  Returns: the socket, or -1 if the connection failed.
+ */
+static int open_idle(struct idle_connection *idle) {
+
+  char greeting[MAX_LINE_LENGTH];
+  struct timeval timeout = { GREETING_TIMEOUT, 0 };
+  uint64_t start = now_ns();
+  int fd = connect_to(opts.host, idle->smtp ? opts.smtp_port : opts.pop_port);
+  if (fd < 0)
+    return -1;
+
+  // The greeting is read a byte at a time, so nothing that follows
+  // it is consumed
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  int len = 0;
+  while (len < sizeof(greeting) - 1 && recv(fd, greeting + len, 1, 0) == 1 && greeting[len++] != '\n');
+  greeting[len] = 0;
+  if (strncmp(greeting, idle->smtp ? "220" : "+OK", 3)) {
+    close(fd);
+    return -1;
+  }
+
+  histogram_record(&idle_connect, now_ns() - start);
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return fd;
+}
+
+/** Reads what the server sent on an idle connection. Replies are only
+ *  expected after a trickled command is complete.
+ *
+ *  Returns: 0, or -1 if the connection was closed.
+ */
+static int read_idle(int fd, struct idle_connection *idle) {
+
+  char buf[256];
+  ssize_t rv = recv(fd, buf, sizeof(buf), 0);
+  if (rv == 0 || (rv < 0 && errno != EAGAIN && errno != EINTR))
+    return -1;
+
+  for (ssize_t i = 0; i < rv; i++) {
+    if (idle->len < sizeof(idle->reply) - 1)
+      idle->reply[idle->len++] = buf[i];
+    if (buf[i] != '\n')
+      continue;
+    idle->reply[idle->len] = 0;
+    if (idle->sent == sizeof(trickle_command) - 1 &&
+        !strncmp(idle->reply, idle->smtp ? "250" : "+OK", 3))
+      count(&stats.trickled_commands, 1);
+    else
+      count(&stats.trickle_errors, 1);
+    idle->sent = 0;
+    idle->len = 0;
+  }
+  return 0;
+}
+
+/** Internal function that adds the resources used by a process, read
+ *  from /proc, to a usage summary.
+ */
+static void add_process_usage(pid_t pid, struct usage *usage) {
+
+  char path[64], line[256];
+  snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", pid);
+  FILE *file = fopen(path, "r");
+  if (!file)
+    return;
+  unsigned long kb;
+  while (fgets(line, sizeof(line), file)) {
+    if (sscanf(line, "Rss: %lu kB", &kb) == 1)
+      usage->rss_kb += kb;
+    else if (sscanf(line, "Pss: %lu kB", &kb) == 1)
+      usage->pss_kb += kb;
+  }
+  fclose(file);
+  usage->processes++;
+
+  snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+  DIR *dir = opendir(path);
+  if (!dir)
+    return;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL)
+    if (entry->d_name[0] != '.')
+      usage->fds++;
+  closedir(dir);
+}
+
+/** Measures the resources used by every process in the process groups
+ *  of the servers.
+ */
+static struct usage measure_servers(void) {
+
+  struct usage usage = { 0 };
+  if (!opts.num_groups)
+    return usage;
+
+  DIR *proc = opendir("/proc");
+  if (!proc)
+    return usage;
+  struct dirent *entry;
+  while ((entry = readdir(proc)) != NULL) {
+    char path[64], stat[512];
+    pid_t pid = atoi(entry->d_name);
+    if (pid <= 0)
+      continue;
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+      continue;
+    ssize_t len = read(fd, stat, sizeof(stat) - 1);
+    close(fd);
+    if (len <= 0)
+      continue;
+    stat[len] = 0;
+
+    // The process group follows the state, after the command name
+    // (which may contain spaces) in parentheses
+    char *rest = strrchr(stat, ')');
+    int ppid, pgrp;
+    if (!rest || sscanf(rest + 1, " %*c %d %d", &ppid, &pgrp) != 2)
+      continue;
+    for (int i = 0; i < opts.num_groups; i++)
+      if (pgrp == opts.groups[i])
+        add_process_usage(pid, &usage);
+  }
+  closedir(proc);
+  return usage;
+}
+
+/** Raises the limit of open files of the process (and of the servers
+ *  it starts) so that all idle connections can be opened.
+ */
+static void raise_file_limit(void) {
+
+  struct rlimit limit;
+  rlim_t needed = opts.idle + 2 * opts.clients + 64;
+  getrlimit(RLIMIT_NOFILE, &limit);
+  if (limit.rlim_cur >= needed)
+    return;
+  limit.rlim_cur = limit.rlim_max < needed ? limit.rlim_max : needed;
+  setrlimit(RLIMIT_NOFILE, &limit);
+  if (limit.rlim_cur < needed) {
+    fprintf(stderr, "mailsoak: %d idle connections need %lu open files, the limit is %lu\n",
+            opts.idle, (unsigned long) needed, (unsigned long) limit.rlim_cur);
+    exit(1);
+  }
+}
+
+/** Finds a free TCP port on the loopback interface by binding to port
+ *  zero. The port is released before the server uses it, so another
+ *  process could take it in the meantime, but this is unlikely.
+ */
+static void find_free_port(char *port, size_t size) {
+
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+      getsockname(fd, (struct sockaddr *) &addr, &len) < 0) {
+    perror("mailsoak: port");
+    exit(1);
+  }
+  snprintf(port, size, "%d", ntohs(addr.sin_port));
+  close(fd);
+}
+
+static pid_t start_server(const char *dir, const char *binary, const char *port) {
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", opts.bin_dir, binary);
+  char *resolved = realpath(path, NULL);
+  if (!resolved) {
+    perror(path);
+    exit(1);
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    // Servers run in their own process group, so that all their
+    // session processes can be measured and stopped together
+    setpgid(0, 0);
+    if (chdir(dir) < 0) exit(1);
+    freopen("/dev/null", "w", stdout);
+    execl(resolved, binary, port, (char *) NULL);
+    perror(resolved);
+    exit(1);
+  }
+  free(resolved);
+
+  uint64_t limit = now_ns() + SERVER_START_TIMEOUT * 1000000000ull;
+  while (now_ns() < limit) {
+    int fd = connect_to(opts.host, port);
+    if (fd >= 0) {
+      close(fd);
+      return pid;
+    }
+    usleep(10000);
+  }
+  fprintf(stderr, "mailsoak: %s did not start\n", binary);
+  kill(-pid, SIGTERM);
+  exit(1);
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int flag, struct FTW *ftw) {
+  return remove(path);
+}
+
+static void setup_scratch_directory(char *dir) {
+
+  if (!mkdtemp(dir)) {
+    perror("mailsoak: mkdtemp");
+    exit(1);
+  }
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/users.txt", dir);
+  FILE *file = fopen(path, "w");
+  for (int i = 0; i < opts.users; i++)
+    fprintf(file, "bench%d bench%d\n", i, i);
+  fclose(file);
+
+  if (opts.config_file) {
+    snprintf(path, sizeof(path), "cp '%s' '%s/mail.conf'", opts.config_file, dir);
+    if (system(path) != 0) {
+      fprintf(stderr, "mailsoak: cannot copy %s\n", opts.config_file);
+      exit(1);
+    }
+  }
+}
+
+static void print_usage(FILE *out, const char *name, const struct usage *u) {
+  fprintf(out, "    \"%s\": {\"processes\": %d, \"rss_kb\": %lu, \"pss_kb\": %lu, \"fds\": %lu}",
+          name, u->processes, (unsigned long) u->rss_kb, (unsigned long) u->pss_kb,
+          (unsigned long) u->fds);
+}
+
+static void print_latency(FILE *out, const char *name, const struct histogram *h, const char *sep) {
+  fprintf(out, "%s    \"%s\": {\"count\": %lu, \"mean\": %.1f, \"min\": %.1f, "
+          "\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}",
+          sep, name, h->count, histogram_mean(h) / 1000, h->min / 1000.0,
+          histogram_percentile(h, 50) / 1000.0, histogram_percentile(h, 90) / 1000.0,
+          histogram_percentile(h, 99) / 1000.0, histogram_percentile(h, 99.9) / 1000.0,
+          h->max / 1000.0);
+}
+
+/** Internal function that checks a value against its budget (if one
+ *  was given) and prints the result. Returns non-zero if the budget
+ *  is exceeded.
+ */
+static int check_budget(FILE *out, const char *name, double value, double budget, const char *sep) {
+  int exceeded = budget > 0 && value > budget;
+  fprintf(out, "%s    \"%s\": {\"value\": %.3f, \"budget\": %.3f, \"exceeded\": %s}",
+          sep, name, value, budget, exceeded ? "true" : "false");
+  return exceeded;
+}
+
+/** Prints the report and returns non-zero if the run failed.
+ */
+static int print_report(FILE *out, double open_time, double elapsed, const struct usage *baseline,
+                        const struct usage *opened, const struct usage *final) {
+
+  const struct usage *peak = final->pss_kb > opened->pss_kb ? final : opened;
+  uint64_t connections = stats.idle_open ? stats.idle_open : 1;
+  double memory_mb = peak->pss_kb / 1024.0;
+  double connection_kb = peak->pss_kb > baseline->pss_kb ?
+    (double) (peak->pss_kb - baseline->pss_kb) / connections : 0;
+  double connection_fds = peak->fds > baseline->fds ? (double) (peak->fds - baseline->fds) / connections : 0;
+
+  struct histogram active;
+  histogram_init(&active);
+  for (int i = 0; i < NUM_COMMANDS; i++)
+    histogram_merge(&active, &histograms[i]);
+  double p99_ms = histogram_percentile(&active, 99) / 1e6;
+
+  fprintf(out, "{\n");
+  fprintf(out, "  \"label\": \"%s\",\n", opts.label ? opts.label : "");
+  fprintf(out, "  \"config\": {\"idle\": %d, \"smtp_percent\": %d, \"trickle_percent\": %d, "
+          "\"trickle_interval_ms\": %d, \"clients\": %d, \"duration_s\": %d, \"users\": %d},\n",
+          opts.idle, opts.smtp_percent, opts.trickle_percent, opts.trickle_interval, opts.clients,
+          opts.duration, opts.users);
+  fprintf(out, "  \"open_s\": %.3f,\n", open_time);
+  fprintf(out, "  \"elapsed_s\": %.3f,\n", elapsed);
+  fprintf(out, "  \"idle_open\": %lu,\n", stats.idle_open);
+  fprintf(out, "  \"idle_errors\": %lu,\n", stats.idle_errors);
+  fprintf(out, "  \"idle_dropped\": %lu,\n", stats.idle_dropped);
+  fprintf(out, "  \"trickled_commands\": %lu,\n", stats.trickled_commands);
+  fprintf(out, "  \"trickle_errors\": %lu,\n", stats.trickle_errors);
+  fprintf(out, "  \"smtp_sessions\": %lu,\n", stats.smtp_sessions);
+  fprintf(out, "  \"pop3_sessions\": %lu,\n", stats.pop_sessions);
+  fprintf(out, "  \"errors\": %lu,\n", stats.errors);
+  fprintf(out, "  \"server\": {\n");
+  print_usage(out, "baseline", baseline);
+  fprintf(out, ",\n");
+  print_usage(out, "opened", opened);
+  fprintf(out, ",\n");
+  print_usage(out, "final", final);
+  fprintf(out, ",\n    \"memory_per_connection_kb\": %.1f,\n", connection_kb);
+  fprintf(out, "    \"fds_per_connection\": %.2f\n  },\n", connection_fds);
+
+  fprintf(out, "  \"latency_us\": {");
+  print_latency(out, "idle_connect", &idle_connect, "\n");
+  print_latency(out, "active", &active, ",\n");
+  for (int i = 0; i < NUM_COMMANDS; i++)
+    if (histograms[i].count)
+      print_latency(out, command_names[i], &histograms[i], ",\n");
+  fprintf(out, "\n  },\n");
+
+  int failed = stats.idle_errors || stats.idle_dropped || stats.trickle_errors || stats.errors;
+  fprintf(out, "  \"budgets\": {");
+  failed |= check_budget(out, "memory_mb", memory_mb, opts.memory_budget, "\n");
+  failed |= check_budget(out, "memory_per_connection_kb", connection_kb, opts.connection_budget, ",\n");
+  failed |= check_budget(out, "fds_per_connection", connection_fds, opts.fd_budget, ",\n");
+  failed |= check_budget(out, "active_p99_ms", p99_ms, opts.latency_budget, ",\n");
+  fprintf(out, "\n  },\n");
+  fprintf(out, "  \"passed\": %s\n}\n", failed ? "false" : "true");
+  return failed;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-S [-B dir] [-C conf] [-k]] [-h host] [-s smtp_port] [-p pop_port] "
+          "[-g pid]... [-i idle] [-m smtp_percent] [-t trickle_percent] [-T ms] [-c clients] "
+          "[-d seconds] [-u users] [-M MB] [-K KB] [-F fds] [-L ms] [-l label] [-o file]\n", name);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+
+  int opt;
+  strcpy(opts.smtp_port, "25");
+  strcpy(opts.pop_port, "110");
+
+  while ((opt = getopt(argc, argv, "SB:C:kh:s:p:g:i:m:t:T:c:d:u:M:K:F:L:l:o:")) != -1) {
+    switch (opt) {
+    case 'S': opts.spawn = 1; break;
+    case 'B': opts.bin_dir = optarg; break;
+    case 'C': opts.config_file = optarg; break;
+    case 'k': opts.keep = 1; break;
+    case 'h': opts.host = optarg; break;
+    case 's': snprintf(opts.smtp_port, sizeof(opts.smtp_port), "%s", optarg); break;
+    case 'p': snprintf(opts.pop_port, sizeof(opts.pop_port), "%s", optarg); break;
+    case 'g':
+      if (opts.num_groups == MAX_GROUPS) usage(argv[0]);
+      opts.groups[opts.num_groups++] = atoi(optarg);
+      break;
+    case 'i': opts.idle = atoi(optarg); break;
+    case 'm': opts.smtp_percent = atoi(optarg); break;
+    case 't': opts.trickle_percent = atoi(optarg); break;
+    case 'T': opts.trickle_interval = atoi(optarg); break;
+    case 'c': opts.clients = atoi(optarg); break;
+    case 'd': opts.duration = atoi(optarg); break;
+    case 'u': opts.users = atoi(optarg); break;
+    case 'M': opts.memory_budget = atof(optarg); break;
+    case 'K': opts.connection_budget = atof(optarg); break;
+    case 'F': opts.fd_budget = atof(optarg); break;
+    case 'L': opts.latency_budget = atof(optarg); break;
+    case 'l': opts.label = optarg; break;
+    case 'o': opts.output = optarg; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind != argc || opts.idle < 0 || opts.clients < 0 || opts.duration < 1 || opts.users < 1 ||
+      opts.trickle_interval < 1)
+    usage(argv[0]);
+
+  raise_file_limit();
+
+  char scratch[] = "/tmp/mailsoak-XXXXXX";
+  pid_t smtp_pid = 0, pop_pid = 0;
+  if (opts.spawn) {
+    setup_scratch_directory(scratch);
+    find_free_port(opts.smtp_port, sizeof(opts.smtp_port));
+    find_free_port(opts.pop_port, sizeof(opts.pop_port));
+    smtp_pid = start_server(scratch, "mysmtpd", opts.smtp_port);
+    pop_pid = start_server(scratch, "mypopd", opts.pop_port);
+    opts.groups[0] = smtp_pid;
+    opts.groups[1] = pop_pid;
+    opts.num_groups = 2;
+  }
+
+  for (int i = 0; i < NUM_COMMANDS; i++)
+    histogram_init(&histograms[i]);
+  histogram_init(&idle_connect);
+  build_message();
+
+  sleep(SETTLE_TIME);
+  struct usage baseline = measure_servers();
+
+  // Idle connections are opened one at a time, as a slow ramp
+  struct idle_connection *idle = calloc(opts.idle ? opts.idle : 1, sizeof(struct idle_connection));
+  struct pollfd *fds = calloc(opts.idle ? opts.idle : 1, sizeof(struct pollfd));
+  unsigned int seed = 1;
+  uint64_t start = now_ns();
+  for (int i = 0; i < opts.idle; i++) {
+    idle[i].smtp = (int) (rand_r(&seed) % 100) < opts.smtp_percent;
+    idle[i].trickle = (int) (rand_r(&seed) % 100) < opts.trickle_percent;
+    fds[i].fd = open_idle(&idle[i]);
+    fds[i].events = POLLIN;
+    if (fds[i].fd < 0)
+      stats.idle_errors++;
+    else
+      stats.idle_open++;
+  }
+  double open_time = (now_ns() - start) / 1e9;
+  fprintf(stderr, "mailsoak: %lu idle connections open in %.1f s (%lu failed)\n",
+          stats.idle_open, open_time, stats.idle_errors);
+
+  sleep(SETTLE_TIME);
+  struct usage opened = measure_servers();
+
+  // Trickled bytes are spread over the interval, so they don't all
+  // arrive at once
+  uint64_t interval = opts.trickle_interval * 1000000ull;
+  start = now_ns();
+  for (int i = 0; i < opts.idle; i++)
+    idle[i].next_byte = start + rand_r(&seed) % interval;
+
+  pthread_t *threads = calloc(opts.clients ? opts.clients : 1, sizeof(pthread_t));
+  for (int i = 0; i < opts.clients; i++)
+    pthread_create(&threads[i], NULL, client_thread, (void *) (uintptr_t) i);
+
+  uint64_t deadline = start + opts.duration * 1000000000ull, now;
+  while ((now = now_ns()) < deadline) {
+    for (int i = 0; i < opts.idle; i++) {
+      if (fds[i].fd < 0 || !idle[i].trickle || idle[i].next_byte > now)
+        continue;
+      if (idle[i].sent < sizeof(trickle_command) - 1 &&
+          send(fds[i].fd, trickle_command + idle[i].sent, 1, MSG_NOSIGNAL) == 1)
+        idle[i].sent++;
+      idle[i].next_byte += interval;
+    }
+
+    uint64_t wait = (deadline - now) / 1000000;
+    if (poll(fds, opts.idle, wait < POLL_INTERVAL ? wait : POLL_INTERVAL) <= 0)
+      continue;
+    for (int i = 0; i < opts.idle; i++) {
+      if (fds[i].fd < 0 || !fds[i].revents)
+        continue;
+      if (read_idle(fds[i].fd, &idle[i]) < 0) {
+        close(fds[i].fd);
+        fds[i].fd = -1;
+        stats.idle_dropped++;
+      }
+    }
+  }
+
+  struct usage final = measure_servers();
+  active_done = 1;
+  for (int i = 0; i < opts.clients; i++)
+    pthread_join(threads[i], NULL);
+  double elapsed = (now_ns() - start) / 1e9;
+  for (int i = 0; i < opts.idle; i++)
+    if (fds[i].fd >= 0)
+      close(fds[i].fd);
+
+  if (opts.spawn) {
+    kill(-smtp_pid, SIGTERM);
+    kill(-pop_pid, SIGTERM);
+    waitpid(smtp_pid, NULL, 0);
+    waitpid(pop_pid, NULL, 0);
+    if (opts.keep)
+      fprintf(stderr, "mailsoak: scratch directory kept in %s\n", scratch);
+    else
+      nftw(scratch, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  }
+
+  FILE *out = stdout;
+  if (opts.output && !(out = fopen(opts.output, "w"))) {
+    perror(opts.output);
+    return 1;
+  }
+  int failed = print_report(out, open_time, elapsed, &baseline, &opened, &final);
+  if (out != stdout) fclose(out);
+  return failed ? 1 : 0;
+}
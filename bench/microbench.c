@@ -0,0 +1,482 @@
+/* microbench.c
+ * Micro-benchmarks for the building blocks of the mail servers:
+ * reading lines from a socket, user lookups, mailbox loading and
+ * delivery, recipient lists, command dispatch and flight recorder
+ * events. Each benchmark reports the time and the number of heap
+ * allocations per operation.
+ *
+ * Usage: microbench [-t min_ms] [-s] [filter]
+ *   -t min_ms  minimum running time for each benchmark (default: 200)
+ *   -s         small mode: skip the largest user lists and mailboxes
+ *   filter     only run benchmarks whose name contains this string
+ *
+ * Each group of benchmarks runs in its own process and directory,
+ * since the mail functions keep per-process state (e.g., an open
+ * users file) and use paths relative to the working directory.
+ */
+
+#define _GNU_SOURCE
+#include "../netbuffer.h"
+#include "../arena.h"
+#include "../mailuser.h"
+#include "../flightrec.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <ftw.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define MAX_LINE_LENGTH 1024
+
+int smtp_dispatch(char *command);
+int pop_dispatch(char *command);
+
+static double min_time = 0.2;
+static int small_mode = 0;
+static const char *filter = NULL;
+static unsigned long alloc_count = 0;
+
+/* Heap allocation counting. These definitions replace the C library
+ * functions for the whole program (including allocations made inside
+ * the C library itself, e.g., by fopen or opendir) and forward to the
+ * C library implementation.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+void *malloc(size_t size) {
+  __atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  __atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  __atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
+  return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+  __libc_free(ptr);
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, long ops, double elapsed, unsigned long allocs) {
+  printf("%-44s %10ld %12.1f ns/op %10.2f allocs/op\n", name, ops,
+         elapsed * 1e9 / ops, (double) allocs / ops);
+  fflush(stdout);
+}
+
+static int selected(const char *name) {
+  return !filter || strstr(name, filter);
+}
+
+/** Checks if any benchmark in a group (whose names all start with the
+ *  given prefix) may be selected by the filter.
+ */
+static int group_selected(const char *prefix) {
+  return selected(prefix) || !strncmp(filter, prefix, strlen(prefix));
+}
+
+/** Runs a benchmark function with an increasing number of iterations,
+ *  until a single run takes at least the minimum running time, and
+ *  reports the last run. The function returns the number of
+ *  operations it performed for the given number of iterations.
+ */
+static void bench_run(const char *name, long (*fn)(void *ctx, long iters), void *ctx) {
+
+  if (!selected(name)) return;
+
+  long iters = 1;
+  while (1) {
+    unsigned long allocs = alloc_count;
+    double start = now();
+    long ops = fn(ctx, iters);
+    double elapsed = now() - start;
+    allocs = alloc_count - allocs;
+
+    if (elapsed >= min_time || iters >= 1000000000L) {
+      report(name, ops, elapsed, allocs);
+      return;
+    }
+    double factor = elapsed > 0 ? 1.2 * min_time / elapsed : 100;
+    if (factor > 100) factor = 100;
+    if (factor < 2) factor = 2;
+    iters *= factor;
+  }
+}
+
+/** Runs a group of benchmarks in a child process, inside a new
+ *  subdirectory of the scratch directory.
+ */
+static void run_group(const char *dir, void (*group)(void)) {
+
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    mkdir(dir, 0777);
+    if (chdir(dir) < 0) {
+      perror(dir);
+      exit(1);
+    }
+    group();
+    exit(0);
+  }
+  waitpid(pid, NULL, 0);
+}
+
+/* nb_read_line over a socket pair, with lines of different sizes
+ * arriving one at a time or pipelined in a single write.
+ */
+
+struct read_line_ctx {
+  int fds[2];
+  net_buffer_t nb;
+  char *data;
+  size_t data_size;
+  int depth;
+};
+
+static long bench_read_line(void *arg, long iters) {
+
+  struct read_line_ctx *ctx = arg;
+  char out[MAX_LINE_LENGTH + 1];
+
+  for (long i = 0; i < iters; i++) {
+    size_t sent = 0;
+    while (sent < ctx->data_size) {
+      ssize_t rv = write(ctx->fds[0], ctx->data + sent, ctx->data_size - sent);
+      if (rv <= 0) exit(1);
+      sent += rv;
+    }
+    for (int j = 0; j < ctx->depth; j++)
+      nb_read_line(ctx->nb, out);
+  }
+  return iters * ctx->depth;
+}
+
+static void group_read_line(void) {
+
+  static const int sizes[] = { 16, 128, 1000 };
+  static const int depths[] = { 1, 16, 64 };
+  char name[128];
+
+  for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    for (int d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+
+      snprintf(name, sizeof(name), "nb_read_line/size=%d/depth=%d", sizes[s], depths[d]);
+      if (!selected(name)) continue;
+
+      struct read_line_ctx ctx;
+      int bufsize = 4 << 20;
+      socketpair(AF_UNIX, SOCK_STREAM, 0, ctx.fds);
+      setsockopt(ctx.fds[0], SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+      setsockopt(ctx.fds[1], SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+      ctx.nb = nb_create(ctx.fds[1], MAX_LINE_LENGTH);
+      ctx.depth = depths[d];
+      ctx.data_size = sizes[s] * depths[d];
+      ctx.data = malloc(ctx.data_size);
+      for (int j = 0; j < depths[d]; j++) {
+        char *line = ctx.data + j * sizes[s];
+        memset(line, 'a', sizes[s] - 2);
+        memcpy(line + sizes[s] - 2, "\r\n", 2);
+      }
+
+      bench_run(name, bench_read_line, &ctx);
+
+      nb_destroy(ctx.nb);
+      close(ctx.fds[0]);
+      close(ctx.fds[1]);
+      free(ctx.data);
+    }
+  }
+}
+
+/* is_valid_user on user files of different sizes, for users found in
+ * the middle of the file, and for unknown users.
+ */
+
+struct valid_user_ctx {
+  const char *user;
+  const char *password;
+};
+
+static long bench_valid_user(void *arg, long iters) {
+  struct valid_user_ctx *ctx = arg;
+  for (long i = 0; i < iters; i++)
+    is_valid_user(ctx->user, ctx->password);
+  return iters;
+}
+
+static int user_count;
+
+static void group_valid_user(void) {
+
+  char name[128], user[64], password[64];
+  FILE *file = fopen("users.txt", "w");
+  for (int i = 0; i < user_count; i++)
+    fprintf(file, "user%d@example.com password%d\n", i, i);
+  fclose(file);
+
+  snprintf(user, sizeof(user), "user%d@example.com", user_count / 2);
+  snprintf(password, sizeof(password), "password%d", user_count / 2);
+
+  struct valid_user_ctx ctx = { user, NULL };
+  snprintf(name, sizeof(name), "is_valid_user/users=%d/found", user_count);
+  bench_run(name, bench_valid_user, &ctx);
+
+  ctx.password = password;
+  snprintf(name, sizeof(name), "is_valid_user/users=%d/password", user_count);
+  bench_run(name, bench_valid_user, &ctx);
+
+  ctx.user = "nobody@example.com";
+  ctx.password = NULL;
+  snprintf(name, sizeof(name), "is_valid_user/users=%d/missing", user_count);
+  bench_run(name, bench_valid_user, &ctx);
+}
+
+/* load_user_mail, get_mail_item and get_mail_count on mailboxes of
+ * different sizes.
+ */
+
+static int mailbox_size;
+
+static long bench_load_mail(void *arg, long iters) {
+  for (long i = 0; i < iters; i++)
+    destroy_mail_list(load_user_mail("bench"));
+  return iters;
+}
+
+static long bench_mail_item(void *arg, long iters) {
+  mail_list_t list = arg;
+  unsigned int pos = 0;
+  for (long i = 0; i < iters; i++) {
+    get_mail_item(list, pos);
+    pos = (pos + 7919) % mailbox_size;
+  }
+  return iters;
+}
+
+static long bench_mail_count(void *arg, long iters) {
+  mail_list_t list = arg;
+  for (long i = 0; i < iters; i++)
+    get_mail_count(list);
+  return iters;
+}
+
+static void group_mailbox(void) {
+
+  char name[128], file_name[PATH_MAX];
+
+  mkdir("mail.store", 0777);
+  mkdir("mail.store/bench", 0777);
+  for (int i = 0; i < mailbox_size; i++) {
+    snprintf(file_name, sizeof(file_name), "mail.store/bench/%d.mail", i);
+    int fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0 || write(fd, "Subject: bench\r\n\r\nbench\r\n", 25) != 25) {
+      perror(file_name);
+      exit(1);
+    }
+    close(fd);
+  }
+
+  snprintf(name, sizeof(name), "load_user_mail/messages=%d", mailbox_size);
+  bench_run(name, bench_load_mail, NULL);
+
+  mail_list_t list = load_user_mail("bench");
+  snprintf(name, sizeof(name), "get_mail_item/messages=%d", mailbox_size);
+  bench_run(name, bench_mail_item, list);
+  snprintf(name, sizeof(name), "get_mail_count/messages=%d", mailbox_size);
+  bench_run(name, bench_mail_count, list);
+  destroy_mail_list(list);
+}
+
+/* save_user_mail delivering a message to a single, growing, mailbox.
+ * Each step reports the cost of the deliveries that take the mailbox
+ * from the previous size to the next.
+ */
+
+static void group_save_mail(void) {
+
+  static const int steps[] = { 100, 1000, 10000, 50000 };
+  char name[128];
+  int delivered = 0;
+
+  int fd = open("message", O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0 || write(fd, "Subject: bench\r\n\r\nbench\r\n", 25) != 25) {
+    perror("message");
+    exit(1);
+  }
+  close(fd);
+
+  user_list_t users = create_user_list();
+  add_user_to_list(&users, "bench");
+
+  for (int s = 0; s < sizeof(steps) / sizeof(steps[0]); s++) {
+    if (small_mode && steps[s] > 1000) break;
+
+    snprintf(name, sizeof(name), "save_user_mail/mailbox=%d-%d", delivered, steps[s]);
+    unsigned long allocs = alloc_count;
+    double start = now();
+    int count = steps[s] - delivered;
+    for (; delivered < steps[s]; delivered++)
+      save_user_mail("message", users);
+    if (selected(name))
+      report(name, count, now() - start, alloc_count - allocs);
+  }
+
+  destroy_user_list(users);
+}
+
+/* Building the recipient list of a message, either on the heap or
+ * in an arena reset after each message (as mysmtpd does).
+ */
+
+static long bench_user_list_heap(void *arg, long iters) {
+  char (*names)[16] = arg;
+  for (long i = 0; i < iters; i++) {
+    user_list_t users = create_user_list();
+    for (int r = 0; r < 20; r++)
+      add_user_to_list(&users, names[r]);
+    destroy_user_list(users);
+  }
+  return iters;
+}
+
+static long bench_user_list_arena(void *arg, long iters) {
+  char (*names)[16] = arg;
+  arena_t arena = arena_create(16384);
+  for (long i = 0; i < iters; i++) {
+    user_list_t users = create_user_list_in_arena(arena);
+    for (int r = 0; r < 20; r++)
+      add_user_to_list(&users, names[r]);
+    arena_reset(arena);
+  }
+  arena_destroy(arena);
+  return iters;
+}
+
+static void group_user_list(void) {
+  char names[20][16];
+  for (int r = 0; r < 20; r++)
+    snprintf(names[r], sizeof(names[r]), "user%d", r);
+  bench_run("add_user_to_list/recipients=20/heap", bench_user_list_heap, names);
+  bench_run("add_user_to_list/recipients=20/arena", bench_user_list_arena, names);
+}
+
+/* Command dispatch in both servers, cycling through a set of
+ * recognized and unrecognized commands.
+ */
+
+static long bench_smtp_dispatch(void *arg, long iters) {
+  char commands[][8] = { "HELO", "MAIL", "RCPT", "DATA", "QUIT", "NOOP", "RSET", "XYZW" };
+  int sum = 0;
+  for (long i = 0; i < iters; i++)
+    sum += smtp_dispatch(commands[i & 7]);
+  return iters + (sum & 0);
+}
+
+static long bench_pop_dispatch(void *arg, long iters) {
+  char commands[][8] = { "USER", "PASS", "STAT", "LIST", "RETR", "DELE", "QUIT", "XYZW" };
+  int sum = 0;
+  for (long i = 0; i < iters; i++)
+    sum += pop_dispatch(commands[i & 7]);
+  return iters + (sum & 0);
+}
+
+static void group_dispatch(void) {
+  bench_run("protocol_find_command/smtp", bench_smtp_dispatch, NULL);
+  bench_run("protocol_find_command/pop3", bench_pop_dispatch, NULL);
+}
+
+/* Cost of recording a flight recorder event, which is paid at every
+ * instrumented point of the servers.
+ */
+
+static long bench_flightrec(void *arg, long iters) {
+  for (long i = 0; i < iters; i++)
+    flightrec_record(FR_COMMAND, "RETR", i, 0);
+  return iters;
+}
+
+static void group_flightrec(void) {
+  bench_run("flightrec_record", bench_flightrec, NULL);
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int flag, struct FTW *ftw) {
+  return remove(path);
+}
+
+int main(int argc, char *argv[]) {
+
+  int opt;
+  while ((opt = getopt(argc, argv, "t:s")) != -1) {
+    switch (opt) {
+    case 't': min_time = atoi(optarg) / 1000.0; break;
+    case 's': small_mode = 1; break;
+    default:
+      fprintf(stderr, "Usage: %s [-t min_ms] [-s] [filter]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (optind < argc)
+    filter = argv[optind];
+
+  char scratch[] = "/tmp/microbench-XXXXXX";
+  if (!mkdtemp(scratch) || chdir(scratch) < 0) {
+    perror("microbench: scratch directory");
+    return 1;
+  }
+
+  static const int user_counts[] = { 10, 10000, 1000000 };
+  static const int mailbox_sizes[] = { 10, 1000, 100000 };
+  char dir[64];
+
+  if (group_selected("nb_read_line"))
+    run_group("read_line", group_read_line);
+
+  for (int i = 0; i < 3 && !(small_mode && i == 2); i++) {
+    user_count = user_counts[i];
+    snprintf(dir, sizeof(dir), "users-%d", user_count);
+    if (group_selected("is_valid_user"))
+      run_group(dir, group_valid_user);
+  }
+
+  for (int i = 0; i < 3 && !(small_mode && i == 2); i++) {
+    mailbox_size = mailbox_sizes[i];
+    snprintf(dir, sizeof(dir), "mailbox-%d", mailbox_size);
+    if (group_selected("load_user_mail") || group_selected("get_mail_item") ||
+        group_selected("get_mail_count"))
+      run_group(dir, group_mailbox);
+  }
+
+  if (group_selected("save_user_mail"))
+    run_group("save", group_save_mail);
+  if (group_selected("add_user_to_list"))
+    run_group("user_list", group_user_list);
+  if (group_selected("protocol_find_command"))
+    run_group("dispatch", group_dispatch);
+  if (group_selected("flightrec_record"))
+    run_group("flightrec", group_flightrec);
+
+  nftw(scratch, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  return 0;
+}
@@ -0,0 +1,17 @@
+/* microbench_pop.c
+ * Exposes the command dispatch of the POP3 protocol (see pop3.c) to
+ * the micro-benchmarks.
+ */
+
+#include "../pop3.h"
+
+#include <string.h>
+
+int pop_dispatch(char *command) {
+  static int initialized = 0;
+  if (!initialized) {
+    protocol_init(&pop3_protocol);
+    initialized = 1;
+  }
+  return protocol_find_command(&pop3_protocol, command, strlen(command)) != NULL;
+}
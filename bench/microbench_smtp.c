@@ -0,0 +1,17 @@
+/* microbench_smtp.c
+ * Exposes the command dispatch of the SMTP protocol (see smtp.c) to
+ * the micro-benchmarks.
+ */
+
+#include "../smtp.h"
+
+#include <string.h>
+
+int smtp_dispatch(char *command) {
+  static int initialized = 0;
+  if (!initialized) {
+    protocol_init(&smtp_protocol);
+    initialized = 1;
+  }
+  return protocol_find_command(&smtp_protocol, command, strlen(command)) != NULL;
+}
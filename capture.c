@@ -0,0 +1,441 @@
+/* capture.c
+ * Opt-in capture of client sessions, for replay with mailreplay.
+ *
+ * When the capture_file setting is set, every session appends a
+ * transcript of its commands to that file: when each command arrived
+ * (relative to the start of the session), how long the server took
+ * to handle it, whether the client sent it before reading the reply
+ * to the previous one (pipelining), bytes received and sent, and the
+ * status of the reply. bench/mailreplay reads the file and replays the
+ * sessions against a test server, with their original timing and
+ * concurrency.
+ *
+ * Transcripts are sanitized as they are recorded. Message contents
+ * are only recorded as their size and number of lines; passwords and
+ * client names are dropped; mailbox names and addresses are replaced
+ * with tokens, a hash keyed with a random value, so that the same
+ * mailbox gets the same token in every session (and the replay can map
+ * each token to a test mailbox). The key is kept in <capture_file>.key,
+ * created by the first server that needs it, so that both servers (and
+ * later runs) writing to a capture file agree on the tokens. Other
+ * arguments are only kept if they are numbers (e.g., message numbers
+ * in RETR), and unknown commands are recorded as "?".
+ *
+ * The file has one record per line:
+ *
+ *   S <pid> <start (Unix time, us)> <protocol>
+ *   C <pid> <offset (us)> <duration (us)> <pipelined> <bytes in>
+ *     <bytes out> <body bytes> <body lines> <reply> <command> [args]
+ *   E <pid> <offset (us)> <bytes in> <bytes out>
+ *
+ * where reply is the first word of the first reply line (e.g., 250 or
+ * +OK), followed by up to two numbers from the same line, separated
+ * by commas (e.g., "+OK,3,1200" for STAT). For DATA, the body and the
+ * reply sent after it are recorded with the command. Each session
+ * buffers its records and appends them to the file in large writes,
+ * at least once per session, so lines of concurrent sessions are never
+ * mixed; the records of a session are identified by its process ID.
+ */
+
+#define _GNU_SOURCE
+#include "capture.h"
+#include "config.h"
+#include "metrics.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/random.h>
+
+#define CAPTURE_BUFFER_SIZE 65536
+#define CAPTURE_RECORD_MAX 512
+#define CAPTURE_ARGS_MAX 256
+#define CAPTURE_REPLY_MAX 48
+
+static int capture_fd = -1;
+static uint64_t token_key[2];
+static int key_loaded = 0;
+
+static struct {
+  int active;
+  pid_t pid;
+  uint64_t start;        // metrics_now when the session started
+  size_t used;
+  char buffer[CAPTURE_BUFFER_SIZE];
+  // Command being handled
+  uint64_t command_start;
+  uint64_t bytes_out;
+  size_t line_length;
+  size_t body_bytes;
+  unsigned int body_lines;
+  int pipelined;
+  int want_reply;
+  char reply[CAPTURE_REPLY_MAX];
+  char command[CAPTURE_ARGS_MAX];
+} session;
+
+/** Internal function that loads the key used for tokens from the key
+ *  file of a capture file. If the key file doesn't exist, a random key
+ *  is written to a temporary file and linked to its name, so servers
+ *  starting at the same time never read a partial key; the server that
+ *  loses the race reads the key of the other one.
+ */
+static void load_key(const char *file) {
+
+  char path[PATH_MAX - 16], temp[PATH_MAX];
+  snprintf(path, sizeof(path), "%s.key", file);
+  for (int attempt = 0; attempt < 2; attempt++) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+      ssize_t rv = read(fd, token_key, sizeof(token_key));
+      close(fd);
+      key_loaded = rv == sizeof(token_key);
+      break;
+    }
+
+    uint64_t key[2];
+    snprintf(temp, sizeof(temp), "%s.XXXXXX", path);
+    if (getrandom(key, sizeof(key), 0) != sizeof(key) || (fd = mkostemp(temp, O_CLOEXEC)) < 0)
+      break;
+    int written = write(fd, key, sizeof(key)) == sizeof(key);
+    close(fd);
+    if (written && link(temp, path) == 0) {
+      memcpy(token_key, key, sizeof(key));
+      key_loaded = 1;
+    }
+    unlink(temp);
+    if (key_loaded) break;
+  }
+
+  if (!key_loaded) {
+    log_warning("capture: cannot use %s, mailbox tokens will differ between servers", path);
+    if (getrandom(token_key, sizeof(token_key), 0) != sizeof(token_key))
+      token_key[0] = (uint64_t) time(NULL) * 0x9e3779b97f4a7c15ull ^ getpid();
+    key_loaded = 1;
+  }
+}
+
+/** Internal function that applies the capture_file setting. An open
+ *  capture file is replaced in place; if the new file can't be
+ *  opened, the current one is kept.
+ */
+static void configure(void) {
+
+  const char *file = config_get_string("capture_file", NULL);
+  if (!file || !*file) {
+    if (capture_fd >= 0)
+      close(capture_fd);
+    capture_fd = -1;
+    return;
+  }
+
+  if (!key_loaded)
+    load_key(file);
+
+  int fd = open(file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    log_error("capture: cannot open %s: %s", file, strerror(errno));
+  } else if (capture_fd < 0) {
+    capture_fd = fd;
+  } else {
+    dup2(fd, capture_fd);
+    fcntl(capture_fd, F_SETFD, FD_CLOEXEC);
+    close(fd);
+  }
+}
+
+/** Sets up session capture, based on the capture_file setting
+ *  (sessions are not captured if not set). Must be called before any
+ *  processes are created.
+ */
+void capture_init(void) {
+  configure();
+}
+
+/** Applies the capture settings again after the configuration is
+ *  reloaded. The capture file is reopened, so it can be rotated by
+ *  renaming it before the reload.
+ */
+void capture_reload(void) {
+  configure();
+}
+
+/** Internal function that writes the records buffered by the session
+ *  to the capture file.
+ */
+static void flush(void) {
+  char *p = session.buffer;
+  while (session.used > 0) {
+    ssize_t rv = write(capture_fd, p, session.used);
+    if (rv <= 0) break;
+    p += rv;
+    session.used -= rv;
+  }
+  session.used = 0;
+}
+
+/** Internal function that appends a record to the session buffer,
+ *  flushing the buffer first if the record might not fit.
+ */
+static void append(const char *format, ...)
+  __attribute__ ((format(printf, 1, 2)));
+
+static void append(const char *format, ...) {
+
+  if (session.used + CAPTURE_RECORD_MAX > sizeof(session.buffer))
+    flush();
+
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(session.buffer + session.used, CAPTURE_RECORD_MAX, format, args);
+  va_end(args);
+  if (len <= 0) return;
+  if (len >= CAPTURE_RECORD_MAX) {
+    len = CAPTURE_RECORD_MAX - 1;
+    session.buffer[session.used + len - 1] = '\n';
+  }
+  session.used += len;
+}
+
+/** Internal function that returns the time since the session started,
+ *  in microseconds.
+ */
+static unsigned long offset_us(uint64_t now) {
+  return (now - session.start) / 1000;
+}
+
+/** Internal function that writes the token that replaces a mailbox
+ *  name or address: a keyed FNV-1a hash of the name (ignoring case),
+ *  with the bits mixed at the end so tokens don't share prefixes.
+ */
+static size_t write_token(char *out, size_t size, const char *name, size_t length) {
+
+  uint64_t hash = 0xcbf29ce484222325ull ^ token_key[0];
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (unsigned char) tolower((unsigned char) name[i]);
+    hash *= 0x100000001b3ull;
+  }
+  hash ^= token_key[1];
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdull;
+  hash ^= hash >> 33;
+
+  int len = snprintf(out, size, "u%012llx", (unsigned long long) (hash & 0xffffffffffffull));
+  return len < size ? len : size - 1;
+}
+
+/** Internal function that writes the sanitized arguments of MAIL and
+ *  RCPT: the keyword (FROM: or TO:) and a token for the address.
+ */
+static size_t write_path(char *out, size_t size, const char *keyword, const char *args, size_t length) {
+
+  const char *end = args + length;
+  const char *colon = memchr(args, ':', length);
+  const char *addr = colon ? colon + 1 : args;
+  while (addr < end && *addr == ' ')
+    addr++;
+  const char *addr_end = addr;
+  if (addr < end && *addr == '<') {
+    addr++;
+    addr_end = memchr(addr, '>', end - addr);
+    if (!addr_end) addr_end = end;
+  } else {
+    while (addr_end < end && *addr_end != ' ')
+      addr_end++;
+  }
+
+  int len = snprintf(out, size, " %s<", keyword);
+  if (len >= size) return size - 1;
+  if (addr_end > addr)
+    len += write_token(out + len, size - len, addr, addr_end - addr);
+  if (len + 1 < size) {
+    out[len++] = '>';
+    out[len] = 0;
+  }
+  return len;
+}
+
+/** Internal function that writes the arguments of other commands,
+ *  keeping numbers and replacing everything else with "x".
+ */
+static size_t write_numbers(char *out, size_t size, const char *args, size_t length) {
+
+  size_t len = 0;
+  const char *p = args, *end = args + length;
+  while (p < end) {
+    while (p < end && *p == ' ')
+      p++;
+    const char *word = p;
+    int numeric = 1;
+    while (p < end && *p != ' ')
+      numeric &= isdigit((unsigned char) *p++) != 0;
+    if (p == word) break;
+    size_t word_length = numeric ? p - word : 1;
+    if (len + word_length + 2 > size) break;
+    out[len++] = ' ';
+    memcpy(out + len, numeric ? word : "x", word_length);
+    len += word_length;
+  }
+  out[len] = 0;
+  return len;
+}
+
+/** Starts capturing a session, if capture is enabled. Called by the
+ *  session process once the greeting is sent.
+ *
+ *  Parameters: protocol: Name of the protocol of the session.
+ */
+void capture_session_start(const char *protocol) {
+
+  if (capture_fd < 0) return;
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  session.active = 1;
+  session.pid = getpid();
+  session.start = metrics_now();
+  session.used = 0;
+  session.want_reply = 0;
+  append("S %d %llu %s\n", (int) session.pid,
+         (unsigned long long) now.tv_sec * 1000000 + now.tv_nsec / 1000, protocol);
+}
+
+/** Ends the capture of a session, writing its remaining records to the
+ *  capture file.
+ */
+void capture_session_end(void) {
+
+  if (!session.active) return;
+  const struct session_totals *totals = metrics_session_totals();
+  append("E %d %lu %llu %llu\n", (int) session.pid, offset_us(metrics_now()),
+         (unsigned long long) totals->bytes_in, (unsigned long long) totals->bytes_out);
+  flush();
+  session.active = 0;
+}
+
+/** Records the start of a command. The arguments are sanitized right
+ *  away, since the handler may modify them.
+ *
+ *  Parameters: command: Name of the command in the protocol table, or
+ *                       NULL if the command is not recognized.
+ *              args: Arguments of the command.
+ *              length: Length of the arguments.
+ *              line_length: Length of the command line as received.
+ *              pipelined: Non-zero if the command was received before
+ *                         the reply to the previous command was sent.
+ */
+void capture_command_start(const char *command, const char *args, size_t length,
+                           size_t line_length, int pipelined) {
+
+  if (!session.active) return;
+  session.command_start = metrics_now();
+  session.bytes_out = metrics_session_totals()->bytes_out;
+  session.line_length = line_length;
+  session.body_bytes = 0;
+  session.body_lines = 0;
+  session.pipelined = pipelined;
+  session.want_reply = 1;
+  strcpy(session.reply, "-");
+
+  char *out = session.command;
+  size_t size = sizeof(session.command);
+  if (!command) {
+    strcpy(out, "?");
+    return;
+  }
+
+  size_t len = snprintf(out, size, "%s", command);
+  if (!strcmp(command, "USER") || !strcmp(command, "VRFY")) {
+    const char *end = memchr(args, ' ', length);
+    if (length > 0 && len + 2 < size) {
+      out[len++] = ' ';
+      write_token(out + len, size - len, args, end ? end - args : length);
+    }
+  } else if (!strcmp(command, "MAIL")) {
+    write_path(out + len, size - len, "FROM:", args, length);
+  } else if (!strcmp(command, "RCPT")) {
+    write_path(out + len, size - len, "TO:", args, length);
+  } else if (strcmp(command, "PASS") && strcmp(command, "APOP") && strcmp(command, "AUTH") &&
+             strcmp(command, "HELO") && strcmp(command, "EHLO")) {
+    write_numbers(out + len, size - len, args, length);
+  }
+}
+
+/** Records the end of a command, started with capture_command_start.
+ */
+void capture_command_end(void) {
+
+  if (!session.active) return;
+  uint64_t now = metrics_now();
+  append("C %d %lu %lu %d %zu %llu %zu %u %s %s\n", (int) session.pid,
+         offset_us(session.command_start), (unsigned long) ((now - session.command_start) / 1000),
+         session.pipelined, session.line_length + session.body_bytes,
+         (unsigned long long) (metrics_session_totals()->bytes_out - session.bytes_out),
+         session.body_bytes, session.body_lines, session.reply, session.command);
+  session.want_reply = 0;
+}
+
+/** Records the size of a message received with DATA. Only the size is
+ *  recorded; the reply sent after the message replaces the reply to
+ *  the DATA command itself.
+ *
+ *  Parameters: bytes: Size of the message, without the final ".".
+ *              lines: Number of lines in the message.
+ */
+void capture_data(size_t bytes, unsigned int lines) {
+  if (!session.active) return;
+  session.body_bytes = bytes;
+  session.body_lines = lines;
+  session.want_reply = 1;
+}
+
+/** Records the status of a reply, if it is the first reply sent since
+ *  the current command started (or since its message was received).
+ *  Called for all data sent to the client.
+ *
+ *  Parameters: buf: Data being sent.
+ *              size: Number of bytes in the buffer.
+ */
+void capture_reply(const char *buf, size_t size) {
+
+  if (!session.active || !session.want_reply) return;
+  session.want_reply = 0;
+
+  // The status ends at a space, or at the dash of an SMTP reply that
+  // continues in the next line (the first character may be the dash
+  // of "-ERR")
+  const char *p = buf, *end = buf + size;
+  size_t len = 0;
+  if (p < end && *p != '\r' && *p != '\n')
+    session.reply[len++] = *p++;
+  while (p < end && *p != ' ' && *p != '-' && *p != '\r' && *p != '\n' &&
+         len < sizeof(session.reply) - 1)
+    session.reply[len++] = *p++;
+
+  // Numbers after the status, e.g. the message count and size in STAT
+  for (int numbers = 0; numbers < 2; numbers++) {
+    while (p < end && (*p == ' ' || *p == '-'))
+      p++;
+    const char *word = p;
+    while (p < end && isdigit((unsigned char) *p))
+      p++;
+    if (p == word || (p < end && *p != ' ' && *p != '\r' && *p != '\n') ||
+        len + (p - word) + 2 > sizeof(session.reply))
+      break;
+    session.reply[len++] = ',';
+    memcpy(session.reply + len, word, p - word);
+    len += p - word;
+  }
+  if (!len)
+    session.reply[len++] = '-';
+  session.reply[len] = 0;
+}
@@ -0,0 +1,21 @@
+/* capture.h
+ * Opt-in capture of client sessions, for replay with mailreplay.
+ */
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stddef.h>
+
+void capture_init(void);
+void capture_reload(void);
+
+void capture_session_start(const char *protocol);
+void capture_session_end(void);
+void capture_command_start(const char *command, const char *args, size_t length,
+                           size_t line_length, int pipelined);
+void capture_command_end(void);
+void capture_data(size_t bytes, unsigned int lines);
+void capture_reply(const char *buf, size_t size);
+
+#endif
@@ -0,0 +1,117 @@
+/* config.c
+ * Reads server settings from a configuration file.
+ *
+ * The configuration file contains one setting per line, in the form
+ * "key value". Blank lines and lines starting with '#' are
+ * ignored. Settings that are not present in the file use the default
+ * value provided by the caller.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define MAX_CONFIG_LINE 1024
+
+struct config_entry {
+  char *key;
+  char *value;
+  struct config_entry *next;
+};
+
+static struct config_entry *entries = NULL;
+
+/** Internal function that frees all settings currently loaded.
+ */
+static void config_clear(void) {
+  while (entries) {
+    struct config_entry *next = entries->next;
+    free(entries->key);
+    free(entries->value);
+    free(entries);
+    entries = next;
+  }
+}
+
+/** Loads settings from a configuration file, replacing any settings
+ *  loaded before. This function may be called again at any point to
+ *  reload a modified file.
+ *
+ *  Parameters: filename: Name of the configuration file.
+ *
+ *  Returns: If the file was read, returns 0. If the file cannot be
+ *           opened, returns -1; in this case the settings loaded
+ *           before are kept (so, on the first call, all settings use
+ *           their default values).
+ */
+int config_load(const char *filename) {
+
+  FILE *file = fopen(filename, "r");
+  if (!file) return -1;
+  config_clear();
+
+  char line[MAX_CONFIG_LINE];
+  while (fgets(line, sizeof(line), file)) {
+
+    char *key = line;
+    while (isspace((unsigned char) *key)) key++;
+    if (!*key || *key == '#') continue;
+
+    char *value = key;
+    while (*value && !isspace((unsigned char) *value)) value++;
+    if (*value) *value++ = 0;
+    while (isspace((unsigned char) *value)) value++;
+
+    char *end = value + strlen(value);
+    while (end > value && isspace((unsigned char) end[-1])) end--;
+    *end = 0;
+
+    struct config_entry *entry = malloc(sizeof(struct config_entry));
+    entry->key = strdup(key);
+    entry->value = strdup(value);
+    entry->next = entries;
+    entries = entry;
+  }
+
+  fclose(file);
+  return 0;
+}
+
+/** Returns the value of a setting as a string. If the same key
+ *  appears more than once in the file, the last value is used.
+ *
+ *  Parameters: key: Name of the setting.
+ *              default_value: Value to return if the setting is not
+ *                             present.
+ *
+ *  Returns: The setting value, or default_value if not found. The
+ *           returned string is valid until the next call to
+ *           config_load.
+ */
+const char *config_get_string(const char *key, const char *default_value) {
+  for (struct config_entry *entry = entries; entry; entry = entry->next) {
+    if (!strcmp(entry->key, key))
+      return entry->value;
+  }
+  return default_value;
+}
+
+/** Returns the value of a setting as an integer.
+ *
+ *  Parameters: key: Name of the setting.
+ *              default_value: Value to return if the setting is not
+ *                             present or is not a valid number.
+ *
+ *  Returns: The setting value, or default_value if not found.
+ */
+long config_get_int(const char *key, long default_value) {
+  const char *value = config_get_string(key, NULL);
+  if (!value || !*value) return default_value;
+
+  char *end;
+  long rv = strtol(value, &end, 0);
+  return *end ? default_value : rv;
+}
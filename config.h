@@ -0,0 +1,14 @@
+/* config.h
+ * Reads server settings from a configuration file.
+ */
+
+#ifndef _CONFIG_H_
+#define _CONFIG_H_
+
+#define CONFIG_FILE_NAME "mail.conf"
+
+int config_load(const char *filename);
+const char *config_get_string(const char *key, const char *default_value);
+long config_get_int(const char *key, long default_value);
+
+#endif
@@ -0,0 +1,191 @@
+/* expunge.c
+ * Removes the files of messages deleted by POP3 sessions in a
+ * background worker process, so QUIT does not wait for them.
+ *
+ * Sessions record the messages they delete in the expunge journal of
+ * the mailbox (see defer_mail_expunge), and then send the name of the
+ * mailbox to the expunger through a pipe. The expunger removes the
+ * files of one mailbox at a time, in small batches, at most
+ * expunge_rate files per second, so large expunges don't flood the
+ * file system with metadata updates. When it starts, it goes through
+ * all mailboxes to finish expunges left behind by a previous run of
+ * the server.
+ */
+
+#define _GNU_SOURCE
+#include "expunge.h"
+#include "mailuser.h"
+#include "config.h"
+#include "server.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+
+#define DEFAULT_EXPUNGE_RATE 1000 // files per second
+#define MAX_EXPUNGE_BATCH 256
+#define BATCHES_PER_SECOND 10
+
+static int notify_pipe[2] = { -1, -1 };
+
+// Mailboxes waiting to be expunged, in the order they were notified
+struct pending_list {
+  char **names;
+  unsigned int count;
+  unsigned int size;
+};
+
+/** Internal function that adds a mailbox to the pending list, unless
+ *  it is already there.
+ */
+static void add_pending(struct pending_list *pending, const char *username) {
+  for (unsigned int i = 0; i < pending->count; i++)
+    if (!strcmp(pending->names[i], username))
+      return;
+  if (pending->count == pending->size) {
+    unsigned int size = pending->size ? pending->size * 2 : 64;
+    char **names = realloc(pending->names, size * sizeof(char *));
+    if (!names) return;
+    pending->names = names;
+    pending->size = size;
+  }
+  pending->names[pending->count++] = strdup(username);
+}
+
+/** Internal function that removes the first mailbox of the pending
+ *  list.
+ */
+static void remove_first_pending(struct pending_list *pending) {
+  free(pending->names[0]);
+  memmove(pending->names, pending->names + 1, --pending->count * sizeof(char *));
+}
+
+/** Internal function that adds a mailbox found in the mail storage
+ *  to the pending list (see list_mailboxes).
+ */
+static void add_listed_mailbox(const char *username, void *arg) {
+  add_pending(arg, username);
+}
+
+/** Internal function that adds every mailbox in the mail storage to
+ *  the pending list. Mailboxes without a journal are skipped quickly
+ *  by expunge_user_mail.
+ */
+static void add_all_mailboxes(struct pending_list *pending) {
+  list_mailboxes(add_listed_mailbox, pending);
+}
+
+/** Internal function that sleeps for a number of nanoseconds.
+ */
+static void pause_ns(long long ns) {
+  if (ns <= 0) return;
+  struct timespec wait = { ns / 1000000000, ns % 1000000000 };
+  nanosleep(&wait, NULL);
+}
+
+/** Internal function run by the expunger process. It waits for
+ *  mailbox names from sessions (one per line) while it has nothing to
+ *  do, and otherwise removes a batch of files at a time, pausing
+ *  between batches to keep to the configured rate.
+ */
+static void expunge_worker(void *arg) {
+
+  close(notify_pipe[1]);
+  notify_pipe[1] = -1;
+
+  long rate = config_get_int("expunge_rate", DEFAULT_EXPUNGE_RATE);
+  unsigned int batch = MAX_EXPUNGE_BATCH;
+  if (rate > 0 && rate / BATCHES_PER_SECOND < batch)
+    batch = rate >= BATCHES_PER_SECOND ? rate / BATCHES_PER_SECOND : 1;
+
+  struct pending_list pending = { NULL, 0, 0 };
+  add_all_mailboxes(&pending);
+
+  char buf[4096];
+  size_t used = 0;
+  while (1) {
+    struct pollfd pfd = { notify_pipe[0], POLLIN, 0 };
+    if (poll(&pfd, 1, pending.count ? 0 : -1) > 0) {
+      ssize_t n = read(notify_pipe[0], buf + used, sizeof(buf) - used);
+      if (n == 0 && !pending.count)
+        return;
+      if (n > 0) {
+        used += n;
+        char *line = buf, *end;
+        while ((end = memchr(line, '\n', buf + used - line)) != NULL) {
+          *end = 0;
+          add_pending(&pending, line);
+          line = end + 1;
+        }
+        used -= line - buf;
+        memmove(buf, line, used);
+        if (used == sizeof(buf))
+          used = 0;
+      }
+    }
+    if (!pending.count)
+      continue;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int n = expunge_user_mail(pending.names[0], batch);
+    if (n < 0)
+      log_warning("expunge: %s: %s", pending.names[0], strerror(errno));
+    if (n <= 0) {
+      remove_first_pending(&pending);
+      continue;
+    }
+    if (rate > 0) {
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      pause_ns(n * 1000000000ll / rate - ((end.tv_sec - start.tv_sec) * 1000000000ll +
+                                           end.tv_nsec - start.tv_nsec));
+    }
+  }
+}
+
+/** Internal function that tells the expunger that a mailbox has
+ *  messages to be removed. The name is written in a single write, so
+ *  names from different sessions are never mixed.
+ *
+ *  Returns: zero if the expunger was notified, or -1 otherwise (e.g.,
+ *           if it is not running or is too far behind).
+ */
+static int notify_expunger(const char *username) {
+  char line[MAX_USERNAME_SIZE + 2];
+  int length = snprintf(line, sizeof(line), "%s\n", username);
+  if (length >= sizeof(line)) return -1;
+  return write(notify_pipe[1], line, length) == length ? 0 : -1;
+}
+
+/** Starts the expunger process, unless the expunge_deferred setting
+ *  is 0 (in which case files are removed before QUIT is answered).
+ *  Must be called before run_server, so that sessions can notify the
+ *  expunger.
+ */
+void expunge_start(void) {
+
+  if (!config_get_int("expunge_deferred", 1)) return;
+
+  if (pipe2(notify_pipe, O_CLOEXEC) < 0) {
+    log_error("expunge: pipe: %s", strerror(errno));
+    return;
+  }
+  fcntl(notify_pipe[1], F_SETFL, O_NONBLOCK);
+
+  if (start_worker(expunge_worker, NULL) < 0) {
+    close(notify_pipe[0]);
+    close(notify_pipe[1]);
+    return;
+  }
+  // Only the expunger reads from the pipe; if it exits, sessions get
+  // an error and remove the files themselves
+  close(notify_pipe[0]);
+  notify_pipe[0] = -1;
+  defer_mail_expunge(notify_expunger);
+}
@@ -0,0 +1,11 @@
+/* expunge.h
+ * Removes the files of messages deleted by POP3 sessions in a
+ * background worker process.
+ */
+
+#ifndef _EXPUNGE_H_
+#define _EXPUNGE_H_
+
+void expunge_start(void);
+
+#endif
@@ -0,0 +1,221 @@
+/* flightrec.c
+ * Per-process flight recorder: a ring buffer of recent events that
+ * can be dumped to a file when something goes wrong.
+ *
+ * Every process keeps its own ring with the last FR_RING_SIZE events
+ * (timestamp, event type, a short tag and two values). Recording an
+ * event only reads the clock and fills one ring entry, so the
+ * recorder can stay on all the time. The ring is dumped to
+ * <flightrec_directory>/flightrec.<pid>.log when the process
+ * receives SIGUSR1, or automatically the first time a command takes
+ * longer than flightrec_threshold_ms milliseconds (if set).
+ *
+ * On x86-64, entries are stamped with the CPU timestamp counter,
+ * which is cheaper to read than the system clock; counter values are
+ * converted to time only when the ring is dumped, based on how far
+ * the counter and the clock advanced since flightrec_init.
+ *
+ * Entries are claimed with an atomic increment, so threads (e.g.,
+ * delivery threads) may record events concurrently. The dump may be
+ * triggered by a signal at any point, so it only uses
+ * async-signal-safe functions, and an entry being written while the
+ * dump runs may be shown partially updated.
+ */
+
+#include "flightrec.h"
+#include "config.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <limits.h>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#define FR_RING_SIZE 1024 // must be a power of two
+#define FR_TAG_SIZE 8
+
+struct fr_entry {
+  uint64_t timestamp;
+  uint32_t event;
+  char tag[FR_TAG_SIZE];
+  uint64_t a;
+  uint64_t b;
+};
+
+static const char *const event_names[FR_NUM_EVENTS] = {
+  "accept", "command", "command_end", "read_wait", "user_lookup",
+  "mail_load", "mail_link", "retr_sent", "session_end"
+};
+
+static struct fr_entry ring[FR_RING_SIZE];
+static uint64_t next_entry = 0;
+static uint64_t threshold = 0;
+static int auto_dumped = 0;
+static char dump_directory[PATH_MAX] = ".";
+static uint64_t init_stamp, init_time;
+
+/** Returns a timestamp, in nanoseconds, to be used as the start time
+ *  of events measuring a duration.
+ */
+uint64_t flightrec_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/** Internal function that returns the timestamp stored in ring
+ *  entries.
+ */
+static inline uint64_t stamp(void) {
+#if defined(__x86_64__)
+  return __rdtsc();
+#else
+  return flightrec_now();
+#endif
+}
+
+/** Records an event in the ring, overwriting the oldest event if the
+ *  ring is full.
+ *
+ *  Parameters: event: Type of event.
+ *              tag: Short string identifying the event (only the
+ *                   first 8 characters are kept), or NULL.
+ *              a, b: Values associated to the event (see fr_event_t).
+ */
+void flightrec_record(fr_event_t event, const char *tag, uint64_t a, uint64_t b) {
+
+  uint64_t n = __atomic_fetch_add(&next_entry, 1, __ATOMIC_RELAXED);
+  struct fr_entry *entry = &ring[n & (FR_RING_SIZE - 1)];
+
+  entry->timestamp = stamp();
+  entry->event = event;
+  if (tag)
+    strncpy(entry->tag, tag, FR_TAG_SIZE);
+  else
+    entry->tag[0] = 0;
+  entry->a = a;
+  entry->b = b;
+}
+
+/** Records the end of a command, and dumps the ring if the command
+ *  took longer than the configured threshold (only once per process,
+ *  so a slow session does not produce a flood of dumps).
+ *
+ *  Parameters: tag: Command name.
+ *              start: Value of flightrec_now when the command started.
+ */
+void flightrec_command_end(const char *tag, uint64_t start) {
+  uint64_t duration = flightrec_now() - start;
+  flightrec_record(FR_COMMAND_END, tag, duration, 0);
+  if (threshold && duration > threshold && !auto_dumped) {
+    auto_dumped = 1;
+    flightrec_dump("slow command");
+  }
+}
+
+/** Internal function that appends an unsigned number to a buffer,
+ *  since snprintf is not async-signal-safe.
+ */
+static char *append_number(char *p, uint64_t value) {
+  char digits[24];
+  int n = 0;
+  do {
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  while (n) *p++ = digits[--n];
+  return p;
+}
+
+static char *append_string(char *p, const char *s, size_t max) {
+  while (max-- && *s) *p++ = *s++;
+  return p;
+}
+
+/** Writes all events in the ring, oldest first, to the dump file of
+ *  the calling process. Safe to be called from a signal handler.
+ *
+ *  Parameters: reason: Short description of why the dump was made.
+ */
+void flightrec_dump(const char *reason) {
+
+  char path[PATH_MAX + 64], line[256], *p;
+  pid_t pid = getpid();
+
+  p = append_string(path, dump_directory, PATH_MAX);
+  p = append_string(p, "/flightrec.", 16);
+  p = append_number(p, pid);
+  p = append_string(p, ".log", 8);
+  *p = 0;
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd < 0) return;
+
+  uint64_t last = __atomic_load_n(&next_entry, __ATOMIC_RELAXED);
+  uint64_t first = last > FR_RING_SIZE ? last - FR_RING_SIZE : 0;
+  uint64_t now = stamp(), now_time = flightrec_now();
+  double stamps_per_us = 1000.0 * (now - init_stamp) / (now_time - init_time + 1);
+  if (stamps_per_us <= 0) stamps_per_us = 1000;
+
+  p = append_string(line, "# flight recorder dump: pid ", 32);
+  p = append_number(p, pid);
+  p = append_string(p, ", reason: ", 16);
+  p = append_string(p, reason, 64);
+  p = append_string(p, ", events: ", 16);
+  p = append_number(p, last - first);
+  p = append_string(p, " (time in us before dump)\n", 32);
+  write(fd, line, p - line);
+
+  for (uint64_t n = first; n < last; n++) {
+    struct fr_entry *entry = &ring[n & (FR_RING_SIZE - 1)];
+    p = line;
+    *p++ = '-';
+    p = append_number(p, now > entry->timestamp ? (now - entry->timestamp) / stamps_per_us : 0);
+    *p++ = ' ';
+    p = append_string(p, entry->event < FR_NUM_EVENTS ? event_names[entry->event] : "?", 16);
+    *p++ = ' ';
+    p = append_string(p, entry->tag[0] ? entry->tag : "-", FR_TAG_SIZE);
+    *p++ = ' ';
+    p = append_number(p, entry->a);
+    *p++ = ' ';
+    p = append_number(p, entry->b);
+    *p++ = '\n';
+    write(fd, line, p - line);
+  }
+
+  close(fd);
+}
+
+static void sigusr1_handler(int s) {
+  flightrec_dump("SIGUSR1");
+}
+
+/** Sets up the flight recorder: reads the dump directory and latency
+ *  threshold from the configuration, and installs the SIGUSR1
+ *  handler. Must be called before run_server, so that every session
+ *  process inherits the handler.
+ */
+void flightrec_init(void) {
+
+  struct sigaction sa;
+
+  init_stamp = stamp();
+  init_time = flightrec_now();
+  threshold = config_get_int("flightrec_threshold_ms", 0) * 1000000ull;
+  snprintf(dump_directory, sizeof(dump_directory), "%s",
+           config_get_string("flightrec_directory", "."));
+
+  sa.sa_handler = sigusr1_handler;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  if (sigaction(SIGUSR1, &sa, NULL) == -1)
+    log_error("flightrec: sigaction: %s", strerror(errno));
+}
@@ -0,0 +1,30 @@
+/* flightrec.h
+ * Per-process flight recorder: a ring buffer of recent events that
+ * can be dumped to a file when something goes wrong.
+ */
+
+#ifndef _FLIGHTREC_H_
+#define _FLIGHTREC_H_
+
+#include <stdint.h>
+
+typedef enum {
+  FR_ACCEPT,        // a: client file descriptor
+  FR_COMMAND,       // tag: command, a: line length
+  FR_COMMAND_END,   // tag: command, a: duration (ns)
+  FR_READ_WAIT,     // a: duration (ns), b: bytes received
+  FR_USER_LOOKUP,   // a: duration (ns), b: result
+  FR_MAIL_LOAD,     // a: duration (ns), b: number of messages
+  FR_MAIL_LINK,     // a: duration (ns), b: errno (0 if linked)
+  FR_RETR_SENT,     // a: duration (ns), b: bytes sent
+  FR_SESSION_END,   // a: session duration (ns)
+  FR_NUM_EVENTS
+} fr_event_t;
+
+void flightrec_init(void);
+uint64_t flightrec_now(void);
+void flightrec_record(fr_event_t event, const char *tag, uint64_t a, uint64_t b);
+void flightrec_command_end(const char *tag, uint64_t start);
+void flightrec_dump(const char *reason);
+
+#endif
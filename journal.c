@@ -0,0 +1,736 @@
+/* journal.c
+ * Ordered, checksummed journal of the changes made to the mailboxes.
+ *
+ * When mail_journal is set, every message added to a mailbox and
+ * every message removed from one is also appended to a journal in
+ * that directory, so another store can be kept up to date by
+ * replaying it (see mailfollow.c) instead of copying the mailboxes.
+ * The contents of a message are written once, in a MESSAGE record,
+ * followed by a DELIVER record for each mailbox it is added to; the
+ * messages removed from a mailbox at once are listed in an EXPUNGE
+ * record. Records are appended under the mailbox's index lock, so the
+ * changes to each mailbox are in the journal in the order they were
+ * made.
+ *
+ * The journal is a sequence of segment files, each named after the
+ * position of its first record in the whole journal (its LSN), in
+ * hexadecimal. A new segment is started once the last one is at
+ * least mail_journal_segment_size bytes long, and segments already
+ * replayed can be removed (see journal_trim). Each record starts with
+ * a header holding its LSN, type, time and length, and a CRC-32C of
+ * the whole record, so readers can tell a complete record from a
+ * partly written or damaged one. Writers in all processes take turns
+ * with an flock on a lock file in the journal directory; readers
+ * don't lock, and wait for records still being written.
+ */
+
+#define _GNU_SOURCE
+#include "journal.h"
+#include "config.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+
+#define DEFAULT_SEGMENT_SIZE (64 * 1024 * 1024) // bytes
+#define JOURNAL_MAGIC 0x314c4a4d // "MJL1"
+#define JOURNAL_LOCK_FILE_NAME ".lock"
+#define SEGMENT_SUFFIX ".journal"
+#define MAX_RECORD_DATA (16 * 1024 * 1024) // bytes, except for messages
+#define COPY_BUFFER_SIZE 65536
+
+struct journal_record {
+  uint32_t magic;
+  uint32_t crc;         // CRC-32C of the data, then of the header from lsn
+  uint64_t lsn;
+  uint64_t time_ns;
+  uint32_t type;
+  uint32_t length;      // size of the data following the header
+};
+
+// Data of a DELIVER record, followed by the user name
+struct journal_deliver_data {
+  uint64_t message_lsn;
+  uint64_t size;
+  uint32_t number;
+  uint32_t reserved;
+};
+
+// Data of an EXPUNGE record, followed by the message numbers and the
+// user name
+struct journal_expunge_data {
+  uint32_t count;
+  uint32_t reserved;
+};
+
+// Writer state of the current process. The descriptors are opened
+// again after a fork, as the lock only excludes other open files.
+static struct {
+  pthread_mutex_t mutex;  // excludes other threads of the process
+  const char *directory;  // NULL if the journal is disabled
+  long segment_size;
+  int sync;
+  pid_t pid;              // process the descriptors were opened by
+  int dir_fd;
+  int lock_fd;
+  int segment_fd;
+  uint64_t segment_base;
+} writer = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0, -1, -1, -1, 0 };
+
+static pthread_once_t writer_once = PTHREAD_ONCE_INIT;
+
+struct journal_reader {
+  int dir_fd;
+  int segment_fd;         // -1 until the segment exists
+  uint64_t segment_base;
+  uint64_t offset;        // of the next record in the segment
+  char *buffer;
+  size_t buffer_size;
+};
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+/** Internal function that fills in the table used to compute
+ *  CRC-32C (Castagnoli) checksums.
+ */
+static void init_crc_table(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++)
+      crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+    crc_table[i] = crc;
+  }
+}
+
+/** Internal function that updates a CRC-32C checksum with more data.
+ *  The checksum of some data split in parts is computed by passing
+ *  the checksum of each part to the next, starting with 0.
+ */
+static uint32_t crc32c(uint32_t crc, const void *data, size_t length) {
+  pthread_once(&crc_once, init_crc_table);
+  const unsigned char *bytes = data;
+  crc = ~crc;
+  while (length--)
+    crc = crc_table[(crc ^ *bytes++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+/** Internal function that computes the checksum of a record, from
+ *  the checksum of its data.
+ */
+static uint32_t record_crc(const struct journal_record *record, uint32_t data_crc) {
+  return crc32c(data_crc, &record->lsn, sizeof(*record) - offsetof(struct journal_record, lsn));
+}
+
+/** Internal function that copies bytes between two files, at given
+ *  offsets, by the kernel where possible.
+ *
+ *  Returns: zero if successful, or -1 otherwise.
+ */
+static int copy_range(int in_fd, off_t in_offset, int out_fd, off_t out_offset, size_t length) {
+
+  while (length > 0) {
+    ssize_t rv = copy_file_range(in_fd, &in_offset, out_fd, &out_offset, length, 0);
+    if (rv <= 0) break;
+    length -= rv;
+  }
+
+  char buf[COPY_BUFFER_SIZE];
+  while (length > 0) {
+    ssize_t rv = pread(in_fd, buf, length < sizeof(buf) ? length : sizeof(buf), in_offset);
+    if (rv <= 0 || pwrite(out_fd, buf, rv, out_offset) != rv) return -1;
+    in_offset += rv;
+    out_offset += rv;
+    length -= rv;
+  }
+  return 0;
+}
+
+/** Internal function that builds the name of a segment file.
+ */
+static void segment_name(char *name, uint64_t base) {
+  sprintf(name, "%016llx" SEGMENT_SUFFIX, (unsigned long long) base);
+}
+
+/** Internal function that lists the segments of a journal.
+ *
+ *  Returns: number of segments, with their first LSNs (in increasing
+ *           order) in an array to be freed by the caller, or -1 if the
+ *           journal directory cannot be read.
+ */
+static int list_segments(int dir_fd, uint64_t **bases) {
+
+  int dup_fd = dup(dir_fd);
+  DIR *dir = dup_fd >= 0 ? fdopendir(dup_fd) : NULL;
+  if (!dir) {
+    if (dup_fd >= 0) close(dup_fd);
+    return -1;
+  }
+  rewinddir(dir);
+
+  int count = 0, size = 0;
+  *bases = NULL;
+  struct dirent *dir_entry;
+  while ((dir_entry = readdir(dir)) != NULL) {
+    char *end;
+    unsigned long long base = strtoull(dir_entry->d_name, &end, 16);
+    if (end != dir_entry->d_name + 16 || strcmp(end, SEGMENT_SUFFIX))
+      continue;
+    if (count == size) {
+      size = size ? size * 2 : 16;
+      uint64_t *grown = realloc(*bases, size * sizeof(uint64_t));
+      if (!grown) break;
+      *bases = grown;
+    }
+    // Segments are few, so they are kept sorted as they are found
+    int pos = count++;
+    while (pos > 0 && (*bases)[pos - 1] > base) {
+      (*bases)[pos] = (*bases)[pos - 1];
+      pos--;
+    }
+    (*bases)[pos] = base;
+  }
+  closedir(dir);
+  return count;
+}
+
+/** Internal function that reads the journal settings, once per
+ *  process.
+ */
+static void read_journal_settings(void) {
+  writer.directory = config_get_string("mail_journal", NULL);
+  writer.segment_size = config_get_int("mail_journal_segment_size", DEFAULT_SEGMENT_SIZE);
+  writer.sync = config_get_int("mail_journal_sync", 0);
+}
+
+/** Returns non-zero (true) if changes to the mailboxes are written to
+ *  a journal (i.e., if mail_journal is set).
+ */
+int journal_enabled(void) {
+  pthread_once(&writer_once, read_journal_settings);
+  return writer.directory != NULL;
+}
+
+/** Internal function that takes the writer lock of the journal,
+ *  opening the journal directory and its lock file in this process
+ *  if needed.
+ *
+ *  Returns: zero if the lock was taken, or -1 otherwise (in which
+ *           case the writer mutex is not held either).
+ */
+static int lock_journal(void) {
+
+  pthread_mutex_lock(&writer.mutex);
+  if (writer.pid != getpid()) {
+    if (writer.dir_fd >= 0) close(writer.dir_fd);
+    if (writer.lock_fd >= 0) close(writer.lock_fd);
+    if (writer.segment_fd >= 0) close(writer.segment_fd);
+    mkdir(writer.directory, 0777);
+    writer.dir_fd = open(writer.directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    writer.lock_fd = writer.dir_fd < 0 ? -1 :
+      openat(writer.dir_fd, JOURNAL_LOCK_FILE_NAME, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    writer.segment_fd = -1;
+    writer.pid = getpid();
+  }
+  if (writer.lock_fd < 0 || flock(writer.lock_fd, LOCK_EX) < 0) {
+    log_error("journal: cannot lock %s: %s", writer.directory, strerror(errno));
+    pthread_mutex_unlock(&writer.mutex);
+    return -1;
+  }
+  return 0;
+}
+
+/** Internal function that releases the writer lock of the journal.
+ */
+static void unlock_journal(void) {
+  flock(writer.lock_fd, LOCK_UN);
+  pthread_mutex_unlock(&writer.mutex);
+}
+
+/** Internal function that opens the segment new records are appended
+ *  to, starting a new one if the last segment is full. Must be called
+ *  with the writer lock held.
+ *
+ *  Parameters: current: If non-zero, records are appended to the
+ *                       segment already open even if it is full (so
+ *                       related records stay together).
+ *
+ *  Returns: size of the segment (i.e., the offset of the next record),
+ *           or -1 if the segment cannot be opened.
+ */
+static off_t open_last_segment(int current) {
+
+  struct stat segment_stat;
+  if (writer.segment_fd >= 0 && fstat(writer.segment_fd, &segment_stat) == 0 &&
+      (current || segment_stat.st_size < writer.segment_size))
+    return segment_stat.st_size;
+  if (writer.segment_fd >= 0) close(writer.segment_fd);
+  writer.segment_fd = -1;
+
+  // Another process may have started a new segment since
+  uint64_t *bases, base = 0;
+  int count = list_segments(writer.dir_fd, &bases);
+  if (count < 0) return -1;
+  if (count > 0) base = bases[count - 1];
+  free(bases);
+
+  char name[32];
+  segment_name(name, base);
+  int fd = openat(writer.dir_fd, name, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  if (fd >= 0 && fstat(fd, &segment_stat) < 0) {
+    close(fd);
+    fd = -1;
+  }
+  if (fd >= 0 && segment_stat.st_size >= writer.segment_size) {
+    close(fd);
+    base += segment_stat.st_size;
+    segment_name(name, base);
+    fd = openat(writer.dir_fd, name, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (fd >= 0 && fstat(fd, &segment_stat) < 0) {
+      close(fd);
+      fd = -1;
+    }
+    if (fd >= 0)
+      fsync(writer.dir_fd);
+  }
+  if (fd < 0) return -1;
+  writer.segment_fd = fd;
+  writer.segment_base = base;
+  return segment_stat.st_size;
+}
+
+/** Internal function that appends a record to the journal. Must be
+ *  called with the writer lock held. The data of the record is given
+ *  as a list of buffers, and may be followed by the contents of a
+ *  file, whose checksum is computed beforehand. With current set, the
+ *  record goes to the segment already open (see open_last_segment).
+ *
+ *  Returns: LSN of the record, or JOURNAL_NO_LSN if it could not be
+ *           written.
+ */
+static uint64_t append_record(journal_type_t type, int current, const struct iovec *data, int count,
+                              int file_fd, size_t file_size, uint32_t file_crc) {
+
+  off_t offset = open_last_segment(current);
+  if (offset < 0) return JOURNAL_NO_LSN;
+
+  struct iovec iov[4];
+  struct journal_record record;
+  struct timespec now;
+  uint32_t crc = 0;
+  size_t length = 0;
+  iov[0].iov_base = &record;
+  iov[0].iov_len = sizeof(record);
+  for (int i = 0; i < count; i++) {
+    iov[i + 1] = data[i];
+    crc = crc32c(crc, data[i].iov_base, data[i].iov_len);
+    length += data[i].iov_len;
+  }
+  if (file_fd >= 0) {
+    crc = file_crc;
+    length += file_size;
+  }
+  if (length > UINT32_MAX) {
+    log_error("journal: record too large (%zu bytes)", length);
+    return JOURNAL_NO_LSN;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  record.magic = JOURNAL_MAGIC;
+  record.lsn = writer.segment_base + offset;
+  record.time_ns = now.tv_sec * 1000000000ull + now.tv_nsec;
+  record.type = type;
+  record.length = length;
+  record.crc = record_crc(&record, crc);
+
+  // A record that cannot be written whole is removed, so readers
+  // don't wait for it
+  ssize_t head = sizeof(record) + length - (file_fd >= 0 ? file_size : 0);
+  if (pwritev(writer.segment_fd, iov, count + 1, offset) != head ||
+      (file_fd >= 0 && copy_range(file_fd, 0, writer.segment_fd, offset + head, file_size) < 0) ||
+      (writer.sync && fdatasync(writer.segment_fd) < 0)) {
+    log_error("journal: cannot append to %s: %s", writer.directory, strerror(errno));
+    ftruncate(writer.segment_fd, offset);
+    return JOURNAL_NO_LSN;
+  }
+  return record.lsn;
+}
+
+/** Prepares a message to be written to the journal, as it is
+ *  delivered to mailboxes. Its contents are only written with its
+ *  first delivery.
+ *
+ *  Parameters: message: Message to be prepared.
+ *              basefile: Name of the file containing the message.
+ *              size: Size of the message.
+ */
+void journal_begin_message(struct journal_message *message, const char *basefile, size_t size) {
+
+  message->fd = -1;
+  message->size = size;
+  message->lsn = JOURNAL_NO_LSN;
+  message->crc = 0;
+  if (!journal_enabled())
+    return;
+
+  // The checksum is computed before the journal is locked
+  message->fd = open(basefile, O_RDONLY | O_CLOEXEC);
+  char buf[COPY_BUFFER_SIZE];
+  off_t offset = 0;
+  ssize_t rv = 0;
+  while (message->fd >= 0 && offset < size &&
+         (rv = pread(message->fd, buf, size - offset < sizeof(buf) ? size - offset : sizeof(buf), offset)) > 0) {
+    message->crc = crc32c(message->crc, buf, rv);
+    offset += rv;
+  }
+  if (message->fd >= 0 && offset < size) {
+    close(message->fd);
+    message->fd = -1;
+  }
+}
+
+/** Releases a message prepared with journal_begin_message.
+ */
+void journal_end_message(struct journal_message *message) {
+  if (message->fd >= 0) close(message->fd);
+  message->fd = -1;
+}
+
+/** Records in the journal that a message was added to a mailbox. Must
+ *  be called with the mailbox index locked, so the changes to each
+ *  mailbox are recorded in order. The contents of the message are
+ *  written first if they are not in the journal yet, or if they are
+ *  in an earlier segment, so a DELIVER record and the contents it
+ *  refers to are always in the same segment.
+ *
+ *  Parameters: message: Message prepared with journal_begin_message.
+ *              username: Name of the user the message was added to.
+ *              number: Number of the message in the mailbox.
+ *
+ *  Returns: zero if the change was recorded (or the journal is
+ *           disabled), or -1 otherwise.
+ */
+int journal_deliver(struct journal_message *message, const char *username, unsigned int number) {
+
+  if (!journal_enabled()) return 0;
+  if (message->fd < 0 || lock_journal() < 0) return -1;
+
+  // Neither record starts a new segment once the segment is chosen
+  uint64_t lsn = JOURNAL_NO_LSN;
+  if (open_last_segment(0) >= 0) {
+    if (message->lsn == JOURNAL_NO_LSN || message->lsn < writer.segment_base)
+      message->lsn = append_record(JOURNAL_MESSAGE, 1, NULL, 0, message->fd, message->size, message->crc);
+    if (message->lsn != JOURNAL_NO_LSN) {
+      struct journal_deliver_data data = { message->lsn, message->size, number, 0 };
+      struct iovec iov[2] = { { &data, sizeof(data) }, { (void *) username, strlen(username) } };
+      lsn = append_record(JOURNAL_DELIVER, 1, iov, 2, -1, 0, 0);
+    }
+  }
+  unlock_journal();
+  return lsn == JOURNAL_NO_LSN ? -1 : 0;
+}
+
+/** Records in the journal that messages were removed from a mailbox.
+ *  Must be called with the mailbox index locked.
+ *
+ *  Parameters: username: Name of the user the messages were removed
+ *                        from.
+ *              numbers: Numbers of the messages in the mailbox.
+ *              count: Number of messages.
+ *
+ *  Returns: zero if the change was recorded (or the journal is
+ *           disabled), or -1 otherwise.
+ */
+int journal_expunge(const char *username, const uint32_t *numbers, unsigned int count) {
+
+  if (!journal_enabled() || !count) return 0;
+  if (lock_journal() < 0) return -1;
+
+  struct journal_expunge_data data = { count, 0 };
+  struct iovec iov[3] = {
+    { &data, sizeof(data) },
+    { (void *) numbers, count * sizeof(uint32_t) },
+    { (void *) username, strlen(username) },
+  };
+  uint64_t lsn = append_record(JOURNAL_EXPUNGE, 0, iov, 3, -1, 0, 0);
+  unlock_journal();
+  return lsn == JOURNAL_NO_LSN ? -1 : 0;
+}
+
+/** Opens a journal to read the changes it records, in order.
+ *
+ *  Parameters: directory: Journal directory (as in mail_journal).
+ *              lsn: Position of the first change to be read, as
+ *                   returned by journal_position, or 0 to start with
+ *                   the oldest change still in the journal.
+ *
+ *  Returns: A reader, or NULL if the journal cannot be opened, or if
+ *           the position was removed from the journal (with errno set
+ *           to ERANGE).
+ */
+journal_reader_t journal_open_reader(const char *directory, uint64_t lsn) {
+
+  int dir_fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd < 0) return NULL;
+
+  uint64_t *bases;
+  int count = list_segments(dir_fd, &bases);
+  if (count < 0 || (count > 0 && lsn && lsn < bases[0])) {
+    free(bases);
+    close(dir_fd);
+    errno = count < 0 ? errno : ERANGE;
+    return NULL;
+  }
+
+  // Before the journal has any segments, the reader waits for the
+  // first one
+  int pos = 0;
+  if (!lsn && count > 0) lsn = bases[0];
+  while (pos + 1 < count && bases[pos + 1] <= lsn)
+    pos++;
+  uint64_t base = count > 0 ? bases[pos] : lsn;
+  free(bases);
+
+  struct journal_reader *reader = calloc(1, sizeof(struct journal_reader));
+  if (!reader) {
+    close(dir_fd);
+    return NULL;
+  }
+  reader->dir_fd = dir_fd;
+  reader->segment_fd = -1;
+  reader->segment_base = base;
+  reader->offset = lsn - base;
+  return reader;
+}
+
+/** Internal function that opens the segment a reader is in, if it
+ *  exists yet.
+ */
+static int open_reader_segment(struct journal_reader *reader) {
+  char name[32];
+  segment_name(name, reader->segment_base);
+  reader->segment_fd = openat(reader->dir_fd, name, O_RDONLY | O_CLOEXEC);
+  return reader->segment_fd;
+}
+
+/** Reads the next change recorded in a journal. Changes still being
+ *  written are not read until they are complete.
+ *
+ *  Parameters: reader: Journal reader.
+ *              entry: Set to the change. Its pointers are valid until
+ *                     the next call.
+ *
+ *  Returns: 1 if a change was read, 0 if there are no more changes
+ *           yet, or -1 if the journal cannot be read or is damaged
+ *           (with errno set to EBADMSG).
+ */
+int journal_read(journal_reader_t reader, struct journal_entry *entry) {
+
+  struct stat segment_stat;
+  struct journal_record record;
+  while (1) {
+    if (reader->segment_fd < 0 && open_reader_segment(reader) < 0)
+      return errno == ENOENT ? 0 : -1;
+    if (fstat(reader->segment_fd, &segment_stat) < 0)
+      return -1;
+    if (reader->offset + sizeof(record) <= segment_stat.st_size)
+      break;
+
+    // The segment is complete once the next one exists
+    char name[32];
+    segment_name(name, reader->segment_base + segment_stat.st_size);
+    if (reader->offset != segment_stat.st_size || faccessat(reader->dir_fd, name, F_OK, 0) < 0)
+      return 0;
+    close(reader->segment_fd);
+    reader->segment_fd = -1;
+    reader->segment_base += segment_stat.st_size;
+    reader->offset = 0;
+  }
+
+  uint64_t lsn = reader->segment_base + reader->offset;
+  if (pread(reader->segment_fd, &record, sizeof(record), reader->offset) != sizeof(record))
+    return -1;
+  if (record.magic != JOURNAL_MAGIC || record.lsn != lsn ||
+      (record.type != JOURNAL_MESSAGE && record.length > MAX_RECORD_DATA)) {
+    errno = EBADMSG;
+    return -1;
+  }
+  if (reader->offset + sizeof(record) + record.length > segment_stat.st_size)
+    return 0;
+
+  // The contents of messages are only checked here; other records are
+  // read whole
+  uint32_t crc = 0;
+  off_t data_offset = reader->offset + sizeof(record);
+  if (record.type == JOURNAL_MESSAGE) {
+    char buf[COPY_BUFFER_SIZE];
+    for (size_t done = 0; done < record.length; ) {
+      size_t chunk = record.length - done < sizeof(buf) ? record.length - done : sizeof(buf);
+      if (pread(reader->segment_fd, buf, chunk, data_offset + done) != chunk)
+        return -1;
+      crc = crc32c(crc, buf, chunk);
+      done += chunk;
+    }
+  } else {
+    if (record.length + 1 > reader->buffer_size) {
+      char *buffer = realloc(reader->buffer, record.length + 1);
+      if (!buffer) return -1;
+      reader->buffer = buffer;
+      reader->buffer_size = record.length + 1;
+    }
+    if (pread(reader->segment_fd, reader->buffer, record.length, data_offset) != record.length)
+      return -1;
+    crc = crc32c(crc, reader->buffer, record.length);
+  }
+  if (record_crc(&record, crc) != record.crc) {
+    errno = EBADMSG;
+    return -1;
+  }
+
+  memset(entry, 0, sizeof(*entry));
+  entry->type = record.type;
+  entry->lsn = lsn;
+  entry->time_ns = record.time_ns;
+  const char *username = NULL;
+  size_t username_length = 0;
+  if (record.type == JOURNAL_MESSAGE) {
+    entry->size = record.length;
+  } else if (record.type == JOURNAL_DELIVER && record.length >= sizeof(struct journal_deliver_data)) {
+    struct journal_deliver_data data;
+    memcpy(&data, reader->buffer, sizeof(data));
+    entry->message_lsn = data.message_lsn;
+    entry->size = data.size;
+    entry->number = data.number;
+    username = reader->buffer + sizeof(data);
+    username_length = record.length - sizeof(data);
+  } else if (record.type == JOURNAL_EXPUNGE && record.length >= sizeof(struct journal_expunge_data)) {
+    struct journal_expunge_data data;
+    memcpy(&data, reader->buffer, sizeof(data));
+    size_t numbers_length = (size_t) data.count * sizeof(uint32_t);
+    if (numbers_length > record.length - sizeof(data)) {
+      errno = EBADMSG;
+      return -1;
+    }
+    entry->numbers = (const uint32_t *) (reader->buffer + sizeof(data));
+    entry->count = data.count;
+    username = reader->buffer + sizeof(data) + numbers_length;
+    username_length = record.length - sizeof(data) - numbers_length;
+  } else {
+    errno = EBADMSG;
+    return -1;
+  }
+  if (username) {
+    if (username_length > MAX_USERNAME_SIZE) {
+      errno = EBADMSG;
+      return -1;
+    }
+    memcpy(entry->username, username, username_length);
+    entry->username[username_length] = 0;
+  }
+
+  reader->offset += sizeof(record) + record.length;
+  return 1;
+}
+
+/** Copies the contents of a message recorded in a journal to a file.
+ *  The message must be in the segment of the last change read, which
+ *  is always the case for the message of a DELIVER record.
+ *
+ *  Parameters: reader: Journal reader.
+ *              lsn: Position of the MESSAGE record.
+ *              fd: File the contents are written to, from its start.
+ *
+ *  Returns: zero if successful, or -1 otherwise.
+ */
+int journal_copy_message(journal_reader_t reader, uint64_t lsn, int fd) {
+
+  struct journal_record record;
+  if (reader->segment_fd < 0 || lsn < reader->segment_base ||
+      lsn >= reader->segment_base + reader->offset ||
+      pread(reader->segment_fd, &record, sizeof(record), lsn - reader->segment_base) != sizeof(record) ||
+      record.magic != JOURNAL_MAGIC || record.lsn != lsn || record.type != JOURNAL_MESSAGE) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (ftruncate(fd, 0) < 0) return -1;
+  return copy_range(reader->segment_fd, lsn - reader->segment_base + sizeof(record), fd, 0,
+                    record.length);
+}
+
+/** Returns the position of the next change to be read from a journal,
+ *  to open it again later from there.
+ */
+uint64_t journal_position(journal_reader_t reader) {
+  return reader->segment_base + reader->offset;
+}
+
+/** Returns the position at the end of a journal (i.e., of the next
+ *  change to be recorded), or 0 if the journal cannot be read.
+ */
+uint64_t journal_end(const char *directory) {
+
+  int dir_fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd < 0) return 0;
+  uint64_t *bases, end = 0;
+  int count = list_segments(dir_fd, &bases);
+  if (count > 0) {
+    char name[32];
+    struct stat segment_stat;
+    segment_name(name, bases[count - 1]);
+    if (fstatat(dir_fd, name, &segment_stat, 0) == 0)
+      end = bases[count - 1] + segment_stat.st_size;
+  }
+  free(bases);
+  close(dir_fd);
+  return end;
+}
+
+/** Removes the segments of a journal that only hold changes before a
+ *  given position. As DELIVER records are always in the same segment
+ *  as the contents they refer to, nothing needed to replay the
+ *  journal from that position is removed. Segments are never removed
+ *  by the servers, as only the readers know what was replayed.
+ *
+ *  Parameters: directory: Journal directory.
+ *              lsn: Position (e.g., as returned by journal_position).
+ *
+ *  Returns: number of segments removed, or -1 if the journal cannot
+ *           be read.
+ */
+int journal_trim(const char *directory, uint64_t lsn) {
+
+  int dir_fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd < 0) return -1;
+  uint64_t *bases;
+  int count = list_segments(dir_fd, &bases), removed = 0;
+  for (int i = 0; i + 1 < count && bases[i + 1] <= lsn; i++) {
+    char name[32];
+    segment_name(name, bases[i]);
+    if (unlinkat(dir_fd, name, 0) == 0)
+      removed++;
+  }
+  free(bases);
+  close(dir_fd);
+  return count < 0 ? -1 : removed;
+}
+
+/** Closes a journal reader.
+ */
+void journal_close_reader(journal_reader_t reader) {
+  if (!reader) return;
+  if (reader->segment_fd >= 0) close(reader->segment_fd);
+  close(reader->dir_fd);
+  free(reader->buffer);
+  free(reader);
+}
@@ -0,0 +1,60 @@
+/* journal.h
+ * Ordered, checksummed journal of the changes made to the mailboxes,
+ * used to replicate the mail store.
+ */
+
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include "mailuser.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef enum {
+  JOURNAL_MESSAGE = 1,  // contents of a message delivered to mailboxes
+  JOURNAL_DELIVER,      // a message added to a mailbox
+  JOURNAL_EXPUNGE,      // messages removed from a mailbox
+} journal_type_t;
+
+// A message being delivered, written to the journal once for all its
+// recipients (see journal_begin_message)
+struct journal_message {
+  int fd;
+  size_t size;
+  uint32_t crc;         // checksum of the contents
+  uint64_t lsn;         // position of its record, or JOURNAL_NO_LSN
+};
+
+#define JOURNAL_NO_LSN UINT64_MAX
+
+// A change read from the journal
+struct journal_entry {
+  journal_type_t type;
+  uint64_t lsn;         // position of the change in the journal
+  uint64_t time_ns;     // when the change was made (CLOCK_REALTIME)
+  char username[MAX_USERNAME_SIZE + 1];
+  unsigned int number;  // JOURNAL_DELIVER: number of the message
+  size_t size;          // JOURNAL_DELIVER and JOURNAL_MESSAGE: size
+  uint64_t message_lsn; // JOURNAL_DELIVER: position of the contents
+  const uint32_t *numbers; // JOURNAL_EXPUNGE: numbers of the messages
+  unsigned int count;   // JOURNAL_EXPUNGE: number of messages
+};
+
+typedef struct journal_reader *journal_reader_t;
+
+int journal_enabled(void);
+void journal_begin_message(struct journal_message *message, const char *basefile, size_t size);
+void journal_end_message(struct journal_message *message);
+int journal_deliver(struct journal_message *message, const char *username, unsigned int number);
+int journal_expunge(const char *username, const uint32_t *numbers, unsigned int count);
+
+journal_reader_t journal_open_reader(const char *directory, uint64_t lsn);
+int journal_read(journal_reader_t reader, struct journal_entry *entry);
+int journal_copy_message(journal_reader_t reader, uint64_t lsn, int fd);
+uint64_t journal_position(journal_reader_t reader);
+uint64_t journal_end(const char *directory);
+int journal_trim(const char *directory, uint64_t lsn);
+void journal_close_reader(journal_reader_t reader);
+
+#endif
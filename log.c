@@ -0,0 +1,409 @@
+/* log.c
+ * Asynchronous, buffered logging for the mail servers.
+ *
+ * Messages are not written by the code that logs them. Each process
+ * keeps a ring of pending messages, and a writer thread in the same
+ * process drains the ring and writes the messages to the log file (or
+ * standard error) in large batches. Logging a message only formats it
+ * into a free entry of the ring, so a slow log destination never
+ * delays accepting connections or answering clients. If the ring is
+ * full, the message is dropped, and the writer reports how many
+ * messages were dropped.
+ *
+ * The ring accepts messages from several threads without locks: a
+ * thread claims an entry by advancing the head of the ring, and
+ * marks the entry as ready by updating its sequence number once the
+ * message is in place. The writer thread only sleeps when the ring is
+ * empty, and is woken up by the next message.
+ *
+ * Since threads do not survive fork, the ring is emptied in every new
+ * process (messages pending in the parent are written by the parent),
+ * and a new writer thread is started by the first message it logs.
+ * Pending messages are written when the process exits normally.
+ *
+ * Errors and warnings logged repeatedly from the same place are rate
+ * limited; the next message that gets through reports how many
+ * similar messages were suppressed.
+ */
+
+#include "log.h"
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define LOG_RING_SIZE 256 // must be a power of two
+#define LOG_LINE_MAX 240
+#define LOG_WRITE_BUFFER 16384
+#define RATE_LIMIT_SLOTS 32
+#define RATE_LIMIT_PER_SECOND 10
+#define WRITER_STACK_SIZE (256 * 1024)
+
+struct log_entry {
+  struct timespec time;
+  log_level_t level;
+  unsigned long session;
+  char text[LOG_LINE_MAX];
+};
+
+struct rate_limit {
+  const char *format;
+  time_t second;
+  unsigned int count;
+  unsigned int suppressed;
+};
+
+static const char *const level_names[] = { "error", "warning", "info", "debug" };
+
+static const char *server = "";
+static log_level_t max_level = LOG_LEVEL_INFO;
+static int log_fd = STDERR_FILENO;
+static unsigned long session_id = 0;
+static pid_t pid;
+static pthread_once_t setup_once = PTHREAD_ONCE_INIT;
+
+// Sequence numbers are kept apart from the entries, so emptying the
+// ring after fork only touches a small part of it
+static struct log_entry entries[LOG_RING_SIZE];
+static uint64_t sequences[LOG_RING_SIZE];
+static uint64_t head = 0, tail = 0;
+static uint64_t dropped = 0, reported_dropped = 0;
+
+static uint32_t wakeup = 0;
+static int writer_waiting = 0;
+static int writer_started = 0;
+static int stopping = 0;
+static pthread_t writer;
+
+static struct rate_limit rate_limits[RATE_LIMIT_SLOTS];
+
+/** Internal function that empties the ring.
+ */
+static void reset_ring(void) {
+  for (int i = 0; i < LOG_RING_SIZE; i++)
+    sequences[i] = i;
+  head = tail = 0;
+  dropped = reported_dropped = 0;
+  pid = getpid();
+}
+
+/** Internal function called in the child process after fork. The
+ *  parent's writer thread does not exist in the child, and messages
+ *  still pending are written by the parent.
+ */
+static void after_fork(void) {
+  reset_ring();
+  writer_started = 0;
+  writer_waiting = 0;
+  stopping = 0;
+  memset(rate_limits, 0, sizeof(rate_limits));
+}
+
+/** Internal function that prepares the ring of the first process
+ *  that logs, and makes sure it is reset in new processes and written
+ *  before processes exit.
+ */
+static void setup(void) {
+  reset_ring();
+  pthread_atfork(NULL, NULL, after_fork);
+  atexit(log_flush);
+}
+
+/** Internal function that appends one message to the write buffer,
+ *  with its time (in UTC), process and session. The date is computed
+ *  here rather than with gmtime_r, which takes a lock that may be
+ *  held by the writer thread of the parent when a process is forked.
+ */
+static size_t format_entry(char *out, size_t size, struct log_entry *entry) {
+
+  long seconds = entry->time.tv_sec % 86400;
+  long days = entry->time.tv_sec / 86400 + 719468; // days since 0000-03-01
+  long era = days / 146097, day_of_era = days % 146097;
+  long year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+  long day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+  long month = (5 * day_of_year + 2) / 153;
+  long day = day_of_year - (153 * month + 2) / 5 + 1;
+  month = month < 10 ? month + 3 : month - 9;
+  long year = year_of_era + era * 400 + (month <= 2);
+
+  char session[32] = "";
+  if (entry->session)
+    snprintf(session, sizeof(session), " s%lu", entry->session);
+
+  int len = snprintf(out, size, "%04ld-%02ld-%02ldT%02ld:%02ld:%02ld.%03ldZ %s[%d] %s%s: %s\n",
+                     year, month, day, seconds / 3600, seconds / 60 % 60, seconds % 60,
+                     entry->time.tv_nsec / 1000000, server, (int) pid,
+                     level_names[entry->level], session, entry->text);
+  return len < size ? len : size - 1;
+}
+
+/** Internal function that writes a whole buffer to the log.
+ */
+static void write_log(const char *buf, size_t size) {
+  while (size > 0) {
+    ssize_t rv = write(log_fd, buf, size);
+    if (rv <= 0) return;
+    buf += rv;
+    size -= rv;
+  }
+}
+
+/** Internal function that writes all messages currently in the ring.
+ */
+static void drain(void) {
+
+  static char buf[LOG_WRITE_BUFFER];
+  size_t used = 0;
+
+  while (1) {
+    uint64_t pos = tail;
+    struct log_entry *entry = &entries[pos & (LOG_RING_SIZE - 1)];
+    if (__atomic_load_n(&sequences[pos & (LOG_RING_SIZE - 1)], __ATOMIC_ACQUIRE) != pos + 1)
+      break;
+
+    if (used + LOG_LINE_MAX + 128 > sizeof(buf)) {
+      write_log(buf, used);
+      used = 0;
+    }
+    used += format_entry(buf + used, sizeof(buf) - used, entry);
+
+    __atomic_store_n(&sequences[pos & (LOG_RING_SIZE - 1)], pos + LOG_RING_SIZE, __ATOMIC_RELEASE);
+    tail = pos + 1;
+  }
+
+  uint64_t now_dropped = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+  if (now_dropped != reported_dropped) {
+    struct log_entry entry = { .level = LOG_LEVEL_WARNING, .session = session_id };
+    clock_gettime(CLOCK_REALTIME, &entry.time);
+    snprintf(entry.text, sizeof(entry.text), "log: %lu message(s) dropped, log buffer full",
+             (unsigned long) (now_dropped - reported_dropped));
+    used += format_entry(buf + used, sizeof(buf) - used, &entry);
+    reported_dropped = now_dropped;
+  }
+
+  if (used)
+    write_log(buf, used);
+}
+
+/** Internal function that checks if the ring has a message ready to
+ *  be written.
+ */
+static int ring_ready(void) {
+  return __atomic_load_n(&sequences[tail & (LOG_RING_SIZE - 1)], __ATOMIC_ACQUIRE) == tail + 1;
+}
+
+/** Internal function run by the writer thread.
+ */
+static void *writer_thread(void *arg) {
+
+  struct timespec timeout = { 1, 0 };
+
+  while (1) {
+    drain();
+    if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE) && !ring_ready())
+      return NULL;
+
+    // A message logged after wakeup is read makes the futex call
+    // return immediately, so no wakeup is missed
+    uint32_t seen = __atomic_load_n(&wakeup, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&writer_waiting, 1, __ATOMIC_SEQ_CST);
+    if (!ring_ready() && !__atomic_load_n(&stopping, __ATOMIC_SEQ_CST))
+      syscall(SYS_futex, &wakeup, FUTEX_WAIT_PRIVATE, seen, &timeout, NULL, 0);
+    __atomic_store_n(&writer_waiting, 0, __ATOMIC_RELAXED);
+  }
+}
+
+/** Internal function that wakes up the writer thread if it is
+ *  waiting for messages.
+ */
+static void wake_writer(void) {
+  __atomic_fetch_add(&wakeup, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&writer_waiting, __ATOMIC_SEQ_CST))
+    syscall(SYS_futex, &wakeup, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/** Internal function that starts the writer thread of the calling
+ *  process, if it is not running yet.
+ */
+static void start_writer(void) {
+
+  int expected = 0;
+  if (!__atomic_compare_exchange_n(&writer_started, &expected, 1, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    return;
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, WRITER_STACK_SIZE);
+  if (pthread_create(&writer, &attr, writer_thread, NULL) != 0)
+    __atomic_store_n(&writer_started, 0, __ATOMIC_RELEASE);
+  pthread_attr_destroy(&attr);
+}
+
+/** Internal function that applies the rate limit of the place a
+ *  message is logged from (identified by its format string).
+ *
+ *  Returns: -1 if the message should be suppressed, otherwise the
+ *           number of similar messages suppressed before it.
+ */
+static int rate_limit(const char *format, time_t now) {
+
+  struct rate_limit *limit = &rate_limits[((uintptr_t) format >> 3) % RATE_LIMIT_SLOTS];
+  if (limit->format != format) {
+    limit->format = format;
+    limit->second = now;
+    limit->count = 0;
+    limit->suppressed = 0;
+  }
+  if (limit->second != now) {
+    limit->second = now;
+    limit->count = 0;
+  }
+  if (++limit->count > RATE_LIMIT_PER_SECOND) {
+    limit->suppressed++;
+    return -1;
+  }
+  int suppressed = limit->suppressed;
+  limit->suppressed = 0;
+  return suppressed;
+}
+
+/** Logs a message. The message is only formatted here and written
+ *  later by the writer thread, so this function never blocks; if too
+ *  many messages are pending, the message is dropped. Errors and
+ *  warnings logged more than 10 times per second from the same place
+ *  are suppressed.
+ *
+ *  Parameters: level: Severity of the message. Messages less severe
+ *                     than the log_level setting are ignored.
+ *              format: printf-style format of the message, without a
+ *                      trailing line break.
+ *              additional parameters based on string format.
+ */
+void log_message(log_level_t level, const char *format, ...) {
+
+  if (level > max_level) return;
+  pthread_once(&setup_once, setup);
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  int suppressed = 0;
+  if (level <= LOG_LEVEL_WARNING && (suppressed = rate_limit(format, now.tv_sec)) < 0)
+    return;
+
+  // Claim the entry at the head of the ring, unless the writer has not
+  // freed it yet (i.e., the ring is full)
+  uint64_t pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+  while (1) {
+    int64_t diff = __atomic_load_n(&sequences[pos & (LOG_RING_SIZE - 1)], __ATOMIC_ACQUIRE) - pos;
+    if (diff < 0) {
+      __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+      return;
+    }
+    if (diff == 0 && __atomic_compare_exchange_n(&head, &pos, pos + 1, 1,
+                                                 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      break;
+    if (diff > 0)
+      pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+  }
+
+  struct log_entry *entry = &entries[pos & (LOG_RING_SIZE - 1)];
+  entry->time = now;
+  entry->level = level;
+  entry->session = session_id;
+
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(entry->text, sizeof(entry->text), format, args);
+  va_end(args);
+  if (suppressed && len >= 0 && len < sizeof(entry->text))
+    snprintf(entry->text + len, sizeof(entry->text) - len,
+             " (%d similar message(s) suppressed)", suppressed);
+
+  __atomic_store_n(&sequences[pos & (LOG_RING_SIZE - 1)], pos + 1, __ATOMIC_RELEASE);
+
+  if (!__atomic_load_n(&writer_started, __ATOMIC_ACQUIRE))
+    start_writer();
+  wake_writer();
+}
+
+/** Sets the session ID of the calling process, included in every
+ *  message it logs from then on. Called at the start of each client
+ *  session.
+ *
+ *  Parameters: id: Session ID (unique among the sessions of a server).
+ */
+void log_session_start(unsigned long id) {
+  session_id = id;
+}
+
+/** Waits until all pending messages of the calling process are
+ *  written, and stops its writer thread. Called automatically when
+ *  the process exits.
+ */
+void log_flush(void) {
+  if (!__atomic_load_n(&writer_started, __ATOMIC_ACQUIRE)) return;
+  __atomic_store_n(&stopping, 1, __ATOMIC_SEQ_CST);
+  wake_writer();
+  pthread_join(writer, NULL);
+  writer_started = 0;
+  stopping = 0;
+}
+
+/** Internal function that applies the log_level and log_file
+ *  settings. An open log file is replaced in place, so the writer
+ *  thread never sees a closed descriptor.
+ */
+static void configure(void) {
+
+  const char *level = config_get_string("log_level", "info");
+  for (int i = 0; i < sizeof(level_names) / sizeof(level_names[0]); i++)
+    if (!strcasecmp(level, level_names[i]))
+      max_level = i;
+
+  const char *file = config_get_string("log_file", NULL);
+  int fd = file ? open(file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644) : STDERR_FILENO;
+  if (fd < 0) {
+    perror(file);
+  } else if (log_fd == STDERR_FILENO) {
+    log_fd = fd;
+  } else if (fd != log_fd) {
+    dup2(fd, log_fd);
+    fcntl(log_fd, F_SETFD, FD_CLOEXEC);
+    if (fd != STDERR_FILENO)
+      close(fd);
+  }
+}
+
+/** Sets up logging for a server, based on the log_level setting
+ *  (error, warning, info or debug) and the log_file setting (standard
+ *  error if not set). Must be called before any processes are
+ *  created.
+ *
+ *  Parameters: server_name: Name of the server, included in every
+ *                           message.
+ */
+void log_init(const char *server_name) {
+
+  server = server_name;
+  configure();
+  pthread_once(&setup_once, setup);
+}
+
+/** Applies the log settings again after the configuration is
+ *  reloaded. The log file is reopened, so it can be rotated by
+ *  renaming it before the reload.
+ */
+void log_reload(void) {
+  configure();
+}
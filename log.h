@@ -0,0 +1,30 @@
+/* log.h
+ * Asynchronous, buffered logging for the mail servers.
+ */
+
+#ifndef _LOG_H_
+#define _LOG_H_
+
+typedef enum {
+  LOG_LEVEL_ERROR,
+  LOG_LEVEL_WARNING,
+  LOG_LEVEL_INFO,
+  LOG_LEVEL_DEBUG
+} log_level_t;
+
+void log_init(const char *server_name);
+void log_reload(void);
+void log_session_start(unsigned long id);
+void log_flush(void);
+
+// The __attribute__ in this function allows the compiler to provided
+// useful warnings when compiling the code.
+void log_message(log_level_t level, const char *format, ...)
+  __attribute__ ((format(printf, 2, 3)));
+
+#define log_error(...) log_message(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warning(...) log_message(LOG_LEVEL_WARNING, __VA_ARGS__)
+#define log_info(...) log_message(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) log_message(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+#endif
@@ -0,0 +1,298 @@
+/* mailctl.c
+ * Lists and controls the sessions in progress in a running server,
+ * through its local admin interface (see admin.c).
+ *
+ * Usage: mailctl [-n server] [-a address] [-s field] [-r] [command]
+ *   -n server     server whose admin address is read from mail.conf
+ *                 (mysmtpd, mypopd or maild; by default, the only one
+ *                 with an admin address)
+ *   -a address    admin address to connect to, instead of the one in
+ *                 mail.conf (port, host:port or unix:/path)
+ *   -s field      sort sessions by id, pid, age, time (of the current
+ *                 or last command), idle, in, out or commands
+ *   -r            sort in reverse order
+ *
+ * Commands:
+ *   sessions      lists the sessions in progress (the default); a
+ *                 command marked with * is still being handled
+ *   kill <id>...  terminates the sessions with the given IDs
+ *   metrics       prints the server metrics
+ *
+ * Must be run in the directory the servers run in (where mail.conf
+ * is), unless the address is given with -a.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MAX_FIELDS 13
+
+static const char *server_names[] = { "mysmtpd", "mypopd", "maild" };
+
+// A session, as listed by the SESSIONS command
+struct session {
+  char *fields[MAX_FIELDS];
+};
+
+// Fields of a session, in the order they are listed
+enum { ID, PID, PROTOCOL, PEER, STATE, COMMAND, BUSY, AGE, TIME, IDLE, BYTES_IN, BYTES_OUT, COMMANDS };
+
+static const struct {
+  const char *name;
+  int field;
+} sort_fields[] = {
+  { "id", ID }, { "pid", PID }, { "age", AGE }, { "time", TIME }, { "idle", IDLE },
+  { "in", BYTES_IN }, { "out", BYTES_OUT }, { "commands", COMMANDS },
+};
+
+static int sort_field = ID;
+static int sort_order = 1;
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-n server] [-a address] [-s field] [-r] [sessions | kill <id>... | metrics]\n",
+          name);
+  exit(2);
+}
+
+/** Internal function that finds the admin address of a server in the
+ *  configuration. Without a server name, the only server with an
+ *  admin address is used.
+ */
+static const char *find_admin_address(const char *server_name) {
+
+  char key[128];
+  const char *address = NULL;
+
+  config_load(CONFIG_FILE_NAME);
+  if (server_name) {
+    snprintf(key, sizeof(key), "%s_admin_listen", server_name);
+    address = config_get_string(key, NULL);
+    if (!address)
+      fprintf(stderr, "mailctl: %s is not set in %s\n", key, CONFIG_FILE_NAME);
+    return address;
+  }
+
+  for (int i = 0; i < sizeof(server_names) / sizeof(server_names[0]); i++) {
+    snprintf(key, sizeof(key), "%s_admin_listen", server_names[i]);
+    const char *found = config_get_string(key, NULL);
+    if (found && address) {
+      fprintf(stderr, "mailctl: several servers have an admin address, choose one with -n\n");
+      return NULL;
+    }
+    if (found)
+      address = found;
+  }
+  if (!address)
+    fprintf(stderr, "mailctl: no admin address is set in %s\n", CONFIG_FILE_NAME);
+  return address;
+}
+
+/** Internal function that connects to an admin address, in any of the
+ *  forms accepted by server_listen. A port alone connects to the
+ *  local host.
+ */
+static int connect_admin(const char *address) {
+
+  int fd;
+  if (!strncmp(address, "unix:", 5)) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", address + 5);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+      return -1;
+    if (connect(fd, (struct sockaddr *) &addr, sizeof addr) < 0) {
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  char host[256] = "localhost";
+  const char *port = address;
+  const char *colon = strrchr(address, ':');
+  if (colon && colon - address < sizeof(host)) {
+    const char *begin = address, *end = colon;
+    if (*begin == '[' && end[-1] == ']') {
+      begin++;
+      end--;
+    }
+    memcpy(host, begin, end - begin);
+    host[end - begin] = 0;
+    port = colon + 1;
+  }
+
+  struct addrinfo hints, *servinfo, *p;
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &servinfo) != 0)
+    return -1;
+
+  fd = -1;
+  for (p = servinfo; p; p = p->ai_next) {
+    if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+      continue;
+    if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+      break;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(servinfo);
+  return fd;
+}
+
+/** Internal function that sends a command to the admin interface and
+ *  returns its whole reply as a string (to be freed by the caller),
+ *  or NULL if the server cannot be reached.
+ */
+static char *send_command(const char *address, const char *command) {
+
+  int fd = connect_admin(address);
+  if (fd < 0) {
+    fprintf(stderr, "mailctl: cannot connect to %s\n", address);
+    return NULL;
+  }
+
+  size_t len = strlen(command);
+  if (write(fd, command, len) != len || write(fd, "\n", 1) != 1) {
+    fprintf(stderr, "mailctl: cannot send command to %s\n", address);
+    close(fd);
+    return NULL;
+  }
+
+  char *reply = NULL, buf[4096];
+  size_t size = 0;
+  FILE *out = open_memstream(&reply, &size);
+  ssize_t rv;
+  while ((rv = read(fd, buf, sizeof(buf))) > 0)
+    fwrite(buf, 1, rv, out);
+  fclose(out);
+  close(fd);
+  return reply;
+}
+
+/** Internal function that compares two sessions by the sort field.
+ */
+static int compare_sessions(const void *a, const void *b) {
+
+  const struct session *s1 = a, *s2 = b;
+  double v1 = strtod(s1->fields[sort_field], NULL);
+  double v2 = strtod(s2->fields[sort_field], NULL);
+  return v1 < v2 ? -sort_order : v1 > v2 ? sort_order : 0;
+}
+
+/** Internal function that lists the sessions in progress.
+ */
+static int list_sessions(const char *address) {
+
+  char *reply = send_command(address, "SESSIONS");
+  if (!reply) return 2;
+  if (!strncmp(reply, "ERR", 3)) {
+    fprintf(stderr, "mailctl: %s", reply);
+    free(reply);
+    return 2;
+  }
+
+  struct session *sessions = NULL;
+  int count = 0, size = 0;
+  char *rest = reply, *line;
+  while ((line = strsep(&rest, "\n")) != NULL) {
+    struct session session;
+    int n = 0;
+    char *field;
+    while (n < MAX_FIELDS && (field = strsep(&line, "\t")) != NULL)
+      session.fields[n++] = field;
+    if (n < MAX_FIELDS)
+      continue;
+    if (count == size) {
+      size = size ? size * 2 : 64;
+      sessions = realloc(sessions, size * sizeof(struct session));
+      if (!sessions) return 2;
+    }
+    sessions[count++] = session;
+  }
+  qsort(sessions, count, sizeof(struct session), compare_sessions);
+
+  printf("%-8s %-8s %-5s %-24s %-12s %-10s %9s %9s %9s %12s %12s %8s\n", "ID", "PID", "PROTO", "PEER",
+         "STATE", "COMMAND", "AGE", "TIME", "IDLE", "IN", "OUT", "COMMANDS");
+  for (int i = 0; i < count; i++) {
+    char **f = sessions[i].fields;
+    char command[32];
+    snprintf(command, sizeof(command), "%s%s", f[COMMAND], strcmp(f[BUSY], "0") ? "*" : "");
+    printf("%-8s %-8s %-5s %-24s %-12s %-10s %9s %9s %9s %12s %12s %8s\n", f[ID], f[PID], f[PROTOCOL],
+           f[PEER], f[STATE], command, f[AGE], f[TIME], f[IDLE], f[BYTES_IN], f[BYTES_OUT], f[COMMANDS]);
+  }
+
+  free(sessions);
+  free(reply);
+  return 0;
+}
+
+/** Internal function that terminates a session.
+ */
+static int kill_session(const char *address, const char *id) {
+
+  char command[64];
+  snprintf(command, sizeof(command), "KILL %s", id);
+  char *reply = send_command(address, command);
+  if (!reply) return 2;
+
+  int rv = strncmp(reply, "OK", 2) ? 1 : 0;
+  if (rv)
+    fprintf(stderr, "mailctl: session %s: %s", id, reply);
+  free(reply);
+  return rv;
+}
+
+int main(int argc, char *argv[]) {
+
+  const char *server_name = NULL, *address = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:a:s:r")) != -1) {
+    switch (opt) {
+    case 'n': server_name = optarg; break;
+    case 'a': address = optarg; break;
+    case 's': {
+      int i, n = sizeof(sort_fields) / sizeof(sort_fields[0]);
+      for (i = 0; i < n && strcasecmp(optarg, sort_fields[i].name); i++);
+      if (i == n) usage(argv[0]);
+      sort_field = sort_fields[i].field;
+      break;
+    }
+    case 'r': sort_order = -1; break;
+    default: usage(argv[0]);
+    }
+  }
+
+  const char *command = optind < argc ? argv[optind] : "sessions";
+  if (!address && !(address = find_admin_address(server_name)))
+    return 2;
+
+  if (!strcmp(command, "sessions") && optind + 1 >= argc) {
+    return list_sessions(address);
+  } else if (!strcmp(command, "kill") && optind + 1 < argc) {
+    int rv = 0;
+    for (int i = optind + 1; i < argc; i++) {
+      int result = kill_session(address, argv[i]);
+      if (result > rv) rv = result;
+    }
+    return rv;
+  } else if (!strcmp(command, "metrics") && optind + 1 >= argc) {
+    char *reply = send_command(address, "METRICS");
+    if (!reply) return 2;
+    fputs(reply, stdout);
+    free(reply);
+    return 0;
+  }
+  usage(argv[0]);
+  return 2;
+}
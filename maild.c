@@ -0,0 +1,58 @@
+#include "smtp.h"
+#include "pop3.h"
+#include "mailuser.h"
+#include "server.h"
+#include "config.h"
+#include "spool.h"
+#include "metrics.h"
+#include "flightrec.h"
+#include "admin.h"
+#include "log.h"
+#include "tls.h"
+#include "ratelimit.h"
+#include "capture.h"
+#include "sessiontab.h"
+#include "expunge.h"
+
+#include <stdio.h>
+
+// A single server for both SMTP and POP3. Sessions of both protocols
+// are forked from the same process, so they share the user directory,
+// the mailbox cache, the rate limit table and the metrics, and
+// messages are delivered by a single pool of queue workers.
+int main(int argc, char *argv[]) {
+
+    if (argc != 3) {
+        fprintf(stderr, "Invalid arguments. Expected: %s <smtp port> <pop3 port>\r\n", argv[0]);
+        return 1;
+    }
+
+    config_load(CONFIG_FILE_NAME);
+    log_init("maild");
+    tls_init("maild");
+    metrics_init("maild");
+    flightrec_init();
+    capture_init();
+    ratelimit_init();
+    sessiontab_init();
+    init_mail_caches();
+    protocol_init(&smtp_protocol);
+    protocol_init(&pop3_protocol);
+    protocol_init(&lmtp_protocol);
+    admin_start("maild");
+    expunge_start();
+    clean_mail_spool();
+    spool_start();
+
+    // SIGUSR2 restarts the server with the same command line, handing
+    // over all listening sockets (including LMTP's, if enabled)
+    const struct server_listener listeners[] = {
+        { argv[1], smtp_handle_client, SMTP_THROTTLE_REPLY },
+        { argv[2], pop3_handle_client, POP3_THROTTLE_REPLY },
+        { config_get_string("maild_lmtp_listen", NULL), lmtp_handle_client, SMTP_THROTTLE_REPLY },
+    };
+    server_set_upgrade_command(argv);
+    run_servers(listeners, listeners[2].address ? 3 : 2);
+
+    return 0;
+}
@@ -0,0 +1,233 @@
+/* mailfollow.c
+ * Keeps a replica of a mail store up to date, by replaying the
+ * journal of the changes made to the primary store (see journal.c,
+ * enabled on the primary with mail_journal). Another mypopd can then
+ * serve the replica, e.g., as a warm standby or to spread POP3 reads
+ * over more machines.
+ *
+ * Usage: mailfollow [-o] [-e] [-t] [-v] [-i interval] [-p file] journal
+ *   -o            replay the changes recorded so far, then exit
+ *   -e            without a saved position, start at the end of the
+ *                 journal instead of its start
+ *   -t            remove the journal segments already replayed (only
+ *                 if there is no other follower)
+ *   -v            list every change replayed
+ *   -i interval   milliseconds between checks for new changes
+ *                 (default 200)
+ *   -p file       file keeping the position replayed so far (default
+ *                 mailfollow.pos)
+ *
+ * Must be run in the directory of the replica (where its mail.conf
+ * is): mailboxes are written where its mail_store puts them, with the
+ * same message numbers as in the primary store. The position is saved
+ * whenever the follower catches up, and at least every few hundred
+ * changes; changes replayed again after a crash are harmless. A
+ * replica is started either along with the journal, or by copying
+ * the primary store while the primary is stopped, and then following
+ * with -e. Sessions on the replica should not delete messages (see
+ * pop3_read_only), as the primary does not know about them. "make
+ * replica" checks that a replica kept through crashes of mailfollow
+ * matches its primary (see bench/mailreplica.c).
+ */
+
+#include "journal.h"
+#include "mailuser.h"
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#define DEFAULT_INTERVAL 200 // milliseconds
+#define DEFAULT_POSITION_FILE "mailfollow.pos"
+#define SAVE_INTERVAL 256 // changes
+
+static int verbose = 0;
+static const char *position_file = DEFAULT_POSITION_FILE;
+static volatile sig_atomic_t stopping = 0;
+
+// Contents of the message of the last DELIVER record, kept for the
+// other recipients of the message
+static struct mail_spool_file message_file = { -1 };
+static uint64_t message_lsn = JOURNAL_NO_LSN;
+
+static void stop(int signal) {
+  stopping = 1;
+}
+
+/** Internal function that reads the saved position, if any.
+ *
+ *  Returns: 1 if a position was read, 0 otherwise.
+ */
+static int load_position(uint64_t *lsn) {
+  FILE *file = fopen(position_file, "r");
+  if (!file) return 0;
+  unsigned long long value;
+  int rv = fscanf(file, "%llu", &value) == 1;
+  fclose(file);
+  if (rv) *lsn = value;
+  return rv;
+}
+
+/** Internal function that saves the position replayed so far. The
+ *  file is replaced at once, so it is never left half written.
+ */
+static void save_position(uint64_t lsn) {
+  char temp_file[4096];
+  snprintf(temp_file, sizeof(temp_file), "%s.tmp", position_file);
+  FILE *file = fopen(temp_file, "w");
+  if (!file) return;
+  fprintf(file, "%llu\n", (unsigned long long) lsn);
+  if (fflush(file) == 0 && fsync(fileno(file)) == 0 && fclose(file) == 0)
+    rename(temp_file, position_file);
+  else
+    perror("mailfollow: cannot save position");
+}
+
+/** Internal function that replays a change.
+ *
+ *  Returns: zero if the change was replayed (or cannot ever be), or
+ *           -1 if it should be tried again later.
+ */
+static int replay_change(journal_reader_t reader, const struct journal_entry *entry) {
+
+  if (entry->type == JOURNAL_DELIVER) {
+    // Each message gets its own file, as the file is linked into the
+    // mailboxes
+    if (message_lsn != entry->message_lsn) {
+      close_mail_spool_file(&message_file);
+      message_lsn = JOURNAL_NO_LSN;
+      if (open_mail_spool_file(&message_file) < 0 ||
+          journal_copy_message(reader, entry->message_lsn, message_file.fd) < 0) {
+        fprintf(stderr, "mailfollow: cannot copy message at %llu: %s\n",
+                (unsigned long long) entry->message_lsn, strerror(errno));
+        close_mail_spool_file(&message_file);
+        return -1;
+      }
+      message_lsn = entry->message_lsn;
+    }
+    int error = restore_user_mail(message_file.path, entry->username, entry->number);
+    if (error) {
+      fprintf(stderr, "mailfollow: %s: cannot deliver message %u: %s\n", entry->username,
+              entry->number, strerror(error));
+      return is_transient_delivery_error(error) ? -1 : 0;
+    }
+    if (verbose)
+      printf("%llu: %s: delivered message %u (%zu bytes)\n", (unsigned long long) entry->lsn,
+             entry->username, entry->number, entry->size);
+  } else if (entry->type == JOURNAL_EXPUNGE) {
+    int removed = remove_user_mail(entry->username, entry->numbers, entry->count);
+    if (verbose)
+      printf("%llu: %s: removed %d of %u messages\n", (unsigned long long) entry->lsn,
+             entry->username, removed, entry->count);
+  }
+  return 0;
+}
+
+/** Internal function that sleeps for a number of milliseconds, unless
+ *  the follower is stopping.
+ */
+static void pause_ms(long ms) {
+  struct timespec wait = { ms / 1000, (ms % 1000) * 1000000 };
+  if (!stopping)
+    nanosleep(&wait, NULL);
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-o] [-e] [-t] [-v] [-i interval] [-p file] journal\n", name);
+  exit(2);
+}
+
+int main(int argc, char *argv[]) {
+
+  int opt, once = 0, from_end = 0, trim = 0;
+  long interval = DEFAULT_INTERVAL;
+  while ((opt = getopt(argc, argv, "oetvi:p:")) != -1) {
+    switch (opt) {
+    case 'o': once = 1; break;
+    case 'e': from_end = 1; break;
+    case 't': trim = 1; break;
+    case 'v': verbose = 1; break;
+    case 'i': interval = atol(optarg); break;
+    case 'p': position_file = optarg; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind + 1 != argc || interval <= 0) usage(argv[0]);
+  const char *journal = argv[optind];
+
+  config_load(CONFIG_FILE_NAME);
+  struct sigaction action = { .sa_handler = stop };
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  uint64_t position = 0;
+  if (!load_position(&position) && from_end)
+    position = journal_end(journal);
+
+  journal_reader_t reader = journal_open_reader(journal, position);
+  if (!reader) {
+    fprintf(stderr, "mailfollow: cannot open journal %s at %llu: %s\n", journal,
+            (unsigned long long) position, errno == ERANGE ? "position was removed" : strerror(errno));
+    return 2;
+  }
+
+  uint64_t saved = position;
+  unsigned long replayed = 0, unsaved = 0;
+  int rv = 0;
+  while (!stopping) {
+    struct journal_entry entry;
+    rv = journal_read(reader, &entry);
+    if (rv > 0) {
+      if (replay_change(reader, &entry) < 0) {
+        // The change is read again after a pause
+        journal_close_reader(reader);
+        pause_ms(interval);
+        if (!(reader = journal_open_reader(journal, entry.lsn))) {
+          rv = -1;
+          break;
+        }
+        continue;
+      }
+      position = journal_position(reader);
+      if (entry.type != JOURNAL_MESSAGE)
+        replayed++;
+      if (++unsaved >= SAVE_INTERVAL) {
+        save_position(position);
+        saved = position;
+        unsaved = 0;
+      }
+      continue;
+    }
+    if (rv < 0)
+      break;
+
+    // Caught up with the journal
+    if (position != saved) {
+      save_position(position);
+      saved = position;
+      unsaved = 0;
+    }
+    if (trim)
+      journal_trim(journal, position);
+    if (once)
+      break;
+    fflush(stdout);
+    pause_ms(interval);
+  }
+
+  if (rv < 0)
+    fprintf(stderr, "mailfollow: cannot read journal %s at %llu: %s\n", journal,
+            (unsigned long long) position, strerror(errno));
+  if (position != saved)
+    save_position(position);
+  close_mail_spool_file(&message_file);
+  journal_close_reader(reader);
+  if (once || verbose)
+    printf("%lu change(s) replayed, position %llu\n", replayed, (unsigned long long) position);
+  return rv < 0 ? 2 : 0;
+}
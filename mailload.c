@@ -0,0 +1,689 @@
+/* mailload.c
+ * Imports messages into mailboxes in bulk, straight into the mail
+ * store (without going through mysmtpd), e.g., to migrate mailboxes
+ * from another system or to seed a store for benchmarks.
+ *
+ * Usage: mailload [-v] [-j jobs] [-b batch] [-c directory] [-f file] [user:source...]
+ *   -v            list the outcome for every user
+ *   -j jobs       users imported in parallel (default: number of CPUs)
+ *   -b batch      messages added to a mailbox at once (default 256)
+ *   -c directory  directory keeping the progress of each user
+ *                 (default mailload.progress)
+ *   -f file       file listing the sources, one "user source" per line
+ *
+ * A source is an mbox file (starting with a "From " line), a file
+ * holding a single message, or a directory of message files (one per
+ * message, e.g., a Maildir, whose new and cur subdirectories are
+ * read). Messages are converted to the format kept in the store (CRLF
+ * line endings and dot-stuffing), and mbox "From " lines are removed
+ * (and ">From " lines unescaped). A user may have several sources,
+ * imported in the order given.
+ *
+ * Messages are added to each mailbox in batches, with a single update
+ * of the mailbox index and a single flush to disk per batch. After
+ * each batch is on disk, the position reached in every source is
+ * saved, so an interrupted import resumes where it stopped when run
+ * again with the same sources. Messages identical to one already in
+ * the mailbox, or imported since, are skipped, so the batch in flight
+ * when an import is interrupted is not imported twice. Sources should
+ * not be changed until they are imported (an mbox may only grow).
+ *
+ * Must be run in the directory the servers run in (where mail.conf
+ * is); mailboxes can be imported while the servers are running.
+ */
+
+#define _GNU_SOURCE
+#include "mailuser.h"
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define DEFAULT_BATCH 256
+#define MAX_BATCH_BYTES (32 << 20)
+#define MAX_JOBS 64
+#define DEFAULT_PROGRESS_DIRECTORY "mailload.progress"
+
+#define FNV64_OFFSET 0xcbf29ce484222325ull
+#define FNV64_PRIME 0x100000001b3ull
+
+static int verbose = 0;
+static unsigned int batch_size = DEFAULT_BATCH;
+static const char *progress_directory = DEFAULT_PROGRESS_DIRECTORY;
+
+// A source given on the command line or in the list file
+struct source_entry {
+  char *username;
+  char *path;
+  unsigned int order;
+};
+
+// Sources of a single user, imported by a single job
+struct user_import {
+  const char *username;
+  struct source_entry *sources;
+  unsigned int count;
+};
+
+static struct source_entry *entries = NULL;
+static unsigned int entry_count = 0, entry_size = 0;
+static struct user_import *imports = NULL;
+static unsigned int import_count = 0;
+static unsigned int next_import = 0;
+
+static unsigned long total_imported = 0, total_duplicates = 0, total_bytes = 0;
+static unsigned int total_users = 0, total_failed = 0;
+
+// Identities (hash and size) of the messages of a mailbox, to skip
+// duplicates, in an open-addressing table
+struct seen_table {
+  uint64_t *keys;
+  size_t count;
+  size_t size;
+};
+
+// Progress of the import of a user. Positions are byte offsets in an
+// mbox, or numbers of files in a directory.
+struct user_progress {
+  struct user_import *import;
+  mail_batch_t batch;
+  unsigned int batch_count;
+  size_t batch_bytes;
+  uint64_t *positions;     // reached by the messages written so far
+  uint64_t *committed;     // reached by the last batch committed
+  unsigned int committed_next; // mailbox number after the last batch
+  int moved;               // positions changed since the last commit
+  int unsaved;             // the last batch committed is not saved yet
+  struct seen_table seen;
+  char *buffer;            // message converted to the store format
+  size_t buffer_size;
+  unsigned long imported, duplicates, bytes;
+};
+
+/** Internal function that computes the identity of a message, from a
+ *  64-bit FNV-1a hash and its size. Zero marks free table slots.
+ */
+static uint64_t message_key(const char *data, size_t size) {
+  uint64_t hash = FNV64_OFFSET;
+  for (size_t i = 0; i < size; i++)
+    hash = (hash ^ (unsigned char) data[i]) * FNV64_PRIME;
+  hash ^= size * 0x9e3779b97f4a7c15ull;
+  return hash ? hash : 1;
+}
+
+/** Internal function that adds a message identity to a table.
+ *
+ *  Returns: zero if the identity was added, 1 if it was already in the
+ *           table, or -1 if out of memory.
+ */
+static int add_seen(struct seen_table *table, uint64_t key) {
+
+  if ((table->count + 1) * 2 > table->size) {
+    size_t size = table->size ? table->size * 2 : 1024;
+    uint64_t *keys = calloc(size, sizeof(uint64_t));
+    if (!keys) return -1;
+    for (size_t i = 0; i < table->size; i++) {
+      if (!table->keys[i]) continue;
+      size_t pos = table->keys[i] & (size - 1);
+      while (keys[pos]) pos = (pos + 1) & (size - 1);
+      keys[pos] = table->keys[i];
+    }
+    free(table->keys);
+    table->keys = keys;
+    table->size = size;
+  }
+
+  size_t pos = key & (table->size - 1);
+  while (table->keys[pos]) {
+    if (table->keys[pos] == key) return 1;
+    pos = (pos + 1) & (table->size - 1);
+  }
+  table->keys[pos] = key;
+  table->count++;
+  return 0;
+}
+
+/** Internal function that makes sure the conversion buffer can hold a
+ *  number of bytes.
+ *
+ *  Returns: zero if successful, or -1 if out of memory.
+ */
+static int reserve_buffer(struct user_progress *progress, size_t size) {
+  if (size <= progress->buffer_size) return 0;
+  char *buffer = realloc(progress->buffer, size);
+  if (!buffer) return -1;
+  progress->buffer = buffer;
+  progress->buffer_size = size;
+  return 0;
+}
+
+/** Internal function that converts a message to the format kept in
+ *  the store: every line ends with CRLF, and lines starting with a dot
+ *  get another one (as in DATA). Lines of an mbox matching ">+From "
+ *  lose one '>'.
+ *
+ *  Returns: size of the converted message (in the progress buffer), or
+ *           -1 if out of memory.
+ */
+static ssize_t convert_message(struct user_progress *progress, const char *data, size_t size,
+                               int from_mbox) {
+
+  // Each line grows by at most two bytes, and has at least one
+  if (reserve_buffer(progress, 2 * size + 2) < 0) return -1;
+  char *out = progress->buffer;
+  const char *end = data + size;
+  while (data < end) {
+    const char *eol = memchr(data, '\n', end - data);
+    const char *next = eol ? eol + 1 : end;
+    if (!eol) eol = end;
+    if (eol > data && eol[-1] == '\r') eol--;
+
+    if (from_mbox && *data == '>') {
+      const char *p = data;
+      while (p < eol && *p == '>') p++;
+      if (eol - p >= 5 && !memcmp(p, "From ", 5)) data++;
+    }
+    if (data < eol && *data == '.') *out++ = '.';
+    memcpy(out, data, eol - data);
+    out += eol - data;
+    *out++ = '\r';
+    *out++ = '\n';
+    data = next;
+  }
+  return out - progress->buffer;
+}
+
+/** Internal function that builds the name of the progress file of a
+ *  user.
+ */
+static void progress_file_name(char *name, size_t size, const char *username, int temporary) {
+  snprintf(name, size, "%s/%s%s%s", progress_directory, temporary ? "." : "", username,
+           temporary ? ".tmp" : "");
+}
+
+/** Internal function that reads the saved progress of a user, setting
+ *  the position of each source found in it.
+ *
+ *  Returns: 1 if progress was saved, with the number of the mailbox
+ *           following the last message saved in next_number, or 0
+ *           otherwise.
+ */
+static int load_progress(struct user_progress *progress, unsigned int *next_number) {
+
+  char name[4096], line[4096];
+  progress_file_name(name, sizeof(name), progress->import->username, 0);
+  FILE *file = fopen(name, "r");
+  if (!file) return 0;
+  int rv = fscanf(file, "next %u\n", next_number) == 1;
+  while (rv && fgets(line, sizeof(line), file)) {
+    line[strcspn(line, "\n")] = 0;
+    char *path;
+    unsigned long long position = strtoull(line, &path, 10);
+    if (*path++ != ' ') continue;
+    for (unsigned int i = 0; i < progress->import->count; i++) {
+      if (!strcmp(progress->import->sources[i].path, path))
+        progress->positions[i] = progress->committed[i] = position;
+    }
+  }
+  fclose(file);
+  return rv;
+}
+
+/** Internal function that saves the progress of a user, as of the last
+ *  batch committed. The file is replaced at once, so it is never left
+ *  half written.
+ */
+static void save_progress(struct user_progress *progress) {
+
+  char name[4096], temp_name[4096];
+  progress_file_name(name, sizeof(name), progress->import->username, 0);
+  progress_file_name(temp_name, sizeof(temp_name), progress->import->username, 1);
+  FILE *file = fopen(temp_name, "w");
+  if (!file) {
+    fprintf(stderr, "mailload: %s: %s\n", temp_name, strerror(errno));
+    return;
+  }
+  fprintf(file, "next %u\n", progress->committed_next);
+  for (unsigned int i = 0; i < progress->import->count; i++)
+    fprintf(file, "%llu %s\n", (unsigned long long) progress->committed[i],
+            progress->import->sources[i].path);
+  if (fclose(file) == 0)
+    rename(temp_name, name);
+  progress->unsaved = 0;
+}
+
+/** Internal function that adds the messages written so far to the
+ *  mailbox. The batch is flushed to disk first, which also makes the
+ *  previous batch durable, so its progress can be saved.
+ *
+ *  Returns: zero if successful, or -1 otherwise.
+ */
+static int flush_batch(struct user_progress *progress) {
+
+  unsigned int next_number = progress->committed_next;
+  if (!progress->moved && !progress->unsaved) return 0;
+  if (sync_mail_batch(progress->batch) < 0) return -1;
+  if (progress->unsaved)
+    save_progress(progress);
+  if (commit_mail_batch(progress->batch, &next_number) < 0) return -1;
+
+  memcpy(progress->committed, progress->positions, progress->import->count * sizeof(uint64_t));
+  progress->committed_next = next_number;
+  progress->unsaved = progress->moved;
+  progress->moved = 0;
+  progress->batch_count = 0;
+  progress->batch_bytes = 0;
+  return 0;
+}
+
+/** Internal function that adds a message to the mailbox being
+ *  imported, unless it is already there, and records the position
+ *  following it in its source.
+ *
+ *  Returns: zero if successful, or -1 otherwise.
+ */
+static int import_message(struct user_progress *progress, unsigned int source, const char *data,
+                          size_t size, int from_mbox, uint64_t position) {
+
+  ssize_t length = convert_message(progress, data, size, from_mbox);
+  int seen = length < 0 ? -1 : add_seen(&progress->seen, message_key(progress->buffer, length));
+  if (seen < 0) {
+    errno = ENOMEM;
+    return -1;
+  }
+  if (seen) {
+    progress->duplicates++;
+  } else {
+    if (add_mail_to_batch(progress->batch, progress->buffer, length) < 0) return -1;
+    progress->batch_count++;
+    progress->batch_bytes += length;
+    progress->imported++;
+    progress->bytes += length;
+  }
+  progress->positions[source] = position;
+  progress->moved = 1;
+
+  if (progress->batch_count >= batch_size || progress->batch_bytes >= MAX_BATCH_BYTES)
+    return flush_batch(progress);
+  return 0;
+}
+
+/** Internal function that maps a whole file into memory.
+ *
+ *  Returns: address of the contents (NULL for an empty file), or
+ *           MAP_FAILED if the file cannot be read.
+ */
+static char *map_file(const char *path, size_t *size) {
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat file_stat;
+  if (fd < 0) return MAP_FAILED;
+  if (fstat(fd, &file_stat) < 0) {
+    close(fd);
+    return MAP_FAILED;
+  }
+  *size = file_stat.st_size;
+  char *data = *size ? mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+  if (data != MAP_FAILED && data)
+    madvise(data, *size, MADV_SEQUENTIAL);
+  close(fd);
+  return data;
+}
+
+/** Internal function that finds the start of the next message of an
+ *  mbox: a "From " line at the start of the file or following an
+ *  empty line.
+ *
+ *  Returns: offset of the "From " line, or the size of the mbox if
+ *           there is none.
+ */
+static size_t find_mbox_separator(const char *data, size_t size, size_t offset) {
+
+  while (offset < size) {
+    const char *from = memmem(data + offset, size - offset, "\nFrom ", 6);
+    if (!from) break;
+    size_t line = from - data;
+    if (line >= 1 && data[line - 1] == '\n')
+      return line + 1;
+    if (line >= 2 && data[line - 1] == '\r' && data[line - 2] == '\n')
+      return line + 1;
+    offset = line + 1;
+  }
+  return size;
+}
+
+/** Internal function that imports a file, either an mbox (if it starts
+ *  with a "From " line) or a single message, from a given position.
+ *
+ *  Returns: zero if successful, or -1 otherwise.
+ */
+static int import_file(struct user_progress *progress, unsigned int source, const char *path) {
+
+  size_t size;
+  char *data = map_file(path, &size);
+  if (data == MAP_FAILED) return -1;
+  int rv = 0;
+
+  if (size < 5 || memcmp(data, "From ", 5)) {
+    if (progress->positions[source] == 0 && size > 0)
+      rv = import_message(progress, source, data, size, 0, 1);
+  } else {
+    size_t offset = progress->positions[source];
+    while (rv == 0 && offset < size) {
+      // Skips the "From " line, and the empty line before the next one
+      const char *body = memchr(data + offset, '\n', size - offset);
+      size_t start = body ? body - data + 1 : size;
+      size_t next = find_mbox_separator(data, size, start);
+      size_t end = next;
+      if (end - start >= 2 && data[end - 1] == '\n' && data[end - 2] == '\n')
+        end--;
+      else if (end - start >= 3 && data[end - 1] == '\n' && data[end - 2] == '\r' && data[end - 3] == '\n')
+        end -= 2;
+      rv = import_message(progress, source, data + start, end - start, 1, next);
+      offset = next;
+    }
+  }
+  if (data) munmap(data, size);
+  return rv;
+}
+
+/** Internal function that compares two file names, for qsort.
+ */
+static int compare_names(const void *a, const void *b) {
+  return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/** Internal function that adds the message files of a directory to a
+ *  list, skipping hidden files and subdirectories.
+ *
+ *  Returns: zero if successful, or -1 otherwise.
+ */
+static int list_message_files(const char *directory, const char *prefix, char ***names,
+                              unsigned int *count, unsigned int *size) {
+
+  DIR *dir = opendir(directory);
+  if (!dir) return -1;
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    if (entry->d_name[0] == '.') continue;
+    if (entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN) continue;
+    if (*count == *size) {
+      *size = *size ? *size * 2 : 256;
+      char **grown = realloc(*names, *size * sizeof(char *));
+      if (!grown) break;
+      *names = grown;
+    }
+    if (asprintf(&(*names)[*count], "%s%s", prefix, entry->d_name) < 0) break;
+    (*count)++;
+  }
+  int rv = entry ? -1 : 0;
+  closedir(dir);
+  return rv;
+}
+
+/** Internal function that imports the message files of a directory (of
+ *  its new and cur subdirectories for a Maildir), in the order of
+ *  their names, from a given position.
+ *
+ *  Returns: zero if successful, or -1 otherwise.
+ */
+static int import_directory(struct user_progress *progress, unsigned int source, const char *path) {
+
+  char **names = NULL, subdirectory[4096];
+  unsigned int count = 0, size = 0;
+  int rv = 0;
+  snprintf(subdirectory, sizeof(subdirectory), "%s/cur", path);
+  struct stat dir_stat;
+  if (stat(subdirectory, &dir_stat) == 0 && S_ISDIR(dir_stat.st_mode)) {
+    rv = list_message_files(subdirectory, "cur/", &names, &count, &size);
+    snprintf(subdirectory, sizeof(subdirectory), "%s/new", path);
+    if (rv == 0 && stat(subdirectory, &dir_stat) == 0)
+      rv = list_message_files(subdirectory, "new/", &names, &count, &size);
+  } else {
+    rv = list_message_files(path, "", &names, &count, &size);
+  }
+  qsort(names, count, sizeof(char *), compare_names);
+
+  for (uint64_t i = progress->positions[source]; rv == 0 && i < count; i++) {
+    char file_path[4096];
+    size_t file_size;
+    snprintf(file_path, sizeof(file_path), "%s/%s", path, names[i]);
+    char *data = map_file(file_path, &file_size);
+    if (data == MAP_FAILED) {
+      // Files removed meanwhile (e.g., by a mail client) are skipped
+      if (errno == ENOENT || errno == EISDIR) continue;
+      rv = -1;
+      break;
+    }
+    rv = file_size ? import_message(progress, source, data, file_size, 0, i + 1) : 0;
+    if (data) munmap(data, file_size);
+  }
+  for (unsigned int i = 0; i < count; i++)
+    free(names[i]);
+  free(names);
+  return rv;
+}
+
+/** Internal function that adds the messages already in a mailbox to
+ *  the table of messages seen, starting at a given number. Only the
+ *  messages added since the progress was saved need to be read, as the
+ *  sources are not read again up to there.
+ *
+ *  Returns: zero if successful, or -1 otherwise.
+ */
+static int load_mailbox_messages(struct user_progress *progress, unsigned int first_number) {
+
+  mail_list_t list = load_user_mail(progress->import->username);
+  int rv = 0;
+  for (unsigned int i = 0; rv == 0 && i < get_mail_count(list); i++) {
+    mail_item_t item = get_mail_item(list, i);
+    if (get_mail_item_number(item) < first_number) continue;
+    size_t size = get_mail_item_size(item);
+    FILE *file = get_mail_item_contents(item);
+    if (!file) continue;
+    if (reserve_buffer(progress, size + 1) < 0 ||
+        fread(progress->buffer, 1, size, file) != size ||
+        add_seen(&progress->seen, message_key(progress->buffer, size)) < 0)
+      rv = -1;
+    fclose(file);
+  }
+  destroy_mail_list(list);
+  return rv;
+}
+
+/** Internal function that imports the sources of a single user.
+ *
+ *  Returns: zero if successful, or -1 otherwise.
+ */
+static int import_user(struct user_progress *progress) {
+
+  struct user_import *import = progress->import;
+  unsigned int next_number = 0;
+  progress->committed_next = load_progress(progress, &next_number) ? next_number : 0;
+  if (load_mailbox_messages(progress, progress->committed_next) < 0) return -1;
+  if (!(progress->batch = create_mail_batch(import->username))) return -1;
+
+  for (unsigned int i = 0; i < import->count; i++) {
+    struct stat source_stat;
+    const char *path = import->sources[i].path;
+    if (stat(path, &source_stat) < 0) return -1;
+    if ((S_ISDIR(source_stat.st_mode) ? import_directory(progress, i, path) :
+         import_file(progress, i, path)) < 0)
+      return -1;
+  }
+
+  // The last batch is flushed again so its progress can be saved
+  if (flush_batch(progress) < 0 || flush_batch(progress) < 0) return -1;
+  return 0;
+}
+
+/** Internal function run by each job, importing users until there are
+ *  none left.
+ */
+static void *import_worker(void *arg) {
+
+  unsigned int i;
+  while ((i = __atomic_fetch_add(&next_import, 1, __ATOMIC_RELAXED)) < import_count) {
+    struct user_import *import = &imports[i];
+    struct user_progress progress = { .import = import };
+    progress.positions = calloc(import->count, sizeof(uint64_t));
+    progress.committed = calloc(import->count, sizeof(uint64_t));
+    int rv = progress.positions && progress.committed ? import_user(&progress) : -1;
+    int error = errno;
+
+    if (rv < 0)
+      fprintf(stderr, "mailload: %s: %s\n", import->username, strerror(error));
+    else if (verbose)
+      printf("%s: %lu message(s) imported, %lu duplicate(s) skipped\n", import->username,
+             progress.imported, progress.duplicates);
+    __atomic_add_fetch(&total_imported, progress.imported, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&total_duplicates, progress.duplicates, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&total_bytes, progress.bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(rv < 0 ? &total_failed : &total_users, 1, __ATOMIC_RELAXED);
+
+    destroy_mail_batch(progress.batch);
+    free(progress.positions);
+    free(progress.committed);
+    free(progress.seen.keys);
+    free(progress.buffer);
+  }
+  return NULL;
+}
+
+/** Internal function that adds a source to be imported.
+ */
+static void add_source(const char *username, size_t username_length, const char *path) {
+
+  if (!username_length || username_length > MAX_USERNAME_SIZE || !*path) {
+    fprintf(stderr, "mailload: invalid source: %.*s %s\n", (int) username_length, username, path);
+    exit(2);
+  }
+  if (entry_count == entry_size) {
+    entry_size = entry_size ? entry_size * 2 : 256;
+    entries = realloc(entries, entry_size * sizeof(struct source_entry));
+    if (!entries) {
+      perror("mailload");
+      exit(2);
+    }
+  }
+  entries[entry_count].username = strndup(username, username_length);
+  entries[entry_count].path = strdup(path);
+  entries[entry_count].order = entry_count;
+  entry_count++;
+}
+
+/** Internal function that reads the sources listed in a file.
+ */
+static void read_source_list(const char *filename) {
+
+  FILE *file = strcmp(filename, "-") ? fopen(filename, "r") : stdin;
+  if (!file) {
+    perror(filename);
+    exit(2);
+  }
+  char line[8192];
+  while (fgets(line, sizeof(line), file)) {
+    line[strcspn(line, "\r\n")] = 0;
+    char *username = line + strspn(line, " \t");
+    if (!*username || *username == '#') continue;
+    size_t length = strcspn(username, " \t");
+    char *path = username + length;
+    path += strspn(path, " \t");
+    add_source(username, length, path);
+  }
+  if (file != stdin) fclose(file);
+}
+
+/** Internal function that compares two sources, by user and then in
+ *  the order they were given, for qsort.
+ */
+static int compare_sources(const void *a, const void *b) {
+  const struct source_entry *first = a, *second = b;
+  int rv = strcmp(first->username, second->username);
+  return rv ? rv : first->order < second->order ? -1 : first->order > second->order;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-v] [-j jobs] [-b batch] [-c directory] [-f file] [user:source...]\n",
+          name);
+  exit(2);
+}
+
+int main(int argc, char *argv[]) {
+
+  int opt;
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  while ((opt = getopt(argc, argv, "vj:b:c:f:")) != -1) {
+    switch (opt) {
+    case 'v': verbose = 1; break;
+    case 'j': jobs = atol(optarg); break;
+    case 'b': batch_size = atoi(optarg); break;
+    case 'c': progress_directory = optarg; break;
+    case 'f': read_source_list(optarg); break;
+    default: usage(argv[0]);
+    }
+  }
+  for (int i = optind; i < argc; i++) {
+    const char *colon = strchr(argv[i], ':');
+    if (!colon) usage(argv[0]);
+    add_source(argv[i], colon - argv[i], colon + 1);
+  }
+  if (!entry_count || jobs < 1 || (int) batch_size < 1) usage(argv[0]);
+  if (jobs > MAX_JOBS) jobs = MAX_JOBS;
+
+  config_load(CONFIG_FILE_NAME);
+  if (mkdir(progress_directory, 0777) < 0 && errno != EEXIST) {
+    perror(progress_directory);
+    return 2;
+  }
+
+  // Sources are grouped by user, as spelled in the users file, so each
+  // mailbox is imported by a single job
+  for (unsigned int i = 0; i < entry_count; i++)
+    find_user_name(entries[i].username, entries[i].username);
+  qsort(entries, entry_count, sizeof(struct source_entry), compare_sources);
+  imports = calloc(entry_count, sizeof(struct user_import));
+  int valid = 0;
+  for (unsigned int i = 0; i < entry_count; i++) {
+    if (i && !strcmp(entries[i].username, entries[i - 1].username)) {
+      if (valid)
+        imports[import_count - 1].count++;
+    } else if (!(valid = is_valid_user(entries[i].username, NULL))) {
+      fprintf(stderr, "mailload: %s: no such user\n", entries[i].username);
+      total_failed++;
+    } else {
+      imports[import_count].username = entries[i].username;
+      imports[import_count].sources = &entries[i];
+      imports[import_count].count = 1;
+      import_count++;
+    }
+  }
+  if (jobs > import_count) jobs = import_count ? import_count : 1;
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pthread_t threads[MAX_JOBS];
+  int started = 0;
+  while (started < jobs - 1 && pthread_create(&threads[started], NULL, import_worker, NULL) == 0)
+    started++;
+  import_worker(NULL);
+  while (started > 0)
+    pthread_join(threads[--started], NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("%lu message(s) imported (%.1f MB) for %u user(s) in %.2f s (%.0f messages/s), "
+         "%lu duplicate(s) skipped, %u user(s) failed\n", total_imported, total_bytes / 1e6,
+         total_users, seconds, seconds > 0 ? total_imported / seconds : 0.0, total_duplicates,
+         total_failed);
+  return total_failed ? 2 : 0;
+}
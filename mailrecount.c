@@ -0,0 +1,87 @@
+/* mailrecount.c
+ * Checks that the mailbox index of each user matches the messages in
+ * the mailbox, and repairs indexes that drifted (e.g., after message
+ * files were added or removed by hand). The index records the message
+ * count and total size used for quotas.
+ *
+ * Usage: mailrecount [-n] [-v] [user...]
+ *   -n            only report mailboxes that don't match their index
+ *   -v            also list mailboxes that match their index
+ *
+ * Without user names, every mailbox is checked, in all roots of the
+ * mail store. Must be run in the directory the servers run in (where
+ * mail.conf is). Mailboxes can be checked while the servers are
+ * running.
+ */
+
+#include "mailuser.h"
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int dry_run = 0;
+static int verbose = 0;
+static int checked = 0, mismatched = 0, failed = 0;
+
+/** Internal function that checks the mailbox of a single user.
+ */
+static void check_mailbox(const char *username) {
+
+  struct mail_usage recorded, actual;
+  int rv = recount_user_mail(username, !dry_run, &recorded, &actual);
+  checked++;
+
+  if (rv < 0) {
+    failed++;
+    fprintf(stderr, "mailrecount: %s: cannot read mailbox\n", username);
+  } else if (rv > 0) {
+    mismatched++;
+    printf("%s: index has %u messages (%zu bytes), mailbox has %u messages (%zu bytes)%s\n",
+           username, recorded.messages, recorded.bytes, actual.messages, actual.bytes,
+           dry_run ? "" : ", repaired");
+  } else if (verbose) {
+    printf("%s: %u messages (%zu bytes)\n", username, actual.messages, actual.bytes);
+  }
+}
+
+/** Internal function that checks a mailbox found in the mail store
+ *  (see list_mailboxes).
+ */
+static void check_listed_mailbox(const char *username, void *arg) {
+  check_mailbox(username);
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-n] [-v] [user...]\n", name);
+  exit(2);
+}
+
+int main(int argc, char *argv[]) {
+
+  int opt;
+  while ((opt = getopt(argc, argv, "nv")) != -1) {
+    switch (opt) {
+    case 'n': dry_run = 1; break;
+    case 'v': verbose = 1; break;
+    default: usage(argv[0]);
+    }
+  }
+
+  config_load(CONFIG_FILE_NAME);
+  if (optind < argc) {
+    // Mailboxes are named as in the users file
+    for (int i = optind; i < argc; i++) {
+      find_user_name(argv[i], argv[i]);
+      check_mailbox(argv[i]);
+    }
+  } else {
+    list_mailboxes(check_listed_mailbox, NULL);
+  }
+
+  printf("%d mailbox(es) checked, %d %s, %d failed\n", checked, mismatched,
+         dry_run ? "not matching their index" : "repaired", failed);
+  return failed ? 2 : mismatched && dry_run ? 1 : 0;
+}
@@ -0,0 +1,167 @@
+/* mailreshard.c
+ * Moves mailboxes from a previous layout of the mail store to the
+ * current one (e.g., after adding store roots or hash directories),
+ * while the servers keep running.
+ *
+ * Usage: mailreshard [-n] [-v] [-p passes] [user...]
+ *   -n            only list the mailboxes that would be moved
+ *   -v            also list mailboxes that are already in place
+ *   -p passes     times mailboxes locked by a POP3 session are tried
+ *                 (default 10, one second apart)
+ *
+ * The current layout is set with mail_store and mail_store_levels,
+ * and the previous one with mail_store_previous and
+ * mail_store_previous_levels (see mail.conf). To change the layout of
+ * a running store:
+ *   1. set the new layout, and the old one as the previous layout;
+ *   2. restart or upgrade the servers, which then find each mailbox in
+ *      either layout, and deliver new mailboxes to the new one;
+ *   3. run mailreshard until it reports no mailboxes left;
+ *   4. remove the previous layout, and restart or upgrade the servers.
+ *
+ * Mailboxes moved within a file system are just renamed. Mailboxes
+ * moved to another file system are copied, which waits for
+ * deliveries and cannot be done while a POP3 session has the mailbox,
+ * so those are tried again later. Without user names, every mailbox
+ * is moved. Must be run in the directory the servers run in (where
+ * mail.conf is).
+ */
+
+#include "mailuser.h"
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define DEFAULT_PASSES 10
+
+static int dry_run = 0;
+static int verbose = 0;
+static int moved = 0, in_place = 0, failed = 0;
+
+// Mailboxes to be moved in the next pass
+struct name_list {
+  char **names;
+  int count;
+  int size;
+};
+
+/** Internal function that adds a user name to a list.
+ */
+static void add_name(struct name_list *list, const char *username) {
+  if (list->count == list->size) {
+    list->size = list->size ? list->size * 2 : 256;
+    list->names = realloc(list->names, list->size * sizeof(char *));
+    if (!list->names) {
+      perror("mailreshard");
+      exit(2);
+    }
+  }
+  list->names[list->count++] = strdup(username);
+}
+
+/** Internal function that adds a mailbox found in the mail store to
+ *  the list (see list_mailboxes). Mailboxes are only moved once the
+ *  store has been listed, so the listing is not affected by the moves.
+ */
+static void add_listed_mailbox(const char *username, void *arg) {
+  add_name(arg, username);
+}
+
+/** Internal function that moves the mailbox of a single user.
+ *
+ *  Returns: non-zero if the mailbox is locked by a session, and should
+ *           be tried again later.
+ */
+static int move_mailbox(const char *username, int last_pass) {
+
+  int rv = reshard_user_mail(username, !dry_run);
+  if (rv > 0) {
+    moved++;
+    printf("%s%s\n", username, dry_run ? ": to be moved" : ": moved");
+  } else if (rv == 0) {
+    in_place++;
+    if (verbose)
+      printf("%s: in place\n", username);
+  } else if (errno == EWOULDBLOCK && !last_pass) {
+    return 1;
+  } else {
+    failed++;
+    fprintf(stderr, "mailreshard: %s: %s\n", username,
+            errno == EWOULDBLOCK ? "mailbox in use" : strerror(errno));
+  }
+  return 0;
+}
+
+/** Internal function that compares two user names, for qsort.
+ */
+static int compare_names(const void *a, const void *b) {
+  return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-n] [-v] [-p passes] [user...]\n", name);
+  exit(2);
+}
+
+int main(int argc, char *argv[]) {
+
+  int opt, passes = DEFAULT_PASSES;
+  while ((opt = getopt(argc, argv, "nvp:")) != -1) {
+    switch (opt) {
+    case 'n': dry_run = 1; break;
+    case 'v': verbose = 1; break;
+    case 'p': passes = atoi(optarg); break;
+    default: usage(argv[0]);
+    }
+  }
+  if (passes < 1) usage(argv[0]);
+
+  config_load(CONFIG_FILE_NAME);
+  if (!config_get_string("mail_store_previous", NULL)) {
+    fprintf(stderr, "mailreshard: mail_store_previous is not set in %s\n", CONFIG_FILE_NAME);
+    return 2;
+  }
+
+  struct name_list pending = { NULL, 0, 0 }, locked = { NULL, 0, 0 };
+  if (optind < argc) {
+    // Mailboxes are named as in the users file
+    for (int i = optind; i < argc; i++) {
+      find_user_name(argv[i], argv[i]);
+      add_name(&pending, argv[i]);
+    }
+  } else {
+    // Roots in both layouts are listed twice
+    list_mailboxes(add_listed_mailbox, &pending);
+    qsort(pending.names, pending.count, sizeof(char *), compare_names);
+    int count = 0;
+    for (int i = 0; i < pending.count; i++) {
+      if (count && !strcmp(pending.names[count - 1], pending.names[i]))
+        free(pending.names[i]);
+      else
+        pending.names[count++] = pending.names[i];
+    }
+    pending.count = count;
+  }
+
+  for (int pass = 1; pass <= passes && pending.count; pass++) {
+    if (pass > 1)
+      sleep(1);
+    for (int i = 0; i < pending.count; i++) {
+      if (move_mailbox(pending.names[i], pass == passes))
+        add_name(&locked, pending.names[i]);
+      free(pending.names[i]);
+    }
+    struct name_list next = locked;
+    locked = pending;
+    locked.count = 0;
+    pending = next;
+  }
+
+  printf("%d mailbox(es) %s, %d in place, %d failed\n", moved, dry_run ? "to be moved" : "moved",
+         in_place, failed);
+  return failed ? 2 : 0;
+}
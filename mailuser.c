@@ -4,52 +4,299 @@
  * Modified: Nov 5, 2021
  */
 
+#define _GNU_SOURCE
 #include "mailuser.h"
+#include "config.h"
+#include "flightrec.h"
+#include "journal.h"
+#include "probes.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <ctype.h>
+#include <stdint.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include <limits.h>
 #include <unistd.h>
 #include <errno.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
 
 #define USER_FILE_NAME "users.txt"
-#define MAIL_BASE_DIRECTORY "mail.store"
 #define MAIL_FILE_SUFFIX ".mail"
+#define MAIL_INDEX_FILE_NAME ".index"
+#define MAIL_LOCK_FILE_NAME ".lock"
+#define MAIL_EXPUNGE_FILE_NAME ".expunge"
+#define EXPUNGE_BATCH_SIZE 256
+#define MAIL_SPOOL_DIRECTORY ".spool"
+#define SPOOL_ORPHAN_AGE 3600 // seconds
 
-struct user_list {
+// Deliveries with at least this many recipients are split among a
+// small pool of threads; smaller ones are handled by the caller.
+#define DELIVERY_THREAD_THRESHOLD 16
+#define DELIVERY_THREADS 4
+
+// Deliveries take the next number of the mailbox, unless they replay
+// a delivery with a given number (see restore_user_mail)
+#define ANY_MAIL_NUMBER UINT_MAX
+
+struct user_item {
   char *user;
-  struct user_list *next;
+  unsigned int hash;
+  int error;
+  struct user_item *next;
+  struct user_item *hash_next;
+};
+
+struct user_list {
+  struct user_item *head;
+  struct user_item **tail;
+  unsigned int count;
+  unsigned int num_buckets;
+  struct user_item **buckets;
+  arena_t arena; // where items are allocated, or NULL for the heap
 };
 
 struct mail_item {
-  char file_name[NAME_MAX];
+  unsigned int number;
   size_t file_size;
   unsigned int deleted:1;
+  struct mail_list *list;
 };
 
 struct mail_list {
-  struct mail_item item;
-  struct mail_list *next;
+  char *username;
+  int dir_fd;
+  unsigned int count;
+  struct mail_item *items;
 };
 
-/** Internal function that opens the users file list. If file has been
- *  opened before, rewinds the pointer to beginning of the file.
- * 
- *  Returns: file pointer for users file, or NULL if file cannot be opened.
+// Messages written to a mailbox but not added to it yet (see
+// create_mail_batch)
+struct mail_batch_file {
+  int fd;
+  size_t size;
+};
+
+struct mail_batch {
+  char *username;
+  int dir_fd;
+  unsigned int count;
+  unsigned int allocated;
+  struct mail_batch_file *files;
+};
+
+// Each mail directory keeps an index of its messages in a file shared
+// by all server processes (through the page cache), so logins don't
+// need to scan the directory and deliveries don't need to probe for
+// free file names. The index is read under a shared flock and changed
+// under an exclusive one. It records the modification time of the
+// directory after its last change; if the directory was changed
+// without updating the index, the index is rebuilt from a scan.
+#define MAIL_INDEX_MAGIC 0x3158444d // "MDX1"
+
+struct mail_index_header {
+  uint32_t magic;
+  uint32_t count;          // number of entries following the header
+  uint32_t next_number;    // file number for the next delivery
+  uint32_t unused;
+  uint64_t version;        // incremented whenever the index changes
+  uint64_t bytes;          // total size of all messages
+  int64_t dir_mtime_sec;   // mail directory modification time
+  int64_t dir_mtime_nsec;  // after the last change
+};
+
+struct mail_index_entry {
+  uint32_t number;
+  uint32_t unused;
+  uint64_t size;
+};
+
+struct mail_index {
+  struct mail_index_header header;
+  struct mail_index_entry *entries;
+};
+
+// Usage figures of recently used mailboxes, in a table shared by all
+// processes of the server (see init_mail_caches). An entry is written
+// whenever a mailbox index is, so a delivery is seen right away by
+// every session, and quota checks don't need to open the index. Like
+// the index, an entry is only used while the mail directory keeps the
+// modification time it was recorded with. Entries are keyed by the
+// directory's device and inode, and their sequence number is odd
+// while they are written: readers that see it change miss the cache,
+// and writers that find it odd skip the update.
+#define DEFAULT_MAILBOX_CACHE_SIZE 4096
+
+struct mailbox_cache_entry {
+  uint32_t sequence;
+  uint32_t messages;
+  uint64_t dir_dev;
+  uint64_t dir_ino;
+  uint64_t bytes;
+  int64_t dir_mtime_sec;
+  int64_t dir_mtime_nsec;
+};
+
+static struct mailbox_cache_entry *mailbox_cache = NULL;
+static unsigned long mailbox_cache_mask;
+
+// Messages deleted by POP3 sessions may be expunged in the background
+// (see defer_mail_expunge). Their numbers are then appended to the
+// mailbox's expunge journal, in a single write, and removed from the
+// index right away; the files are removed later by expunge_user_mail,
+// which records in the journal header how far it got. The journal is
+// only changed under an exclusive lock on the index, and messages
+// still in it are left out when the index is rebuilt.
+struct mail_expunge_header {
+  uint64_t done;              // size of the journal already handled
+};
+
+static int (*expunge_notify)(const char *username) = NULL;
+
+// The mail store is made of one or more root directories (e.g., on
+// different disks, set with mail_store), and each mailbox is kept in
+// one of them, chosen with a hash of the user name. Within a root,
+// mailboxes are kept either in the root itself or, with
+// mail_store_levels, in one or two levels of hash directories (e.g.,
+// "3f/a0/alice"), so no directory holds too many entries. While
+// mailboxes are moved to a new layout (see reshard_user_mail),
+// mail_store_previous and mail_store_previous_levels give the layout
+// they are moved from, where mailboxes not moved yet are found. The
+// layouts are read once per process, so changing them needs a restart.
+#define MAX_STORE_ROOTS 16
+#define MAX_STORE_LEVELS 2
+#define MAX_MAILBOX_PATH (3 * MAX_STORE_LEVELS + MAX_USERNAME_SIZE)
+#define RESHARD_NEW_PREFIX ".reshard-new."
+#define RESHARD_OLD_PREFIX ".reshard-old."
+#define MAX_MAILBOX_ATTEMPTS 3
+
+struct mail_store_layout {
+  int num_roots;              // 0 if the layout is not set
+  int levels;                 // levels of hash directories
+  char *roots[MAX_STORE_ROOTS];
+  int root_fds[MAX_STORE_ROOTS];
+};
+
+// Place of a mailbox in a store layout
+struct mailbox_location {
+  int root;                   // position of the root in the layout
+  int root_fd;
+  char path[MAX_MAILBOX_PATH + 1]; // relative to the root
+};
+
+static struct mail_store_layout store_layout, previous_layout;
+static pthread_once_t store_layout_once = PTHREAD_ONCE_INIT;
+
+// Users from the users file, loaded into memory so lookups don't
+// read the file. The server loads the directory before it starts any
+// sessions (see init_mail_caches), so all sessions share it; each
+// lookup only checks, with a stat, that the file did not change since
+// it was loaded, and reloads it otherwise.
+struct user_entry {
+  const char *name;
+  const char *password;
+  unsigned int hash;
+  struct user_entry *next;
+};
+
+static struct {
+  arena_t arena;              // where entries and buckets are allocated
+  struct user_entry **buckets;
+  unsigned int num_buckets;   // a power of two
+  struct stat file_stat;      // users file when it was loaded
+} user_directory;
+
+static unsigned int hash_user_name(const char *username);
+
+/** Internal function that loads the users file into the user
+ *  directory, if it was never loaded or the file changed since then
+ *  (i.e., it has a different inode, size or modification time). A
+ *  missing file is loaded as an empty directory.
  */
-static FILE *user_file_list(void) {
+static void refresh_user_directory(void) {
+  
+  struct stat file_stat;
+  if (stat(USER_FILE_NAME, &file_stat) < 0)
+    memset(&file_stat, 0, sizeof(file_stat));
+  
+  struct stat *loaded = &user_directory.file_stat;
+  if (user_directory.arena && file_stat.st_ino == loaded->st_ino && file_stat.st_dev == loaded->st_dev &&
+      file_stat.st_size == loaded->st_size && file_stat.st_mtim.tv_sec == loaded->st_mtim.tv_sec &&
+      file_stat.st_mtim.tv_nsec == loaded->st_mtim.tv_nsec)
+    return;
+  
+  if (user_directory.arena)
+    arena_reset(user_directory.arena);
+  else if (!(user_directory.arena = arena_create(64 * 1024)))
+    return;
+  user_directory.file_stat = file_stat;
+  user_directory.buckets = NULL;
+  user_directory.num_buckets = 0;
+  
+  // Users are read into a list first, so the table can be sized for
+  // the whole file
+  FILE *file = fopen(USER_FILE_NAME, "r");
+  char name[MAX_USERNAME_SIZE + 1], password[MAX_PASSWORD_SIZE + 1];
+  struct user_entry *head = NULL, **tail = &head;
+  unsigned int count = 0;
+  while (file && fscanf(file, "%255s%255s", name, password) == 2) {
+    struct user_entry *entry = arena_alloc(user_directory.arena, sizeof(struct user_entry));
+    entry->name = arena_strdup(user_directory.arena, name);
+    entry->password = arena_strdup(user_directory.arena, password);
+    entry->hash = hash_user_name(name);
+    entry->next = NULL;
+    *tail = entry;
+    tail = &entry->next;
+    count++;
+  }
+  if (file) fclose(file);
+  
+  unsigned int num_buckets = 16;
+  while (num_buckets < count)
+    num_buckets *= 2;
+  user_directory.buckets = arena_alloc(user_directory.arena, num_buckets * sizeof(struct user_entry *));
+  memset(user_directory.buckets, 0, num_buckets * sizeof(struct user_entry *));
+  user_directory.num_buckets = num_buckets;
+  
+  // If a user is listed more than once, the first entry is used
+  struct user_entry *entry, *other;
+  while ((entry = head) != NULL) {
+    head = entry->next;
+    struct user_entry **bucket = &user_directory.buckets[entry->hash & (num_buckets - 1)];
+    for (other = *bucket; other && strcasecmp(other->name, entry->name); other = other->next);
+    if (!other) {
+      entry->next = *bucket;
+      *bucket = entry;
+    }
+  }
+}
 
-  static FILE *file_ptr = NULL;
-  if (!file_ptr)
-    file_ptr = fopen(USER_FILE_NAME, "r+");
-  if (file_ptr)
-    rewind(file_ptr);
-  return file_ptr;
+/** Internal function that finds a user in the user directory,
+ *  ignoring case, loading the users file first if needed.
+ *
+ *  Returns: the entry of the user, or NULL if there is none.
+ */
+static struct user_entry *find_user_entry(const char *username) {
+  
+  refresh_user_directory();
+  if (!user_directory.num_buckets) return NULL;
+  
+  unsigned int hash = hash_user_name(username);
+  struct user_entry *entry = user_directory.buckets[hash & (user_directory.num_buckets - 1)];
+  for (; entry; entry = entry->next) {
+    if (entry->hash == hash && !strcasecmp(username, entry->name))
+      return entry;
+  }
+  return NULL;
 }
 
 /** Checks if the user name is valid. If password is informed, also
@@ -72,97 +319,1366 @@ static FILE *user_file_list(void) {
  */
 int is_valid_user(const char *username, const char *password) {
   
-  FILE *file_ptr = user_file_list();
-  if (!file_ptr) return 0;
+  uint64_t start = flightrec_now();
+  struct user_entry *entry = find_user_entry(username);
+  int rv = entry && (password == NULL || !strcmp(password, entry->password));
+  
+  flightrec_record(FR_USER_LOOKUP, NULL, flightrec_now() - start, rv);
+  return rv;
+}
+
+/** Looks up a user name, ignoring case as is_valid_user does, and
+ *  copies it as spelled in the users file. Mailboxes, their locks and
+ *  their place in the mail store all follow that spelling, so names
+ *  given by clients must go through this function before they are
+ *  used for anything but a lookup.
+ *
+ *  Parameters: username: Non-NULL name of the user to look up.
+ *              name: Buffer of at least MAX_USERNAME_SIZE + 1 bytes
+ *                    receiving the name as spelled in the users file.
+ *                    May be username itself, which then has the
+ *                    same length as the name copied to it.
+ *
+ *  Returns: non-zero (true) if the user exists, and zero (false)
+ *           otherwise (in which case name is not changed).
+ */
+int find_user_name(const char *username, char *name) {
+  
+  uint64_t start = flightrec_now();
+  struct user_entry *entry = find_user_entry(username);
+  if (entry && entry->name != name)
+    memmove(name, entry->name, strlen(entry->name) + 1);
+  
+  flightrec_record(FR_USER_LOOKUP, NULL, flightrec_now() - start, entry != NULL);
+  return entry != NULL;
+}
+
+/** Loads the users file again, if it changed, after the server
+ *  receives SIGHUP. Sessions started from then on share the new
+ *  directory instead of each loading it on its first lookup.
+ */
+void reload_user_directory(void) {
+  refresh_user_directory();
+}
+
+/** Creates a new, empty, list of users.
+ * 
+ *  Returns: A user_list_t object with no users.
+ */
+user_list_t create_user_list(void) {
+  return NULL;
+}
+
+/** Creates a new, empty, list of users whose memory is allocated in
+ *  an arena. The list is released with the arena (e.g., when a mail
+ *  transaction ends), so destroy_user_list does nothing for it.
+ *
+ *  Parameters: arena: Arena where the list and its users are stored.
+ *
+ *  Returns: A user_list_t object with no users.
+ */
+user_list_t create_user_list_in_arena(arena_t arena) {
+  user_list_t list = arena_alloc(arena, sizeof(struct user_list));
+  memset(list, 0, sizeof(struct user_list));
+  list->tail = &list->head;
+  list->arena = arena;
+  return list;
+}
+
+/** Internal function that computes a case-insensitive hash of a user
+ *  name, so that 'ADMIN' and 'admin' fall in the same bucket.
+ */
+static unsigned int hash_user_name(const char *username) {
+  unsigned int hash = 2166136261u;
+  for (; *username; username++)
+    hash = (hash ^ (unsigned char) tolower((unsigned char) *username)) * 16777619u;
+  return hash;
+}
+
+/** Internal function that doubles the number of hash buckets in a
+ *  list of users, rehashing all existing entries.
+ */
+static void grow_user_list_buckets(user_list_t list) {
+  unsigned int num_buckets = list->num_buckets ? list->num_buckets * 2 : 16;
+  struct user_item **buckets;
+  if (list->arena) {
+    buckets = arena_alloc(list->arena, num_buckets * sizeof(struct user_item *));
+    memset(buckets, 0, num_buckets * sizeof(struct user_item *));
+  } else {
+    buckets = calloc(num_buckets, sizeof(struct user_item *));
+  }
+  for (struct user_item *item = list->head; item; item = item->next) {
+    item->hash_next = buckets[item->hash & (num_buckets - 1)];
+    buckets[item->hash & (num_buckets - 1)] = item;
+  }
+  if (!list->arena)
+    free(list->buckets);
+  list->buckets = buckets;
+  list->num_buckets = num_buckets;
+}
+
+/** Adds a user name to a list of users, unless the list already
+ *  contains the same user name. As in is_valid_user, the comparison
+ *  ignores case, so 'ADMIN' is considered a duplicate of 'admin'.
+ *  Users are kept in the order they were added, and their messages
+ *  are delivered to the mailbox named as in the list, so names given
+ *  by clients must be spelled as in the users file first (see
+ *  find_user_name).
+ *  
+ *  Parameters: list: address of the list of users to be modified.
+ *              username: Name of the user to be added. The name will
+ *                        be copied to a new buffer, so the caller is
+ *                        free to use a string that will be modified
+ *                        later.
+ *
+ *  Returns: non-zero (true) if the user was added, or zero (false) if
+ *           the user was already in the list.
+ */
+int add_user_to_list(user_list_t *list, const char *username) {
+
+  if (!*list) {
+    *list = calloc(1, sizeof(struct user_list));
+    (*list)->tail = &(*list)->head;
+  }
+  
+  user_list_t ul = *list;
+  unsigned int hash = hash_user_name(username);
+  
+  if (ul->num_buckets) {
+    for (struct user_item *item = ul->buckets[hash & (ul->num_buckets - 1)];
+         item; item = item->hash_next) {
+      if (item->hash == hash && !strcasecmp(item->user, username))
+        return 0;
+    }
+  }
+  
+  if (ul->count >= ul->num_buckets)
+    grow_user_list_buckets(ul);
+  
+  // The name is stored right after the item, in the same allocation
+  size_t size = sizeof(struct user_item) + strlen(username) + 1;
+  struct user_item *new_item = ul->arena ? arena_alloc(ul->arena, size) : malloc(size);
+  new_item->user = strcpy((char *) (new_item + 1), username);
+  new_item->hash = hash;
+  new_item->error = 0;
+  new_item->next = NULL;
+  new_item->hash_next = ul->buckets[hash & (ul->num_buckets - 1)];
+  ul->buckets[hash & (ul->num_buckets - 1)] = new_item;
+  *ul->tail = new_item;
+  ul->tail = &new_item->next;
+  ul->count++;
+  return 1;
+}
+
+/** Frees all memory used by a list of users.
+ *
+ * Parameters: list: list of users to be freed.
+ */
+void destroy_user_list(user_list_t list) {
+  if (!list || list->arena) return;
+  struct user_item *item = list->head;
+  while (item) {
+    struct user_item *next = item->next;
+    free(item);
+    item = next;
+  }
+  free(list->buckets);
+  free(list);
+}
+
+/** Returns the number of users in a list of users.
+ *
+ *  Parameters: list: List of users to be assessed.
+ *
+ *  Returns: Number of (distinct) users in the list.
+ */
+unsigned int get_user_count(user_list_t list) {
+  return list ? list->count : 0;
+}
+
+/** Returns the first user in a list of users, in the order they were
+ *  added. Together with get_next_user, allows a caller to iterate
+ *  through all users in a list.
+ *
+ *  Parameters: list: List of users to be assessed.
+ *
+ *  Returns: user_item_t object for the first user, or NULL if the
+ *           list is empty.
+ */
+user_item_t get_first_user(user_list_t list) {
+  return list ? list->head : NULL;
+}
+
+/** Finds a user in a list of users. As in add_user_to_list, the
+ *  comparison ignores case.
+ *
+ *  Parameters: list: List of users to be searched.
+ *              username: Name of the user to be found.
+ *
+ *  Returns: user_item_t object for the user, or NULL if the user is
+ *           not in the list.
+ */
+user_item_t find_user_in_list(user_list_t list, const char *username) {
+  
+  if (!list || !list->num_buckets) return NULL;
+  unsigned int hash = hash_user_name(username);
+  for (struct user_item *item = list->buckets[hash & (list->num_buckets - 1)]; item; item = item->hash_next) {
+    if (item->hash == hash && !strcasecmp(item->user, username))
+      return item;
+  }
+  return NULL;
+}
+
+/** Returns the user following a specific user in its list.
+ *
+ *  Parameters: item: User item obtained from get_first_user or
+ *                    get_next_user.
+ *
+ *  Returns: user_item_t object for the next user, or NULL if item is
+ *           the last user in the list.
+ */
+user_item_t get_next_user(user_item_t item) {
+  return item->next;
+}
+
+/** Returns the name of a user in a list of users.
+ *
+ *  Parameters: item: User item to be assessed.
+ *
+ *  Returns: The user name, as passed to add_user_to_list.
+ */
+const char *get_user_name(user_item_t item) {
+  return item->user;
+}
+
+/** Returns the outcome of the last delivery to a user through
+ *  save_user_mail.
+ *
+ *  Parameters: item: User item to be assessed.
+ *
+ *  Returns: Zero if the message was delivered, or an errno value
+ *           describing why delivery to this user failed.
+ */
+int get_user_delivery_error(user_item_t item) {
+  return item->error;
+}
+
+/** Checks if a delivery error may go away on its own (e.g., a full
+ *  disk), so delivery should be retried later, as opposed to errors
+ *  that will fail again on every attempt.
+ *
+ *  Parameters: error: errno value, as returned by
+ *                     get_user_delivery_error.
+ *
+ *  Returns: non-zero (true) if the error is transient, zero otherwise.
+ */
+int is_transient_delivery_error(int error) {
+  switch (error) {
+  case ENOSPC:
+  case EDQUOT:
+  case EIO:
+  case EMFILE:
+  case ENFILE:
+  case ENOMEM:
+  case EAGAIN:
+  case EINTR:
+  case EBUSY:
+  case EROFS:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/** Internal function that reads a store layout from the configuration:
+ *  a list of root directories, separated by spaces, and a number of
+ *  levels of hash directories. The root directories are opened once,
+ *  for the lifetime of the process; the roots of the current layout
+ *  are created if they don't exist yet.
+ */
+static void read_store_layout(struct mail_store_layout *layout, const char *roots_setting,
+                              const char *default_roots, const char *levels_setting, int create) {
+  
+  const char *roots = config_get_string(roots_setting, default_roots);
+  if (!roots) return;
+  
+  char *copy = strdup(roots), *saveptr = NULL;
+  for (char *root = strtok_r(copy, " \t", &saveptr); root && layout->num_roots < MAX_STORE_ROOTS;
+       root = strtok_r(NULL, " \t", &saveptr)) {
+    // Create root directory if it doesn't exist yet (error ignored)
+    if (create)
+      mkdir(root, 0777);
+    layout->roots[layout->num_roots] = strdup(root);
+    layout->root_fds[layout->num_roots++] = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  }
+  free(copy);
+  
+  layout->levels = config_get_int(levels_setting, 0);
+  if (layout->levels < 0) layout->levels = 0;
+  if (layout->levels > MAX_STORE_LEVELS) layout->levels = MAX_STORE_LEVELS;
+}
+
+/** Internal function that reads the current and previous store
+ *  layouts, only once per process.
+ */
+static void read_store_layouts(void) {
+  read_store_layout(&store_layout, "mail_store", MAIL_BASE_DIRECTORY, "mail_store_levels", 1);
+  read_store_layout(&previous_layout, "mail_store_previous", NULL, "mail_store_previous_levels", 0);
+}
+
+/** Internal function that returns the current store layout, reading
+ *  it from the configuration on the first call.
+ */
+static const struct mail_store_layout *get_store_layout(void) {
+  pthread_once(&store_layout_once, read_store_layouts);
+  return &store_layout;
+}
+
+/** Internal function that hashes a user name to place its mailbox in
+ *  a store layout (64-bit FNV-1a). Case is ignored, like in the users
+ *  file, so a name spelled differently still hashes to the same root.
+ *  Existing mailboxes are found with this hash, so it must never
+ *  change.
+ */
+static uint64_t hash_mailbox_name(const char *username) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (const unsigned char *c = (const unsigned char *) username; *c; c++)
+    hash = (hash ^ tolower(*c)) * 0x100000001b3ull;
+  return hash;
+}
+
+/** Internal function that mixes the bits of a 64-bit value (the
+ *  finalizer of MurmurHash3).
+ */
+static uint64_t mix_hash(uint64_t value) {
+  value ^= value >> 33;
+  value *= 0xff51afd7ed558ccdull;
+  value ^= value >> 33;
+  value *= 0xc4ceb9fe1a85ec53ull;
+  value ^= value >> 33;
+  return value;
+}
+
+/** Internal function that finds where a store layout puts the mailbox
+ *  of a user. Each root gets a score from the hash of the user name
+ *  and the root's position in the list, and the mailbox goes to the
+ *  root with the highest score (rendezvous hashing), so adding a root
+ *  at the end of the list only moves the mailboxes that go to the new
+ *  root. The hash directories are named after the top bytes of the
+ *  mixed hash, in hexadecimal.
+ */
+static void find_mailbox_location(const struct mail_store_layout *layout, const char *username,
+                                  struct mailbox_location *location) {
+  
+  uint64_t hash = hash_mailbox_name(username), best_score = 0;
+  location->root = 0;
+  for (int i = 0; i < layout->num_roots; i++) {
+    uint64_t score = mix_hash(hash ^ (i + 1) * 0x9e3779b97f4a7c15ull);
+    if (i == 0 || score > best_score) {
+      location->root = i;
+      best_score = score;
+    }
+  }
+  location->root_fd = layout->num_roots ? layout->root_fds[location->root] : -1;
+  
+  char *path = location->path;
+  hash = mix_hash(hash);
+  for (int level = 0; level < layout->levels; level++)
+    path += sprintf(path, "%02x/", (unsigned int) (hash >> (56 - 8 * level)) & 0xff);
+  snprintf(path, MAX_USERNAME_SIZE + 1, "%s", username);
+}
+
+/** Internal function that checks if a name at some depth of a store
+ *  root is a hash directory rather than a mailbox. Names of two
+ *  hexadecimal digits are taken as hash directories wherever either
+ *  layout has them, so users with such names cannot be moved between
+ *  layouts with different levels.
+ */
+static int is_hash_directory_name(const char *name, int depth) {
+  return (store_layout.levels > depth || previous_layout.levels > depth) &&
+    isxdigit((unsigned char) name[0]) && isxdigit((unsigned char) name[1]) && !name[2];
+}
+
+/** Internal function that finds the places where the mailbox of a
+ *  user may be: where the current layout puts it and, while mailboxes
+ *  are moved from a previous layout, where that layout puts it, and
+ *  once more where the current layout puts it, in case the mailbox
+ *  was moved between the two lookups.
+ *
+ *  Returns: number of places (1 or 3).
+ */
+static int find_mailbox_locations(const char *username, struct mailbox_location locations[3]) {
+  
+  find_mailbox_location(get_store_layout(), username, &locations[0]);
+  if (!previous_layout.num_roots) return 1;
+  find_mailbox_location(&previous_layout, username, &locations[1]);
+  locations[2] = locations[0];
+  return 3;
+}
+
+/** Internal function that creates a mail directory where a layout
+ *  puts it, along with its hash directories. Directories that exist
+ *  already make mkdirat return an error, which is ignored.
+ *
+ *  Parameters: parents_only: If non-zero, only the hash directories
+ *                            are created.
+ */
+static void make_mail_directory(const struct mailbox_location *location, int parents_only) {
+  
+  char path[MAX_MAILBOX_PATH + 1];
+  strcpy(path, location->path);
+  for (char *slash = path; (slash = strchr(slash, '/')) != NULL; *slash++ = '/') {
+    *slash = 0;
+    mkdirat(location->root_fd, path, 0777);
+  }
+  if (!parents_only)
+    mkdirat(location->root_fd, path, 0777);
+}
+
+/** Internal function that opens the mail directory of a user, looking
+ *  for it in every place it may be (see find_mailbox_locations).
+ *
+ *  Parameters: username: Name of the user.
+ *              create: If non-zero, the directory is created where the
+ *                      current layout puts it if it is not found.
+ *
+ *  Returns: directory file descriptor, or -1 if the directory cannot
+ *           be opened (with errno set to ENOENT if it does not exist).
+ */
+static int open_mail_directory(const char *username, int create) {
+  
+  struct mailbox_location locations[3];
+  int count = find_mailbox_locations(username, locations);
+  for (int i = 0; i < count; i++) {
+    int dir_fd = openat(locations[i].root_fd, locations[i].path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0 || errno != ENOENT) return dir_fd;
+  }
+  if (!create) return -1;
+  
+  make_mail_directory(&locations[0], 0);
+  return openat(locations[0].root_fd, locations[0].path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/** Internal function that gets the status of the mail directory of a
+ *  user, looking for it like open_mail_directory.
+ *
+ *  Returns: zero if successful, or -1 otherwise.
+ */
+static int stat_mail_directory(const char *username, struct stat *dir_stat) {
+  
+  struct mailbox_location locations[3];
+  int count = find_mailbox_locations(username, locations);
+  for (int i = 0; i < count; i++) {
+    if (fstatat(locations[i].root_fd, locations[i].path, dir_stat, 0) == 0) return 0;
+    if (errno != ENOENT) return -1;
+  }
+  return -1;
+}
+
+/** Internal function that checks if an open mail directory is no
+ *  longer the one of its user, which happens when the mailbox is
+ *  copied to another file system (see reshard_user_mail) while the
+ *  caller waits for one of its locks. Mailboxes are only moved while a
+ *  previous layout is set, so the check is skipped otherwise.
+ */
+static int is_mail_directory_moved(const char *username, int dir_fd) {
+  
+  struct stat dir_stat, found_stat;
+  if (!previous_layout.num_roots) return 0;
+  return fstat(dir_fd, &dir_stat) < 0 || stat_mail_directory(username, &found_stat) < 0 ||
+    dir_stat.st_dev != found_stat.st_dev || dir_stat.st_ino != found_stat.st_ino;
+}
+
+/** Internal function that checks if a numbered mail file exists in a
+ *  user's mail directory.
+ */
+static int mail_file_exists(int dir_fd, unsigned int number) {
+  char mail_file[32];
+  sprintf(mail_file, "%u" MAIL_FILE_SUFFIX, number);
+  return faccessat(dir_fd, mail_file, F_OK, 0) == 0;
+}
+
+/** Internal function that finds an unused mail file number in a
+ *  user's mail directory. Instead of trying every number starting at
+ *  zero, the search doubles the probed number until an unused one is
+ *  found, then bisects back towards the last used number, so growing
+ *  mailboxes only need a logarithmic number of probes. The returned
+ *  number is only a starting point: a concurrent delivery may still
+ *  take it before the caller does.
+ */
+static unsigned int find_free_mail_number(int dir_fd) {
+  
+  if (!mail_file_exists(dir_fd, 0)) return 0;
+  
+  unsigned int used = 0, unused = 1;
+  while (mail_file_exists(dir_fd, unused)) {
+    used = unused;
+    unused *= 2;
+  }
+  while (unused - used > 1) {
+    unsigned int mid = used + (unused - used) / 2;
+    if (mail_file_exists(dir_fd, mid))
+      used = mid;
+    else
+      unused = mid;
+  }
+  return unused;
+}
+
+/** Internal function that opens the index of a mail directory,
+ *  creating it if needed, and locks it with flock (LOCK_SH or
+ *  LOCK_EX). Closing the descriptor releases the lock.
+ *
+ *  Returns: index file descriptor, or -1 if the index cannot be
+ *           opened.
+ */
+static int open_mail_index(int dir_fd, int operation) {
+  
+  int index_fd = openat(dir_fd, MAIL_INDEX_FILE_NAME, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  if (index_fd >= 0 && flock(index_fd, operation) < 0) {
+    close(index_fd);
+    return -1;
+  }
+  return index_fd;
+}
+
+/** Internal function that opens the mail directory of a user and its
+ *  index, locked with flock (LOCK_SH or LOCK_EX). If the mailbox is
+ *  moved to another file system while waiting for the lock, it is
+ *  opened again in its new place.
+ *
+ *  Parameters: username: Name of the user.
+ *              create: If non-zero, the directory is created if it
+ *                      does not exist.
+ *              operation: Lock operation (LOCK_SH or LOCK_EX).
+ *              index_fd: Set to the index file descriptor, or -1 if
+ *                        the index cannot be opened.
+ *
+ *  Returns: directory file descriptor, or -1 if the directory cannot
+ *           be opened.
+ */
+static int open_locked_mail_directory(const char *username, int create, int operation, int *index_fd) {
+  
+  for (int attempt = 1; ; attempt++) {
+    int dir_fd = open_mail_directory(username, create);
+    *index_fd = dir_fd < 0 ? -1 : open_mail_index(dir_fd, operation);
+    if (*index_fd < 0 || attempt == MAX_MAILBOX_ATTEMPTS || !is_mail_directory_moved(username, dir_fd))
+      return dir_fd;
+    close(*index_fd);
+    close(dir_fd);
+  }
+}
+
+/** Internal function that reads the header of a mailbox index. The
+ *  header is read even if it is not current, so a rebuilt index can
+ *  keep its version and message numbers.
+ *
+ *  Returns: zero if the index is current (i.e., it has the expected
+ *           size and the directory has not changed since it was
+ *           written), or -1 otherwise.
+ */
+static int read_mail_index_header(int index_fd, int dir_fd, struct mail_index_header *header) {
+  
+  struct stat index_stat, dir_stat;
+  memset(header, 0, sizeof(*header));
+  if (pread(index_fd, header, sizeof(*header), 0) != sizeof(*header) ||
+      header->magic != MAIL_INDEX_MAGIC ||
+      fstat(index_fd, &index_stat) < 0 || fstat(dir_fd, &dir_stat) < 0)
+    return -1;
+  
+  return index_stat.st_size == sizeof(*header) + (off_t) header->count * sizeof(struct mail_index_entry) &&
+    header->dir_mtime_sec == dir_stat.st_mtim.tv_sec &&
+    header->dir_mtime_nsec == dir_stat.st_mtim.tv_nsec ? 0 : -1;
+}
+
+/** Internal function that reads a mailbox index, including all its
+ *  entries.
+ *
+ *  Returns: zero if the index is current, or -1 otherwise (in which
+ *           case no entries are loaded).
+ */
+static int read_mail_index(int index_fd, int dir_fd, struct mail_index *index) {
+  
+  index->entries = NULL;
+  if (read_mail_index_header(index_fd, dir_fd, &index->header) < 0) return -1;
+  
+  ssize_t size = index->header.count * sizeof(struct mail_index_entry);
+  index->entries = malloc(size ? size : 1);
+  if (pread(index_fd, index->entries, size, sizeof(index->header)) != size) {
+    free(index->entries);
+    index->entries = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+/** Internal function that compares mailbox index entries by message
+ *  number, for use with qsort.
+ */
+static int compare_mail_index_entries(const void *a, const void *b) {
+  const struct mail_index_entry *ea = a, *eb = b;
+  return ea->number < eb->number ? -1 : ea->number > eb->number;
+}
+
+/** Internal function that compares message numbers, for use with
+ *  qsort and bsearch.
+ */
+static int compare_mail_numbers(const void *a, const void *b) {
+  uint32_t na = *(const uint32_t *) a, nb = *(const uint32_t *) b;
+  return na < nb ? -1 : na > nb;
+}
+
+/** Internal function that reads the numbers of the messages in the
+ *  expunge journal of a mail directory whose files were not yet
+ *  removed.
+ *
+ *  Returns: sorted array of message numbers (to be freed by the
+ *           caller), or NULL if there are none.
+ */
+static uint32_t *read_expunge_journal(int dir_fd, unsigned int *count) {
+  
+  *count = 0;
+  struct mail_expunge_header header;
+  struct stat journal_stat;
+  int journal_fd = openat(dir_fd, MAIL_EXPUNGE_FILE_NAME, O_RDONLY | O_CLOEXEC);
+  if (journal_fd < 0) return NULL;
+  if (fstat(journal_fd, &journal_stat) < 0 ||
+      pread(journal_fd, &header, sizeof(header), 0) != sizeof(header) ||
+      header.done < sizeof(header) || header.done >= journal_stat.st_size) {
+    close(journal_fd);
+    return NULL;
+  }
+  
+  size_t size = (journal_stat.st_size - header.done) / sizeof(uint32_t) * sizeof(uint32_t);
+  uint32_t *numbers = malloc(size ? size : 1);
+  ssize_t got = pread(journal_fd, numbers, size, header.done);
+  close(journal_fd);
+  *count = got > 0 ? got / sizeof(uint32_t) : 0;
+  qsort(numbers, *count, sizeof(uint32_t), compare_mail_numbers);
+  return numbers;
+}
+
+/** Internal function that rebuilds a mailbox index by scanning the
+ *  mail directory. Only files named after a message number, as
+ *  created by save_user_mail, are included, except for messages
+ *  waiting in the expunge journal. The version and next message
+ *  number of the previous index, if any, are preserved, so numbers
+ *  of expunged messages are not reused.
+ */
+static void scan_mail_directory(int dir_fd, struct mail_index *index) {
+  
+  struct mail_index_header *header = &index->header;
+  if (header->magic != MAIL_INDEX_MAGIC) {
+    memset(header, 0, sizeof(*header));
+    header->magic = MAIL_INDEX_MAGIC;
+  }
+  header->count = 0;
+  header->bytes = 0;
+  index->entries = NULL;
+  
+  // Messages waiting in the expunge journal are already deleted, but
+  // their numbers are not reused
+  unsigned int num_expunged;
+  uint32_t *expunged = read_expunge_journal(dir_fd, &num_expunged);
+  for (unsigned int i = 0; i < num_expunged; i++)
+    if (expunged[i] >= header->next_number)
+      header->next_number = expunged[i] + 1;
+  
+  // The directory stream gets its own descriptor, as closedir closes it
+  int scan_fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  DIR *dir = scan_fd >= 0 ? fdopendir(scan_fd) : NULL;
+  if (!dir) {
+    if (scan_fd >= 0) close(scan_fd);
+    free(expunged);
+    return;
+  }
+  
+  struct stat file_stat;
+  struct dirent *dir_entry;
+  unsigned int capacity = 0;
+  
+  while ((dir_entry = readdir(dir)) != NULL) {
+    
+    char *end;
+    unsigned long number = strtoul(dir_entry->d_name, &end, 10);
+    if (dir_entry->d_type != DT_REG || !isdigit((unsigned char) dir_entry->d_name[0]) ||
+        strcmp(end, MAIL_FILE_SUFFIX) || number >= UINT32_MAX ||
+        (num_expunged && bsearch(&(uint32_t) { number }, expunged, num_expunged, sizeof(uint32_t),
+                                 compare_mail_numbers)) ||
+        fstatat(dir_fd, dir_entry->d_name, &file_stat, 0) < 0)
+      continue;
+    
+    if (header->count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      index->entries = realloc(index->entries, capacity * sizeof(struct mail_index_entry));
+    }
+    struct mail_index_entry *entry = &index->entries[header->count++];
+    entry->number = number;
+    entry->unused = 0;
+    entry->size = file_stat.st_size;
+    header->bytes += file_stat.st_size;
+    if (number >= header->next_number)
+      header->next_number = number + 1;
+  }
+  
+  closedir(dir);
+  free(expunged);
+  if (header->count)
+    qsort(index->entries, header->count, sizeof(struct mail_index_entry), compare_mail_index_entries);
+}
+
+/** Internal function that returns the mailbox cache entry for a mail
+ *  directory, or NULL if there is no cache.
+ */
+static struct mailbox_cache_entry *mailbox_cache_slot(const struct stat *dir_stat) {
+  if (!mailbox_cache) return NULL;
+  uint64_t key = ((uint64_t) dir_stat->st_ino ^ ((uint64_t) dir_stat->st_dev << 40)) * 0x9e3779b97f4a7c15ull;
+  return &mailbox_cache[(key >> 32) & mailbox_cache_mask];
+}
+
+/** Internal function that records the figures of a current mailbox
+ *  index header in the mailbox cache.
+ */
+static void cache_mailbox_usage(const struct stat *dir_stat, const struct mail_index_header *header) {
+  
+  struct mailbox_cache_entry *entry = mailbox_cache_slot(dir_stat);
+  if (!entry) return;
+  uint32_t sequence = __atomic_load_n(&entry->sequence, __ATOMIC_RELAXED);
+  if ((sequence & 1) ||
+      !__atomic_compare_exchange_n(&entry->sequence, &sequence, sequence + 1, 0, __ATOMIC_ACQUIRE,
+                                   __ATOMIC_RELAXED))
+    return;
+  entry->dir_dev = dir_stat->st_dev;
+  entry->dir_ino = dir_stat->st_ino;
+  entry->messages = header->count;
+  entry->bytes = header->bytes;
+  entry->dir_mtime_sec = header->dir_mtime_sec;
+  entry->dir_mtime_nsec = header->dir_mtime_nsec;
+  __atomic_store_n(&entry->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+/** Internal function that looks up the figures of a mail directory
+ *  in the mailbox cache.
+ *
+ *  Returns: zero if the cache has current figures for the directory,
+ *           or -1 otherwise.
+ */
+static int find_cached_mailbox_usage(const struct stat *dir_stat, struct mail_usage *usage) {
+  
+  struct mailbox_cache_entry *entry = mailbox_cache_slot(dir_stat);
+  if (!entry) return -1;
+  uint32_t sequence = __atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE);
+  struct mailbox_cache_entry copy = *(volatile struct mailbox_cache_entry *) entry;
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if ((sequence & 1) || __atomic_load_n(&entry->sequence, __ATOMIC_RELAXED) != sequence ||
+      copy.dir_dev != (uint64_t) dir_stat->st_dev || copy.dir_ino != (uint64_t) dir_stat->st_ino ||
+      copy.dir_mtime_sec != dir_stat->st_mtim.tv_sec || copy.dir_mtime_nsec != dir_stat->st_mtim.tv_nsec)
+    return -1;
+  usage->messages = copy.messages;
+  usage->bytes = copy.bytes;
+  return 0;
+}
+
+/** Internal function that writes a mailbox index after its directory
+ *  was changed. Must be called with an exclusive lock on the index.
+ *
+ *  Parameters: index_fd: Index file descriptor.
+ *              dir_fd: Mail directory file descriptor.
+ *              header: Index header; updated with the new version and
+ *                      directory modification time.
+ *              entries: Entries from position first onwards; entries
+ *                       before that are already in the file (e.g.,
+ *                       when a message is added only its entry is
+ *                       written).
+ *              first: Position of the first entry to be written.
+ */
+static void write_mail_index(int index_fd, int dir_fd, struct mail_index_header *header,
+                             const struct mail_index_entry *entries, unsigned int first) {
+  
+  struct stat dir_stat;
+  if (fstat(dir_fd, &dir_stat) < 0) return;
+  
+  header->version++;
+  header->dir_mtime_sec = dir_stat.st_mtim.tv_sec;
+  header->dir_mtime_nsec = dir_stat.st_mtim.tv_nsec;
+  
+  // The header is written last: if the update is interrupted, the
+  // file size does not match the old header, and the index is rebuilt
+  ssize_t entries_size = (header->count - first) * sizeof(struct mail_index_entry);
+  off_t size = sizeof(*header) + (off_t) header->count * sizeof(struct mail_index_entry);
+  if (pwrite(index_fd, entries, entries_size, size - entries_size) == entries_size &&
+      ftruncate(index_fd, size) == 0 &&
+      pwrite(index_fd, header, sizeof(*header), 0) == sizeof(*header))
+    cache_mailbox_usage(&dir_stat, header);
+}
+
+/** Internal function that moves the modification time of a mail
+ *  directory forward, for changes to the mailbox that do not change
+ *  the directory itself (e.g., deferred expunges). Indexes and cached
+ *  figures are only checked against that time, so this makes other
+ *  processes read the index again.
+ */
+static void touch_mail_directory(int dir_fd) {
+  
+  struct stat dir_stat;
+  struct timespec times[2] = { { 0, UTIME_OMIT } };
+  if (fstat(dir_fd, &dir_stat) < 0) return;
+  clock_gettime(CLOCK_REALTIME, &times[1]);
+  if (times[1].tv_sec < dir_stat.st_mtim.tv_sec ||
+      (times[1].tv_sec == dir_stat.st_mtim.tv_sec && times[1].tv_nsec <= dir_stat.st_mtim.tv_nsec)) {
+    times[1] = dir_stat.st_mtim;
+    if (++times[1].tv_nsec == 1000000000) {
+      times[1].tv_sec++;
+      times[1].tv_nsec = 0;
+    }
+  }
+  futimens(dir_fd, times);
+}
+
+/** Internal function that copies the contents of a file to another,
+ *  from the current offset of each. The copy is done by the kernel
+ *  where possible, and through a buffer otherwise.
+ *
+ *  Returns: zero if successful, or -1 otherwise.
+ */
+static int copy_file_contents(int in_fd, int out_fd) {
+  
+  ssize_t rv;
+  while ((rv = copy_file_range(in_fd, NULL, out_fd, NULL, 1 << 30, 0)) > 0);
+  if (rv == 0) return 0;
+  if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) return -1;
+  
+  char buf[65536];
+  while ((rv = read(in_fd, buf, sizeof(buf))) > 0)
+    if (write(out_fd, buf, rv) != rv) return -1;
+  return rv < 0 ? -1 : 0;
+}
+
+/** Internal function that copies a message to an unnamed temporary
+ *  file in a mail directory, for deliveries to mailboxes in another
+ *  file system than the message (i.e., in another store root).
+ *
+ *  Returns: descriptor of the copy, or -1 if the message cannot be
+ *           copied.
+ */
+static int copy_mail_file(const char *basefile, int dir_fd) {
+  
+  int in_fd = open(basefile, O_RDONLY | O_CLOEXEC);
+  if (in_fd < 0) return -1;
+  int out_fd = openat(dir_fd, ".", O_TMPFILE | O_RDWR | O_CLOEXEC, 0666);
+  if (out_fd >= 0 && copy_file_contents(in_fd, out_fd) < 0) {
+    int error = errno;
+    close(out_fd);
+    errno = error;
+    out_fd = -1;
+  }
+  close(in_fd);
+  return out_fd;
+}
+
+/** Internal function that delivers a message to a single user,
+ *  recording the outcome in the user item, and in the journal.
+ */
+static void deliver_user_mail(const char *basefile, size_t size, struct journal_message *message,
+                              unsigned int number, struct user_item *item) {
+  
+  char mail_file[32];
+  
+  PROBE1(deliver__start, item->user);
+  
+  // The message number comes from the mailbox index, which stays
+  // locked until the new message is added to it. Without an index,
+  // look for an unused number instead.
+  uint64_t start = flightrec_now();
+  struct mail_index index = { .entries = NULL };
+  int index_fd;
+  int dir_fd = open_locked_mail_directory(item->user, 1, LOCK_EX, &index_fd);
+  if (dir_fd < 0) {
+    item->error = errno;
+    PROBE2(deliver__end, item->user, item->error);
+    return;
+  }
+  int rebuilt = 0;
+  unsigned int i;
+  if (index_fd < 0) {
+    i = find_free_mail_number(dir_fd);
+  } else {
+    if (read_mail_index_header(index_fd, dir_fd, &index.header) < 0) {
+      scan_mail_directory(dir_fd, &index);
+      rebuilt = 1;
+    }
+    i = index.header.next_number;
+  }
+  if (number != ANY_MAIL_NUMBER) {
+    // A replayed delivery that is already in the mailbox is skipped,
+    // and one with an earlier number than the last one rebuilds the
+    // index, to keep it in order
+    if (number < i && index_fd >= 0) {
+      free(index.entries);
+      index.entries = NULL;
+      rebuilt = -1;
+    }
+    i = number;
+  }
+  
+  // Tries to create the file, moving on to the next number if it
+  // exists (i.e., if it was created without going through the index).
+  // Mailboxes in another store root than the message get a copy.
+  const char *source = basefile;
+  char copy_path[32];
+  int copy_fd = -1, rv, exists = 0;
+  sprintf(mail_file, "%u" MAIL_FILE_SUFFIX, i);
+  while ((rv = linkat(AT_FDCWD, source, dir_fd, mail_file, AT_SYMLINK_FOLLOW)) < 0) {
+    if (errno == EEXIST && number != ANY_MAIL_NUMBER) {
+      exists = 1;
+      rv = 0;
+      break;
+    } else if (errno == EEXIST) {
+      sprintf(mail_file, "%u" MAIL_FILE_SUFFIX, ++i);
+    } else if (errno == EXDEV && copy_fd < 0 && (copy_fd = copy_mail_file(basefile, dir_fd)) >= 0) {
+      sprintf(copy_path, "/proc/self/fd/%d", copy_fd);
+      source = copy_path;
+    } else {
+      break;
+    }
+  }
+  
+  item->error = rv < 0 ? errno : 0;
+  if (copy_fd >= 0) close(copy_fd);
+  
+  if (index_fd >= 0) {
+    if (rebuilt < 0) {
+      scan_mail_directory(dir_fd, &index);
+      write_mail_index(index_fd, dir_fd, &index.header, index.entries, 0);
+    } else if (rv == 0 && !exists) {
+      struct mail_index_entry entry = { i, 0, size };
+      index.header.next_number = i + 1;
+      index.header.bytes += size;
+      if (rebuilt) {
+        index.entries = realloc(index.entries, (index.header.count + 1) * sizeof(struct mail_index_entry));
+        index.entries[index.header.count++] = entry;
+        write_mail_index(index_fd, dir_fd, &index.header, index.entries, 0);
+      } else {
+        index.header.count++;
+        write_mail_index(index_fd, dir_fd, &index.header, &entry, index.header.count - 1);
+      }
+    } else if (rebuilt) {
+      write_mail_index(index_fd, dir_fd, &index.header, index.entries, 0);
+    }
+  }
+  
+  // The journal is written while the index is still locked, so the
+  // changes to the mailbox are recorded in order
+  if (rv == 0 && !exists)
+    journal_deliver(message, item->user, i);
+  if (index_fd >= 0) close(index_fd);
+  free(index.entries);
+  
+  flightrec_record(FR_MAIL_LINK, item->user, flightrec_now() - start, item->error);
+  PROBE2(deliver__end, item->user, item->error);
+  close(dir_fd);
+}
+
+struct delivery_batch {
+  const char *basefile;
+  size_t size;
+  struct journal_message *message;
+  struct user_item **items;
+  unsigned int count;
+  unsigned int next;
+};
+
+/** Internal function run by each delivery thread. Threads take the
+ *  next undelivered recipient from the shared batch until all
+ *  recipients are handled.
+ */
+static void *delivery_worker(void *arg) {
+  
+  struct delivery_batch *batch = arg;
+  unsigned int i;
+  while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < batch->count)
+    deliver_user_mail(batch->basefile, batch->size, batch->message, ANY_MAIL_NUMBER, batch->items[i]);
+  return NULL;
+}
+
+/** Saves a new email message into the mail storage for a list of
+ *  users.
+ *
+ *  This function uses hard links to create the files based on an
+ *  existing temporary file. Files created with open_mail_spool_file
+ *  are in the first root of the mail store; mailboxes in other roots
+ *  (i.e., other file systems) get a copy of the file instead.
+ *
+ *  Messages with many recipients are delivered by a small pool of
+ *  threads working in parallel. The outcome for each recipient can
+ *  be retrieved with get_user_delivery_error.
+ *
+ *  Parameters: basefile: Name of a temporary file containing the
+ *                        contents of the email message.
+ *              users: List of recipient users to the message.
+ *
+ *  Returns: Number of recipients the message could not be delivered
+ *           to (zero if delivery succeeded for all recipients).
+ */
+int save_user_mail(const char *basefile, user_list_t users) {
+  
+  if (!users) return 0;
+  
+  struct user_item *item;
+  struct stat file_stat;
+  size_t size = stat(basefile, &file_stat) == 0 ? file_stat.st_size : 0;
+  struct journal_message message;
+  journal_begin_message(&message, basefile, size);
+  
+  if (users->count < DELIVERY_THREAD_THRESHOLD) {
+    for (item = users->head; item; item = item->next)
+      deliver_user_mail(basefile, size, &message, ANY_MAIL_NUMBER, item);
+  } else {
+    struct delivery_batch batch = { basefile, size, &message, NULL, 0, 0 };
+    pthread_t threads[DELIVERY_THREADS - 1];
+    int num_threads = 0;
+    
+    batch.items = malloc(users->count * sizeof(struct user_item *));
+    for (item = users->head; item; item = item->next)
+      batch.items[batch.count++] = item;
+    
+    // The calling thread also works on the batch, so only start the
+    // remaining threads
+    while (num_threads < DELIVERY_THREADS - 1 &&
+           pthread_create(&threads[num_threads], NULL, delivery_worker, &batch) == 0)
+      num_threads++;
+    delivery_worker(&batch);
+    while (num_threads > 0)
+      pthread_join(threads[--num_threads], NULL);
+    free(batch.items);
+  }
+  journal_end_message(&message);
+  
+  int failed = 0;
+  for (item = users->head; item; item = item->next)
+    failed += item->error != 0;
+  return failed;
+}
+
+/** Adds a message to a user's mailbox with a given number, to replay
+ *  a delivery recorded in the journal of another mail store (see
+ *  mailfollow.c). A message already in the mailbox with that number is
+ *  left as is, so deliveries can be replayed more than once.
+ *
+ *  Parameters: basefile: Name of a temporary file containing the
+ *                        contents of the email message.
+ *              username: Name of the user.
+ *              number: Number of the message in the mailbox.
+ *
+ *  Returns: zero if the message is in the mailbox, or an error number
+ *           (as for get_user_delivery_error) otherwise.
+ */
+int restore_user_mail(const char *basefile, const char *username, unsigned int number) {
+  
+  struct user_item item = { .user = (char *) username };
+  struct stat file_stat;
+  size_t size = stat(basefile, &file_stat) == 0 ? file_stat.st_size : 0;
+  struct journal_message message;
+  journal_begin_message(&message, basefile, size);
+  deliver_user_mail(basefile, size, &message, number, &item);
+  journal_end_message(&message);
+  return item.error;
+}
+
+/** Starts a batch of messages to be added to a user's mailbox (e.g.,
+ *  by a bulk import). Each message is written to an unnamed file in
+ *  the mail directory as it is added to the batch, and the messages
+ *  are only added to the mailbox, with a single update of its index,
+ *  when the batch is committed.
+ *
+ *  Parameters: username: Name of the user.
+ *
+ *  Returns: the new batch, or NULL (with errno set) if the mail
+ *           directory cannot be opened.
+ */
+mail_batch_t create_mail_batch(const char *username) {
+  
+  int dir_fd = open_mail_directory(username, 1);
+  if (dir_fd < 0) return NULL;
+  mail_batch_t batch = calloc(1, sizeof(struct mail_batch));
+  if (batch) batch->username = strdup(username);
+  if (!batch || !batch->username) {
+    free(batch);
+    close(dir_fd);
+    errno = ENOMEM;
+    return NULL;
+  }
+  batch->dir_fd = dir_fd;
+  return batch;
+}
+
+/** Writes a message to a batch, to be added to the mailbox when the
+ *  batch is committed. Messages must already be in the format kept in
+ *  the store (CRLF line endings and dot-stuffing, as received in
+ *  DATA).
+ *
+ *  Parameters: batch: Batch created with create_mail_batch.
+ *              data: Contents of the message.
+ *              size: Size of the message.
+ *
+ *  Returns: zero if the message was written, or -1 (with errno set)
+ *           otherwise.
+ */
+int add_mail_to_batch(mail_batch_t batch, const void *data, size_t size) {
+  
+  if (batch->count == batch->allocated) {
+    unsigned int allocated = batch->allocated ? batch->allocated * 2 : 64;
+    struct mail_batch_file *files = realloc(batch->files, allocated * sizeof(struct mail_batch_file));
+    if (!files) {
+      errno = ENOMEM;
+      return -1;
+    }
+    batch->files = files;
+    batch->allocated = allocated;
+  }
+  
+  int fd = openat(batch->dir_fd, ".", O_TMPFILE | O_RDWR | O_CLOEXEC, 0666);
+  if (fd < 0) return -1;
+  for (size_t written = 0; written < size; ) {
+    ssize_t rv = write(fd, (const char *) data + written, size - written);
+    if (rv < 0) {
+      int error = errno;
+      close(fd);
+      errno = error;
+      return -1;
+    }
+    written += rv;
+  }
+  batch->files[batch->count].fd = fd;
+  batch->files[batch->count].size = size;
+  batch->count++;
+  return 0;
+}
+
+/** Flushes to disk the file system holding a batch, so the messages
+ *  written to it (and anything committed before) survive a crash. A
+ *  single call covers every file of the batch.
+ *
+ *  Returns: zero if successful, or -1 otherwise.
+ */
+int sync_mail_batch(mail_batch_t batch) {
+  return syncfs(batch->dir_fd);
+}
+
+/** Internal function that closes the files of a batch, leaving it
+ *  empty.
+ */
+static void clear_mail_batch(mail_batch_t batch) {
+  for (unsigned int i = 0; i < batch->count; i++)
+    close(batch->files[i].fd);
+  batch->count = 0;
+}
+
+/** Adds the messages of a batch to the mailbox, in the order they were
+ *  written, under a single lock of the mailbox index, which is updated
+ *  once. The batch is left empty, ready for more messages. Messages
+ *  are not flushed to disk (see sync_mail_batch).
+ *
+ *  Parameters: batch: Batch created with create_mail_batch.
+ *              next_number: If not NULL, set to the number following
+ *                           the last message added.
+ *
+ *  Returns: number of messages added, or -1 (with errno set) if they
+ *           could not all be added.
+ */
+int commit_mail_batch(mail_batch_t batch, unsigned int *next_number) {
+  
+  if (!batch->count) return 0;
   
-  char user_file[MAX_USERNAME_SIZE+1];
-  char pw_file[MAX_PASSWORD_SIZE+1];
+  // The mailbox is opened again, in case it was moved since the batch
+  // was created; messages are then copied
+  int index_fd;
+  int dir_fd = open_locked_mail_directory(batch->username, 1, LOCK_EX, &index_fd);
+  if (dir_fd < 0) {
+    int error = errno;
+    clear_mail_batch(batch);
+    errno = error;
+    return -1;
+  }
+  struct mail_index index = { .entries = NULL };
+  int rebuilt = 0;
+  unsigned int i;
+  if (index_fd < 0) {
+    i = find_free_mail_number(dir_fd);
+  } else {
+    if (read_mail_index_header(index_fd, dir_fd, &index.header) < 0) {
+      scan_mail_directory(dir_fd, &index);
+      rebuilt = 1;
+    }
+    i = index.header.next_number;
+  }
   
-  while (fscanf(file_ptr, "%s%s", user_file, pw_file) == 2) {
-    if (!strcasecmp(username, user_file))
-      return password == NULL || !strcmp(password, pw_file);
+  struct mail_index_entry *added = malloc(batch->count * sizeof(struct mail_index_entry));
+  unsigned int count = 0;
+  int error = added ? 0 : ENOMEM;
+  char mail_file[32], file_path[32], copy_path[32];
+  for (unsigned int f = 0; !error && f < batch->count; f++) {
+    sprintf(file_path, "/proc/self/fd/%d", batch->files[f].fd);
+    const char *source = file_path;
+    int copy_fd = -1, rv;
+    sprintf(mail_file, "%u" MAIL_FILE_SUFFIX, i);
+    while ((rv = linkat(AT_FDCWD, source, dir_fd, mail_file, AT_SYMLINK_FOLLOW)) < 0) {
+      if (errno == EEXIST) {
+        sprintf(mail_file, "%u" MAIL_FILE_SUFFIX, ++i);
+      } else if (errno == EXDEV && copy_fd < 0 && (copy_fd = copy_mail_file(file_path, dir_fd)) >= 0) {
+        sprintf(copy_path, "/proc/self/fd/%d", copy_fd);
+        source = copy_path;
+      } else {
+        break;
+      }
+    }
+    if (rv < 0) {
+      error = errno;
+    } else {
+      added[count].number = i++;
+      added[count].unused = 0;
+      added[count].size = batch->files[f].size;
+      count++;
+    }
+    if (copy_fd >= 0) close(copy_fd);
   }
-
-  return 0;
+  
+  if (index_fd >= 0 && (count || rebuilt)) {
+    index.header.next_number = count ? i : index.header.next_number;
+    for (unsigned int a = 0; a < count; a++)
+      index.header.bytes += added[a].size;
+    if (rebuilt) {
+      index.entries = realloc(index.entries, (index.header.count + count) * sizeof(struct mail_index_entry));
+      memcpy(index.entries + index.header.count, added, count * sizeof(struct mail_index_entry));
+      index.header.count += count;
+      write_mail_index(index_fd, dir_fd, &index.header, index.entries, 0);
+    } else {
+      index.header.count += count;
+      write_mail_index(index_fd, dir_fd, &index.header, added, index.header.count - count);
+    }
+  }
+  
+  // The journal is written while the index is still locked, see
+  // deliver_user_mail
+  for (unsigned int a = 0; a < count && journal_enabled(); a++) {
+    struct journal_message message;
+    sprintf(file_path, "/proc/self/fd/%d", batch->files[a].fd);
+    journal_begin_message(&message, file_path, added[a].size);
+    journal_deliver(&message, batch->username, added[a].number);
+    journal_end_message(&message);
+  }
+  if (index_fd >= 0) close(index_fd);
+  close(dir_fd);
+  free(index.entries);
+  free(added);
+  clear_mail_batch(batch);
+  
+  if (next_number) *next_number = i;
+  if (error) {
+    errno = error;
+    return -1;
+  }
+  return count;
 }
 
-/** Creates a new, empty, list of users.
- * 
- *  Returns: A user_list_t object with no users.
+/** Destroys a batch, discarding the messages not committed.
  */
-user_list_t create_user_list(void) {
-  return NULL;
+void destroy_mail_batch(mail_batch_t batch) {
+  if (!batch) return;
+  clear_mail_batch(batch);
+  close(batch->dir_fd);
+  free(batch->files);
+  free(batch->username);
+  free(batch);
 }
 
-/** Adds a user name to a list of users.
- *  
- *  Parameters: list: address of the list of users to be modified.
- *              username: Name of the user to be added. The name will
- *                        be copied to a new buffer, so the caller is
- *                        free to use a string that will be modified
- *                        later.
+/** Creates a temporary file in the mail storage, to receive a new
+ *  message before it is saved with save_user_mail (or queued). The
+ *  file is created with O_TMPFILE, so it has no name until it is
+ *  linked into a mailbox, and nothing is left behind if the process
+ *  dies before that. On file systems without O_TMPFILE, a named file
+ *  is created in the spool directory of the mail storage instead, and
+ *  removed by close_mail_spool_file.
+ *
+ *  Parameters: file: Set to the descriptor of the new file, open for
+ *                    reading and writing, and a path that can be
+ *                    passed to save_user_mail.
+ *
+ *  Returns: zero if the file was created, or -1 otherwise.
  */
-void add_user_to_list(user_list_t *list, const char *username) {
-  user_list_t new_list = malloc(sizeof(struct user_list));
-  new_list->user = strdup(username);
-  new_list->next = *list;
-  *list = new_list;
+int open_mail_spool_file(struct mail_spool_file *file) {
+  
+  const struct mail_store_layout *layout = get_store_layout();
+  int base_fd = layout->num_roots ? layout->root_fds[0] : -1;
+  if (base_fd < 0) return -1;
+  mkdirat(base_fd, MAIL_SPOOL_DIRECTORY, 0777);
+  
+  // The file is linked through its /proc entry, which (unlike linking
+  // the descriptor itself) needs no privileges
+  file->fd = openat(base_fd, MAIL_SPOOL_DIRECTORY, O_TMPFILE | O_RDWR | O_CLOEXEC, 0666);
+  if (file->fd >= 0) {
+    file->named = 0;
+    snprintf(file->path, sizeof(file->path), "/proc/self/fd/%d", file->fd);
+    return 0;
+  }
+  
+  file->named = 1;
+  snprintf(file->path, sizeof(file->path), "%s/" MAIL_SPOOL_DIRECTORY "/msg-XXXXXX", layout->roots[0]);
+  file->fd = mkostemp(file->path, O_CLOEXEC);
+  return file->fd < 0 ? -1 : 0;
 }
 
-/** Frees all memory used by a list of users.
+/** Closes a temporary file created with open_mail_spool_file. The
+ *  message remains in the mailboxes it was saved to.
  *
- * Parameters: list: list of users to be freed.
+ *  Parameters: file: File to be closed.
  */
-void destroy_user_list(user_list_t list) {
-  while (list) {
-    user_list_t next = list->next;
-    free(list->user);
-    free(list);
-    list = next;
-  }
+void close_mail_spool_file(struct mail_spool_file *file) {
+  if (file->fd < 0) return;
+  if (file->named)
+    unlink(file->path);
+  close(file->fd);
+  file->fd = -1;
 }
 
-/** Saves a new email message into the mail storage for a list of
- *  users.
- *
- *  This function uses hard links to create the files based on an
- *  existing temporary file. It assumes the temporary file is in the
- *  same file system as the newly created files. Typically, saving the
- *  temporary file in a local directory (where the executable is
- *  running) is enough for this to work.
- *
- *  Parameters: basefile: Name of a temporary file containing the
- *                        contents of the email message.
- *              users: List of recipient users to the message.
+/** Removes named temporary files left in the spool directory of the
+ *  mail storage by processes that died while receiving a message
+ *  (only on file systems without O_TMPFILE). Files modified in the
+ *  last hour are kept, as they may belong to messages still being
+ *  received.
  */
-void save_user_mail(const char *basefile, user_list_t users) {
+void clean_mail_spool(void) {
   
-  char mail_file[NAME_MAX + 1];
-  
-  // Create base directory if it doesn't exist yet (error ignored)
-  mkdir(MAIL_BASE_DIRECTORY, 0777);
+  const struct mail_store_layout *layout = get_store_layout();
+  int base_fd = layout->num_roots ? layout->root_fds[0] : -1;
+  int dir_fd = base_fd < 0 ? -1 : openat(base_fd, MAIL_SPOOL_DIRECTORY, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  DIR *dir = dir_fd >= 0 ? fdopendir(dir_fd) : NULL;
+  if (!dir) {
+    if (dir_fd >= 0) close(dir_fd);
+    return;
+  }
   
-  for (; users; users = users->next) {
-    
-    // Create a directory for the user if it doesn't exist yet. If it
-    // exists mkdir will return an error, which is ignored.
-    int i = 0;
-    sprintf(mail_file, MAIL_BASE_DIRECTORY "/%s", users->user);
-    mkdir(mail_file, 0777);
-    
-    // Tries to create a file called 0.mail, if it exists tries 1.mail, and so on
-    do {
-      sprintf(mail_file, MAIL_BASE_DIRECTORY "/%s/%d" MAIL_FILE_SUFFIX, users->user, i++);
-    } while (link(basefile, mail_file) < 0 && errno == EEXIST);
+  time_t now = time(NULL);
+  struct stat file_stat;
+  struct dirent *dir_entry;
+  while ((dir_entry = readdir(dir)) != NULL) {
+    if (dir_entry->d_type == DT_REG && fstatat(dir_fd, dir_entry->d_name, &file_stat, 0) == 0 &&
+        now - file_stat.st_mtime >= SPOOL_ORPHAN_AGE)
+      unlinkat(dir_fd, dir_entry->d_name, 0);
   }
+  closedir(dir);
 }
 
 /** Reads the list of available email messages for a username, based
  *  on existing email files created using save_user_mail (or
- *  equivalent). Only file names and sizes are loaded into memory, the
- *  messages themselves are not kept in memory. If the user does not
+ *  equivalent). Only message numbers and sizes are loaded into
+ *  memory, the messages themselves are not kept in memory. Messages
+ *  are listed in the order they were delivered. If the user does not
  *  exist or does not have any messages, an empty list is returned.
  *
+ *  The list is taken from the mailbox index, so the mail directory is
+ *  only scanned if the index is missing or out of date.
+ *
  *  Parameters: username: Name of the user whose email messages should
  *                        be retrieved.
  *
@@ -171,60 +1687,170 @@ void save_user_mail(const char *basefile, user_list_t users) {
  */
 mail_list_t load_user_mail(const char *username) {
   
-  char filename[NAME_MAX + 1];
-  sprintf(filename, MAIL_BASE_DIRECTORY "/%s", username);
-  
-  DIR *dir = opendir(filename);
-  if (!dir) return NULL;
-  
-  struct stat file_stat;
-  struct dirent *dir_entry;
-  const size_t suflen = strlen(MAIL_FILE_SUFFIX);
-  struct mail_list *list = NULL;
+  uint64_t start = flightrec_now();
+  struct mail_list *list = calloc(1, sizeof(struct mail_list));
+  struct mail_index index = { .entries = NULL };
+  int index_fd;
   
-  while ((dir_entry = readdir(dir)) != NULL) {
+  list->username = strdup(username);
+  list->dir_fd = open_locked_mail_directory(username, 0, LOCK_SH, &index_fd);
+  if (list->dir_fd >= 0) {
+    int current = index_fd >= 0 && read_mail_index(index_fd, list->dir_fd, &index) == 0;
+    int exclusive = 0;
     
-    if (// Check if it's a regular file (not a directory)
-        dir_entry->d_type == DT_REG &&
-        // Check if the filename is big enough to contain the suffix
-	strlen(dir_entry->d_name) > suflen &&
-        // Check if the filename ends with the mail suffix
-	!strcmp(dir_entry->d_name + strlen(dir_entry->d_name) - suflen, MAIL_FILE_SUFFIX)) {
-      
-      struct mail_list *node = malloc(sizeof(struct mail_list));
-      sprintf(node->item.file_name, MAIL_BASE_DIRECTORY "/%s/%s",
-              username, dir_entry->d_name);
-      
-      if (stat(node->item.file_name, &file_stat) < 0) {
-	free(node);
-	continue;
-      }
-      
-      node->item.file_size = file_stat.st_size;
-      node->item.deleted = 0;
-      node->next = list;
-      list = node;
+    // Rebuilding the index needs an exclusive lock. Upgrading the lock
+    // is not atomic, so another process may have rebuilt it meanwhile.
+    if (!current && index_fd >= 0 && flock(index_fd, LOCK_EX) == 0) {
+      exclusive = 1;
+      current = read_mail_index(index_fd, list->dir_fd, &index) == 0;
+    }
+    if (!current) {
+      scan_mail_directory(list->dir_fd, &index);
+      if (exclusive)
+        write_mail_index(index_fd, list->dir_fd, &index.header, index.entries, 0);
     }
+    if (index_fd >= 0) close(index_fd);
   }
   
-  closedir(dir);
+  list->count = index.header.count;
+  list->items = malloc((list->count ? list->count : 1) * sizeof(struct mail_item));
+  for (unsigned int i = 0; i < list->count; i++) {
+    list->items[i].number = index.entries[i].number;
+    list->items[i].file_size = index.entries[i].size;
+    list->items[i].deleted = 0;
+    list->items[i].list = list;
+  }
+  free(index.entries);
+  
+  flightrec_record(FR_MAIL_LOAD, NULL, flightrec_now() - start, list->count);
+  PROBE3(mailbox__load, username, list->count, flightrec_now() - start);
   return list;
 }
 
+/** Internal function that appends the messages marked for deletion
+ *  in a list of emails to the expunge journal of the mailbox, with a
+ *  single write that is flushed to disk. Must be called with an
+ *  exclusive lock on the index.
+ *
+ *  Returns: zero if the messages were recorded, or -1 otherwise.
+ */
+static int journal_mail_expunge(mail_list_t list) {
+  
+  int journal_fd = openat(list->dir_fd, MAIL_EXPUNGE_FILE_NAME, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+  struct stat journal_stat;
+  if (journal_fd < 0) return -1;
+  if (fstat(journal_fd, &journal_stat) < 0) {
+    close(journal_fd);
+    return -1;
+  }
+  
+  // A new (or emptied) journal starts with its header. Part of an
+  // entry left by a failed append is dropped; the files of complete
+  // entries were removed right away, and removing them again is
+  // harmless.
+  struct mail_expunge_header header = { sizeof(header) };
+  off_t aligned = journal_stat.st_size < sizeof(header) ? 0 :
+    sizeof(header) + (journal_stat.st_size - sizeof(header)) / sizeof(uint32_t) * sizeof(uint32_t);
+  size_t start = aligned ? 0 : sizeof(header);
+  char *record = malloc(start + list->count * sizeof(uint32_t));
+  size_t size = start;
+  memcpy(record, &header, start);
+  for (unsigned int i = 0; i < list->count; i++) {
+    if (list->items[i].deleted) {
+      uint32_t number = list->items[i].number;
+      memcpy(record + size, &number, sizeof(number));
+      size += sizeof(number);
+    }
+  }
+  
+  int rv = (aligned == journal_stat.st_size || ftruncate(journal_fd, aligned) == 0) &&
+    write(journal_fd, record, size) == size && fdatasync(journal_fd) == 0 ? 0 : -1;
+  free(record);
+  close(journal_fd);
+  return rv;
+}
+
+/** Internal function that removes the messages marked for deletion
+ *  in a list of emails from the mailbox index. Their files are either
+ *  deleted right away, or recorded in the expunge journal if expunges
+ *  are deferred. The index is locked while the files are deleted, so
+ *  deliveries made in the meantime are not lost.
+ */
+static void expunge_mail_list(mail_list_t list) {
+  
+  char mail_file[32];
+  struct mail_index index = { .entries = NULL };
+  int index_fd = open_mail_index(list->dir_fd, LOCK_EX);
+  int current = index_fd >= 0 && read_mail_index(index_fd, list->dir_fd, &index) == 0;
+  int deferred = expunge_notify && index_fd >= 0 && journal_mail_expunge(list) == 0;
+  
+  for (unsigned int i = 0; i < list->count && !deferred; i++) {
+    if (list->items[i].deleted) {
+      sprintf(mail_file, "%u" MAIL_FILE_SUFFIX, list->items[i].number);
+      unlinkat(list->dir_fd, mail_file, 0);
+    }
+  }
+  
+  // Deferred files are still in the directory, which must look changed
+  // all the same, or other servers keep using their cached figures
+  if (deferred)
+    touch_mail_directory(list->dir_fd);
+  
+  // Both the list and the index are sorted by message number. If the
+  // index was not current, it is rebuilt by the next load.
+  if (current) {
+    unsigned int kept = 0, pos = 0;
+    for (unsigned int i = 0; i < index.header.count; i++) {
+      struct mail_index_entry *entry = &index.entries[i];
+      while (pos < list->count && list->items[pos].number < entry->number)
+        pos++;
+      if (pos < list->count && list->items[pos].number == entry->number && list->items[pos].deleted)
+        index.header.bytes -= entry->size;
+      else
+        index.entries[kept++] = *entry;
+    }
+    index.header.count = kept;
+    write_mail_index(index_fd, list->dir_fd, &index.header, index.entries, 0);
+  }
+  
+  // The journal is written while the index is still locked, see
+  // deliver_user_mail
+  if (journal_enabled()) {
+    uint32_t *numbers = malloc(list->count * sizeof(uint32_t));
+    unsigned int count = 0;
+    for (unsigned int i = 0; numbers && i < list->count; i++)
+      if (list->items[i].deleted)
+        numbers[count++] = list->items[i].number;
+    if (numbers)
+      journal_expunge(list->username, numbers, count);
+    free(numbers);
+  }
+  
+  free(index.entries);
+  if (index_fd >= 0) close(index_fd);
+  
+  // If the expunger cannot be told, the files are removed right away
+  if (deferred && expunge_notify(list->username) < 0)
+    while (expunge_user_mail(list->username, EXPUNGE_BATCH_SIZE) > 0);
+}
+
 /** Frees all memory used by a list of emails. Also deletes any files
  *  marked to be deleted.
  *
  *  Parameters: list: List of emails to be deleted.
  */
 void destroy_mail_list(mail_list_t list) {
-  while (list) {
-    
-    if (list->item.deleted) unlink(list->item.file_name);
-    
-    mail_list_t next = list->next;
-    free(list);
-    list = next;
+  
+  if (!list) return;
+  
+  if (list->dir_fd >= 0) {
+    if (get_mail_count(list) < list->count)
+      expunge_mail_list(list);
+    close(list->dir_fd);
   }
+  free(list->username);
+  free(list->items);
+  free(list);
 }
 
 /** Returns the number of email messages available in a list of
@@ -238,10 +1864,8 @@ void destroy_mail_list(mail_list_t list) {
  */
 unsigned int get_mail_count(mail_list_t list) {
   unsigned int rv = 0;
-  while (list) {
-    if (!list->item.deleted) rv++;
-    list = list->next;
-  }
+  for (unsigned int i = 0; list && i < list->count; i++)
+    rv += !list->items[i].deleted;
   return rv;
 }
 
@@ -263,13 +1887,9 @@ unsigned int get_mail_count(mail_list_t list) {
  */
 mail_item_t get_mail_item(mail_list_t list, unsigned int pos) {
   
-  while (list) {
-    if (!pos--)
-      return list->item.deleted ? NULL : &list->item;
-    list = list->next;
-  }
-  
-  return NULL;
+  if (!list || pos >= list->count || list->items[pos].deleted)
+    return NULL;
+  return &list->items[pos];
 }
 
 /** Returns the total amount of bytes in all email messages in a list
@@ -281,10 +1901,8 @@ mail_item_t get_mail_item(mail_list_t list, unsigned int pos) {
  */
 size_t get_mail_list_size(mail_list_t list) {
   size_t rv = 0;
-  while (list) {
-    rv += list->item.deleted ? 0 : list->item.file_size;
-    list = list->next;
-  }
+  for (unsigned int i = 0; list && i < list->count; i++)
+    rv += list->items[i].deleted ? 0 : list->items[i].file_size;
   return rv;
 }
 
@@ -298,6 +1916,17 @@ size_t get_mail_item_size(mail_item_t item) {
   return item->file_size;
 }
 
+/** Returns the number of an email message in its mailbox (i.e., the
+ *  name of its file), which does not change while it is there.
+ *
+ *  Parameters: item: Email message to be assessed.
+ *
+ *  Returns: Number of the email message.
+ */
+unsigned int get_mail_item_number(mail_item_t item) {
+  return item->number;
+}
+
 /** Returns a file pointer that can be used to read the contents of an
  *  email message. The caller is responsible for closing the file
  *  using the `fclose()` function once the data is no longer needed.
@@ -305,10 +1934,17 @@ size_t get_mail_item_size(mail_item_t item) {
  *  Parameters: item: Email message to be retrieved.
  *
  *  Returns: FILE * object, or NULL in case of error retrieving the
- *           contents.
+ *           contents (e.g., if the message was deleted by another
+ *           session).
  */
 FILE *get_mail_item_contents(mail_item_t item) {
-  return fopen(item->file_name, "r");
+  
+  char mail_file[32];
+  sprintf(mail_file, "%u" MAIL_FILE_SUFFIX, item->number);
+  int fd = openat(item->list->dir_fd, mail_file, O_RDONLY | O_CLOEXEC);
+  FILE *file = fd < 0 ? NULL : fdopen(fd, "r");
+  if (fd >= 0 && !file) close(fd);
+  return file;
 }
 
 /** Marks a message for deletion in the internal email list. Does not
@@ -332,11 +1968,612 @@ unsigned int reset_mail_list_deleted_flag(mail_list_t list) {
   
   unsigned int rv = 0;
   
-  while (list) {
-    rv += list->item.deleted;
-    list->item.deleted = 0;
-    list = list->next;
+  for (unsigned int i = 0; list && i < list->count; i++) {
+    rv += list->items[i].deleted;
+    list->items[i].deleted = 0;
+  }
+  
+  return rv;
+}
+
+/** Locks the mailbox of a user for exclusive access, as POP3 requires
+ *  for a maildrop. Only one session at a time can hold the lock of a
+ *  mailbox, but messages can still be delivered to it while it is
+ *  locked. The lock is held until unlock_user_mail is called, or the
+ *  process exits.
+ *
+ *  Parameters: username: Name of the user whose mailbox should be
+ *                        locked, spelled as in the users file (see
+ *                        find_user_name), as the lock is taken in the
+ *                        mailbox of that exact name.
+ *
+ *  Returns: A non-negative lock handle, or -1 if the mailbox is locked
+ *           by another session (with errno set to EWOULDBLOCK) or
+ *           cannot be locked.
+ */
+int lock_user_mail(const char *username) {
+  
+  for (int attempt = 1; ; attempt++) {
+    // The lock is kept in the user's mail directory, created if needed
+    int dir_fd = open_mail_directory(username, 1);
+    if (dir_fd < 0) return -1;
+    int lock_fd = openat(dir_fd, MAIL_LOCK_FILE_NAME, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    
+    if (lock_fd >= 0 && flock(lock_fd, LOCK_EX | LOCK_NB) < 0) {
+      int error = errno;
+      close(lock_fd);
+      close(dir_fd);
+      errno = error;
+      return -1;
+    }
+    
+    // A mailbox copied to another file system (see reshard_user_mail)
+    // just before it was locked is locked again in its new place
+    if (lock_fd < 0 || attempt == MAX_MAILBOX_ATTEMPTS || !is_mail_directory_moved(username, dir_fd)) {
+      close(dir_fd);
+      return lock_fd;
+    }
+    close(lock_fd);
+    close(dir_fd);
+  }
+}
+
+/** Releases a mailbox lock obtained with lock_user_mail.
+ *
+ *  Parameters: lock: Lock handle returned by lock_user_mail.
+ */
+void unlock_user_mail(int lock) {
+  if (lock >= 0) close(lock);
+}
+
+/** Returns the number of messages in a user's mailbox and their total
+ *  size, as recorded in the mailbox index. The figures are kept up to
+ *  date by every delivery and expunge, so they are taken from the
+ *  mailbox cache if it has them, and otherwise only the index header
+ *  is read. If the mailbox was changed without going through the
+ *  index, the index is rebuilt first.
+ *
+ *  Parameters: username: Name of the user whose mailbox is assessed.
+ *              usage: Set to the number of messages and bytes in the
+ *                     mailbox (zero if the mailbox does not exist).
+ *
+ *  Returns: zero if successful, or -1 if the mailbox cannot be read.
+ */
+int get_user_mail_usage(const char *username, struct mail_usage *usage) {
+  
+  memset(usage, 0, sizeof(*usage));
+  struct stat dir_stat;
+  if (mailbox_cache && stat_mail_directory(username, &dir_stat) == 0 &&
+      find_cached_mailbox_usage(&dir_stat, usage) == 0)
+    return 0;
+  int index_fd;
+  int dir_fd = open_locked_mail_directory(username, 0, LOCK_SH, &index_fd);
+  if (dir_fd < 0)
+    return errno == ENOENT ? 0 : -1;
+  
+  struct mail_index index = { .entries = NULL };
+  if (index_fd >= 0) {
+    // Rebuilding the index needs an exclusive lock, see load_user_mail
+    if (read_mail_index_header(index_fd, dir_fd, &index.header) == 0) {
+      if (fstat(dir_fd, &dir_stat) == 0)
+        cache_mailbox_usage(&dir_stat, &index.header);
+    } else if (flock(index_fd, LOCK_EX) == 0 &&
+               read_mail_index_header(index_fd, dir_fd, &index.header) < 0) {
+      scan_mail_directory(dir_fd, &index);
+      write_mail_index(index_fd, dir_fd, &index.header, index.entries, 0);
+      free(index.entries);
+    }
+    usage->messages = index.header.count;
+    usage->bytes = index.header.bytes;
+    close(index_fd);
+  }
+  close(dir_fd);
+  return index_fd < 0 ? -1 : 0;
+}
+
+/** Internal function that returns a quota setting for a user: the
+ *  user's own setting (e.g., "quota_bytes:alice") if present, or the
+ *  setting for all users otherwise.
+ */
+static long get_user_quota(const char *setting, const char *username) {
+  char key[MAX_USERNAME_SIZE + 32];
+  snprintf(key, sizeof(key), "%s:%s", setting, username);
+  return config_get_int(key, config_get_int(setting, 0));
+}
+
+/** Checks if a user's mailbox has reached its quota of messages
+ *  (quota_messages setting) or bytes (quota_bytes setting). A quota of
+ *  zero means no limit. Messages are accepted as long as the mailbox
+ *  is under its quota, so the last message may take it over.
+ *
+ *  Parameters: username: Name of the user whose mailbox is checked.
+ *
+ *  Returns: non-zero (true) if the mailbox is full, zero otherwise.
+ */
+int is_user_over_quota(const char *username) {
+  
+  long max_messages = get_user_quota("quota_messages", username);
+  long max_bytes = get_user_quota("quota_bytes", username);
+  struct mail_usage usage;
+  if ((max_messages <= 0 && max_bytes <= 0) || get_user_mail_usage(username, &usage) < 0)
+    return 0;
+  
+  return (max_messages > 0 && usage.messages >= max_messages) ||
+    (max_bytes > 0 && usage.bytes >= max_bytes);
+}
+
+/** Counts the messages in a user's mailbox by scanning the mail
+ *  directory, and compares the result with the mailbox index. Used to
+ *  repair an index whose figures drifted from the actual contents of
+ *  the mailbox (e.g., after files were removed by hand).
+ *
+ *  Parameters: username: Name of the user whose mailbox is counted.
+ *              repair: If non-zero, the index is rewritten from the
+ *                      scan if it does not match it.
+ *              recorded: Set to the figures in the index (zero if
+ *                        there is no valid index).
+ *              actual: Set to the figures found in the directory.
+ *
+ *  Returns: zero if the index matches the directory, 1 if it does not
+ *           (and was repaired, if requested), or -1 if the mailbox
+ *           cannot be read.
+ */
+int recount_user_mail(const char *username, int repair, struct mail_usage *recorded,
+                      struct mail_usage *actual) {
+  
+  memset(recorded, 0, sizeof(*recorded));
+  memset(actual, 0, sizeof(*actual));
+  
+  // Deliveries and expunges wait while the directory is scanned
+  int index_fd;
+  int dir_fd = open_locked_mail_directory(username, 0, repair ? LOCK_EX : LOCK_SH, &index_fd);
+  if (dir_fd < 0) return -1;
+  if (index_fd < 0) {
+    close(dir_fd);
+    return -1;
+  }
+  
+  struct mail_index index = { .entries = NULL };
+  int current = read_mail_index_header(index_fd, dir_fd, &index.header) == 0;
+  recorded->messages = index.header.count;
+  recorded->bytes = index.header.bytes;
+  
+  scan_mail_directory(dir_fd, &index);
+  actual->messages = index.header.count;
+  actual->bytes = index.header.bytes;
+  
+  int rv = current && recorded->messages == actual->messages && recorded->bytes == actual->bytes ? 0 : 1;
+  if (rv && repair)
+    write_mail_index(index_fd, dir_fd, &index.header, index.entries, 0);
+  
+  free(index.entries);
+  close(index_fd);
+  close(dir_fd);
+  return rv;
+}
+
+/** Loads the users file and creates the mailbox cache (with the
+ *  mailbox_cache_size setting, in entries; 0 disables it). Must be
+ *  called before any processes are created (i.e., before run_server),
+ *  so that all sessions share the user directory and the cache;
+ *  without it, each session loads the users file on its first lookup
+ *  and reads mailbox figures from the index.
+ */
+void init_mail_caches(void) {
+  
+  refresh_user_directory();
+  
+  long size = config_get_int("mailbox_cache_size", DEFAULT_MAILBOX_CACHE_SIZE);
+  if (size <= 0 || mailbox_cache) return;
+  unsigned long entries = 1;
+  while (entries < size)
+    entries *= 2;
+  void *region = mmap(NULL, entries * sizeof(struct mailbox_cache_entry), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (region == MAP_FAILED) return;
+  mailbox_cache = region;
+  mailbox_cache_mask = entries - 1;
+}
+
+/** Defers the removal of the files of messages deleted by POP3
+ *  sessions: destroy_mail_list records them in the mailbox's expunge
+ *  journal, which is flushed to disk, and then calls the notify
+ *  function with the mailbox's name. The files are then removed by
+ *  calling expunge_user_mail (e.g., in a background process). Must be
+ *  called before any sessions start.
+ *
+ *  Parameters: notify: Function called after messages of a mailbox
+ *                      are recorded in its journal. If it returns a
+ *                      negative value, the files are removed right
+ *                      away instead.
+ */
+void defer_mail_expunge(int (*notify)(const char *username)) {
+  expunge_notify = notify;
+}
+
+/** Removes the files of messages recorded in a mailbox's expunge
+ *  journal, up to a maximum number of files per call, so the caller
+ *  can pace the removals. The journal is emptied once all its files
+ *  are removed. The mail directory is kept open between calls for the
+ *  same mailbox.
+ *
+ *  Parameters: username: Name of the user whose mailbox is expunged.
+ *              max_files: Maximum number of files to remove.
+ *
+ *  Returns: number of files handled, zero if the journal has no
+ *           files left to remove, or -1 if the mailbox cannot be
+ *           read.
+ */
+int expunge_user_mail(const char *username, unsigned int max_files) {
+  
+  static char cached_user[MAX_USERNAME_SIZE + 1];
+  static int cached_dir_fd = -1;
+  
+  // The directory is opened again if the mailbox was copied to
+  // another file system since (see reshard_user_mail)
+  if (cached_dir_fd < 0 || strcmp(cached_user, username) ||
+      is_mail_directory_moved(username, cached_dir_fd)) {
+    if (cached_dir_fd >= 0) close(cached_dir_fd);
+    cached_dir_fd = open_mail_directory(username, 0);
+    if (cached_dir_fd < 0) return errno == ENOENT ? 0 : -1;
+    snprintf(cached_user, sizeof(cached_user), "%s", username);
+  }
+  int dir_fd = cached_dir_fd;
+  
+  // Most mailboxes have no journal, or an empty one, which is checked
+  // without locking the index
+  struct stat journal_stat;
+  struct mail_expunge_header journal;
+  int journal_fd = openat(dir_fd, MAIL_EXPUNGE_FILE_NAME, O_RDWR | O_CLOEXEC);
+  if (journal_fd < 0)
+    return errno == ENOENT ? 0 : -1;
+  if (fstat(journal_fd, &journal_stat) < 0 || journal_stat.st_size <= sizeof(journal)) {
+    close(journal_fd);
+    return 0;
+  }
+  
+  int index_fd = open_mail_index(dir_fd, LOCK_EX);
+  if (index_fd < 0) {
+    close(journal_fd);
+    return -1;
+  }
+  struct mail_index_header header;
+  int current = read_mail_index_header(index_fd, dir_fd, &header) == 0;
+  
+  // The journal may have changed before the lock was taken
+  unsigned int count = 0;
+  if (fstat(journal_fd, &journal_stat) == 0 &&
+      pread(journal_fd, &journal, sizeof(journal), 0) == sizeof(journal) &&
+      journal.done >= sizeof(journal) && journal.done < journal_stat.st_size) {
+    size_t size = (journal_stat.st_size - journal.done) / sizeof(uint32_t);
+    if (size > max_files) size = max_files;
+    uint32_t *numbers = malloc((size ? size : 1) * sizeof(uint32_t));
+    ssize_t got = pread(journal_fd, numbers, size * sizeof(uint32_t), journal.done);
+    count = got > 0 ? got / sizeof(uint32_t) : 0;
+    
+    char mail_file[32];
+    for (unsigned int i = 0; i < count; i++) {
+      sprintf(mail_file, "%u" MAIL_FILE_SUFFIX, numbers[i]);
+      unlinkat(dir_fd, mail_file, 0);
+    }
+    free(numbers);
+    journal.done += count * sizeof(uint32_t);
+  }
+  
+  // Once all files are removed, the journal is emptied; otherwise it
+  // records how far the removal got
+  if (!count || journal.done + sizeof(uint32_t) > journal_stat.st_size)
+    ftruncate(journal_fd, 0);
+  else
+    pwrite(journal_fd, &journal, sizeof(journal), 0);
+  
+  // Removing files changes the directory, so the index is written
+  // again to remain current (with the same entries)
+  if (count && current)
+    write_mail_index(index_fd, dir_fd, &header, NULL, header.count);
+  
+  close(index_fd);
+  close(journal_fd);
+  return count;
+}
+
+/** Removes messages from a user's mailbox by number, to replay an
+ *  expunge recorded in the journal of another mail store (see
+ *  mailfollow.c). Messages no longer in the mailbox are ignored.
+ *
+ *  Parameters: username: Name of the user.
+ *              numbers: Numbers of the messages to remove.
+ *              count: Number of messages.
+ *
+ *  Returns: number of messages removed.
+ */
+int remove_user_mail(const char *username, const uint32_t *numbers, unsigned int count) {
+  
+  uint32_t *sorted = malloc((count ? count : 1) * sizeof(uint32_t));
+  if (!sorted) return 0;
+  memcpy(sorted, numbers, count * sizeof(uint32_t));
+  qsort(sorted, count, sizeof(uint32_t), compare_mail_numbers);
+  
+  mail_list_t list = load_user_mail(username);
+  int removed = 0;
+  for (unsigned int i = 0; i < list->count; i++) {
+    if (bsearch(&(uint32_t) { list->items[i].number }, sorted, count, sizeof(uint32_t),
+                compare_mail_numbers)) {
+      list->items[i].deleted = 1;
+      removed++;
+    }
+  }
+  destroy_mail_list(list);
+  free(sorted);
+  return removed;
+}
+
+/** Internal function that calls a function for every mailbox in a
+ *  directory of a store layout, at the given depth (0 for a root),
+ *  going down through the hash directories of the layout. The
+ *  directory descriptor is closed.
+ */
+static void list_layout_directory(int dir_fd, int depth, int levels,
+                                  void (*callback)(const char *username, void *arg), void *arg) {
+  
+  DIR *dir = fdopendir(dir_fd);
+  if (!dir) {
+    close(dir_fd);
+    return;
+  }
+  
+  struct dirent *dir_entry;
+  while ((dir_entry = readdir(dir)) != NULL) {
+    const char *name = dir_entry->d_name;
+    if (name[0] == '.' || (dir_entry->d_type != DT_DIR && dir_entry->d_type != DT_UNKNOWN))
+      continue;
+    if (depth == levels) {
+      if (!is_hash_directory_name(name, depth))
+        callback(name, arg);
+    } else if (isxdigit((unsigned char) name[0]) && isxdigit((unsigned char) name[1]) && !name[2]) {
+      int sub_fd = openat(dirfd(dir), name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (sub_fd >= 0)
+        list_layout_directory(sub_fd, depth + 1, levels, callback, arg);
+    }
+  }
+  closedir(dir);
+}
+
+/** Calls a function for every mailbox in the mail store, in all its
+ *  roots. While mailboxes are moved from a previous layout, the
+ *  mailboxes in the previous layout are listed too, so a mailbox may
+ *  be listed twice if it is moved during the listing.
+ *
+ *  Parameters: callback: Function called with the name of the user
+ *                        of each mailbox.
+ *              arg: Argument passed to the function.
+ */
+void list_mailboxes(void (*callback)(const char *username, void *arg), void *arg) {
+  
+  const struct mail_store_layout *layouts[] = { get_store_layout(), &previous_layout };
+  for (int l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++) {
+    for (int i = 0; i < layouts[l]->num_roots; i++) {
+      int dir_fd = layouts[l]->root_fds[i] < 0 ? -1 :
+        openat(layouts[l]->root_fds[i], ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (dir_fd >= 0)
+        list_layout_directory(dir_fd, 0, layouts[l]->levels, callback, arg);
+    }
+  }
+}
+
+/** Internal function that builds the path of a temporary name for a
+ *  mail directory, next to it in the same parent directory.
+ */
+static void make_reshard_path(char *path, size_t size, const struct mailbox_location *location,
+                              const char *prefix) {
+  const char *name = strrchr(location->path, '/');
+  int parent_len = name ? name + 1 - location->path : 0;
+  snprintf(path, size, "%.*s%s%s", parent_len, location->path, prefix, name ? name + 1 : location->path);
+}
+
+/** Internal function that opens the parent directory of a mail
+ *  directory (a hash directory, or the root itself).
+ */
+static int open_parent_directory(const struct mailbox_location *location) {
+  char path[MAX_MAILBOX_PATH + 1];
+  strcpy(path, location->path);
+  char *name = strrchr(path, '/');
+  if (!name) return openat(location->root_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  *name = 0;
+  return openat(location->root_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/** Internal function that removes a mail directory and all its files.
+ *  Files created while the directory is emptied (e.g., a lock file)
+ *  are removed in another pass.
+ */
+static void remove_mail_directory(int root_fd, const char *path) {
+  
+  for (int attempt = 1; attempt <= MAX_MAILBOX_ATTEMPTS; attempt++) {
+    int dir_fd = openat(root_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = dir_fd >= 0 ? fdopendir(dir_fd) : NULL;
+    if (!dir) {
+      if (dir_fd >= 0) close(dir_fd);
+      return;
+    }
+    struct dirent *dir_entry;
+    while ((dir_entry = readdir(dir)) != NULL)
+      if (strcmp(dir_entry->d_name, ".") && strcmp(dir_entry->d_name, ".."))
+        unlinkat(dir_fd, dir_entry->d_name, 0);
+    closedir(dir);
+    if (unlinkat(root_fd, path, AT_REMOVEDIR) == 0 || errno != ENOTEMPTY)
+      return;
+  }
+}
+
+/** Internal function that copies the files of a mail directory (except
+ *  its lock file) to another, and flushes them to disk.
+ *
+ *  Returns: zero if successful, or -1 otherwise.
+ */
+static int copy_mail_directory(int from_fd, int to_fd) {
+  
+  int dup_fd = dup(from_fd);
+  DIR *dir = dup_fd >= 0 ? fdopendir(dup_fd) : NULL;
+  if (!dir) {
+    if (dup_fd >= 0) close(dup_fd);
+    return -1;
+  }
+  
+  int rv = 0;
+  struct dirent *dir_entry;
+  while (rv == 0 && (dir_entry = readdir(dir)) != NULL) {
+    const char *name = dir_entry->d_name;
+    if (!strcmp(name, ".") || !strcmp(name, "..") || !strcmp(name, MAIL_LOCK_FILE_NAME))
+      continue;
+    int in_fd = openat(from_fd, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    int out_fd = in_fd < 0 ? -1 : openat(to_fd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (out_fd < 0 || copy_file_contents(in_fd, out_fd) < 0 || fdatasync(out_fd) < 0)
+      rv = -1;
+    int error = errno;
+    if (in_fd >= 0) close(in_fd);
+    if (out_fd >= 0) close(out_fd);
+    errno = error;
+  }
+  closedir(dir);
+  return rv == 0 ? fsync(to_fd) : -1;
+}
+
+/** Internal function that moves a mailbox to another file system, by
+ *  copying it. The copy takes the mailbox lock, so it fails if a POP3
+ *  session has the mailbox, and then an exclusive lock on the index,
+ *  so deliveries and expunges wait until the mailbox is in its new
+ *  place (see open_locked_mail_directory). The copy is made under a
+ *  temporary name and flushed to disk before it takes the mailbox's
+ *  name, and the old directory is only removed after that.
+ *
+ *  Returns: 1 if the mailbox was moved, 0 if it was not found, or -1
+ *           if it could not be moved.
+ */
+static int copy_mailbox(const char *username, const struct mailbox_location *from,
+                        const struct mailbox_location *to) {
+  
+  char temp_path[MAX_MAILBOX_PATH + 32];
+  int dir_fd = openat(from->root_fd, from->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd < 0) return errno == ENOENT ? 0 : -1;
+  
+  // Creating the lock file would make the index out of date, so a
+  // mailbox without one is copied without it (a session locking the
+  // mailbox meanwhile finds that it was moved, see lock_user_mail)
+  int lock_fd = openat(dir_fd, MAIL_LOCK_FILE_NAME, O_RDWR | O_CLOEXEC);
+  int locked = lock_fd < 0 ? errno == ENOENT : flock(lock_fd, LOCK_EX | LOCK_NB) == 0;
+  int index_fd = locked ? open_mail_index(dir_fd, LOCK_EX) : -1;
+  int rv = index_fd < 0 ? -1 : 1;
+  
+  // Another process may have moved the mailbox meanwhile
+  struct mail_index_header header;
+  int current = 0;
+  if (rv > 0 && is_mail_directory_moved(username, dir_fd))
+    rv = 0;
+  else if (rv > 0)
+    current = read_mail_index_header(index_fd, dir_fd, &header) == 0;
+  
+  if (rv > 0) {
+    make_reshard_path(temp_path, sizeof(temp_path), to, RESHARD_NEW_PREFIX);
+    remove_mail_directory(to->root_fd, temp_path); // left by an interrupted copy
+    int temp_fd = mkdirat(to->root_fd, temp_path, 0777) < 0 ? -1 :
+      openat(to->root_fd, temp_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int parent_fd = open_parent_directory(to);
+    if (temp_fd >= 0 && parent_fd >= 0 && (rv = copy_mail_directory(dir_fd, temp_fd)) == 0) {
+      // The copy has the same messages, so its index is written again
+      // to remain current in the new directory
+      int new_index_fd = current ? openat(temp_fd, MAIL_INDEX_FILE_NAME, O_RDWR | O_CLOEXEC) : -1;
+      if (new_index_fd >= 0) {
+        write_mail_index(new_index_fd, temp_fd, &header, NULL, header.count);
+        fdatasync(new_index_fd);
+        close(new_index_fd);
+      }
+      rv = 1;
+    }
+    if (temp_fd < 0 || parent_fd < 0 || rv < 0 ||
+        renameat2(to->root_fd, temp_path, to->root_fd, to->path, RENAME_NOREPLACE) < 0) {
+      int error = errno;
+      remove_mail_directory(to->root_fd, temp_path);
+      errno = error;
+      rv = -1;
+    } else {
+      fsync(parent_fd);
+    }
+    if (temp_fd >= 0) close(temp_fd);
+    if (parent_fd >= 0) close(parent_fd);
+  }
+  
+  // The old directory is renamed first, so it is no longer found, and
+  // then removed; processes waiting for its locks then find that it
+  // was moved
+  if (rv > 0) {
+    make_reshard_path(temp_path, sizeof(temp_path), from, RESHARD_OLD_PREFIX);
+    if (renameat(from->root_fd, from->path, from->root_fd, temp_path) == 0)
+      remove_mail_directory(from->root_fd, temp_path);
   }
   
+  int error = errno;
+  if (index_fd >= 0) close(index_fd);
+  if (lock_fd >= 0) close(lock_fd);
+  close(dir_fd);
+  errno = error;
   return rv;
 }
+
+/** Moves the mailbox of a user from where the previous store layout
+ *  (mail_store_previous) puts it to where the current layout puts it,
+ *  while the servers keep using the store. Within a file system, the
+ *  mail directory is just renamed. Otherwise, it is copied to its new
+ *  place and then removed, which is only possible while no POP3
+ *  session has the mailbox; deliveries to the mailbox wait for the
+ *  copy. Sessions and deliveries look for mailboxes in both layouts,
+ *  so a mailbox is found before and after it is moved.
+ *
+ *  Parameters: username: Name of the user whose mailbox is moved.
+ *              move: If zero, the mailbox is not moved, and the
+ *                    function only checks if it would be.
+ *
+ *  Returns: 1 if the mailbox was moved (or would be), 0 if there is
+ *           nothing to move (no previous layout, or no mailbox in its
+ *           previous place), or -1 if the mailbox cannot be moved
+ *           (with errno set to EWOULDBLOCK if it is locked by a
+ *           session, or to EEXIST if there is already a mailbox in its
+ *           new place).
+ */
+int reshard_user_mail(const char *username, int move) {
+  
+  struct mailbox_location from, to;
+  struct stat from_stat, to_stat;
+  
+  find_mailbox_location(get_store_layout(), username, &to);
+  if (!previous_layout.num_roots || strlen(username) > MAX_USERNAME_SIZE || username[0] == '.' ||
+      strchr(username, '/') || is_hash_directory_name(username, 0))
+    return 0;
+  find_mailbox_location(&previous_layout, username, &from);
+  
+  // Nothing to do if both layouts put the mailbox in the same place
+  if (fstat(from.root_fd, &from_stat) < 0 || fstat(to.root_fd, &to_stat) < 0)
+    return -1;
+  if (from_stat.st_dev == to_stat.st_dev && from_stat.st_ino == to_stat.st_ino &&
+      !strcmp(from.path, to.path))
+    return 0;
+  if (fstatat(from.root_fd, from.path, &from_stat, AT_SYMLINK_NOFOLLOW) < 0 || !S_ISDIR(from_stat.st_mode))
+    return 0;
+  if (!move)
+    return 1;
+  
+  make_mail_directory(&to, 1);
+  if (renameat2(from.root_fd, from.path, to.root_fd, to.path, RENAME_NOREPLACE) == 0)
+    return 1;
+  if (errno == ENOENT)
+    return 0;
+  if (errno != EXDEV)
+    return -1;
+  
+  // The new place must be free before the mailbox is copied there
+  if (fstatat(to.root_fd, to.path, &to_stat, AT_SYMLINK_NOFOLLOW) == 0) {
+    errno = EEXIST;
+    return -1;
+  }
+  return copy_mailbox(username, &from, &to);
+}
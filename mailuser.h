@@ -7,22 +7,62 @@
 #ifndef _MAILUSER_H_
 #define _MAILUSER_H_
 
+#include "arena.h"
+
 #include <stdio.h>
+#include <stdint.h>
 
 #define MAX_USERNAME_SIZE 255
 #define MAX_PASSWORD_SIZE 255
+#define MAIL_BASE_DIRECTORY "mail.store"
 
 typedef struct user_list *user_list_t;
+typedef struct user_item *user_item_t;
 typedef struct mail_item *mail_item_t;
 typedef struct mail_list *mail_list_t;
+typedef struct mail_batch *mail_batch_t;
+
+// Temporary file receiving a message (see open_mail_spool_file)
+struct mail_spool_file {
+  int fd;
+  int named;
+  char path[256];
+};
 
+// Number of messages in a mailbox and their total size
+struct mail_usage {
+  unsigned int messages;
+  size_t bytes;
+};
+
+void init_mail_caches(void);
+void reload_user_directory(void);
 int is_valid_user(const char *username, const char *password);
+int find_user_name(const char *username, char *name);
 
 user_list_t create_user_list(void);
-void add_user_to_list(user_list_t *list, const char *username);
+user_list_t create_user_list_in_arena(arena_t arena);
+int add_user_to_list(user_list_t *list, const char *username);
 void destroy_user_list(user_list_t list);
+unsigned int get_user_count(user_list_t list);
+user_item_t get_first_user(user_list_t list);
+user_item_t find_user_in_list(user_list_t list, const char *username);
+user_item_t get_next_user(user_item_t item);
+const char *get_user_name(user_item_t item);
+int get_user_delivery_error(user_item_t item);
+int is_transient_delivery_error(int error);
+
+int open_mail_spool_file(struct mail_spool_file *file);
+void close_mail_spool_file(struct mail_spool_file *file);
+void clean_mail_spool(void);
+int save_user_mail(const char *basefile, user_list_t users);
+int restore_user_mail(const char *basefile, const char *username, unsigned int number);
 
-void save_user_mail(const char *basefile, user_list_t users);
+mail_batch_t create_mail_batch(const char *username);
+int add_mail_to_batch(mail_batch_t batch, const void *data, size_t size);
+int sync_mail_batch(mail_batch_t batch);
+int commit_mail_batch(mail_batch_t batch, unsigned int *next_number);
+void destroy_mail_batch(mail_batch_t batch);
 
 mail_list_t load_user_mail(const char *username);
 void destroy_mail_list(mail_list_t list);
@@ -32,7 +72,23 @@ size_t get_mail_list_size(mail_list_t list);
 unsigned int reset_mail_list_deleted_flag(mail_list_t list);
 
 size_t get_mail_item_size(mail_item_t item);
+unsigned int get_mail_item_number(mail_item_t item);
 FILE *get_mail_item_contents(mail_item_t item);
 void mark_mail_item_deleted(mail_item_t item);
 
+void defer_mail_expunge(int (*notify)(const char *username));
+int expunge_user_mail(const char *username, unsigned int max_files);
+int remove_user_mail(const char *username, const uint32_t *numbers, unsigned int count);
+
+int lock_user_mail(const char *username);
+void unlock_user_mail(int lock);
+
+int get_user_mail_usage(const char *username, struct mail_usage *usage);
+int is_user_over_quota(const char *username);
+int recount_user_mail(const char *username, int repair, struct mail_usage *recorded,
+                      struct mail_usage *actual);
+
+void list_mailboxes(void (*callback)(const char *username, void *arg), void *arg);
+int reshard_user_mail(const char *username, int move);
+
 #endif
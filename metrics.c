@@ -0,0 +1,345 @@
+/* metrics.c
+ * Counters and latency histograms shared by all processes of a
+ * server, exported in Prometheus text format.
+ *
+ * Since every session runs in its own forked process, metrics are
+ * kept in a shared memory region created before the server starts
+ * accepting connections. The region is split into one slot per CPU,
+ * and each process updates the slot of the CPU it is running on, so
+ * processes running on different CPUs never write to the same cache
+ * lines. Updates are atomic, so a process that migrates to another
+ * CPU halfway through an update is still counted correctly. Slots
+ * are only added up when the metrics are exported.
+ *
+ * Each process also keeps its own totals for the session it handles,
+ * used for the summary logged when the session ends.
+ */
+
+#define _GNU_SOURCE
+#include "metrics.h"
+#include "ratelimit.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/sysinfo.h>
+
+#define MAX_SLOTS 64
+
+// Upper bounds of the latency histogram buckets, in nanoseconds
+static const uint64_t bucket_bounds[] = {
+  50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000,
+  25000000, 50000000, 100000000, 250000000, 500000000, 1000000000,
+  2500000000, 5000000000, 10000000000
+};
+#define NUM_BUCKETS (sizeof(bucket_bounds) / sizeof(bucket_bounds[0]) + 1)
+
+struct histogram {
+  uint64_t buckets[NUM_BUCKETS];
+  uint64_t count;
+  uint64_t sum;
+};
+
+struct protocol_metrics {
+  uint64_t auth_failures;
+  struct histogram commands[METRICS_MAX_COMMANDS];
+};
+
+struct metrics_slot {
+  uint64_t connections;
+  uint64_t sessions_started;
+  uint64_t sessions_ended;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t delivered;
+  uint64_t delivery_failures;
+  uint64_t retr_bytes;
+  uint64_t throttled[RATELIMIT_NUM_LIMITS];
+  struct histogram delivery;
+  struct histogram retr;
+  struct protocol_metrics protocols[METRICS_MAX_PROTOCOLS];
+} __attribute__((aligned(64)));
+
+struct protocol_info {
+  const char *name;
+  const char *const *commands;
+  int num_commands;
+};
+
+static struct metrics_slot *slots = NULL;
+static int num_slots = 0;
+static const char *server = "";
+static struct protocol_info protocols[METRICS_MAX_PROTOCOLS];
+static int num_protocols = 0;
+static struct session_totals session;
+
+/** Creates the shared memory region used to keep the metrics. Must be
+ *  called before any processes are created (i.e., before run_server
+ *  or start_worker), so that all processes share the same region. If
+ *  this function is not called, all other functions do nothing.
+ *
+ *  Parameters: server_name: Name of the server, used to label all
+ *                           exported metrics.
+ */
+void metrics_init(const char *server_name) {
+
+  server = server_name;
+  num_slots = get_nprocs_conf();
+  if (num_slots < 1) num_slots = 1;
+  if (num_slots > MAX_SLOTS) num_slots = MAX_SLOTS;
+
+  void *region = mmap(NULL, num_slots * sizeof(struct metrics_slot), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (region == MAP_FAILED) {
+    log_error("metrics: mmap: %s", strerror(errno));
+    return;
+  }
+  slots = region;
+}
+
+/** Registers a protocol handled by the server, and the names of the
+ *  commands whose latencies are measured for it. Must be called
+ *  before any processes are created.
+ *
+ *  Parameters: name: Name of the protocol (e.g., "smtp").
+ *              commands: Names of the commands; the position of each
+ *                        name is the command number used in
+ *                        metrics_command.
+ *              count: Number of commands (at most METRICS_MAX_COMMANDS).
+ *
+ *  Returns: Protocol number, to be used in other metrics functions.
+ */
+int metrics_register_protocol(const char *name, const char *const commands[], int count) {
+  if (num_protocols == METRICS_MAX_PROTOCOLS) return METRICS_MAX_PROTOCOLS - 1;
+  protocols[num_protocols].name = name;
+  protocols[num_protocols].commands = commands;
+  protocols[num_protocols].num_commands = count < METRICS_MAX_COMMANDS ? count : METRICS_MAX_COMMANDS;
+  return num_protocols++;
+}
+
+/** Returns a timestamp, in nanoseconds, to be passed as the start
+ *  time of a measured operation.
+ */
+uint64_t metrics_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/** Internal function that returns the slot for the CPU running the
+ *  calling process.
+ */
+static inline struct metrics_slot *my_slot(void) {
+  int cpu = sched_getcpu();
+  return &slots[cpu > 0 ? cpu % num_slots : 0];
+}
+
+static inline void add(uint64_t *counter, uint64_t value) {
+  __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+/** Internal function that records a value in a histogram.
+ */
+static void observe(struct histogram *h, uint64_t value) {
+  int i = 0;
+  while (i < NUM_BUCKETS - 1 && value > bucket_bounds[i])
+    i++;
+  add(&h->buckets[i], 1);
+  add(&h->count, 1);
+  add(&h->sum, value);
+}
+
+/** Counts a new connection accepted by the server.
+ */
+void metrics_connection(void) {
+  if (slots) add(&my_slot()->connections, 1);
+}
+
+/** Counts the start of a session (i.e., a client being handled). The
+ *  number of active sessions is the number of sessions started minus
+ *  the number of sessions ended.
+ */
+void metrics_session_start(void) {
+  memset(&session, 0, sizeof(session));
+  if (slots) add(&my_slot()->sessions_started, 1);
+}
+
+/** Counts the end of a session.
+ */
+void metrics_session_end(void) {
+  if (slots) add(&my_slot()->sessions_ended, 1);
+}
+
+/** Records the latency of a command handled by the server.
+ *
+ *  Parameters: protocol: Protocol number, from metrics_register_protocol.
+ *              command: Position of the command in the list of
+ *                       commands registered for the protocol.
+ *              start: Value of metrics_now when the command started.
+ */
+void metrics_command(int protocol, int command, uint64_t start) {
+  session.commands++;
+  if (!slots || command < 0 || command >= METRICS_MAX_COMMANDS) return;
+  observe(&my_slot()->protocols[protocol].commands[command], metrics_now() - start);
+}
+
+/** Counts bytes received from clients.
+ */
+void metrics_bytes_in(size_t bytes) {
+  session.bytes_in += bytes;
+  if (slots) add(&my_slot()->bytes_in, bytes);
+}
+
+/** Counts bytes sent to clients.
+ */
+void metrics_bytes_out(size_t bytes) {
+  session.bytes_out += bytes;
+  if (slots) add(&my_slot()->bytes_out, bytes);
+}
+
+/** Counts a failed authentication attempt (e.g., an invalid password).
+ */
+void metrics_auth_failure(int protocol) {
+  if (slots) add(&my_slot()->protocols[protocol].auth_failures, 1);
+}
+
+/** Counts a client refused for reaching a limit (see ratelimit.c).
+ *
+ *  Parameters: limit: Limit reached (a ratelimit_limit_t value).
+ */
+void metrics_throttled(int limit) {
+  if (slots) add(&my_slot()->throttled[limit], 1);
+}
+
+/** Records the delivery of a message to the mail storage.
+ *
+ *  Parameters: start: Value of metrics_now when delivery started.
+ *              recipients: Number of recipients of the message.
+ *              failed: Number of recipients delivery failed for.
+ */
+void metrics_delivery(uint64_t start, unsigned int recipients, unsigned int failed) {
+  if (!slots) return;
+  struct metrics_slot *slot = my_slot();
+  observe(&slot->delivery, metrics_now() - start);
+  add(&slot->delivered, recipients - failed);
+  add(&slot->delivery_failures, failed);
+}
+
+/** Records the retrieval of a message by a client.
+ *
+ *  Parameters: start: Value of metrics_now when retrieval started.
+ *              bytes: Size of the message.
+ */
+void metrics_retr(uint64_t start, size_t bytes) {
+  if (!slots) return;
+  struct metrics_slot *slot = my_slot();
+  observe(&slot->retr, metrics_now() - start);
+  add(&slot->retr_bytes, bytes);
+}
+
+/** Returns the totals (bytes received and sent, and commands
+ *  handled) for the session handled by the calling process, since
+ *  metrics_session_start was called.
+ */
+const struct session_totals *metrics_session_totals(void) {
+  return &session;
+}
+
+/** Internal function that adds up a counter across all slots, given
+ *  the offset of the counter inside a slot.
+ */
+static uint64_t total(size_t offset) {
+  uint64_t rv = 0;
+  for (int i = 0; i < num_slots; i++)
+    rv += __atomic_load_n((uint64_t *) ((char *) &slots[i] + offset), __ATOMIC_RELAXED);
+  return rv;
+}
+
+#define TOTAL(field) total(offsetof(struct metrics_slot, field))
+
+static void write_counter(FILE *out, const char *name, const char *help, uint64_t value) {
+  fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s{server=\"%s\"} %lu\n",
+          name, help, name, name, server, value);
+}
+
+/** Internal function that writes the buckets, sum and count of a
+ *  histogram (added up across all slots) with the given labels.
+ */
+static void write_histogram(FILE *out, const char *name, const char *labels, size_t offset) {
+
+  uint64_t cumulative = 0;
+  for (int i = 0; i < NUM_BUCKETS; i++) {
+    cumulative += total(offset + offsetof(struct histogram, buckets[i]));
+    if (i < NUM_BUCKETS - 1)
+      fprintf(out, "%s_bucket{%s,le=\"%g\"} %lu\n", name, labels, bucket_bounds[i] / 1e9, cumulative);
+    else
+      fprintf(out, "%s_bucket{%s,le=\"+Inf\"} %lu\n", name, labels, cumulative);
+  }
+  fprintf(out, "%s_sum{%s} %.9f\n", name, labels,
+          total(offset + offsetof(struct histogram, sum)) / 1e9);
+  fprintf(out, "%s_count{%s} %lu\n", name, labels,
+          total(offset + offsetof(struct histogram, count)));
+}
+
+/** Writes all metrics in Prometheus text format.
+ *
+ *  Parameters: out: File where the metrics are written.
+ */
+void metrics_write(FILE *out) {
+
+  if (!slots) return;
+
+  char labels[256];
+  snprintf(labels, sizeof(labels), "server=\"%s\"", server);
+
+  write_counter(out, "mail_connections_total", "Connections accepted.", TOTAL(connections));
+  fprintf(out, "# HELP mail_sessions_active Sessions currently being handled.\n"
+          "# TYPE mail_sessions_active gauge\nmail_sessions_active{%s} %ld\n",
+          labels, (long) (TOTAL(sessions_started) - TOTAL(sessions_ended)));
+  write_counter(out, "mail_received_bytes_total", "Bytes received from clients.", TOTAL(bytes_in));
+  write_counter(out, "mail_sent_bytes_total", "Bytes sent to clients.", TOTAL(bytes_out));
+
+  fprintf(out, "# HELP mail_auth_failures_total Failed authentication attempts.\n"
+          "# TYPE mail_auth_failures_total counter\n");
+  for (int p = 0; p < num_protocols; p++)
+    fprintf(out, "mail_auth_failures_total{%s,protocol=\"%s\"} %lu\n", labels, protocols[p].name,
+            TOTAL(protocols[p].auth_failures));
+
+  static const char *limit_names[RATELIMIT_NUM_LIMITS] = { "connections", "sessions", "messages", "logins" };
+  fprintf(out, "# HELP mail_throttled_total Clients refused for reaching a rate limit.\n"
+          "# TYPE mail_throttled_total counter\n");
+  for (int i = 0; i < RATELIMIT_NUM_LIMITS; i++)
+    fprintf(out, "mail_throttled_total{%s,limit=\"%s\"} %lu\n", labels, limit_names[i], TOTAL(throttled[i]));
+
+  fprintf(out, "# HELP mail_command_duration_seconds Time taken to handle client commands.\n"
+          "# TYPE mail_command_duration_seconds histogram\n");
+  for (int p = 0; p < num_protocols; p++) {
+    for (int c = 0; c < protocols[p].num_commands; c++) {
+      char command_labels[512];
+      snprintf(command_labels, sizeof(command_labels), "%s,protocol=\"%s\",command=\"%s\"",
+               labels, protocols[p].name, protocols[p].commands[c]);
+      write_histogram(out, "mail_command_duration_seconds", command_labels,
+                      offsetof(struct metrics_slot, protocols[p].commands[c]));
+    }
+  }
+
+  write_counter(out, "mail_delivered_total", "Messages delivered to a mailbox (per recipient).",
+                TOTAL(delivered));
+  write_counter(out, "mail_delivery_failures_total", "Recipients a message could not be delivered to.",
+                TOTAL(delivery_failures));
+  fprintf(out, "# HELP mail_delivery_duration_seconds Time taken to deliver a message to all recipients.\n"
+          "# TYPE mail_delivery_duration_seconds histogram\n");
+  write_histogram(out, "mail_delivery_duration_seconds", labels, offsetof(struct metrics_slot, delivery));
+
+  write_counter(out, "mail_retrieved_bytes_total", "Bytes of messages retrieved by clients.",
+                TOTAL(retr_bytes));
+  fprintf(out, "# HELP mail_retrieve_duration_seconds Time taken to send a message to a client.\n"
+          "# TYPE mail_retrieve_duration_seconds histogram\n");
+  write_histogram(out, "mail_retrieve_duration_seconds", labels, offsetof(struct metrics_slot, retr));
+}
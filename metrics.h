@@ -0,0 +1,40 @@
+/* metrics.h
+ * Counters and latency histograms shared by all processes of a
+ * server, exported in Prometheus text format.
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define METRICS_MAX_PROTOCOLS 4
+#define METRICS_MAX_COMMANDS 16
+
+// Totals for the session handled by the calling process
+struct session_totals {
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  unsigned int commands;
+};
+
+void metrics_init(const char *server_name);
+int metrics_register_protocol(const char *name, const char *const commands[], int count);
+uint64_t metrics_now(void);
+
+void metrics_connection(void);
+void metrics_session_start(void);
+void metrics_session_end(void);
+void metrics_command(int protocol, int command, uint64_t start);
+void metrics_bytes_in(size_t bytes);
+void metrics_bytes_out(size_t bytes);
+void metrics_auth_failure(int protocol);
+void metrics_throttled(int limit);
+void metrics_delivery(uint64_t start, unsigned int recipients, unsigned int failed);
+void metrics_retr(uint64_t start, size_t bytes);
+const struct session_totals *metrics_session_totals(void);
+
+void metrics_write(FILE *out);
+
+#endif
@@ -6,6 +6,10 @@
  */
 
 #include "netbuffer.h"
+#include "metrics.h"
+#include "flightrec.h"
+#include "sessiontab.h"
+#include "tls.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -47,6 +51,27 @@ net_buffer_t nb_create(int fd, size_t max_buffer_size) {
   return nb;
 }
 
+/** Creates a new buffer for handling data read from a socket, like
+ *  nb_create, but stored in an arena. The buffer is released with the
+ *  arena, and must not be passed to nb_destroy.
+ *
+ *  Parameters: arena: Arena where the buffer is stored.
+ *              fd: Socket file descriptor.
+ *              max_buffer_size: Maximum number of bytes to be stored
+ *                               locally for a connection.
+ *
+ *  Returns: A net_buffer_t object that can be used in other functions
+ *           to read buffered data.
+ */
+net_buffer_t nb_create_in_arena(arena_t arena, int fd, size_t max_buffer_size) {
+
+  net_buffer_t nb = arena_alloc(arena, sizeof(struct net_buffer) + max_buffer_size);
+  nb->fd          = fd;
+  nb->max_bytes   = max_buffer_size;
+  nb->avail_data  = 0;
+  return nb;
+}
+
 /** Frees all memory used by a net_buffer_t object.
  *  
  *  Parameters: nb: buffer object to be freed.
@@ -55,6 +80,26 @@ void nb_destroy(net_buffer_t nb) {
   free(nb);
 }
 
+/** Discards any data received but not read yet from a buffer. Used
+ *  when the way data is received changes (e.g., when TLS is started),
+ *  so that data received before the change is not read after it.
+ *
+ *  Parameters: nb: buffer object to be cleared.
+ */
+void nb_clear(net_buffer_t nb) {
+  nb->avail_data = 0;
+}
+
+/** Returns the number of bytes received but not read yet from a
+ *  buffer, e.g., commands the client sent without waiting for the
+ *  reply to the previous one.
+ *
+ *  Parameters: nb: buffer object to be assessed.
+ */
+size_t nb_buffered(net_buffer_t nb) {
+  return nb->avail_data;
+}
+
 /** Reads a single line from the socket/buffer (i.e., a string ending
  *  in LF, aka "\n"). If the socket returns more than one line in a
  *  single call to recv, returns a single line and caches the
@@ -92,7 +137,9 @@ int nb_read_line(net_buffer_t nb, char out[]) {
 
     // Check if the buffer has space for more data to be received
     if (nb->avail_data < nb->max_bytes) {
-      rv = recv(nb->fd, nb->buf + nb->avail_data, nb->max_bytes - nb->avail_data, 0);
+      uint64_t start = flightrec_now();
+      rv = tls_recv(nb->fd, nb->buf + nb->avail_data, nb->max_bytes - nb->avail_data);
+      flightrec_record(FR_READ_WAIT, NULL, flightrec_now() - start, rv);
       // If recv returns an error, return the same error.
       if (rv < 0)
 	return rv;
@@ -103,6 +150,8 @@ int nb_read_line(net_buffer_t nb, char out[]) {
 	break;
       }
       nb->avail_data += rv;
+      metrics_bytes_in(rv);
+      sessiontab_bytes_in(rv);
     } else {
       // If the buffer is already full, return the full buffer.
       eos = nb->buf + nb->max_bytes - 1;
@@ -7,12 +7,17 @@
 #ifndef _NET_BUFFER_H_
 #define _NET_BUFFER_H_
 
+#include "arena.h"
+
 #include <string.h>
 
 typedef struct net_buffer *net_buffer_t;
 
 net_buffer_t nb_create(int fd, size_t max_buffer_size);
+net_buffer_t nb_create_in_arena(arena_t arena, int fd, size_t max_buffer_size);
 void nb_destroy(net_buffer_t nb);
 int nb_read_line(net_buffer_t nb, char out[]);
+void nb_clear(net_buffer_t nb);
+size_t nb_buffered(net_buffer_t nb);
 
 #endif
@@ -0,0 +1,388 @@
+/* pop3.c
+ * POP3 protocol: command handlers for the mail retrieval server,
+ * shared by mypopd and maild.
+ */
+
+#include "pop3.h"
+#include "netbuffer.h"
+#include "protocol.h"
+#include "mailuser.h"
+#include "server.h"
+#include "metrics.h"
+#include "flightrec.h"
+#include "probes.h"
+#include "log.h"
+#include "tls.h"
+#include "ratelimit.h"
+#include "capture.h"
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <stdbool.h>
+
+#define MAX_LINE_LENGTH 1024
+
+// Enumeration for the state of the server
+typedef enum {
+    GREETING_STATE,
+    AUTHORIZATION_STATE_USERNAME,
+    AUTHORIZATION_STATE_PASSWORD,
+    TRANSACTION_STATE,
+    UPDATE_STATE
+} state_t;
+
+// State names, as listed in the session table
+static const char *const state_names[] = { "greeting", "username", "password", "transaction", "update" };
+
+// Data kept for each client session
+struct pop_session {
+    char user[MAX_LINE_LENGTH];
+    mail_list_t mail_list;
+    unsigned int original_mail_count;
+    int mailbox_lock;
+};
+
+// Function declarations
+void command_user(protocol_session_t *session, span_t args);
+
+void command_pass(protocol_session_t *session, span_t args);
+
+void command_stat(protocol_session_t *session, span_t args);
+
+void command_list(protocol_session_t *session, span_t args);
+
+void command_retr(protocol_session_t *session, span_t args);
+
+void command_dele(protocol_session_t *session, span_t args);
+
+void command_noop(protocol_session_t *session, span_t args);
+
+void command_rset(protocol_session_t *session, span_t args);
+
+void command_quit(protocol_session_t *session, span_t args);
+
+void command_capa(protocol_session_t *session, span_t args);
+
+void command_stls(protocol_session_t *session, span_t args);
+
+#define AUTHORIZATION_STATES \
+    (PROTOCOL_STATE(AUTHORIZATION_STATE_USERNAME) | PROTOCOL_STATE(AUTHORIZATION_STATE_PASSWORD))
+#define ALREADY_LOGGED_IN "-ERR Already logged in!\r\n"
+
+// Commands recognized by the server, and the states they are allowed in
+static const protocol_command_t pop_commands[] = {
+    // AUTHORIZATION state commands
+    { PROTOCOL_WORD('u', 's', 'e', 'r'), "USER", AUTHORIZATION_STATES, command_user, ALREADY_LOGGED_IN },
+    { PROTOCOL_WORD('p', 'a', 's', 's'), "PASS", AUTHORIZATION_STATES, command_pass, ALREADY_LOGGED_IN },
+    { PROTOCOL_WORD('s', 't', 'l', 's'), "STLS", AUTHORIZATION_STATES, command_stls, ALREADY_LOGGED_IN },
+    // TRANSACTION state commands
+    { PROTOCOL_WORD('s', 't', 'a', 't'), "STAT", PROTOCOL_STATE(TRANSACTION_STATE), command_stat },
+    { PROTOCOL_WORD('l', 'i', 's', 't'), "LIST", PROTOCOL_STATE(TRANSACTION_STATE), command_list },
+    { PROTOCOL_WORD('r', 'e', 't', 'r'), "RETR", PROTOCOL_STATE(TRANSACTION_STATE), command_retr },
+    { PROTOCOL_WORD('d', 'e', 'l', 'e'), "DELE", PROTOCOL_STATE(TRANSACTION_STATE), command_dele },
+    { PROTOCOL_WORD('r', 's', 'e', 't'), "RSET", PROTOCOL_STATE(TRANSACTION_STATE), command_rset },
+    // Any state commands
+    { PROTOCOL_WORD('n', 'o', 'o', 'p'), "NOOP", PROTOCOL_ANY_STATE, command_noop },
+    { PROTOCOL_WORD('q', 'u', 'i', 't'), "QUIT", PROTOCOL_ANY_STATE, command_quit },
+    { PROTOCOL_WORD('c', 'a', 'p', 'a'), "CAPA", PROTOCOL_ANY_STATE, command_capa },
+    // Unsupported commands
+    { PROTOCOL_WORD('t', 'o', 'p', ' '), "TOP", PROTOCOL_ANY_STATE, NULL },
+    { PROTOCOL_WORD('u', 'i', 'd', 'l'), "UIDL", PROTOCOL_ANY_STATE, NULL },
+    { PROTOCOL_WORD('a', 'p', 'o', 'p'), "APOP", PROTOCOL_ANY_STATE, NULL },
+};
+
+protocol_t pop3_protocol = {
+    .name = "pop3",
+    .commands = pop_commands,
+    .num_commands = sizeof(pop_commands) / sizeof(pop_commands[0]),
+    .line_too_long_reply = "-ERR Line is too long\r\n",
+    .unknown_reply = "-ERR Invalid command: %s\r\n",
+    .unsupported_reply = "-ERR Unsupported command: %s\r\n",
+    .bad_state_reply = "-ERR Login first using USER and PASS commands!\r\n",
+    .state_names = state_names,
+    .num_states = sizeof(state_names) / sizeof(state_names[0]),
+};
+
+// Serves a POP3 client connection until it quits or disconnects
+void pop3_handle_client(int fd) {
+    // Initialize states
+    struct pop_session pop = { .user = "", .mailbox_lock = -1 };
+    protocol_session_t session = { .fd = fd, .state = GREETING_STATE, .data = &pop };
+
+    // Server greeting
+    send_formatted(fd, "+OK POP3 server ready\r\n");
+    session.state = AUTHORIZATION_STATE_USERNAME;
+
+    protocol_run(&pop3_protocol, &session);
+}
+
+// Process USER command: goes to the password state if the username is valid
+void command_user(protocol_session_t *session, span_t args) {
+    struct pop_session *pop = session->data;
+    // Read the username
+    span_t user_input = protocol_next_arg(&args);
+
+    // If username is missing, send an error
+    if (!user_input.length) {
+        pop->user[0] = '\0';
+        session->state = AUTHORIZATION_STATE_USERNAME;
+        send_formatted(session->fd, "-ERR Mailbox name argument missing for USER command\r\n");
+        return;
+    }
+
+    // Without TLS, logins are refused if the configuration requires it
+    if (tls_required() && !tls_active()) {
+        send_formatted(session->fd, "-ERR Must issue a STLS command first\r\n");
+        return;
+    }
+
+    // Check if the username is valid. It is stored as spelled in the
+    // users file, so the mailbox and its lock are the same whatever
+    // case the client used.
+    snprintf(pop->user, sizeof(pop->user), "%s", user_input.start);
+    if (find_user_name(pop->user, pop->user)) {
+        // Username is valid, send OK message
+        send_formatted(session->fd, "+OK %s is a valid mailbox\r\n", user_input.start);
+        session->state = AUTHORIZATION_STATE_PASSWORD;
+    } else {
+        // Username is not valid, clear user and send ERR message
+        metrics_auth_failure(pop3_protocol.metrics_id);
+        pop->user[0] = '\0';
+        session->state = AUTHORIZATION_STATE_USERNAME;
+        send_formatted(session->fd, "-ERR No mailbox for %s here\r\n", user_input.start);
+    }
+}
+
+// Process PASS command: loads the user's mail and goes to the transaction state if the
+// password is valid, or back to the username state otherwise.
+void command_pass(protocol_session_t *session, span_t args) {
+    struct pop_session *pop = session->data;
+
+    // Valid user name not entered yet, send an error
+    if (session->state == AUTHORIZATION_STATE_USERNAME) {
+        send_formatted(session->fd, "-ERR Send USER command first with valid username\r\n");
+        return;
+    }
+
+    // Read the password
+    span_t pass_input = protocol_next_arg(&args);
+
+    // If password is missing, send an error
+    if (!pass_input.length) {
+        session->state = AUTHORIZATION_STATE_USERNAME;
+        send_formatted(session->fd, "-ERR No password provided, login again with USER command first\r\n");
+        return;
+    }
+
+    // Login attempts are limited, so passwords can't be guessed quickly
+    if (!ratelimit_allow(RATELIMIT_LOGINS)) {
+        session->state = AUTHORIZATION_STATE_USERNAME;
+        send_formatted(session->fd, "-ERR Too many login attempts, try again later\r\n");
+        return;
+    }
+
+    // Check if the password is valid
+    if (is_valid_user(pop->user, pass_input.start)) {
+        // Password is valid, lock the maildrop so no other session changes it
+        pop->mailbox_lock = lock_user_mail(pop->user);
+        if (pop->mailbox_lock < 0) {
+            session->state = AUTHORIZATION_STATE_USERNAME;
+            send_formatted(session->fd, "-ERR Maildrop is already locked, try again later\r\n");
+            return;
+        }
+        // Grab the mail list and mail count
+        pop->mail_list = load_user_mail(pop->user);
+        pop->original_mail_count = get_mail_count(pop->mail_list);
+        session->state = TRANSACTION_STATE;
+        send_formatted(session->fd, "+OK Logged in successfully, welcome %s! (%d new messages)\r\n",
+                       pop->user, pop->original_mail_count);
+    } else {
+        // Password is not valid, send ERR message
+        metrics_auth_failure(pop3_protocol.metrics_id);
+        session->state = AUTHORIZATION_STATE_USERNAME;
+        send_formatted(session->fd, "-ERR Invalid password, login again with USER command first\r\n");
+    }
+}
+
+// Process STAT command: sends the number of non-deleted messages and their total size
+void command_stat(protocol_session_t *session, span_t args) {
+    struct pop_session *pop = session->data;
+    // Send the mail count and size (not including the deleted mails)
+    send_formatted(session->fd, "+OK %d %zu\r\n", get_mail_count(pop->mail_list),
+                   get_mail_list_size(pop->mail_list));
+}
+
+// Process LIST command: sends a list of non-deleted messages and their sizes
+void command_list(protocol_session_t *session, span_t args) {
+    struct pop_session *pop = session->data;
+    int fd = session->fd;
+    // Get argument, if any
+    span_t msg_num_input = protocol_next_arg(&args);
+
+    // If no argument, list all messages
+    if (!msg_num_input.length) {
+        send_formatted(fd, "+OK %d messages (%zu octets)\r\n",
+                       get_mail_count(pop->mail_list), get_mail_list_size(pop->mail_list));
+        for (int i = 0; i < pop->original_mail_count; i++) {
+            mail_item_t mail_item = get_mail_item(pop->mail_list, i);
+            if (mail_item != NULL) {
+                send_formatted(fd, "%d %zu\r\n", i + 1, get_mail_item_size(mail_item));
+            }
+        }
+        send_formatted(fd, ".\r\n");
+        return;
+    } else {
+        // If argument, list only that message
+        int msg_num = atoi(msg_num_input.start);
+        mail_item_t mail_item = get_mail_item(pop->mail_list, msg_num - 1);
+        if (mail_item == NULL || msg_num < 1 || msg_num > pop->original_mail_count) {
+            // If message does not exist or is deleted, return error
+            send_formatted(fd, "-ERR Message %d does not exist or deleted!\r\n", msg_num);
+            return;
+        }
+        send_formatted(fd, "+OK %d %zu\r\n", msg_num, get_mail_item_size(mail_item));
+    }
+}
+
+// Process RETR command: sends the requested message
+void command_retr(protocol_session_t *session, span_t args) {
+    struct pop_session *pop = session->data;
+    int fd = session->fd;
+    // Get the message number
+    span_t msg_num_input = protocol_next_arg(&args);
+
+    // If no message number was given, send an error
+    if (!msg_num_input.length) {
+        send_formatted(fd, "-ERR No message number given!\r\n");
+        return;
+    } else {
+        // Convert the message number to an integer and check if it is valid
+        int msg_num = atoi(msg_num_input.start);
+        mail_item_t mail_item = get_mail_item(pop->mail_list, msg_num - 1);
+        if (mail_item == NULL || msg_num < 1 || msg_num > pop->original_mail_count) {
+            send_formatted(fd, "-ERR Message %d does not exist or deleted!\r\n", msg_num);
+            return;
+        }
+        FILE *mail_item_data = get_mail_item_contents(mail_item);
+        if (mail_item_data == NULL) {
+            send_formatted(fd, "-ERR Message %d is no longer available\r\n", msg_num);
+            return;
+        }
+        // Send mail size and message. Messages are stored as received
+        // (with CRLF line endings and dot-stuffing), so the file is sent
+        // as is. The socket is corked so the reply leaves in full packets.
+        uint64_t start = metrics_now();
+        PROBE2(retr__begin, msg_num, get_mail_item_size(mail_item));
+        set_socket_corked(fd, 1);
+        send_formatted(fd, "+OK %zu octets\r\n", get_mail_item_size(mail_item));
+        send_file(fd, fileno(mail_item_data), get_mail_item_size(mail_item));
+        fclose(mail_item_data);
+
+        // Send the end of message (.CRLF)
+        send_formatted(fd, ".\r\n");
+        set_socket_corked(fd, 0);
+        metrics_retr(start, get_mail_item_size(mail_item));
+        flightrec_record(FR_RETR_SENT, NULL, flightrec_now() - start, get_mail_item_size(mail_item));
+        PROBE2(retr__end, msg_num, get_mail_item_size(mail_item));
+    }
+}
+
+// Process DELE command: deletes the requested message
+void command_dele(protocol_session_t *session, span_t args) {
+    struct pop_session *pop = session->data;
+    // Get the message number
+    span_t msg_num_input = protocol_next_arg(&args);
+
+    // If no message number was given, send an error
+    if (!msg_num_input.length) {
+        send_formatted(session->fd, "-ERR No message number given. Nothing deleted!\r\n");
+        return;
+    } else if (config_get_int("pop3_read_only", 0)) {
+        // Replicas of the mail store only change through the journal
+        send_formatted(session->fd, "-ERR Mailbox is read-only. Nothing deleted!\r\n");
+        return;
+    } else {
+        // Convert the message number to an integer and check if it is valid
+        int msg_num = atoi(msg_num_input.start);
+        mail_item_t mail_item = get_mail_item(pop->mail_list, msg_num - 1);
+        if (mail_item == NULL || msg_num < 1) {
+            send_formatted(session->fd, "-ERR Message %d already deleted or does not exist!\r\n", msg_num);
+            return;
+        }
+
+        // Mark the mail as deleted
+        mark_mail_item_deleted(mail_item);
+        send_formatted(session->fd, "+OK Message %d deleted!\r\n", msg_num);
+    }
+
+}
+
+// Process NOOP command: does nothing, but sends an OK response
+void command_noop(protocol_session_t *session, span_t args) {
+    // Send OK response
+    send_formatted(session->fd, "+OK noop received!\r\n");
+}
+
+// Process RSET command: reset mail marked as deleted
+void command_rset(protocol_session_t *session, span_t args) {
+    struct pop_session *pop = session->data;
+    int deleted_count = pop->original_mail_count - get_mail_count(pop->mail_list);
+    reset_mail_list_deleted_flag(pop->mail_list);
+    send_formatted(session->fd, "+OK %d message(s) restored!\r\n",
+                   deleted_count);
+}
+
+// Process QUIT command: destroy mail marked as deleted if the user is logged in
+void command_quit(protocol_session_t *session, span_t args) {
+    struct pop_session *pop = session->data;
+    session->done = 1;
+
+    if (session->state != TRANSACTION_STATE) {
+        // User is not logged in, just say bye
+        send_formatted(session->fd, "+OK POP3 Server signing off\r\n");
+        return;
+    }
+
+    // Destroy all mail marked for deletion
+    session->state = UPDATE_STATE;
+    int remaining = get_mail_count(pop->mail_list);
+    destroy_mail_list(pop->mail_list);
+    pop->mail_list = NULL;
+    unlock_user_mail(pop->mailbox_lock);
+    pop->mailbox_lock = -1;
+    send_formatted(session->fd, "+OK POP3 Server signing off. Bye %s! (%d messages left)\r\n", pop->user,
+                   remaining);
+}
+
+// Process CAPA command: lists the capabilities of the server
+void command_capa(protocol_session_t *session, span_t args) {
+    send_formatted(session->fd, "+OK Capability list follows\r\nUSER\r\n%s.\r\n",
+                   tls_available() ? "STLS\r\n" : "");
+}
+
+// Process STLS command: starts TLS on the connection. Anything the client sent before the
+// handshake is discarded, and it has to log in again.
+void command_stls(protocol_session_t *session, span_t args) {
+    struct pop_session *pop = session->data;
+
+    if (tls_active()) {
+        send_formatted(session->fd, "-ERR Command not permitted when TLS active\r\n");
+        return;
+    }
+    if (!tls_available()) {
+        send_formatted(session->fd, "-ERR TLS not available\r\n");
+        return;
+    }
+
+    send_formatted(session->fd, "+OK Begin TLS negotiation\r\n");
+    nb_clear(session->nb);
+    if (tls_start(session->fd) < 0) {
+        session->done = 1;
+        return;
+    }
+    pop->user[0] = '\0';
+    session->state = AUTHORIZATION_STATE_USERNAME;
+}
@@ -0,0 +1,17 @@
+/* pop3.h
+ * POP3 protocol, served by mypopd and maild.
+ */
+
+#ifndef _POP3_H_
+#define _POP3_H_
+
+#include "protocol.h"
+
+// Reply to clients refused by the connection limits
+#define POP3_THROTTLE_REPLY "-ERR Too many connections, try again later\r\n"
+
+extern protocol_t pop3_protocol;
+
+void pop3_handle_client(int fd);
+
+#endif
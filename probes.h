@@ -0,0 +1,46 @@
+/* probes.h
+ * USDT static tracepoints for perf and bpftrace.
+ *
+ * When built with HAVE_SDT (see the USDT setting in the Makefile),
+ * each PROBE macro places a "mail" provider probe in the binary. A
+ * probe is a single nop until a tracer attaches to it, e.g.:
+ *
+ *   bpftrace -e 'usdt:./mysmtpd:mail:command__start { ... }'
+ *   perf probe -x ./mypopd sdt_mail:retr__begin
+ *
+ * Without HAVE_SDT the macros expand to nothing and their arguments
+ * are not evaluated. Probes available (arguments in order):
+ *
+ *   conn__accept    fd, peer address (string)
+ *   conn__close     fd
+ *   command__start  protocol (string), command (string)
+ *   command__end    protocol (string), command (string)
+ *   data__begin     number of recipients
+ *   data__end       bytes received, number of recipients
+ *   deliver__start  user (string)
+ *   deliver__end    user (string), errno (0 if delivered)
+ *   mailbox__load   user (string), number of messages, duration (ns)
+ *   retr__begin     message number, size
+ *   retr__end       message number, size
+ */
+
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+#ifdef HAVE_SDT
+
+#include <sys/sdt.h>
+
+#define PROBE1(name, a) DTRACE_PROBE1(mail, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(mail, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(mail, name, a, b, c)
+
+#else
+
+#define PROBE1(name, a) do {} while (0)
+#define PROBE2(name, a, b) do {} while (0)
+#define PROBE3(name, a, b, c) do {} while (0)
+
+#endif
+
+#endif
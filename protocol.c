@@ -0,0 +1,240 @@
+/* protocol.c
+ * Table-driven command engine shared by the mail servers.
+ *
+ * Each server describes its protocol as a table of commands: the
+ * command word, the states in which the command is allowed, and the
+ * handler. The engine reads command lines from the client, finds the
+ * command in the table and calls its handler, replying to unknown,
+ * unsupported and out-of-sequence commands itself. It also takes
+ * care of the instrumentation common to every command (metrics,
+ * flight recorder, tracepoints and the session table).
+ *
+ * Commands are matched by their first four characters, case-folded
+ * and packed in a 32-bit word. protocol_init builds a small index
+ * where every command word hashes to a different slot, so finding a
+ * command takes a multiplication and a single comparison (plus a
+ * comparison of the whole name for longer commands like STARTTLS). Arguments
+ * are handed to handlers as spans of the line buffer, so dispatching
+ * a command copies and allocates nothing.
+ *
+ * Memory needed during a session (the net buffer, and anything the
+ * handlers keep, like the recipients of a message) comes from a
+ * session arena, which is emptied when the session ends. The arena is
+ * created by protocol_init, before the server starts, so every
+ * session process inherits it already allocated.
+ */
+
+#include "protocol.h"
+#include "server.h"
+#include "metrics.h"
+#include "flightrec.h"
+#include "capture.h"
+#include "sessiontab.h"
+#include "probes.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define MAX_INDEX_ATTEMPTS 100000
+#define SESSION_ARENA_SIZE 16384
+
+static arena_t session_arena = NULL;
+
+/** Internal function that returns the index slot of a command word
+ *  for a given multiplier.
+ */
+static inline unsigned int index_slot(uint32_t word, uint32_t multiplier) {
+  return (word * multiplier) >> (32 - PROTOCOL_INDEX_BITS);
+}
+
+/** Internal function that builds the command index of a protocol,
+ *  looking for a multiplier that puts each command in its own slot.
+ *  If none is found, commands are searched linearly.
+ */
+static void build_index(protocol_t *protocol) {
+
+  uint32_t multiplier = 0x9e3779b1;
+  protocol->index_multiplier = 0;
+  if (protocol->num_commands > (1 << PROTOCOL_INDEX_BITS)) return;
+
+  for (int attempt = 0; attempt < MAX_INDEX_ATTEMPTS; attempt++, multiplier += 2) {
+    int i;
+    memset(protocol->index, -1, sizeof(protocol->index));
+    for (i = 0; i < protocol->num_commands; i++) {
+      unsigned int slot = index_slot(protocol->commands[i].word, multiplier);
+      if (protocol->index[slot] >= 0) break;
+      protocol->index[slot] = i;
+    }
+    if (i == protocol->num_commands) {
+      protocol->index_multiplier = multiplier;
+      return;
+    }
+  }
+}
+
+/** Builds the command index of a protocol and registers its commands
+ *  in the server metrics. Must be called once for each protocol, after
+ *  metrics_init and before any processes are created.
+ *
+ *  Parameters: protocol: Protocol description.
+ */
+void protocol_init(protocol_t *protocol) {
+
+  build_index(protocol);
+  if (!session_arena)
+    session_arena = arena_create(SESSION_ARENA_SIZE);
+
+  // Commands are measured in table order, followed by unknown commands
+  const char **names = malloc((protocol->num_commands + 1) * sizeof(char *));
+  for (int i = 0; i < protocol->num_commands; i++)
+    names[i] = protocol->commands[i].name;
+  names[protocol->num_commands] = "other";
+  protocol->metrics_id = metrics_register_protocol(protocol->name, names, protocol->num_commands + 1);
+}
+
+/** Finds a command in the table of a protocol, ignoring case.
+ *
+ *  Parameters: protocol: Protocol description.
+ *              command: Command as sent by the client (not necessarily
+ *                       null-terminated).
+ *              length: Length of the command.
+ *
+ *  Returns: Entry of the command in the table, or NULL if the command
+ *           is not recognized.
+ */
+const protocol_command_t *protocol_find_command(const protocol_t *protocol,
+                                                const char *command, size_t length) {
+
+  if (length == 0) return NULL;
+
+  // Every command letter differs from its uppercase version only in
+  // the 0x20 bit, so setting that bit folds case without changing
+  // which words match a table entry
+  uint32_t word = 0;
+  for (int i = 0; i < 4; i++)
+    word |= (uint32_t) ((i < length ? (unsigned char) command[i] : ' ') | 0x20) << (8 * i);
+
+  const protocol_command_t *entry = NULL;
+  if (protocol->index_multiplier) {
+    int i = protocol->index[index_slot(word, protocol->index_multiplier)];
+    if (i >= 0 && protocol->commands[i].word == word)
+      entry = &protocol->commands[i];
+  } else {
+    for (int i = 0; i < protocol->num_commands && !entry; i++)
+      if (protocol->commands[i].word == word)
+        entry = &protocol->commands[i];
+  }
+
+  // The word only covers the first four characters
+  if (entry && (length > 4 || entry->name[4]) &&
+      (strncasecmp(entry->name, command, length) || entry->name[length]))
+    return NULL;
+  return entry;
+}
+
+/** Takes the next space-separated argument from the arguments of a
+ *  command. The argument is null-terminated in place.
+ *
+ *  Parameters: args: Remaining arguments; updated to the arguments
+ *                    that follow the one returned.
+ *
+ *  Returns: The next argument, with length zero if there are no more
+ *           arguments.
+ */
+span_t protocol_next_arg(span_t *args) {
+
+  char *p = args->start, *end = args->start + args->length;
+  while (p < end && *p == ' ')
+    p++;
+
+  span_t arg = { p, 0 };
+  while (p < end && *p != ' ')
+    p++;
+  arg.length = p - arg.start;
+
+  if (p < end) {
+    *p++ = 0;
+    args->start = p;
+    args->length = end - p;
+  } else {
+    args->start = end;
+    args->length = 0;
+  }
+  return arg;
+}
+
+/** Handles the commands of a client session until the client
+ *  disconnects or a handler marks the session as done. The caller
+ *  sends the greeting and sets up the initial state and session
+ *  data; this function sets up the session's arena and net buffer.
+ *
+ *  Parameters: protocol: Protocol description.
+ *              session: Session of the client; fd, state and data
+ *                       must be set.
+ */
+void protocol_run(const protocol_t *protocol, protocol_session_t *session) {
+
+  char line[PROTOCOL_MAX_LINE + 1];
+  int fd = session->fd;
+
+  session->arena = session_arena;
+  session->nb = nb_create_in_arena(session->arena, fd, PROTOCOL_MAX_LINE);
+  session->done = 0;
+
+  capture_session_start(protocol->name);
+  sessiontab_protocol(protocol->name);
+
+  while (!session->done) {
+    // Data already received is a command sent before the previous
+    // reply, which matters when sessions are replayed
+    int pipelined = nb_buffered(session->nb) > 0;
+    int len = nb_read_line(session->nb, line);
+    if (len <= 0) break;
+    size_t line_length = len;
+
+    // A line filling the whole buffer without a line break is too
+    // long; the rest of it will be read as the next line
+    if (len == PROTOCOL_MAX_LINE && line[len - 1] != '\n') {
+      send_formatted(fd, protocol->line_too_long_reply);
+      continue;
+    }
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+      len--;
+    line[len] = 0;
+
+    span_t args = { line, len };
+    span_t command = protocol_next_arg(&args);
+    const protocol_command_t *entry = protocol_find_command(protocol, command.start, command.length);
+    const char *name = entry ? entry->name : command.start;
+
+    uint64_t start = metrics_now();
+    flightrec_record(FR_COMMAND, name, len, 0);
+    PROBE2(command__start, protocol->name, name);
+    sessiontab_command_start(name, start);
+
+    capture_command_start(entry ? entry->name : NULL, args.start, args.length, line_length, pipelined);
+
+    if (!entry)
+      send_formatted(fd, protocol->unknown_reply, command.start);
+    else if (!entry->handler)
+      send_formatted(fd, protocol->unsupported_reply, command.start);
+    else if (!(entry->states & PROTOCOL_STATE(session->state)))
+      send_formatted(fd, entry->bad_state_reply ? entry->bad_state_reply : protocol->bad_state_reply,
+                     command.start);
+    else
+      entry->handler(session, args);
+
+    capture_command_end();
+    sessiontab_command_end(session->state < protocol->num_states ? protocol->state_names[session->state] : "",
+                           metrics_now());
+    metrics_command(protocol->metrics_id, entry ? entry - protocol->commands : protocol->num_commands,
+                    start);
+    flightrec_command_end(name, start);
+    PROBE2(command__end, protocol->name, name);
+  }
+
+  capture_session_end();
+  session->nb = NULL;
+  arena_reset(session->arena);
+}
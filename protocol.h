@@ -0,0 +1,78 @@
+/* protocol.h
+ * Table-driven command engine shared by the mail servers.
+ */
+
+#ifndef _PROTOCOL_H_
+#define _PROTOCOL_H_
+
+#include "netbuffer.h"
+#include "arena.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PROTOCOL_MAX_LINE 1024
+#define PROTOCOL_INDEX_BITS 5 // command index has 32 slots
+
+// Command word: the first four characters of a command, in lowercase,
+// padded with spaces (e.g., PROTOCOL_WORD('t','o','p',' ') for TOP)
+#define PROTOCOL_WORD(a, b, c, d) \
+  ((uint32_t) ((a) | 0x20) | (uint32_t) ((b) | 0x20) << 8 | \
+   (uint32_t) ((c) | 0x20) << 16 | (uint32_t) ((d) | 0x20) << 24)
+
+// Set of states a command is allowed in
+#define PROTOCOL_STATE(state) (1u << (state))
+#define PROTOCOL_ANY_STATE (~0u)
+
+// Part of a command line. The text is also terminated by a null
+// character, so it can be used as a regular string.
+typedef struct {
+  char *start;
+  size_t length;
+} span_t;
+
+typedef struct protocol_session {
+  int fd;
+  net_buffer_t nb;
+  unsigned int state;  // current state, as used in PROTOCOL_STATE
+  int done;            // set by a handler to end the session
+  void *data;          // protocol-specific session data
+  arena_t arena;       // memory released when the session ends
+} protocol_session_t;
+
+typedef struct {
+  uint32_t word;
+  const char *name;
+  unsigned int states;
+  // Handler, or NULL for commands recognized but not supported
+  void (*handler)(protocol_session_t *session, span_t args);
+  // Reply if the command is not allowed in the current state, or
+  // NULL for the protocol default
+  const char *bad_state_reply;
+} protocol_command_t;
+
+typedef struct {
+  const char *name;
+  const protocol_command_t *commands;
+  int num_commands;
+  // Replies to errors, formatted with the command as a string
+  const char *line_too_long_reply;
+  const char *unknown_reply;
+  const char *unsupported_reply;
+  const char *bad_state_reply;
+  // Names of the states, as listed in the session table
+  const char *const *state_names;
+  unsigned int num_states;
+  // Set by protocol_init
+  int metrics_id;
+  uint32_t index_multiplier;
+  signed char index[1 << PROTOCOL_INDEX_BITS];
+} protocol_t;
+
+void protocol_init(protocol_t *protocol);
+const protocol_command_t *protocol_find_command(const protocol_t *protocol,
+                                                const char *command, size_t length);
+span_t protocol_next_arg(span_t *args);
+void protocol_run(const protocol_t *protocol, protocol_session_t *session);
+
+#endif
@@ -0,0 +1,323 @@
+/* ratelimit.c
+ * Per-client limits on connections, sessions, messages and logins.
+ *
+ * Each client address, and each subnet (by default, /24 for IPv4 and
+ * /64 for IPv6), may be limited in the number of new connections per
+ * second, concurrent sessions, messages sent per minute (SMTP) and
+ * login attempts per minute (POP3). Every limit is disabled unless
+ * configured (see the ratelimit_* settings).
+ *
+ * The state of every client is kept in a hash table in a shared
+ * memory region, created before the server starts accepting
+ * connections, so the server process and every session process see
+ * the same counts. The table is updated without locks: each rate is a
+ * token bucket stored as a single word, the time at which the bucket
+ * will be full again (also known as the generic cell rate algorithm),
+ * updated with compare-and-swap; concurrent sessions are an atomic
+ * counter. Clients are identified by a 64-bit hash of their address,
+ * and looked up in a few neighbouring slots, so checking a limit
+ * takes constant time.
+ *
+ * An entry can be taken over by another client once its client has
+ * no sessions and all its buckets are full, since such an entry is
+ * no different from a new one. If all slots a client can use are
+ * busy, the client is not limited.
+ */
+
+#include "ratelimit.h"
+#include "config.h"
+#include "metrics.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define DEFAULT_TABLE_SIZE 16384 // entries, must be a power of two
+#define MAX_PROBES 16
+
+#define ADDRESS 0
+#define SUBNET 1
+
+struct ratelimit_entry {
+  uint64_t key;                            // 0 if never used
+  uint32_t sessions;
+  uint64_t full_at[RATELIMIT_NUM_LIMITS];  // in microseconds
+} __attribute__((aligned(64)));
+
+static struct ratelimit_entry *table = NULL;
+static unsigned int table_mask = 0;
+
+// Limits for client addresses and subnets (0 if not limited), and the
+// period each rate is measured in
+static long limits[2][RATELIMIT_NUM_LIMITS];
+static const uint64_t periods[RATELIMIT_NUM_LIMITS] = { 1000000, 0, 60000000, 60000000 };
+static const char *limit_names[RATELIMIT_NUM_LIMITS] = {
+  "connections per second", "concurrent sessions", "messages per minute", "logins per minute"
+};
+static int ipv4_prefix = 24;
+static int ipv6_prefix = 64;
+static int enabled = 0;
+
+// Entries of the client of this session process
+static ratelimit_client_t session_client = { -1, -1 };
+
+/** Internal function that returns the current time, in microseconds.
+ */
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+/** Internal function that computes the key of an address, keeping only
+ *  its first prefix bits.
+ */
+static uint64_t address_key(int kind, const unsigned char *address, int length, int prefix) {
+  uint64_t key = 0xcbf29ce484222325ull ^ (kind << 16 | length << 8 | prefix);
+  for (int i = 0; i < length; i++) {
+    int bits = prefix - 8 * i;
+    unsigned char byte = bits >= 8 ? address[i] : bits > 0 ? address[i] & (0xff << (8 - bits)) : 0;
+    key = (key ^ byte) * 0x100000001b3ull;
+  }
+  // Mixes the bits, so nearby addresses spread over the whole table
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdull;
+  key ^= key >> 33;
+  return key ? key : 1;
+}
+
+/** Internal function that checks if an entry can be taken over by
+ *  another client.
+ */
+static int is_idle(struct ratelimit_entry *entry, uint64_t now) {
+  if (__atomic_load_n(&entry->sessions, __ATOMIC_RELAXED)) return 0;
+  for (int i = 0; i < RATELIMIT_NUM_LIMITS; i++)
+    if (__atomic_load_n(&entry->full_at[i], __ATOMIC_RELAXED) > now)
+      return 0;
+  return 1;
+}
+
+/** Internal function that finds the entry of a client key in the
+ *  table, or takes a free or idle entry for it.
+ *
+ *  Returns: index of the entry, or -1 if all slots are busy.
+ */
+static int find_entry(uint64_t key, uint64_t now) {
+
+  for (int i = 0; i < MAX_PROBES; i++) {
+    unsigned int slot = (key + i) & table_mask;
+    if (__atomic_load_n(&table[slot].key, __ATOMIC_ACQUIRE) == key)
+      return slot;
+  }
+
+  for (int i = 0; i < MAX_PROBES; i++) {
+    unsigned int slot = (key + i) & table_mask;
+    uint64_t current = __atomic_load_n(&table[slot].key, __ATOMIC_ACQUIRE);
+    if ((current == 0 || is_idle(&table[slot], now)) &&
+        __atomic_compare_exchange_n(&table[slot].key, &current, key, 0, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE))
+      return slot;
+    if (current == key)
+      return slot;
+  }
+  return -1;
+}
+
+/** Internal function that takes a token from a bucket of an entry.
+ *
+ *  Returns: non-zero (true) if a token was available.
+ */
+static int take_token(struct ratelimit_entry *entry, ratelimit_limit_t limit, long rate, uint64_t now) {
+
+  // Each token refills in interval; the bucket holds rate tokens
+  uint64_t interval = periods[limit] / rate;
+  uint64_t full_at = __atomic_load_n(&entry->full_at[limit], __ATOMIC_RELAXED);
+  do {
+    uint64_t start = full_at > now ? full_at : now;
+    if (start + interval - now > periods[limit])
+      return 0;
+    if (__atomic_compare_exchange_n(&entry->full_at[limit], &full_at, start + interval, 1,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      return 1;
+  } while (1);
+}
+
+/** Internal function that checks a limit against one entry of a
+ *  client, counting the connection, session, message or login.
+ *  Sessions are counted even if they are not limited, so the count
+ *  stays right if the limits are reloaded.
+ *
+ *  Returns: non-zero (true) if the limit was not reached.
+ */
+static int check_entry(int index, int kind, ratelimit_limit_t limit, uint64_t now) {
+
+  long value = limits[kind][limit];
+  if (index < 0) return 1;
+  struct ratelimit_entry *entry = &table[index];
+
+  if (limit != RATELIMIT_SESSIONS)
+    return !value || take_token(entry, limit, value, now);
+  if (__atomic_add_fetch(&entry->sessions, 1, __ATOMIC_RELAXED) <= value || !value)
+    return 1;
+  __atomic_sub_fetch(&entry->sessions, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/** Internal function that checks a limit for a client, counting it in
+ *  the metrics and logging it if the limit was reached.
+ */
+static int check_client(ratelimit_client_t client, ratelimit_limit_t limit, const char *name) {
+
+  uint64_t now = now_us();
+  int kind = ADDRESS;
+  if (check_entry(client.address, ADDRESS, limit, now)) {
+    kind = SUBNET;
+    if (check_entry(client.subnet, SUBNET, limit, now))
+      return 1;
+    // The session counted for the address is not going to happen
+    if (limit == RATELIMIT_SESSIONS && client.address >= 0)
+      __atomic_sub_fetch(&table[client.address].sessions, 1, __ATOMIC_RELAXED);
+  }
+
+  metrics_throttled(limit);
+  log_warning("ratelimit: %s%s reached %ld %s", name ? name : "client", kind == SUBNET ? " subnet" : "",
+              limits[kind][limit], limit_names[limit]);
+  return 0;
+}
+
+/** Internal function that reads the limits from the configuration.
+ */
+static void read_limits(void) {
+
+  static const char *keys[RATELIMIT_NUM_LIMITS] = { "connections", "sessions", "messages", "logins" };
+  char key[64];
+
+  enabled = 0;
+  for (int i = 0; i < RATELIMIT_NUM_LIMITS; i++) {
+    snprintf(key, sizeof(key), "ratelimit_%s", keys[i]);
+    limits[ADDRESS][i] = config_get_int(key, 0);
+    snprintf(key, sizeof(key), "ratelimit_subnet_%s", keys[i]);
+    limits[SUBNET][i] = config_get_int(key, 0);
+    if (limits[ADDRESS][i] < 0) limits[ADDRESS][i] = 0;
+    if (limits[SUBNET][i] < 0) limits[SUBNET][i] = 0;
+    enabled |= limits[ADDRESS][i] || limits[SUBNET][i];
+  }
+  ipv4_prefix = config_get_int("ratelimit_ipv4_prefix", 24);
+  ipv6_prefix = config_get_int("ratelimit_ipv6_prefix", 64);
+}
+
+/** Creates the shared table used to keep the state of every client,
+ *  and reads the limits from the configuration. Must be called before
+ *  any processes are created (i.e., before run_server), so that all
+ *  processes share the same table. If this function is not called,
+ *  clients are not limited.
+ */
+void ratelimit_init(void) {
+
+  long size = config_get_int("ratelimit_table_size", DEFAULT_TABLE_SIZE);
+  if (size < MAX_PROBES || (size & (size - 1))) {
+    log_warning("ratelimit: ratelimit_table_size must be a power of two, using %d", DEFAULT_TABLE_SIZE);
+    size = DEFAULT_TABLE_SIZE;
+  }
+
+  void *region = mmap(NULL, size * sizeof(struct ratelimit_entry), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (region == MAP_FAILED) {
+    log_error("ratelimit: mmap: %s", strerror(errno));
+    return;
+  }
+  table = region;
+  table_mask = size - 1;
+  read_limits();
+}
+
+/** Reads the limits again after the configuration is reloaded. Only
+ *  sessions started from then on use the new limits.
+ */
+void ratelimit_reload(void) {
+  if (table) read_limits();
+}
+
+/** Checks the connection limits (connections per second and
+ *  concurrent sessions) for a new client, before a session is created
+ *  for it. If the connection is allowed, the session counts towards
+ *  the limits until ratelimit_disconnect is called, and the process
+ *  created next for the session checks its other limits against this
+ *  client (see ratelimit_allow). Clients connected through a local
+ *  socket are not limited.
+ *
+ *  Parameters: addr: Address of the client.
+ *              client: Set to the entries of the client, to be passed
+ *                      to ratelimit_disconnect.
+ *
+ *  Returns: zero if the connection is allowed, or -1 if the client
+ *           reached a limit.
+ */
+int ratelimit_connect(const struct sockaddr *addr, ratelimit_client_t *client) {
+
+  client->address = client->subnet = -1;
+  session_client = *client;
+  if (!table || !enabled) return 0;
+
+  const unsigned char *address;
+  int length, prefix;
+  if (addr->sa_family == AF_INET) {
+    address = (const unsigned char *) &((const struct sockaddr_in *) addr)->sin_addr;
+    length = 4;
+    prefix = ipv4_prefix;
+  } else if (addr->sa_family == AF_INET6) {
+    const struct in6_addr *addr6 = &((const struct sockaddr_in6 *) addr)->sin6_addr;
+    // IPv4 clients of an IPv6 socket are limited as IPv4 clients
+    int mapped = IN6_IS_ADDR_V4MAPPED(addr6);
+    address = addr6->s6_addr + (mapped ? 12 : 0);
+    length = mapped ? 4 : 16;
+    prefix = mapped ? ipv4_prefix : ipv6_prefix;
+  } else {
+    return 0;
+  }
+
+  uint64_t now = now_us();
+  client->address = find_entry(address_key(ADDRESS, address, length, 8 * length), now);
+  client->subnet = find_entry(address_key(SUBNET, address, length, prefix), now);
+
+  char name[INET6_ADDRSTRLEN];
+  inet_ntop(length == 4 ? AF_INET : AF_INET6, address, name, sizeof(name));
+  if (!check_client(*client, RATELIMIT_CONNECTIONS, name) ||
+      !check_client(*client, RATELIMIT_SESSIONS, name)) {
+    client->address = client->subnet = -1;
+    return -1;
+  }
+  session_client = *client;
+  return 0;
+}
+
+/** Ends a session counted by ratelimit_connect, once its process has
+ *  finished.
+ *
+ *  Parameters: client: Entries of the client, as set by
+ *                      ratelimit_connect.
+ */
+void ratelimit_disconnect(ratelimit_client_t client) {
+  if (client.address >= 0)
+    __atomic_sub_fetch(&table[client.address].sessions, 1, __ATOMIC_RELAXED);
+  if (client.subnet >= 0)
+    __atomic_sub_fetch(&table[client.subnet].sessions, 1, __ATOMIC_RELAXED);
+}
+
+/** Checks a per-minute limit (messages or logins) for the client of
+ *  the calling session process, counting one message or login.
+ *
+ *  Parameters: limit: RATELIMIT_MESSAGES or RATELIMIT_LOGINS.
+ *
+ *  Returns: non-zero (true) if the client has not reached the limit.
+ */
+int ratelimit_allow(ratelimit_limit_t limit) {
+  if (!table || !enabled) return 1;
+  return check_client(session_client, limit, NULL);
+}
@@ -0,0 +1,32 @@
+/* ratelimit.h
+ * Per-client limits on connections, sessions, messages and logins.
+ */
+
+#ifndef _RATELIMIT_H_
+#define _RATELIMIT_H_
+
+#include <sys/socket.h>
+
+typedef enum {
+  RATELIMIT_CONNECTIONS, // new connections per second
+  RATELIMIT_SESSIONS,    // concurrent sessions
+  RATELIMIT_MESSAGES,    // messages per minute (SMTP)
+  RATELIMIT_LOGINS,      // login attempts per minute (POP3)
+  RATELIMIT_NUM_LIMITS
+} ratelimit_limit_t;
+
+// Table entries of a client: one for its address and one for its
+// subnet (-1 if the client is not limited)
+typedef struct {
+  int address;
+  int subnet;
+} ratelimit_client_t;
+
+void ratelimit_init(void);
+void ratelimit_reload(void);
+
+int ratelimit_connect(const struct sockaddr *addr, ratelimit_client_t *client);
+void ratelimit_disconnect(ratelimit_client_t client);
+int ratelimit_allow(ratelimit_limit_t limit);
+
+#endif
@@ -5,11 +5,32 @@
  *
  * Notes: This code is adapted from Beej's Guide to Network
  * Programming (http://beej.us/guide/bgnet/), in particular the code
- * available in functions sigchld_handler, get_in_addr, run_server and
- * send_all.
+ * available in functions get_in_addr, run_server and send_all.
+ *
+ * The server process is controlled with signals: SIGHUP reloads the
+ * configuration, SIGTERM stops accepting connections and lets the
+ * sessions in progress finish (up to drain_timeout seconds), and
+ * SIGUSR2 starts a new server binary that takes over the listening
+ * sockets, so the server can be upgraded without refusing or dropping
+ * any connection. The sockets are handed over by leaving them open
+ * across exec and naming them, in the order the listeners were given
+ * to run_servers, in the MAIL_LISTEN_FD environment variable (e.g.,
+ * "3,4"); once the new server is ready, it sends SIGTERM to the old
+ * one, which then drains its sessions and exits.
  */
 
+#define _GNU_SOURCE
 #include "server.h"
+#include "config.h"
+#include "metrics.h"
+#include "flightrec.h"
+#include "probes.h"
+#include "log.h"
+#include "tls.h"
+#include "ratelimit.h"
+#include "capture.h"
+#include "sessiontab.h"
+#include "mailuser.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -19,24 +40,270 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <stdarg.h>
 #include <signal.h>
+#include <sys/prctl.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 
 #define BACKLOG 10     // how many pending connections queue will hold
+#define MAX_LISTENERS 8
+#define DEFAULT_DRAIN_TIMEOUT 60 // seconds
+
+#define LISTEN_FD_VARIABLE "MAIL_LISTEN_FD"
+#define UPGRADE_PID_VARIABLE "MAIL_UPGRADE_PID"
+
+// Child process of the server that is still running, and the rate
+// limit entries of the client and the session table entry of a
+// session
+struct child {
+  pid_t pid;
+  ratelimit_client_t client;
+  int slot;
+};
+
+struct child_list {
+  struct child *children;
+  int count;
+  int size;
+};
+
+static struct child_list sessions = { NULL, 0, 0 };
+static struct child_list workers = { NULL, 0, 0 };
+
+// Listening sockets of the server, in the order of its listeners
+static int listen_fds[MAX_LISTENERS];
+static int num_listeners = 0;
+
+static char **upgrade_command = NULL;
+static const char *throttle_reply = NULL;
+static pid_t upgrade_pid = 0;
+
+static volatile sig_atomic_t reload_requested = 0;
+static volatile sig_atomic_t upgrade_requested = 0;
+static volatile sig_atomic_t drain_requested = 0;
+
+/** Internal function that adds a process to a list.
+ */
+static void add_child(struct child_list *list, pid_t pid, ratelimit_client_t client, int slot) {
+  if (list->count == list->size) {
+    int size = list->size ? list->size * 2 : 64;
+    struct child *children = realloc(list->children, size * sizeof(struct child));
+    if (!children) return;
+    list->children = children;
+    list->size = size;
+  }
+  list->children[list->count].pid = pid;
+  list->children[list->count].client = client;
+  list->children[list->count++].slot = slot;
+}
+
+/** Internal function that removes a process from a list.
+ *
+ *  Returns: non-zero (true) if the process was in the list, in which
+ *           case its entry is copied to removed.
+ */
+static int remove_child(struct child_list *list, pid_t pid, struct child *removed) {
+  for (int i = 0; i < list->count; i++) {
+    if (list->children[i].pid == pid) {
+      *removed = list->children[i];
+      list->children[i] = list->children[--list->count];
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/** Signal handler for the signals that control the server. The
+ *  signals are only handled while the server waits for connections
+ *  (see run_server), which checks the flags set here.
+ */
+static void control_handler(int s) {
+  if (s == SIGHUP)
+    reload_requested = 1;
+  else if (s == SIGUSR2)
+    upgrade_requested = 1;
+  else if (s == SIGTERM)
+    drain_requested = 1;
+  // SIGCHLD only interrupts the wait, so finished children are reaped
+}
+
+/** Internal function that restores the default handling of the
+ *  control signals in a new child process.
+ */
+static void reset_control_signals(const sigset_t *mask) {
+  signal(SIGCHLD, SIG_DFL);
+  signal(SIGHUP, SIG_DFL);
+  signal(SIGUSR2, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  sigprocmask(SIG_SETMASK, mask, NULL);
+}
+
+/** Internal function that destroys zombie children (forked) processes
+ *  once they finish executing, and keeps track of the sessions still
+ *  running.
+ */
+static void reap_children(void) {
+
+  pid_t pid;
+  int status;
+  struct child child;
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    if (remove_child(&sessions, pid, &child)) {
+      ratelimit_disconnect(child.client);
+      sessiontab_release(child.slot);
+      continue;
+    }
+    if (remove_child(&workers, pid, &child)) {
+      if (!drain_requested)
+        log_warning("server: worker %d exited unexpectedly", pid);
+    } else if (pid == upgrade_pid) {
+      upgrade_pid = 0;
+      if (!drain_requested)
+        log_error("server: upgrade failed, new server exited with status %d",
+                  WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+    }
+  }
+}
+
+/** Internal function that reloads the configuration file and applies
+ *  the settings that may change while the server runs, and the users
+ *  file if it changed. Sessions started from then on use the new
+ *  settings.
+ */
+static void reload_configuration(void) {
+  if (config_load(CONFIG_FILE_NAME) < 0) {
+    log_error("server: cannot read %s, keeping the current settings", CONFIG_FILE_NAME);
+    return;
+  }
+  log_reload();
+  tls_reload();
+  ratelimit_reload();
+  capture_reload();
+  reload_user_directory();
+  log_info("server: configuration reloaded");
+}
+
+/** Internal function that starts a new server binary, handing over
+ *  the listening sockets. The new server takes over once it is ready,
+ *  sending SIGTERM to this one; if it fails to start, this server
+ *  keeps running.
+ */
+static void start_upgrade(const sigset_t *mask) {
+
+  if (!upgrade_command) {
+    log_warning("server: upgrade not supported by this server");
+    return;
+  }
+  if (upgrade_pid) {
+    log_warning("server: upgrade already in progress (process %d)", upgrade_pid);
+    return;
+  }
+
+  char value[MAX_LISTENERS * 12];
+  pid_t parent = getpid();
+  pid_t pid = fork();
+  if (pid == 0) {
+    // Only the listening sockets (and the standard streams) are left
+    // open in the new server
+    reset_control_signals(mask);
+    close_range(3, ~0U, CLOSE_RANGE_CLOEXEC);
+    size_t length = 0;
+    for (int i = 0; i < num_listeners; i++) {
+      fcntl(listen_fds[i], F_SETFD, 0);
+      length += snprintf(value + length, sizeof(value) - length, "%s%d", i ? "," : "", listen_fds[i]);
+    }
+    setenv(LISTEN_FD_VARIABLE, value, 1);
+    snprintf(value, sizeof(value), "%d", parent);
+    setenv(UPGRADE_PID_VARIABLE, value, 1);
+    execvp(upgrade_command[0], upgrade_command);
+    log_error("server: upgrade: %s: %s", upgrade_command[0], strerror(errno));
+    exit(127);
+  }
+  if (pid < 0) {
+    log_error("server: upgrade: %s", strerror(errno));
+    return;
+  }
+  upgrade_pid = pid;
+  log_info("server: upgrade started, new server is process %d", pid);
+}
+
+/** Internal function that takes the listening sockets handed over by
+ *  a previous server during an upgrade, if any, into listen_fds. The
+ *  previous server must have had the same number of listeners.
+ *
+ *  Returns: zero if all sockets were handed over, or -1 otherwise.
+ */
+static int inherited_listeners(int count) {
+
+  const char *value = getenv(LISTEN_FD_VARIABLE);
+  if (!value) return -1;
+
+  int fds[MAX_LISTENERS], found = 0;
+  const char *p = value;
+  while (*p && found < MAX_LISTENERS) {
+    char *end;
+    int listening = 0;
+    socklen_t size = sizeof(listening);
+    fds[found] = strtol(p, &end, 10);
+    if (end == p || getsockopt(fds[found], SOL_SOCKET, SO_ACCEPTCONN, &listening, &size) < 0 ||
+        !listening)
+      break;
+    found++;
+    p = *end == ',' ? end + 1 : end;
+  }
+  if (*p || found != count) {
+    log_warning("server: %s=%s does not name %d listening socket(s)", LISTEN_FD_VARIABLE, value, count);
+    unsetenv(LISTEN_FD_VARIABLE);
+    return -1;
+  }
+  unsetenv(LISTEN_FD_VARIABLE);
+  for (int i = 0; i < count; i++) {
+    fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    listen_fds[i] = fds[i];
+  }
+  return 0;
+}
 
-/** Signal handler used to destroy zombie children (forked) processes
- *  once they finish executing.
+/** Internal function that stops accepting connections and waits for
+ *  the sessions in progress to finish, up to the drain_timeout
+ *  setting. Sessions still running after that are terminated.
  */
-static void sigchld_handler(int s) {
+static void drain_sessions(const sigset_t *mask) {
+
+  // If the server is being upgraded, the new server keeps the sockets
+  // open, so no new connection is refused
+  for (int i = 0; i < num_listeners; i++)
+    close(listen_fds[i]);
+  for (int i = 0; i < workers.count; i++)
+    kill(workers.children[i].pid, SIGTERM);
+
+  long timeout = config_get_int("drain_timeout", DEFAULT_DRAIN_TIMEOUT);
+  time_t deadline = time(NULL) + timeout;
+  reap_children();
+  log_info("server: stopped accepting connections, waiting up to %ld s for %d session(s)",
+           timeout, sessions.count);
 
-  // waitpid() might overwrite errno, so we save and restore it:
-  int saved_errno = errno;
-  while(waitpid(-1, NULL, WNOHANG) > 0);
-  errno = saved_errno;
+  while (sessions.count > 0 && time(NULL) < deadline) {
+    struct timespec wait = { deadline - time(NULL), 0 };
+    ppoll(NULL, 0, &wait, mask);
+    reap_children();
+  }
+
+  if (sessions.count > 0) {
+    log_warning("server: drain timeout, terminating %d session(s)", sessions.count);
+    for (int i = 0; i < sessions.count; i++)
+      kill(sessions.children[i].pid, SIGTERM);
+  }
+  log_info("server: stopped");
 }
 
 /** Returns the IPv4 or IPv6 object for a socket address, depending on
@@ -49,40 +316,75 @@ static void *get_in_addr(struct sockaddr *sa) {
     return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
-/** Creates a server socket at the specified port number, listens for
- *  new connections and accepts them. A new forked process is created
- *  for each new client, calling the provided handler function for
- *  this client.
+/** Creates a socket listening for new connections at the specified
+ *  address. The address may be a port number (or name), in which
+ *  case the socket accepts connections on any local address; a host
+ *  and port separated by a colon (e.g., "127.0.0.1:9110" or
+ *  "[::1]:9110"); or "unix:" followed by the path of a Unix-domain
+ *  socket, which is replaced if it already exists.
  *
- *  Parameters: port: String corresponding to the port number (or
- *                    name) where the server will listen for new
- *                    connections.
- *              handler: Function to be called when a new connection
- *                       is accepted. Will receive, as the only
- *                       parameter, the file descriptor corresponding
- *                       to the newly accepted connection.
+ *  Parameters: address: Address where the server will listen for new
+ *                       connections.
+ *
+ *  Returns: file descriptor of the listening socket, or -1 if the
+ *           socket could not be created (an error message is
+ *           printed in this case).
  */
-void run_server(const char *port, void (*handler)(int)) {
+int server_listen(const char *address) {
   
   int sockfd; // fd used for listening connections
-  int new_fd; // fd used to transfer data to/from an accepted connection
   struct addrinfo hints, *servinfo, *p;
-  struct sockaddr_storage their_addr; // connector's address information
-  socklen_t sin_size;
-  struct sigaction sa;
   int yes = 1;
-  char s[INET6_ADDRSTRLEN];
   int rv;
   
+  if (!strncmp(address, "unix:", 5)) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (strlen(address + 5) >= sizeof(addr.sun_path)) {
+      log_error("server: socket path too long: %s", address + 5);
+      return -1;
+    }
+    strcpy(addr.sun_path, address + 5);
+    
+    if ((sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+      log_error("server: socket: %s", strerror(errno));
+      return -1;
+    }
+    unlink(addr.sun_path);
+    if (bind(sockfd, (struct sockaddr *) &addr, sizeof addr) == -1 ||
+        listen(sockfd, BACKLOG) == -1) {
+      log_error("server: bind %s: %s", address, strerror(errno));
+      close(sockfd);
+      return -1;
+    }
+    return sockfd;
+  }
+  
+  // split an optional host from the port
+  char host[256];
+  const char *port = address;
+  const char *colon = strrchr(address, ':');
+  if (colon && colon - address < sizeof(host)) {
+    const char *begin = address, *end = colon;
+    if (*begin == '[' && end[-1] == ']') {
+      begin++;
+      end--;
+    }
+    memcpy(host, begin, end - begin);
+    host[end - begin] = 0;
+    port = colon + 1;
+  }
+  
   memset(&hints, 0, sizeof hints);
   hints.ai_family   = AF_UNSPEC;   // use IPv4 or IPv6, whichever is available
   hints.ai_socktype = SOCK_STREAM; // create a stream (TCP) socket server
   hints.ai_flags    = AI_PASSIVE;  // use any available connection
   
   // Gets information about available socket types and protocols
-  if ((rv = getaddrinfo(NULL, port, &hints, &servinfo)) != 0) {
-    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
-    exit(1);
+  if ((rv = getaddrinfo(port == address ? NULL : host, port, &hints, &servinfo)) != 0) {
+    log_error("server: getaddrinfo %s: %s", address, gai_strerror(rv));
+    return -1;
   }
   
   // loop through all the results and bind to the first we can
@@ -90,20 +392,21 @@ void run_server(const char *port, void (*handler)(int)) {
     
     // create socket object
     if ((sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
-      perror("server: socket");
+      log_error("server: socket: %s", strerror(errno));
       continue;
     }
     
     // specify that, once the program finishes, the port can be reused by other processes
     if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
-      perror("setsockopt");
-      exit(1);
+      log_error("server: setsockopt: %s", strerror(errno));
+      close(sockfd);
+      continue;
     }
     
     // bind to the specified port number
     if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
+      log_error("server: bind %s: %s", address, strerror(errno));
       close(sockfd);
-      perror("server: bind");
       continue;
     }
     
@@ -116,54 +419,276 @@ void run_server(const char *port, void (*handler)(int)) {
   
   // if p is null, the loop above could not create a socket for any available address
   if (p == NULL)  {
-    fprintf(stderr, "server: failed to bind\n");
-    exit(1);
+    log_error("server: failed to bind %s", address);
+    return -1;
   }
   
   // set up a queue of incoming connections to be received by the server
   if (listen(sockfd, BACKLOG) == -1) {
-    perror("listen");
+    log_error("server: listen: %s", strerror(errno));
+    close(sockfd);
+    return -1;
+  }
+  
+  return sockfd;
+}
+
+/** Internal function that accepts a pending connection on a
+ *  listening socket and creates a new forked process for the client,
+ *  calling the handler of the listener in it.
+ */
+static void accept_connection(const struct server_listener *listener, int sockfd,
+                              const sigset_t *mask, unsigned long *session_id) {
+  
+  int new_fd; // fd used to transfer data to/from an accepted connection
+  struct sockaddr_storage their_addr; // connector's address information
+  socklen_t sin_size = sizeof(their_addr);
+  char s[INET6_ADDRSTRLEN];
+  ratelimit_client_t client;
+  
+  new_fd = accept(sockfd, (struct sockaddr *)&their_addr, &sin_size);
+  if (new_fd == -1) {
+    if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED)
+      log_error("server: accept: %s", strerror(errno));
+    return;
+  }
+  
+  metrics_connection();
+  
+  // Clients over their connection limits are turned away right
+  // away; the reply is short enough to never block
+  if (ratelimit_connect((struct sockaddr *)&their_addr, &client) < 0) {
+    const char *reply = listener->throttle_reply ? listener->throttle_reply : throttle_reply;
+    if (reply)
+      send(new_fd, reply, strlen(reply), MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(new_fd);
+    return;
+  }
+  (*session_id)++;
+  int slot = sessiontab_claim();
+  
+  // Create a new process to handle the new client; parent process
+  // will wait for another client. The client address is only
+  // formatted and logged in the new process, to keep the accept
+  // loop short.
+  pid_t pid = fork();
+  if (!pid) {
+    // this is the child process, which doesn't need the listeners
+    for (int i = 0; i < num_listeners; i++)
+      close(listen_fds[i]);
+    reset_control_signals(mask);
+    // sendfile and TLS writes can't use MSG_NOSIGNAL
+    signal(SIGPIPE, SIG_IGN);
+    uint64_t start = flightrec_now();
+    flightrec_record(FR_ACCEPT, NULL, new_fd, 0);
+    log_session_start(*session_id);
+    if (their_addr.ss_family == AF_UNIX)
+      strcpy(s, "local socket");
+    else
+      inet_ntop(their_addr.ss_family, get_in_addr((struct sockaddr *)&their_addr),
+                s, sizeof(s));
+    log_info("server: got connection from %s", s);
+    sessiontab_attach(slot, *session_id, s);
+    PROBE2(conn__accept, new_fd, s);
+    metrics_session_start();
+    listener->handler(new_fd);
+    metrics_session_end();
+    tls_end();
+    close(new_fd);
+    
+    uint64_t duration = flightrec_now() - start;
+    const struct session_totals *totals = metrics_session_totals();
+    log_info("server: session end: %lu bytes in, %lu bytes out, %u commands, %.3f s",
+             (unsigned long) totals->bytes_in, (unsigned long) totals->bytes_out,
+             totals->commands, duration / 1e9);
+    flightrec_record(FR_SESSION_END, NULL, duration, 0);
+    PROBE1(conn__close, new_fd);
+    exit(0);
+  }
+  if (pid > 0) {
+    add_child(&sessions, pid, client, slot);
+  } else {
+    log_error("server: fork: %s", strerror(errno));
+    ratelimit_disconnect(client);
+    sessiontab_release(slot);
+  }
+  
+  // Parent proceeds from here. In parent, client socket is not needed.
+  close(new_fd);
+}
+
+/** Creates server sockets at the specified addresses, listens for new
+ *  connections on all of them and accepts them. A new forked process
+ *  is created for each new client, calling the handler of the
+ *  listener that accepted it. If the server was started by an upgrade
+ *  (see server_set_upgrade_command), the listening sockets of the
+ *  previous server are used instead, and the previous server is told
+ *  to stop once this one is ready.
+ *
+ *  Parameters: listeners: Addresses where the server will listen for
+ *                         new connections (any address accepted by
+ *                         server_listen), each with the function to
+ *                         be called when a connection is accepted
+ *                         there, which receives the file descriptor
+ *                         of the new connection, and the reply to
+ *                         clients refused by the connection limits
+ *                         (NULL for the one set with
+ *                         server_set_throttle_reply).
+ *              count: Number of listeners (at most 8).
+ *
+ *  Returns once the server is stopped with SIGTERM and its sessions
+ *  have finished.
+ */
+void run_servers(const struct server_listener *listeners, int count) {
+  
+  struct sigaction sa;
+  sigset_t control_signals, mask;
+  struct pollfd pfds[MAX_LISTENERS];
+  unsigned long session_id = 0;
+  
+  if (count < 1 || count > MAX_LISTENERS) {
+    log_error("server: %d listeners given, between 1 and %d supported", count, MAX_LISTENERS);
     exit(1);
   }
+  num_listeners = count;
+  if (inherited_listeners(count) < 0) {
+    for (int i = 0; i < count; i++)
+      if ((listen_fds[i] = server_listen(listeners[i].address)) == -1)
+        exit(1);
+  }
+  // Another server may accept a pending connection first during an
+  // upgrade, so waiting for connections must not block in accept
+  for (int i = 0; i < count; i++) {
+    fcntl(listen_fds[i], F_SETFL, fcntl(listen_fds[i], F_GETFL) | O_NONBLOCK);
+    pfds[i] = (struct pollfd) { listen_fds[i], POLLIN, 0 };
+  }
+  
+  // Control signals (and finished children) are only handled while
+  // waiting for connections, so the server state changes at a single
+  // point of the loop
+  sigemptyset(&control_signals);
+  sigaddset(&control_signals, SIGCHLD);
+  sigaddset(&control_signals, SIGHUP);
+  sigaddset(&control_signals, SIGUSR2);
+  sigaddset(&control_signals, SIGTERM);
+  sigprocmask(SIG_BLOCK, &control_signals, &mask);
   
-  // set up a signal handler to kill zombie forked processes when they exit
-  sa.sa_handler = sigchld_handler;
+  sa.sa_handler = control_handler;
   sigemptyset(&sa.sa_mask);
-  sa.sa_flags = SA_RESTART;
-  if (sigaction(SIGCHLD, &sa, NULL) == -1) {
-    perror("sigaction");
+  sa.sa_flags = 0;
+  if (sigaction(SIGCHLD, &sa, NULL) == -1 || sigaction(SIGHUP, &sa, NULL) == -1 ||
+      sigaction(SIGUSR2, &sa, NULL) == -1 || sigaction(SIGTERM, &sa, NULL) == -1) {
+    log_error("server: sigaction: %s", strerror(errno));
     exit(1);
   }
   
-  printf("server: waiting for connections...\n");
+  for (int i = 0; i < count; i++)
+    log_info("server: waiting for connections on %s", listeners[i].address);
+  
+  // Completes an upgrade: the previous server drains its sessions
+  const char *previous = getenv(UPGRADE_PID_VARIABLE);
+  if (previous && atoi(previous) == getppid()) {
+    log_info("server: took over from process %s", previous);
+    kill(getppid(), SIGTERM);
+  }
+  unsetenv(UPGRADE_PID_VARIABLE);
   
   while(1) {
-    // wait for new client to connect
-    sin_size = sizeof(their_addr);
-    new_fd = accept(sockfd, (struct sockaddr *)&their_addr, &sin_size);
-    if (new_fd == -1) {
-      perror("accept");
-      continue;
+    reap_children();
+    if (drain_requested) break;
+    if (reload_requested) {
+      reload_requested = 0;
+      reload_configuration();
     }
-    
-    inet_ntop(their_addr.ss_family, get_in_addr((struct sockaddr *)&their_addr),
-	      s, sizeof(s));
-    printf("server: got connection from %s\n", s);
-    
-    // Create a new process to handle the new client; parent process
-    // will wait for another client.
-    if (!fork()) {
-      // this is the child process
-      close(sockfd); // child doesn't need the listener, close
-      handler(new_fd);
-      close(new_fd);
-      exit(0);
+    if (upgrade_requested) {
+      upgrade_requested = 0;
+      start_upgrade(&mask);
     }
     
-    // Parent proceeds from here. In parent, client socket is not needed.
-    close(new_fd);
+    // wait for new clients to connect, taking one connection from
+    // each ready listener so no listener starves the others
+    if (ppoll(pfds, count, NULL, &mask) <= 0)
+      continue;
+    for (int i = 0; i < count; i++)
+      if (pfds[i].revents & POLLIN)
+        accept_connection(&listeners[i], listen_fds[i], &mask, &session_id);
   }
+  
+  drain_sessions(&mask);
+  sigprocmask(SIG_SETMASK, &mask, NULL);
+}
+
+/** Creates a server socket at the specified port number, listens for
+ *  new connections and accepts them, as run_servers does for a single
+ *  listener.
+ *
+ *  Parameters: port: String corresponding to the port number (or
+ *                    name) where the server will listen for new
+ *                    connections. Any address accepted by
+ *                    server_listen may also be used.
+ *              handler: Function to be called when a new connection
+ *                       is accepted. Will receive, as the only
+ *                       parameter, the file descriptor corresponding
+ *                       to the newly accepted connection.
+ *
+ *  Returns once the server is stopped with SIGTERM and its sessions
+ *  have finished.
+ */
+void run_server(const char *port, void (*handler)(int)) {
+  struct server_listener listener = { port, handler, NULL };
+  run_servers(&listener, 1);
+}
+
+/** Sets the command used to start a new server binary when the server
+ *  receives SIGUSR2, normally the command line the server was started
+ *  with. Without it, the server cannot be upgraded.
+ *
+ *  Parameters: argv: Program and arguments, terminated by a NULL
+ *                    pointer; must remain valid while the server runs.
+ */
+void server_set_upgrade_command(char *argv[]) {
+  upgrade_command = argv;
+}
+
+/** Sets the reply sent to clients refused because they reached a
+ *  connection limit (see ratelimit.c), before the connection is
+ *  closed. Without it, the connection is closed with no reply.
+ *
+ *  Parameters: reply: Reply line, including the line break.
+ */
+void server_set_throttle_reply(const char *reply) {
+  throttle_reply = reply;
+}
 
+/** Creates a background worker process, used for tasks that should
+ *  not delay client sessions (e.g., delivering queued messages). The
+ *  worker is terminated automatically if the process that started it
+ *  exits, or when the server starts draining its sessions.
+ *
+ *  Parameters: worker: Function to be run by the new process. The
+ *                      process exits once this function returns.
+ *              arg: Argument passed to the worker function.
+ *
+ *  Returns: Process ID of the new worker, or -1 if the process could
+ *           not be created.
+ */
+pid_t start_worker(void (*worker)(void *), void *arg) {
+
+  pid_t parent = getpid();
+  pid_t pid = fork();
+  if (pid == 0) {
+    // this is the worker process
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != parent)
+      exit(0);
+    worker(arg);
+    exit(0);
+  }
+  if (pid > 0)
+    add_child(&workers, pid, (ratelimit_client_t) { -1, -1 }, -1);
+  else
+    log_error("server: worker: %s", strerror(errno));
+  return pid;
 }
 
 /** Sends a buffer of data, until all data is sent or an error is
@@ -175,7 +700,8 @@ void run_server(const char *port, void (*handler)(int)) {
  *  Data is sent using the MSG_NOSIGNAL flag, so that, if the
  *  connection is interrupted, instead of a PIPE signal that crashes
  *  the program, this function will be able to return an error that
- *  can be handled by the caller.
+ *  can be handled by the caller. If the client started TLS, data is
+ *  encrypted (see tls_send).
  *
  *  Parameters: fd: Socket file descriptor.
  *              buf: Buffer where data to be sent is stored.
@@ -186,18 +712,75 @@ void run_server(const char *port, void (*handler)(int)) {
  */
 int send_all(int fd, char buf[], size_t size) {
   
+  capture_reply(buf, size);
   size_t rem = size;
   while (rem > 0) {
-    int rv = send(fd, buf, rem, MSG_NOSIGNAL);
+    int rv = tls_send(fd, buf, rem);
     // If there was an error, interrupt sending and returns an error
     if (rv <= 0)
       return rv;
+    metrics_bytes_out(rv);
+    sessiontab_bytes_out(rv);
     buf += rv;
     rem -= rv;
   }
   return size;
 }
 
+/** Sends the contents of a file to a socket descriptor. The file is
+ *  sent with sendfile, so its contents are not copied through the
+ *  process, unless the client started TLS without kernel offload, in
+ *  which case it is read and sent in blocks.
+ *
+ *  Parameters: fd: Socket file descriptor.
+ *              file_fd: Descriptor of the file to be sent, starting
+ *                       at its current offset.
+ *              size: Number of bytes to be sent.
+ *
+ *  Returns: If the data was successfully sent, returns size. If the
+ *           file ends before size bytes are sent, returns the number
+ *           of bytes sent. Otherwise, returns -1.
+ */
+int send_file(int fd, int file_fd, size_t size) {
+  
+  char buf[16384];
+  size_t sent = 0;
+  while (sent < size) {
+    size_t count = size - sent;
+    ssize_t rv;
+    if (tls_zero_copy()) {
+      rv = sendfile(fd, file_fd, NULL, count);
+      if (rv > 0) {
+        metrics_bytes_out(rv);
+        sessiontab_bytes_out(rv);
+      }
+    } else {
+      // send_all encrypts the data and counts it in the metrics
+      rv = read(file_fd, buf, count < sizeof(buf) ? count : sizeof(buf));
+      if (rv > 0 && send_all(fd, buf, rv) < 0)
+        return -1;
+    }
+    if (rv <= 0)
+      return rv < 0 ? -1 : sent;
+    sent += rv;
+  }
+  return sent;
+}
+
+/** Holds back partial packets on a socket until it is uncorked, so
+ *  that a response sent in several pieces (e.g., a status line, a
+ *  message and a terminator) leaves in as few packets as possible,
+ *  without the last piece waiting for the client to acknowledge the
+ *  previous ones. Has no effect on non-TCP sockets.
+ *
+ *  Parameters: fd: Socket file descriptor.
+ *              corked: Non-zero to cork the socket, zero to uncork it
+ *                      and send any pending data.
+ */
+void set_socket_corked(int fd, int corked) {
+  setsockopt(fd, IPPROTO_TCP, TCP_CORK, &corked, sizeof(corked));
+}
+
 /** Sends a printf-style formatted string to a socket descriptor. The
  *  string can contain format directives (e.g., %d, %s, %u), which
  *  will be translated using the same rules as printf. For example,
@@ -237,7 +820,7 @@ int send_formatted(int fd, const char *str, ...) {
       return -1;
     
     // If buffer was enough to fit entire string, send it
-    if (strsize <= bufsize)
+    if (strsize < bufsize)
       break;
     
     // Try again with more space
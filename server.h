@@ -8,10 +8,27 @@
 #define _SERVER_H_
 
 #include <stdio.h>
+#include <sys/types.h>
 
+// An address where the server accepts connections, and how they are
+// handled (see run_servers)
+struct server_listener {
+  const char *address;
+  void (*handler)(int);
+  const char *throttle_reply;
+};
+
+int server_listen(const char *address);
 void run_server(const char *port, void (*handler)(int));
+void run_servers(const struct server_listener *listeners, int count);
+void server_set_upgrade_command(char *argv[]);
+void server_set_throttle_reply(const char *reply);
+
+pid_t start_worker(void (*worker)(void *), void *arg);
 
 int send_all(int fd, char buf[], size_t size);
+int send_file(int fd, int file_fd, size_t size);
+void set_socket_corked(int fd, int corked);
 
 // The __attribute__ in this function allows the compiler to provided
 // useful warnings when compiling the code.
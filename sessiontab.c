@@ -0,0 +1,246 @@
+/* sessiontab.c
+ * Shared table of the client sessions in progress.
+ *
+ * Every session process describes what it is doing in its own entry
+ * of a table kept in a shared memory region: the client address, the
+ * protocol and state, the command being handled (or the last one),
+ * the bytes received and sent, and when the session started and was
+ * last active. The admin process (see admin.c) reads the table to
+ * list the sessions, and to terminate one of them on request.
+ *
+ * The table is laid out so that keeping it up to date costs the
+ * sessions next to nothing: entries are assigned by the server
+ * process before it creates the session process, so each entry has a
+ * single writer, which updates it with plain stores, without locks or
+ * system calls. The times come from the clock already read for the
+ * metrics of each command. Readers may see an entry in the middle of
+ * an update (e.g., a new command with the state of the previous
+ * one), which is harmless for a listing; text fields are always null
+ * terminated. An entry is in use while its process ID is set; the
+ * session sets it once the rest of the entry is filled in, and the
+ * server clears it once the session process has exited.
+ */
+
+#include "sessiontab.h"
+#include "config.h"
+#include "metrics.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define DEFAULT_TABLE_SIZE 1024 // sessions
+
+struct sessiontab_entry {
+  pid_t pid;            // 0 if the entry is not in use
+  int busy;             // non-zero while a command is being handled
+  unsigned long id;     // session ID, as in the logs
+  char protocol[8];
+  char peer[48];
+  char command[16];     // command being handled, or the last one
+  char state[24];       // protocol state after the last command
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  unsigned int commands;
+  uint64_t start_ns;    // as returned by metrics_now
+  uint64_t command_ns;  // start of the current (or last) command
+  uint64_t activity_ns; // start or end of the last command
+} __attribute__((aligned(64)));
+
+static struct sessiontab_entry *table = NULL;
+static int table_size = 0;
+
+// Entries not in use, only kept by the server process
+static int *free_slots = NULL;
+static int num_free = 0;
+
+// Entry of the current session process
+static struct sessiontab_entry *current = NULL;
+
+/** Internal function that copies a string to a fixed-size field,
+ *  truncating it if needed. The last character of the field is never
+ *  written, so it is always null terminated for concurrent readers.
+ */
+static void copy_field(char *field, size_t size, const char *str) {
+  size_t i;
+  for (i = 0; i < size - 1 && str[i]; i++)
+    field[i] = str[i];
+  field[i] = 0;
+}
+
+/** Creates the shared session table, with as many entries as the
+ *  session_table_size setting (0 disables the table). Must be called
+ *  before any processes are created (i.e., before admin_start and
+ *  run_server), so that all processes share the same table.
+ */
+void sessiontab_init(void) {
+
+  long size = config_get_int("session_table_size", DEFAULT_TABLE_SIZE);
+  if (size <= 0)
+    return;
+
+  free_slots = malloc(size * sizeof(int));
+  if (!free_slots)
+    return;
+  void *region = mmap(NULL, size * sizeof(struct sessiontab_entry), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (region == MAP_FAILED) {
+    log_error("sessiontab: mmap: %s", strerror(errno));
+    free(free_slots);
+    free_slots = NULL;
+    return;
+  }
+  table = region;
+  table_size = size;
+  for (int i = 0; i < size; i++)
+    free_slots[num_free++] = size - 1 - i;
+}
+
+/** Assigns a table entry to a new session. Called by the server
+ *  process before it creates the session process.
+ *
+ *  Returns: The entry assigned to the session, or -1 if the table is
+ *           full or disabled, in which case the session is not listed.
+ */
+int sessiontab_claim(void) {
+  return num_free > 0 ? free_slots[--num_free] : -1;
+}
+
+/** Makes the entry of a session available again. Called by the server
+ *  process once the session process has exited.
+ *
+ *  Parameters: slot: Entry returned by sessiontab_claim, or -1.
+ */
+void sessiontab_release(int slot) {
+  if (slot < 0) return;
+  __atomic_store_n(&table[slot].pid, 0, __ATOMIC_RELEASE);
+  free_slots[num_free++] = slot;
+}
+
+/** Fills in the entry of the current session, so it can be listed.
+ *  Called by the session process, before handling the client.
+ *
+ *  Parameters: slot: Entry returned by sessiontab_claim, or -1.
+ *              session_id: ID of the session, as in the logs.
+ *              peer: Client address, as a string.
+ */
+void sessiontab_attach(int slot, unsigned long session_id, const char *peer) {
+
+  if (slot < 0) return;
+  current = &table[slot];
+  current->busy = 0;
+  current->id = session_id;
+  current->protocol[0] = 0;
+  copy_field(current->peer, sizeof(current->peer), peer);
+  current->command[0] = 0;
+  current->state[0] = 0;
+  current->bytes_in = current->bytes_out = 0;
+  current->commands = 0;
+  current->start_ns = current->command_ns = current->activity_ns = metrics_now();
+  __atomic_store_n(&current->pid, getpid(), __ATOMIC_RELEASE);
+}
+
+/** Records the protocol spoken by the current session.
+ */
+void sessiontab_protocol(const char *protocol) {
+  if (!current) return;
+  copy_field(current->protocol, sizeof(current->protocol), protocol);
+}
+
+/** Records that the current session started handling a command.
+ *
+ *  Parameters: command: Name of the command.
+ *              now: Time the command started, as returned by
+ *                   metrics_now.
+ */
+void sessiontab_command_start(const char *command, uint64_t now) {
+  if (!current) return;
+  copy_field(current->command, sizeof(current->command), command);
+  current->command_ns = current->activity_ns = now;
+  current->commands++;
+  current->busy = 1;
+}
+
+/** Records that the current session finished handling a command.
+ *
+ *  Parameters: state: Name of the state of the session after the
+ *                     command.
+ *              now: Time the command ended, as returned by
+ *                   metrics_now.
+ */
+void sessiontab_command_end(const char *state, uint64_t now) {
+  if (!current) return;
+  copy_field(current->state, sizeof(current->state), state);
+  current->activity_ns = now;
+  current->busy = 0;
+}
+
+/** Adds data received from the client to the current session.
+ */
+void sessiontab_bytes_in(size_t bytes) {
+  if (current) current->bytes_in += bytes;
+}
+
+/** Adds data sent to the client to the current session.
+ */
+void sessiontab_bytes_out(size_t bytes) {
+  if (current) current->bytes_out += bytes;
+}
+
+/** Internal function that returns the time between two readings of
+ *  metrics_now in seconds, or 0 if the second one is earlier (the
+ *  entry was updated after the listing started).
+ */
+static double seconds_between(uint64_t start, uint64_t end) {
+  return end > start ? (end - start) / 1e9 : 0.0;
+}
+
+/** Writes one line for each session in progress, with tab-separated
+ *  fields: session ID, process ID, protocol, client address, state,
+ *  current (or last) command, 1 if the command is still being handled
+ *  (0 otherwise), seconds since the session started, seconds spent in
+ *  the current (or last) command, seconds since the last activity,
+ *  bytes received, bytes sent and number of commands.
+ *
+ *  Parameters: out: Stream where the sessions are written.
+ */
+void sessiontab_write(FILE *out) {
+
+  uint64_t now = metrics_now();
+  for (int i = 0; i < table_size; i++) {
+    if (!__atomic_load_n(&table[i].pid, __ATOMIC_ACQUIRE))
+      continue;
+    struct sessiontab_entry entry = table[i];
+
+    uint64_t command_end = entry.busy ? now : entry.activity_ns;
+    fprintf(out, "%lu\t%d\t%s\t%s\t%s\t%s\t%d\t%.3f\t%.3f\t%.3f\t%llu\t%llu\t%u\n",
+            entry.id, (int) entry.pid, entry.protocol, entry.peer, entry.state, entry.command,
+            entry.busy ? 1 : 0, seconds_between(entry.start_ns, now),
+            seconds_between(entry.command_ns, command_end), seconds_between(entry.activity_ns, now),
+            (unsigned long long) entry.bytes_in, (unsigned long long) entry.bytes_out,
+            entry.commands);
+  }
+}
+
+/** Terminates a session in progress, by sending SIGTERM to its
+ *  process.
+ *
+ *  Parameters: session_id: ID of the session, as listed.
+ *
+ *  Returns: 0 if the session was found and signalled, or -1 if there
+ *           is no such session.
+ */
+int sessiontab_kill(unsigned long session_id) {
+
+  for (int i = 0; i < table_size; i++) {
+    pid_t pid = __atomic_load_n(&table[i].pid, __ATOMIC_ACQUIRE);
+    if (pid && table[i].id == session_id)
+      return kill(pid, SIGTERM) < 0 ? -1 : 0;
+  }
+  return -1;
+}
@@ -0,0 +1,27 @@
+/* sessiontab.h
+ * Shared table of the client sessions in progress.
+ */
+
+#ifndef _SESSIONTAB_H_
+#define _SESSIONTAB_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+void sessiontab_init(void);
+
+int sessiontab_claim(void);
+void sessiontab_release(int slot);
+
+void sessiontab_attach(int slot, unsigned long session_id, const char *peer);
+void sessiontab_protocol(const char *protocol);
+void sessiontab_command_start(const char *command, uint64_t now);
+void sessiontab_command_end(const char *state, uint64_t now);
+void sessiontab_bytes_in(size_t bytes);
+void sessiontab_bytes_out(size_t bytes);
+
+void sessiontab_write(FILE *out);
+int sessiontab_kill(unsigned long session_id);
+
+#endif
@@ -0,0 +1,493 @@
+/* smtp.c
+ * SMTP protocol: command handlers for the mail submission server,
+ * shared by mysmtpd and maild. The same handlers also serve LMTP (RFC
+ * 2033), for an upstream mail server handing messages over: clients
+ * greet with LHLO, and get one reply per recipient after DATA, with
+ * the outcome of the delivery to that recipient.
+ */
+
+#include "smtp.h"
+#include "netbuffer.h"
+#include "protocol.h"
+#include "mailuser.h"
+#include "server.h"
+#include "spool.h"
+#include "metrics.h"
+#include "flightrec.h"
+#include "probes.h"
+#include "log.h"
+#include "tls.h"
+#include "ratelimit.h"
+#include "capture.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/utsname.h>
+#include <ctype.h>
+#include <errno.h>
+#include <string.h>
+
+#define MAX_LINE_LENGTH 1024
+
+// Server states
+typedef enum {
+    GREET_NEXT,
+    MAIL_NEXT,
+    RCPT_NEXT,
+    DATA_NEXT
+} state_t;
+
+// State names, as listed in the session table
+static const char *const state_names[] = { "greet", "mail", "rcpt", "data" };
+
+static user_list_t forward_paths;
+static arena_mark_t transaction_start;
+static char domain[256];
+
+// In LMTP sessions, the recipient of each accepted RCPT command, in
+// order, including repeated ones (which share a single user item)
+static int lmtp_session = 0;
+static user_item_t *lmtp_recipients;
+static unsigned int num_lmtp_recipients;
+static unsigned int max_lmtp_recipients;
+
+static void hello(protocol_session_t *session, span_t args);
+
+static void extended_hello(protocol_session_t *session, span_t args);
+
+static void local_hello(protocol_session_t *session, span_t args);
+
+static void start_tls(protocol_session_t *session, span_t args);
+
+static void mail(protocol_session_t *session, span_t args);
+
+static void recipient(protocol_session_t *session, span_t args);
+
+static void data(protocol_session_t *session, span_t args);
+
+static void reset(protocol_session_t *session, span_t args);
+
+static void verify(protocol_session_t *session, span_t args);
+
+static void noop(protocol_session_t *session, span_t args);
+
+static void quit(protocol_session_t *session, span_t args);
+
+#define BAD_SEQUENCE "503 Bad sequence of commands\r\n"
+
+// Commands recognized by the server, and the states they are allowed in
+static const protocol_command_t smtp_commands[] = {
+    { PROTOCOL_WORD('h', 'e', 'l', 'o'), "HELO", PROTOCOL_ANY_STATE, hello },
+    { PROTOCOL_WORD('e', 'h', 'l', 'o'), "EHLO", PROTOCOL_ANY_STATE, extended_hello },
+    { PROTOCOL_WORD('m', 'a', 'i', 'l'), "MAIL", PROTOCOL_STATE(MAIL_NEXT), mail },
+    { PROTOCOL_WORD('r', 'c', 'p', 't'), "RCPT", PROTOCOL_STATE(RCPT_NEXT) | PROTOCOL_STATE(DATA_NEXT),
+      recipient },
+    { PROTOCOL_WORD('d', 'a', 't', 'a'), "DATA", PROTOCOL_STATE(DATA_NEXT), data },
+    { PROTOCOL_WORD('r', 's', 'e', 't'), "RSET", PROTOCOL_ANY_STATE, reset },
+    { PROTOCOL_WORD('v', 'r', 'f', 'y'), "VRFY", PROTOCOL_ANY_STATE, verify },
+    { PROTOCOL_WORD('n', 'o', 'o', 'p'), "NOOP", PROTOCOL_ANY_STATE, noop },
+    { PROTOCOL_WORD('q', 'u', 'i', 't'), "QUIT", PROTOCOL_ANY_STATE, quit },
+    { PROTOCOL_WORD('s', 't', 'a', 'r'), "STARTTLS", PROTOCOL_ANY_STATE, start_tls },
+    { PROTOCOL_WORD('e', 'x', 'p', 'n'), "EXPN", PROTOCOL_ANY_STATE, NULL },
+    { PROTOCOL_WORD('h', 'e', 'l', 'p'), "HELP", PROTOCOL_ANY_STATE, NULL },
+};
+
+protocol_t smtp_protocol = {
+    .name = "smtp",
+    .commands = smtp_commands,
+    .num_commands = sizeof(smtp_commands) / sizeof(smtp_commands[0]),
+    .line_too_long_reply = "500 Line is too long\r\n",
+    .unknown_reply = "500 Invalid command: %s\r\n",
+    .unsupported_reply = "502 Unsupported command: %s\r\n",
+    .bad_state_reply = BAD_SEQUENCE,
+    .state_names = state_names,
+    .num_states = sizeof(state_names) / sizeof(state_names[0]),
+};
+
+// LMTP commands: as in SMTP, but clients greet with LHLO instead
+static const protocol_command_t lmtp_commands[] = {
+    { PROTOCOL_WORD('l', 'h', 'l', 'o'), "LHLO", PROTOCOL_ANY_STATE, local_hello },
+    { PROTOCOL_WORD('m', 'a', 'i', 'l'), "MAIL", PROTOCOL_STATE(MAIL_NEXT), mail },
+    { PROTOCOL_WORD('r', 'c', 'p', 't'), "RCPT", PROTOCOL_STATE(RCPT_NEXT) | PROTOCOL_STATE(DATA_NEXT),
+      recipient },
+    { PROTOCOL_WORD('d', 'a', 't', 'a'), "DATA", PROTOCOL_STATE(DATA_NEXT), data },
+    { PROTOCOL_WORD('r', 's', 'e', 't'), "RSET", PROTOCOL_ANY_STATE, reset },
+    { PROTOCOL_WORD('v', 'r', 'f', 'y'), "VRFY", PROTOCOL_ANY_STATE, verify },
+    { PROTOCOL_WORD('n', 'o', 'o', 'p'), "NOOP", PROTOCOL_ANY_STATE, noop },
+    { PROTOCOL_WORD('q', 'u', 'i', 't'), "QUIT", PROTOCOL_ANY_STATE, quit },
+    { PROTOCOL_WORD('h', 'e', 'l', 'o'), "HELO", PROTOCOL_ANY_STATE, NULL },
+    { PROTOCOL_WORD('e', 'h', 'l', 'o'), "EHLO", PROTOCOL_ANY_STATE, NULL },
+    { PROTOCOL_WORD('s', 't', 'a', 'r'), "STARTTLS", PROTOCOL_ANY_STATE, NULL },
+    { PROTOCOL_WORD('e', 'x', 'p', 'n'), "EXPN", PROTOCOL_ANY_STATE, NULL },
+    { PROTOCOL_WORD('h', 'e', 'l', 'p'), "HELP", PROTOCOL_ANY_STATE, NULL },
+};
+
+protocol_t lmtp_protocol = {
+    .name = "lmtp",
+    .commands = lmtp_commands,
+    .num_commands = sizeof(lmtp_commands) / sizeof(lmtp_commands[0]),
+    .line_too_long_reply = "500 Line is too long\r\n",
+    .unknown_reply = "500 Invalid command: %s\r\n",
+    .unsupported_reply = "502 Unsupported command: %s\r\n",
+    .bad_state_reply = BAD_SEQUENCE,
+    .state_names = state_names,
+    .num_states = sizeof(state_names) / sizeof(state_names[0]),
+};
+
+// Serves an SMTP client connection until it quits or disconnects
+void smtp_handle_client(int fd) {
+    // Initialize server for new client
+    struct utsname my_uname;
+    uname(&my_uname);
+    snprintf(domain, sizeof(domain), "%s", my_uname.nodename);
+
+    send_formatted(fd, "220 Connection Established\r\n");
+    protocol_session_t session = { .fd = fd, .state = GREET_NEXT };
+    protocol_run(&smtp_protocol, &session);
+}
+
+// Serves an LMTP client connection until it quits or disconnects
+void lmtp_handle_client(int fd) {
+    struct utsname my_uname;
+    uname(&my_uname);
+    snprintf(domain, sizeof(domain), "%s", my_uname.nodename);
+    lmtp_session = 1;
+
+    send_formatted(fd, "220 %s LMTP server ready\r\n", domain);
+    protocol_session_t session = { .fd = fd, .state = GREET_NEXT };
+    protocol_run(&lmtp_protocol, &session);
+}
+
+// Starts a new mail transaction with no recipients. Recipients are
+// kept in the session arena, so the previous transaction's memory is
+// released all at once.
+static void new_transaction(protocol_session_t *session) {
+    if (forward_paths)
+        arena_release(session->arena, transaction_start);
+    else
+        transaction_start = arena_mark(session->arena);
+    forward_paths = create_user_list_in_arena(session->arena);
+    num_lmtp_recipients = max_lmtp_recipients = 0;
+}
+
+// Records the recipient of an accepted RCPT command in an LMTP
+// session, to reply for it after DATA
+static void add_lmtp_recipient(protocol_session_t *session, const char *user) {
+    if (num_lmtp_recipients == max_lmtp_recipients) {
+        max_lmtp_recipients = max_lmtp_recipients ? max_lmtp_recipients * 2 : 16;
+        user_item_t *recipients = arena_alloc(session->arena, max_lmtp_recipients * sizeof(user_item_t));
+        if (num_lmtp_recipients)
+            memcpy(recipients, lmtp_recipients, num_lmtp_recipients * sizeof(user_item_t));
+        lmtp_recipients = recipients;
+    }
+    lmtp_recipients[num_lmtp_recipients++] = find_user_in_list(forward_paths, user);
+}
+
+// Sends the reply to the end of a message: once in SMTP, and once for
+// every accepted recipient in LMTP
+static void transaction_reply(int fd, const char *reply) {
+    unsigned int count = lmtp_session ? num_lmtp_recipients : 1;
+    for (unsigned int i = 0; i < count; i++)
+        send_formatted(fd, "%s", reply);
+}
+
+// Returns the LMTP reply for the outcome of a delivery to a recipient
+static const char *lmtp_delivery_reply(int error) {
+    if (!error)
+        return "250 OK\r\n";
+    if (error == ENOSPC || error == EDQUOT)
+        return "452 Requested action not taken: insufficient system storage\r\n";
+    if (is_transient_delivery_error(error))
+        return "451 Requested action aborted: error in processing\r\n";
+    return "550 Requested action not taken: mailbox unavailable\r\n";
+}
+
+// Starts a new mail session after HELO or EHLO, listing the given
+// extensions (if any) after the domain in the reply. A new greeting
+// also aborts any mail transaction in process.
+static void greet(protocol_session_t *session, span_t args, const char *extensions) {
+    // check for client domain
+    if (protocol_next_arg(&args).length) {
+        session->state = MAIL_NEXT;
+        new_transaction(session);
+        send_formatted(session->fd, "250%c%s\r\n%s", *extensions ? '-' : ' ', domain, extensions);
+    } else {
+        send_formatted(session->fd, "550 No domain given\r\n");
+    }
+}
+
+// Handles HELO command
+// Sends appropriate response codes to client.
+void hello(protocol_session_t *session, span_t args) {
+    greet(session, args, "");
+}
+
+// Handles EHLO command
+// Same as HELO, but also lists the supported extensions
+void extended_hello(protocol_session_t *session, span_t args) {
+    greet(session, args, tls_available() ? "250 STARTTLS\r\n" : "");
+}
+
+// Handles LHLO command (LMTP)
+// Same as EHLO, but STARTTLS is not offered
+void local_hello(protocol_session_t *session, span_t args) {
+    greet(session, args, "250 PIPELINING\r\n");
+}
+
+// Handles STARTTLS command
+// Starts TLS on the connection. The client must greet the server again
+// afterwards, and anything it sent before the handshake is discarded.
+void start_tls(protocol_session_t *session, span_t args) {
+    if (args.length) {
+        send_formatted(session->fd, "501 Syntax error (no parameters allowed)\r\n");
+        return;
+    }
+    if (tls_active()) {
+        send_formatted(session->fd, "554 TLS already active\r\n");
+        return;
+    }
+    if (!tls_available()) {
+        send_formatted(session->fd, "454 TLS not available due to temporary reason\r\n");
+        return;
+    }
+
+    send_formatted(session->fd, "220 Ready to start TLS\r\n");
+    nb_clear(session->nb);
+    if (tls_start(session->fd) < 0) {
+        session->done = 1;
+        return;
+    }
+    session->state = GREET_NEXT;
+    new_transaction(session);
+}
+
+// Handles MAIL command
+// Verifies reverse path is given in corrrect format and sends appropriate response codes to client
+void mail(protocol_session_t *session, span_t args) {
+    span_t param = protocol_next_arg(&args);
+    // Error if no parameter
+    if (!param.length) {
+        send_formatted(session->fd, "501 No parameter found\r\n");
+        return;
+    }
+
+    // Check that reverse-path is specified with correct prefix
+    if (strncasecmp(param.start, "FROM:<", 6) != 0 || param.start[param.length - 1] != '>') {
+        send_formatted(session->fd, "501 Unsupported parameter\r\n");
+        return;
+    }
+
+    // Without TLS, mail is refused if the configuration requires it
+    if (tls_required() && !tls_active()) {
+        send_formatted(session->fd, "530 Must issue a STARTTLS command first\r\n");
+        return;
+    }
+
+    // Clients sending too many messages are asked to try again later
+    if (!ratelimit_allow(RATELIMIT_MESSAGES)) {
+        send_formatted(session->fd, "451 Too many messages, try again later\r\n");
+        return;
+    }
+
+    session->state = RCPT_NEXT;
+    // clear and initialize mail transaction
+    new_transaction(session);
+
+    send_formatted(session->fd, "250 OK\r\n");
+}
+
+// Handles RCPT command
+// Verifies a valid user is given in the corrrect format and sends appropriate response codes to client
+void recipient(protocol_session_t *session, span_t args) {
+    span_t param = protocol_next_arg(&args);
+    // Error if no params found
+    if (!param.length) {
+        send_formatted(session->fd, "501 No parameters found\r\n");
+        return;
+    }
+
+    // Check that forward-path is specified with correct prefix and brackets
+    if (param.length < 5 || strncasecmp(param.start, "TO:<", 4) != 0 ||
+        param.start[param.length - 1] != '>') {
+        send_formatted(session->fd, "501 Unsupported parameter\r\n");
+        return;
+    }
+
+    // Parse user from parameter, dropping the closing bracket
+    char *user = param.start + 4;
+    param.start[param.length - 1] = '\0';
+
+    // Add user to forward path if valid. Repeated recipients (ignoring
+    // case) are accepted but only receive a single copy of the message.
+    // From here on, the user is named as spelled in the users file, so
+    // the mail goes to the same mailbox whatever case the client used.
+    if (find_user_name(user, user)) {
+        // Full mailboxes are refused before the message is transferred
+        if (is_user_over_quota(user)) {
+            send_formatted(session->fd, "552 Mailbox full, quota exceeded\r\n");
+            return;
+        }
+        add_user_to_list(&forward_paths, user);
+        if (lmtp_session)
+            add_lmtp_recipient(session, user);
+        session->state = DATA_NEXT;
+        send_formatted(session->fd, "250 OK\r\n");
+    } else {
+        send_formatted(session->fd, "550 No such user here\r\n");
+    }
+}
+
+// Handles DATA command
+// Recieves mail transaction contents, saves to recipient(s)'s mailbox, and sends appropriate response codes to client
+// (in LMTP, one for each recipient)
+void data(protocol_session_t *session, span_t args) {
+    int fd = session->fd;
+    net_buffer_t nb = session->nb;
+
+    send_formatted(fd, "354 Start mail input; end with <CRLF>.<CRLF>\r\n");
+    PROBE1(data__begin, get_user_count(forward_paths));
+
+    // Initialize temporary mail file, in the mail store so it can be
+    // linked into the mailboxes (it has no name, so it needs no cleanup)
+    struct mail_spool_file message;
+    int spooled = open_mail_spool_file(&message) == 0;
+
+    // Write client input into temporary file until terminator "." or client connection terminates
+    char recvbuf[MAX_LINE_LENGTH + 1];
+    size_t bytes = 0;
+    unsigned int lines = 0;
+    int write_error = 0;
+    int len = nb_read_line(nb, recvbuf);
+    while (len > 0 && strcmp(recvbuf, ".\r\n") != 0) {
+        // After a failed (or short) write, the rest of the message is
+        // still read, so the session stays in sync with the client
+        if (spooled && !write_error) {
+            ssize_t written = write(message.fd, recvbuf, len);
+            if (written != len)
+                write_error = written < 0 ? errno : ENOSPC;
+        }
+        bytes += len;
+        lines++;
+        len = nb_read_line(nb, recvbuf);
+    }
+    capture_data(bytes, lines);
+
+    // Without the terminator, the client lost the connection (or it
+    // failed) mid-message: the message is dropped, as the client was
+    // never told it was accepted and will send it again
+    if (len <= 0) {
+        if (spooled)
+            close_mail_spool_file(&message);
+        log_warning("connection lost during DATA, message of %zu bytes dropped", bytes);
+        session->state = MAIL_NEXT;
+        PROBE2(data__end, bytes, get_user_count(forward_paths));
+        return;
+    }
+
+    if (!spooled) {
+        log_error("cannot create spool file: %s", strerror(errno));
+        session->state = MAIL_NEXT;
+        transaction_reply(fd, "451 Requested action aborted: error in processing\r\n");
+        PROBE2(data__end, bytes, get_user_count(forward_paths));
+        return;
+    }
+
+    // A message that was not written in full must not be accepted
+    if (write_error)
+        log_error("cannot write spool file: %s", strerror(write_error));
+
+    // With a delivery queue, the message only needs to be queued
+    // before it is acknowledged; queue workers deliver it later. LMTP
+    // clients keep their own queue and need each recipient's outcome,
+    // so their messages are always delivered right away.
+    if (spool_enabled() && !lmtp_session) {
+        int rv = write_error ? -1 : spool_submit(message.path, forward_paths);
+        close_mail_spool_file(&message);
+        session->state = MAIL_NEXT;
+        if (rv < 0)
+            send_formatted(fd, "451 Requested action aborted: error in processing\r\n");
+        else
+            send_formatted(fd, "250 OK\r\n");
+        PROBE2(data__end, bytes, get_user_count(forward_paths));
+        return;
+    }
+
+    // Nor is it linked into the mailboxes; LMTP clients get the error
+    // for each recipient
+    if (write_error) {
+        close_mail_spool_file(&message);
+        session->state = MAIL_NEXT;
+        if (lmtp_session) {
+            for (unsigned int i = 0; i < num_lmtp_recipients; i++)
+                send_formatted(fd, "451 Requested action aborted: error in processing\r\n");
+        } else {
+            send_formatted(fd, "451 Requested action aborted: error in processing\r\n");
+        }
+        PROBE2(data__end, bytes, get_user_count(forward_paths));
+        return;
+    }
+
+    uint64_t start = metrics_now();
+    int failed = save_user_mail(message.path, forward_paths);
+    metrics_delivery(start, get_user_count(forward_paths), failed);
+    // Close temporary mail file
+    close_mail_spool_file(&message);
+    session->state = MAIL_NEXT;
+
+    // Report recipients that could not receive the message
+    for (user_item_t item = get_first_user(forward_paths); item; item = get_next_user(item)) {
+        if (get_user_delivery_error(item))
+            log_error("delivery to %s failed: %s", get_user_name(item),
+                      strerror(get_user_delivery_error(item)));
+    }
+
+    if (lmtp_session) {
+        for (unsigned int i = 0; i < num_lmtp_recipients; i++)
+            send_formatted(fd, "%s", lmtp_delivery_reply(get_user_delivery_error(lmtp_recipients[i])));
+    } else if (failed && failed == get_user_count(forward_paths)) {
+        send_formatted(fd, "451 Requested action aborted: error in processing\r\n");
+    } else {
+        send_formatted(fd, "250 OK\r\n");
+    }
+    PROBE2(data__end, bytes, get_user_count(forward_paths));
+}
+
+// Handles RSET command
+// Aborts any mail transaction in process
+void reset(protocol_session_t *session, span_t args) {
+    session->state = MAIL_NEXT;
+    new_transaction(session);
+    send_formatted(session->fd, "250 OK\r\n");
+}
+
+// Handles VRFY command
+// Verifies user is a valid and sends appropriate response codes to client
+void verify(protocol_session_t *session, span_t args) {
+    span_t user = protocol_next_arg(&args);
+
+    // Error if no parameter
+    if (!user.length) {
+        send_formatted(session->fd, "501 No parameter found\r\n");
+        return;
+    }
+
+    // Check if user is valid
+    if (is_valid_user(user.start, NULL)) {
+        send_formatted(session->fd, "250 <%s> is a valid user\r\n", user.start);
+    } else {
+        send_formatted(session->fd, "550 User <%s> not local\r\n", user.start);
+    }
+}
+
+// Handles NOOP command
+void noop(protocol_session_t *session, span_t args) {
+    send_formatted(session->fd, "250 OK\r\n");
+}
+
+// Handles QUIT command
+// Closes the session
+void quit(protocol_session_t *session, span_t args) {
+    send_formatted(session->fd, "221 Closing transmission Channel\r\n");
+    session->done = 1;
+}
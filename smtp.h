@@ -0,0 +1,19 @@
+/* smtp.h
+ * SMTP and LMTP protocols, served by mysmtpd and maild.
+ */
+
+#ifndef _SMTP_H_
+#define _SMTP_H_
+
+#include "protocol.h"
+
+// Reply to clients refused by the connection limits
+#define SMTP_THROTTLE_REPLY "421 Too many connections, try again later\r\n"
+
+extern protocol_t smtp_protocol;
+extern protocol_t lmtp_protocol;
+
+void smtp_handle_client(int fd);
+void lmtp_handle_client(int fd);
+
+#endif
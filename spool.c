@@ -0,0 +1,363 @@
+/* spool.c
+ * Queues accepted email messages on disk, to be delivered to the mail
+ * storage by background worker processes.
+ *
+ * Each queued message is kept in the queue directory as two files:
+ * <id>.msg, with the message contents, and <id>.env, the envelope
+ * with the delivery schedule and the recipients that have not yet
+ * received the message. A message is only considered queued once its
+ * envelope exists, and it is removed from the queue once all
+ * recipients are handled. Workers lock an envelope while delivering
+ * the message, so a message is never handled by two workers at the
+ * same time, and the lock is released automatically if a worker dies.
+ */
+
+#include "spool.h"
+#include "config.h"
+#include "server.h"
+#include "metrics.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/file.h>
+
+#define DEFAULT_QUEUE_DIRECTORY "mail.queue"
+#define DEFAULT_QUEUE_MAX_ATTEMPTS 12
+#define DEFAULT_QUEUE_RETRY_DELAY 30     // seconds, doubled after every attempt
+#define MAX_QUEUE_RETRY_DELAY 3600       // seconds
+#define IDLE_SCAN_INTERVAL 60            // seconds
+#define ORPHAN_FILE_AGE 3600             // seconds
+
+#define ENVELOPE_SUFFIX ".env"
+#define MESSAGE_SUFFIX ".msg"
+#define TEMP_SUFFIX ".tmp"
+
+static char *queue_directory = NULL;
+static int notify_pipe[2] = { -1, -1 };
+
+/** Internal function that checks if a file name ends with a suffix.
+ */
+static int has_suffix(const char *name, const char *suffix) {
+  size_t len = strlen(name), suflen = strlen(suffix);
+  return len > suflen && !strcmp(name + len - suflen, suffix);
+}
+
+/** Checks if messages should be queued for background delivery,
+ *  i.e., if queue workers were started by spool_start.
+ *
+ *  Returns: non-zero (true) if messages should be submitted with
+ *           spool_submit, or zero (false) if they should be delivered
+ *           directly with save_user_mail.
+ */
+int spool_enabled(void) {
+  return queue_directory != NULL;
+}
+
+/** Internal function that removes files left behind by sessions or
+ *  workers that crashed while writing to the queue: unfinished
+ *  envelopes, and message contents whose envelope was never written
+ *  (or was removed before the contents were).
+ */
+static void remove_orphan_files(void) {
+
+  DIR *dir = opendir(queue_directory);
+  if (!dir) return;
+
+  int dir_fd = dirfd(dir);
+  time_t now = time(NULL);
+  struct dirent *dir_entry;
+  struct stat file_stat;
+  char envelope[NAME_MAX + 1];
+
+  while ((dir_entry = readdir(dir)) != NULL) {
+
+    if (fstatat(dir_fd, dir_entry->d_name, &file_stat, 0) < 0 ||
+        now - file_stat.st_mtime < ORPHAN_FILE_AGE)
+      continue;
+
+    if (has_suffix(dir_entry->d_name, TEMP_SUFFIX)) {
+      unlinkat(dir_fd, dir_entry->d_name, 0);
+    } else if (has_suffix(dir_entry->d_name, MESSAGE_SUFFIX)) {
+      snprintf(envelope, sizeof(envelope), "%.*s" ENVELOPE_SUFFIX,
+               (int) (strlen(dir_entry->d_name) - strlen(MESSAGE_SUFFIX)), dir_entry->d_name);
+      if (faccessat(dir_fd, envelope, F_OK, 0) < 0 && errno == ENOENT)
+        unlinkat(dir_fd, dir_entry->d_name, 0);
+    }
+  }
+
+  closedir(dir);
+}
+
+/** Internal function that writes an envelope file. The envelope is
+ *  written to a temporary file, synced to disk, and then renamed over
+ *  any existing envelope, so readers never see a partial envelope.
+ */
+static int write_envelope(const char *id, time_t created, int attempts, time_t next,
+                          user_list_t users) {
+
+  char temp_file[PATH_MAX], envelope_file[PATH_MAX];
+  snprintf(temp_file, sizeof(temp_file), "%s/%s" TEMP_SUFFIX, queue_directory, id);
+  snprintf(envelope_file, sizeof(envelope_file), "%s/%s" ENVELOPE_SUFFIX, queue_directory, id);
+
+  FILE *file = fopen(temp_file, "w");
+  if (!file) return -1;
+
+  fprintf(file, "created %ld\nattempts %d\nnext %ld\n", (long) created, attempts, (long) next);
+  for (user_item_t item = get_first_user(users); item; item = get_next_user(item))
+    fprintf(file, "to %s\n", get_user_name(item));
+
+  if (fflush(file) != 0 || fsync(fileno(file)) < 0 || ferror(file)) {
+    fclose(file);
+    unlink(temp_file);
+    return -1;
+  }
+  fclose(file);
+
+  if (rename(temp_file, envelope_file) < 0) {
+    unlink(temp_file);
+    return -1;
+  }
+  return 0;
+}
+
+/** Internal function that syncs the queue directory itself, so that
+ *  newly created or renamed entries survive a crash.
+ */
+static void sync_queue_directory(void) {
+  int dir_fd = open(queue_directory, O_RDONLY | O_DIRECTORY);
+  if (dir_fd >= 0) {
+    fsync(dir_fd);
+    close(dir_fd);
+  }
+}
+
+/** Adds a new email message to the delivery queue. Once this function
+ *  returns successfully, the message is safely stored on disk and
+ *  will be delivered by a queue worker, even if the server is
+ *  restarted in the meantime. Like save_user_mail, this function uses
+ *  a hard link to the temporary file, so the queue directory must be
+ *  in the same file system as the mail storage.
+ *
+ *  Parameters: basefile: Name of a temporary file containing the
+ *                        contents of the email message.
+ *              users: List of recipient users to the message.
+ *
+ *  Returns: 0 if the message was queued, or -1 in case of error.
+ */
+int spool_submit(const char *basefile, user_list_t users) {
+
+  static unsigned int counter = 0;
+  char id[64], message_file[PATH_MAX];
+  time_t now = time(NULL);
+
+  snprintf(id, sizeof(id), "%lx.%x.%x", (long) now, (unsigned int) getpid(), counter++);
+  snprintf(message_file, sizeof(message_file), "%s/%s" MESSAGE_SUFFIX, queue_directory, id);
+
+  if (linkat(AT_FDCWD, basefile, AT_FDCWD, message_file, AT_SYMLINK_FOLLOW) < 0) {
+    log_error("queue: link %s: %s", message_file, strerror(errno));
+    return -1;
+  }
+
+  int fd = open(message_file, O_RDONLY);
+  if (fd < 0 || fsync(fd) < 0 || write_envelope(id, now, 0, now, users) < 0) {
+    log_error("queue: write %s: %s", id, strerror(errno));
+    if (fd >= 0) close(fd);
+    unlink(message_file);
+    return -1;
+  }
+  close(fd);
+  sync_queue_directory();
+
+  // Wake up one of the workers; if the pipe is full, all workers are
+  // already awake and will find the message anyway
+  if (notify_pipe[1] >= 0 && write(notify_pipe[1], "", 1) < 0 && errno != EAGAIN)
+    log_warning("queue: notify: %s", strerror(errno));
+  return 0;
+}
+
+/** Internal function that handles a single queued message, if it is
+ *  due. Recipients that fail with a transient error are kept in the
+ *  envelope for another attempt, with an exponentially increasing
+ *  delay, while recipients that succeed or fail permanently are
+ *  removed from it.
+ *
+ *  Returns: the time of the next attempt for this message, or 0 if
+ *           the message is no longer in the queue.
+ */
+static time_t process_envelope(int dir_fd, const char *envelope_name) {
+
+  int fd = openat(dir_fd, envelope_name, O_RDONLY);
+  if (fd < 0) return 0;
+
+  // Another worker is handling this message
+  struct stat file_stat;
+  if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+    close(fd);
+    return 0;
+  }
+  // The message was handled by another worker after this file was opened
+  if (fstat(fd, &file_stat) < 0 || file_stat.st_nlink == 0) {
+    close(fd);
+    return 0;
+  }
+
+  FILE *file = fdopen(fd, "r");
+  char line[MAX_USERNAME_SIZE + 16], user[MAX_USERNAME_SIZE + 1];
+  long created = 0, next = 0;
+  int attempts = 0;
+  user_list_t users = create_user_list();
+
+  while (fgets(line, sizeof(line), file)) {
+    if (sscanf(line, "created %ld", &created) == 1 ||
+        sscanf(line, "attempts %d", &attempts) == 1 ||
+        sscanf(line, "next %ld", &next) == 1)
+      continue;
+    if (sscanf(line, "to %255s", user) == 1)
+      add_user_to_list(&users, user);
+  }
+
+  time_t now = time(NULL);
+  if (next > now) {
+    destroy_user_list(users);
+    fclose(file);
+    return next;
+  }
+
+  char id[NAME_MAX + 1], message_file[PATH_MAX];
+  snprintf(id, sizeof(id), "%.*s", (int) (strlen(envelope_name) - strlen(ENVELOPE_SUFFIX)),
+           envelope_name);
+  snprintf(message_file, sizeof(message_file), "%s/%s" MESSAGE_SUFFIX, queue_directory, id);
+
+  uint64_t start = metrics_now();
+  metrics_delivery(start, get_user_count(users), save_user_mail(message_file, users));
+
+  user_list_t remaining = create_user_list();
+  for (user_item_t item = get_first_user(users); item; item = get_next_user(item)) {
+    int error = get_user_delivery_error(item);
+    if (!error)
+      continue;
+    if (is_transient_delivery_error(error)) {
+      add_user_to_list(&remaining, get_user_name(item));
+    } else {
+      log_error("queue: %s: delivery to %s failed: %s", id,
+                get_user_name(item), strerror(error));
+    }
+  }
+
+  attempts++;
+  int max_attempts = config_get_int("queue_max_attempts", DEFAULT_QUEUE_MAX_ATTEMPTS);
+  time_t delay = config_get_int("queue_retry_delay", DEFAULT_QUEUE_RETRY_DELAY);
+  for (int i = 1; i < attempts && delay < MAX_QUEUE_RETRY_DELAY; i++)
+    delay *= 2;
+  if (delay > MAX_QUEUE_RETRY_DELAY)
+    delay = MAX_QUEUE_RETRY_DELAY;
+
+  if (get_user_count(remaining) && attempts < max_attempts &&
+      write_envelope(id, created, attempts, now + delay, remaining) == 0) {
+    log_warning("queue: %s: %u recipient(s) deferred, attempt %d, retrying in %lds",
+                id, get_user_count(remaining), attempts, (long) delay);
+    next = now + delay;
+  } else {
+    for (user_item_t item = get_first_user(remaining); item; item = get_next_user(item))
+      log_error("queue: %s: giving up on %s after %d attempt(s)", id,
+                get_user_name(item), attempts);
+    // Envelope is removed first, so a crash in between only leaves an
+    // orphan message file behind, never an envelope without contents
+    unlinkat(dir_fd, envelope_name, 0);
+    unlink(message_file);
+    next = 0;
+  }
+
+  destroy_user_list(remaining);
+  destroy_user_list(users);
+  fclose(file);
+  return next;
+}
+
+/** Internal function that goes through all messages in the queue,
+ *  delivering the ones that are due.
+ *
+ *  Returns: time of the earliest future delivery attempt, or 0 if no
+ *           message is waiting.
+ */
+static time_t process_queue(void) {
+
+  DIR *dir = opendir(queue_directory);
+  if (!dir) return 0;
+
+  time_t earliest = 0;
+  struct dirent *dir_entry;
+  while ((dir_entry = readdir(dir)) != NULL) {
+    if (!has_suffix(dir_entry->d_name, ENVELOPE_SUFFIX))
+      continue;
+    time_t next = process_envelope(dirfd(dir), dir_entry->d_name);
+    if (next && (!earliest || next < earliest))
+      earliest = next;
+  }
+
+  closedir(dir);
+  return earliest;
+}
+
+/** Internal function run by each queue worker process. Workers wait
+ *  until a new message is submitted or a deferred message is due,
+ *  and then go through the queue.
+ */
+static void queue_worker(void *arg) {
+
+  close(notify_pipe[1]);
+  notify_pipe[1] = -1;
+
+  while (1) {
+    time_t earliest = process_queue();
+    time_t now = time(NULL);
+    int timeout = IDLE_SCAN_INTERVAL;
+    if (earliest && earliest - now < timeout)
+      timeout = earliest > now ? earliest - now : 0;
+
+    struct pollfd pfd = { notify_pipe[0], POLLIN, 0 };
+    if (poll(&pfd, 1, timeout * 1000) > 0) {
+      char c;
+      if (read(notify_pipe[0], &c, 1) == 0)
+        return;
+    }
+  }
+}
+
+/** Prepares the delivery queue and starts the queue workers, if the
+ *  configuration sets a number of queue workers (if not, messages are
+ *  delivered directly). Must be called before run_server, so that
+ *  sessions can notify the workers of new messages. Messages left in
+ *  the queue by a previous run of the server are picked up by the
+ *  workers as soon as they start.
+ */
+void spool_start(void) {
+
+  int workers = config_get_int("queue_workers", 0);
+  if (workers <= 0) return;
+
+  queue_directory = strdup(config_get_string("queue_directory", DEFAULT_QUEUE_DIRECTORY));
+  mkdir(queue_directory, 0777);
+  remove_orphan_files();
+
+  if (pipe(notify_pipe) < 0) {
+    log_error("queue: pipe: %s", strerror(errno));
+    exit(1);
+  }
+  fcntl(notify_pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(notify_pipe[1], F_SETFL, O_NONBLOCK);
+
+  for (int i = 0; i < workers; i++)
+    start_worker(queue_worker, NULL);
+}
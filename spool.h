@@ -0,0 +1,15 @@
+/* spool.h
+ * Queues accepted email messages on disk, to be delivered to the mail
+ * storage by background worker processes.
+ */
+
+#ifndef _SPOOL_H_
+#define _SPOOL_H_
+
+#include "mailuser.h"
+
+int spool_enabled(void);
+void spool_start(void);
+int spool_submit(const char *basefile, user_list_t users);
+
+#endif
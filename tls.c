@@ -0,0 +1,318 @@
+/* tls.c
+ * TLS support for the mail servers (STARTTLS and STLS).
+ *
+ * TLS is started on an existing connection when the client asks for
+ * it. OpenSSL performs the handshake; afterwards, if the kernel
+ * supports it (Linux kTLS), record encryption and decryption are
+ * handed over to the kernel. The socket then keeps being used with
+ * plain send, recv and sendfile, so message bodies are still sent
+ * without being copied through the process. Without kernel support,
+ * data goes through OpenSSL in the process instead (see tls_send and
+ * tls_recv).
+ *
+ * The TLS context, including the keys protecting session tickets, is
+ * created before the server starts accepting connections, so a client
+ * can resume a session started in any other session process. The
+ * keys can also be read from a file (tls_ticket_key_file), so that
+ * they survive restarts and can be shared between servers. When the
+ * configuration is reloaded, a new context is created with the current
+ * certificate (e.g., after it is renewed), keeping the same keys.
+ *
+ * TLS support is only built if OpenSSL is available (see the TLS
+ * setting in the Makefile); otherwise, TLS is never offered.
+ */
+
+#include "tls.h"
+#include "config.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/socket.h>
+
+#ifdef HAVE_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+#endif
+
+#define TICKET_KEYS_SIZE 80 // key name, HMAC key and AES key
+
+static int required = 0;
+
+#ifdef HAVE_TLS
+
+static SSL_CTX *context = NULL;
+static const char *name = NULL;
+
+// TLS session of the client handled by this process, if started, and
+// whether each direction is handled by the kernel
+static SSL *session = NULL;
+static int kernel_send = 0;
+static int kernel_recv = 0;
+
+/** Internal function that returns a description of the most recent
+ *  OpenSSL error, and clears the error queue.
+ */
+static const char *tls_error(void) {
+  static char buf[256];
+  unsigned long error = ERR_get_error();
+  if (error)
+    ERR_error_string_n(error, buf, sizeof(buf));
+  else
+    strcpy(buf, "connection closed");
+  ERR_clear_error();
+  return buf;
+}
+
+/** Internal function that sets the keys used to protect session
+ *  tickets, read from a file or generated randomly. Random keys are
+ *  only generated once, so tickets issued before the configuration is
+ *  reloaded can still be used.
+ *
+ *  Returns: zero if successful, or -1 otherwise.
+ */
+static int set_ticket_keys(SSL_CTX *new_context, const char *key_file) {
+
+  static unsigned char random_keys[TICKET_KEYS_SIZE];
+  static int random_keys_set = 0;
+  unsigned char keys[TICKET_KEYS_SIZE];
+
+  if (key_file) {
+    FILE *file = fopen(key_file, "r");
+    size_t size = file ? fread(keys, 1, sizeof(keys), file) : 0;
+    if (file) fclose(file);
+    if (size != sizeof(keys)) {
+      log_error("tls: %s: cannot read %d bytes of ticket keys", key_file, TICKET_KEYS_SIZE);
+      return -1;
+    }
+  } else {
+    if (!random_keys_set && RAND_bytes(random_keys, sizeof(random_keys)) != 1) {
+      log_error("tls: cannot generate ticket keys: %s", tls_error());
+      return -1;
+    }
+    random_keys_set = 1;
+    memcpy(keys, random_keys, sizeof(keys));
+  }
+
+  return SSL_CTX_set_tlsext_ticket_keys(new_context, keys, sizeof(keys)) == 1 ? 0 : -1;
+}
+
+/** Internal function that creates a TLS context with the given
+ *  certificate and the current TLS settings.
+ *
+ *  Returns: the new context, or NULL if it could not be created (an
+ *           error is logged in this case).
+ */
+static SSL_CTX *create_context(const char *certificate) {
+
+  const char *private_key = config_get_string("tls_private_key", certificate);
+
+  SSL_CTX *new_context = SSL_CTX_new(TLS_server_method());
+  if (!new_context) {
+    log_error("tls: cannot create context: %s", tls_error());
+    return NULL;
+  }
+  SSL_CTX_set_min_proto_version(new_context, TLS1_2_VERSION);
+  SSL_CTX_set_options(new_context, SSL_OP_ENABLE_KTLS);
+  // Sessions are only resumed through tickets: a session cache would
+  // be local to the process of a single session
+  SSL_CTX_set_session_cache_mode(new_context, SSL_SESS_CACHE_OFF);
+  SSL_CTX_set_session_id_context(new_context, (const unsigned char *) name,
+                                 strnlen(name, SSL_MAX_SID_CTX_LENGTH));
+
+  if (SSL_CTX_use_certificate_chain_file(new_context, certificate) != 1 ||
+      SSL_CTX_use_PrivateKey_file(new_context, private_key, SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_check_private_key(new_context) != 1) {
+    log_error("tls: %s: %s", certificate, tls_error());
+  } else if (set_ticket_keys(new_context, config_get_string("tls_ticket_key_file", NULL)) == 0) {
+    return new_context;
+  }
+
+  SSL_CTX_free(new_context);
+  return NULL;
+}
+
+/** Sets up TLS for a server, if the configuration sets a certificate
+ *  (tls_certificate). Must be called before run_server, so that every
+ *  session process shares the same TLS context.
+ *
+ *  Parameters: server_name: Name of the server (e.g., "mysmtpd").
+ */
+void tls_init(const char *server_name) {
+  name = server_name;
+  tls_reload();
+}
+
+/** Applies the TLS settings again after the configuration is
+ *  reloaded; sessions started from then on use the new certificate.
+ *  If the new certificate cannot be loaded, the previous one is kept.
+ */
+void tls_reload(void) {
+
+  required = config_get_int("tls_required", 0);
+  const char *certificate = config_get_string("tls_certificate", NULL);
+  if (!certificate) {
+    if (required)
+      log_warning("tls: tls_required is set but no tls_certificate is configured");
+    SSL_CTX_free(context);
+    context = NULL;
+    return;
+  }
+
+  SSL_CTX *new_context = create_context(certificate);
+  if (!new_context) {
+    if (context)
+      log_warning("tls: keeping the previous certificate");
+    return;
+  }
+  SSL_CTX_free(context);
+  context = new_context;
+  log_info("tls: using certificate %s", certificate);
+}
+
+/** Returns non-zero (true) if clients can start TLS, i.e., if TLS is
+ *  configured and was not started yet in this session.
+ */
+int tls_available(void) {
+  return context && !session;
+}
+
+/** Returns non-zero (true) if TLS was started in this session.
+ */
+int tls_active(void) {
+  return session != NULL;
+}
+
+/** Returns non-zero (true) if data can be written directly to the
+ *  client socket (e.g., with sendfile), i.e., if TLS was not started
+ *  or its encryption is handled by the kernel.
+ */
+int tls_zero_copy(void) {
+  return !session || kernel_send;
+}
+
+/** Starts TLS on the client connection, performing the handshake. The
+ *  caller must discard any data received before this call.
+ *
+ *  Parameters: fd: Socket file descriptor.
+ *
+ *  Returns: zero if TLS was started, or -1 if the handshake failed (in
+ *           which case the connection can't be used anymore).
+ */
+int tls_start(int fd) {
+
+  if (!tls_available()) return -1;
+
+  session = SSL_new(context);
+  if (!session || SSL_set_fd(session, fd) != 1 || SSL_accept(session) != 1) {
+    log_warning("tls: handshake failed: %s", tls_error());
+    SSL_free(session);
+    session = NULL;
+    return -1;
+  }
+
+  kernel_send = BIO_get_ktls_send(SSL_get_wbio(session));
+  kernel_recv = BIO_get_ktls_recv(SSL_get_rbio(session));
+  log_info("tls: %s with %s (%s), kernel offload: %s", SSL_get_version(session),
+           SSL_get_cipher_name(session), SSL_session_reused(session) ? "resumed" : "full handshake",
+           kernel_send ? (kernel_recv ? "send and receive" : "send") : (kernel_recv ? "receive" : "none"));
+  return 0;
+}
+
+/** Ends the TLS session of this process, if started, notifying the
+ *  client. Called when the session ends, before the connection is
+ *  closed.
+ */
+void tls_end(void) {
+  if (!session) return;
+  SSL_shutdown(session);
+  SSL_free(session);
+  session = NULL;
+}
+
+#else
+
+/** Without OpenSSL, TLS is never offered. The tls_required setting is
+ *  still honoured, so a misconfigured server refuses clients instead
+ *  of accepting them without TLS.
+ */
+void tls_init(const char *server_name) {
+  tls_reload();
+}
+
+void tls_reload(void) {
+  required = config_get_int("tls_required", 0);
+  if (config_get_string("tls_certificate", NULL))
+    log_warning("tls: TLS support not built in, tls_certificate ignored");
+}
+
+int tls_available(void) {
+  return 0;
+}
+
+int tls_active(void) {
+  return 0;
+}
+
+int tls_zero_copy(void) {
+  return 1;
+}
+
+int tls_start(int fd) {
+  return -1;
+}
+
+void tls_end(void) {
+}
+
+#endif
+
+/** Returns non-zero (true) if clients must start TLS before logging
+ *  in or sending mail (tls_required setting).
+ */
+int tls_required(void) {
+  return required;
+}
+
+/** Sends data to the client, encrypting it in the process if TLS was
+ *  started without kernel offload. Like send, may send only part of
+ *  the data.
+ *
+ *  Parameters: fd: Socket file descriptor.
+ *              buf: Data to be sent.
+ *              size: Number of bytes to be sent.
+ *
+ *  Returns: Number of bytes sent, or -1 in case of error.
+ */
+ssize_t tls_send(int fd, const void *buf, size_t size) {
+#ifdef HAVE_TLS
+  if (session && !kernel_send) {
+    int rv = SSL_write(session, buf, size > INT_MAX ? INT_MAX : size);
+    return rv > 0 ? rv : -1;
+  }
+#endif
+  return send(fd, buf, size, MSG_NOSIGNAL);
+}
+
+/** Receives data from the client, decrypting it in the process if TLS
+ *  was started without kernel offload.
+ *
+ *  Parameters: fd: Socket file descriptor.
+ *              buf: Buffer where data is stored.
+ *              size: Size of the buffer.
+ *
+ *  Returns: Number of bytes received, zero if the client closed the
+ *           connection, or -1 in case of error.
+ */
+ssize_t tls_recv(int fd, void *buf, size_t size) {
+#ifdef HAVE_TLS
+  if (session && !kernel_recv) {
+    int rv = SSL_read(session, buf, size > INT_MAX ? INT_MAX : size);
+    if (rv > 0) return rv;
+    return SSL_get_error(session, rv) == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+  }
+#endif
+  return recv(fd, buf, size, 0);
+}
@@ -0,0 +1,23 @@
+/* tls.h
+ * TLS support for the mail servers (STARTTLS and STLS).
+ */
+
+#ifndef _TLS_H_
+#define _TLS_H_
+
+#include <sys/types.h>
+
+void tls_init(const char *server_name);
+void tls_reload(void);
+int tls_available(void);
+int tls_required(void);
+int tls_active(void);
+int tls_zero_copy(void);
+
+int tls_start(int fd);
+void tls_end(void);
+
+ssize_t tls_send(int fd, const void *buf, size_t size);
+ssize_t tls_recv(int fd, void *buf, size_t size);
+
+#endif